@@ -0,0 +1,527 @@
+/*
+ * ImageCompressor.cpp
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ *
+ *  Host tool that compresses a bootloader image into the "DCZ1" format that UpdateBootloaderTask accepts, and tests the firmware's own
+ *  decompressor in src/Hardware/CompressedImage.h against the images that it produces.
+ *
+ *  The compressed image is a CompressedImageHeader followed by a LZ4 block. The firmware decompresses through a window of DecompressionWindowSize bytes,
+ *  so match offsets are limited to that, which is equivalent to building the reference LZ4 compressor with LZ4_DISTANCE_MAX=2048.
+ *  The block also follows the LZ4 end of block rules, so it can be decoded by any LZ4 block decoder.
+ *
+ *  Usage:
+ *    ImageCompressor [--max-length <bytes>] <input.bin> <output.bin>
+ *        Compress a bootloader image. The image must fit in the board's bootloader block, which is 16384 bytes on SAMC21 boards (the default)
+ *        and 65536 bytes on SAME5x boards. Vector M9 of the image must give a valid CRC offset. The output is decompressed and checked before it is written.
+ *    ImageCompressor --test [--seed <n>] [<file>...]
+ *        Compress and decompress synthetic images and the given files for both block sizes, then check that the decompressor rejects truncated images
+ *        and bad headers, and that corrupt images never make it write outside the block or pass the chunks out of order.
+ *
+ *  The program returns 0 on success, 1 if a check fails and 2 if the arguments are wrong.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <random>
+#include <algorithm>
+
+#include <Hardware/CompressedImage.h>
+
+namespace ImageCompressor
+{
+	constexpr uint32_t SamC21BlockSize = 0x4000;					// FlashBlockSize in Tasks.cpp
+	constexpr uint32_t Same5xBlockSize = 0x10000;
+
+	// LZ4 block format constants
+	constexpr size_t MinMatch = 4;
+	constexpr size_t LastLiterals = 5;								// the last 5 bytes of a block are always literals
+	constexpr size_t MatchFindLimit = 12;							// the last match must start at least 12 bytes before the end of the block
+	constexpr unsigned int HashBits = 14;
+	constexpr unsigned int MaxChainLength = 256;					// how many earlier positions with the same hash we try
+
+	static uint32_t ReadWord(const uint8_t *p) noexcept
+	{
+		return p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+	}
+
+	static void WriteWord(std::vector<uint8_t>& out, uint32_t val) noexcept
+	{
+		for (unsigned int i = 0; i < 4; ++i)
+		{
+			out.push_back((uint8_t)(val >> (8 * i)));
+		}
+	}
+
+	static unsigned int Hash(const uint8_t *p) noexcept
+	{
+		return (ReadWord(p) * 2654435761u) >> (32 - HashBits);
+	}
+
+	// Append a LZ4 length extension
+	static void WriteLength(std::vector<uint8_t>& out, size_t length) noexcept
+	{
+		while (length >= 255)
+		{
+			out.push_back(255);
+			length -= 255;
+		}
+		out.push_back((uint8_t)length);
+	}
+
+	// Append a LZ4 sequence. If matchLength is zero this is the last sequence, which has literals only.
+	static void WriteSequence(std::vector<uint8_t>& out, const uint8_t *literals, size_t literalLength, size_t offset, size_t matchLength) noexcept
+	{
+		const size_t matchCode = (matchLength == 0) ? 0 : matchLength - MinMatch;
+		out.push_back((uint8_t)((std::min<size_t>(literalLength, 15) << 4) | std::min<size_t>(matchCode, 15)));
+		if (literalLength >= 15)
+		{
+			WriteLength(out, literalLength - 15);
+		}
+		out.insert(out.end(), literals, literals + literalLength);
+		if (matchLength != 0)
+		{
+			out.push_back((uint8_t)offset);
+			out.push_back((uint8_t)(offset >> 8));
+			if (matchCode >= 15)
+			{
+				WriteLength(out, matchCode - 15);
+			}
+		}
+	}
+
+	// Compress data to a LZ4 block with match offsets no greater than DecompressionWindowSize, taking the longest match at each position
+	static std::vector<uint8_t> CompressBlock(const std::vector<uint8_t>& input) noexcept
+	{
+		std::vector<uint8_t> out;
+		const size_t length = input.size();
+		std::vector<int32_t> head(1u << HashBits, -1);
+		std::vector<int32_t> previous(length, -1);
+		auto insert = [&input, &head, &previous](size_t pos) noexcept
+						{
+							const unsigned int h = Hash(&input[pos]);
+							previous[pos] = head[h];
+							head[h] = (int32_t)pos;
+						};
+
+		size_t anchor = 0, pos = 0;
+		while (pos + MatchFindLimit <= length)
+		{
+			const size_t maxMatchLength = length - LastLiterals - pos;
+			size_t bestLength = 0, bestOffset = 0;
+			unsigned int chainLength = 0;
+			for (int32_t candidate = head[Hash(&input[pos])];
+				 candidate >= 0 && pos - (size_t)candidate <= DecompressionWindowSize && chainLength < MaxChainLength;
+				 candidate = previous[candidate], ++chainLength)
+			{
+				size_t matchLength = 0;
+				while (matchLength < maxMatchLength && input[candidate + matchLength] == input[pos + matchLength])
+				{
+					++matchLength;
+				}
+				if (matchLength > bestLength)
+				{
+					bestLength = matchLength;
+					bestOffset = pos - (size_t)candidate;
+				}
+			}
+
+			if (bestLength >= MinMatch)
+			{
+				WriteSequence(out, &input[anchor], pos - anchor, bestOffset, bestLength);
+				for (const size_t end = pos + bestLength; pos < end; ++pos)
+				{
+					if (pos + MinMatch <= length)
+					{
+						insert(pos);
+					}
+				}
+				anchor = pos;
+			}
+			else
+			{
+				insert(pos);
+				++pos;
+			}
+		}
+		WriteSequence(out, input.data() + anchor, length - anchor, 0, 0);
+		return out;
+	}
+
+	// Build a compressed image file, which is the header followed by the LZ4 block
+	static std::vector<uint8_t> CompressImage(const std::vector<uint8_t>& image) noexcept
+	{
+		const std::vector<uint8_t> block = CompressBlock(image);
+		std::vector<uint8_t> out;
+		WriteWord(out, CompressedImageHeader::MagicValue);
+		WriteWord(out, (uint32_t)image.size());
+		WriteWord(out, (uint32_t)block.size());
+		out.insert(out.end(), block.begin(), block.end());
+		return out;
+	}
+
+	// Collect the chunks that the decompressor produces, checking that they are in order and within the block
+	struct ChunkCollector
+	{
+		std::vector<uint8_t> output;
+		uint32_t maxLength;
+		bool badChunk = false;
+
+		explicit ChunkCollector(uint32_t p_maxLength) noexcept : maxLength(p_maxLength) { }
+
+		bool operator()(uint32_t offset, const uint32_t *data) noexcept
+		{
+			if (offset != output.size() || offset + DecompressionChunkSize > maxLength)
+			{
+				badChunk = true;
+				return false;
+			}
+			const uint8_t * const bytes = reinterpret_cast<const uint8_t*>(data);
+			output.insert(output.end(), bytes, bytes + DecompressionChunkSize);
+			return true;
+		}
+	};
+
+	// Decompress an image as the firmware does, from a buffer of the block size that holds the received file padded with 0xFF
+	static bool Decompress(const std::vector<uint8_t>& file, uint32_t maxLength, ChunkCollector& collector) noexcept
+	{
+		std::vector<uint32_t> blockBuffer(maxLength/4, 0xFFFFFFFF);
+		memcpy(blockBuffer.data(), file.data(), std::min<size_t>(file.size(), maxLength));
+		std::vector<uint32_t> window(DecompressionWindowSize/4);
+		return DecompressImage(*reinterpret_cast<const CompressedImageHeader*>(blockBuffer.data()), maxLength, reinterpret_cast<uint8_t*>(window.data()), collector);
+	}
+
+	// Return the image padded to a whole number of chunks, which is what the decompressor should produce
+	static std::vector<uint8_t> PaddedImage(const std::vector<uint8_t>& image) noexcept
+	{
+		std::vector<uint8_t> padded(image);
+		padded.resize((image.size() + DecompressionChunkSize - 1)/DecompressionChunkSize * DecompressionChunkSize, 0xFF);
+		return padded;
+	}
+
+	static bool ReadFile(const char *fileName, std::vector<uint8_t>& data) noexcept
+	{
+		FILE * const f = fopen(fileName, "rb");
+		if (f == nullptr)
+		{
+			fprintf(stderr, "Can't open %s\n", fileName);
+			return false;
+		}
+		data.clear();
+		uint8_t buf[4096];
+		size_t n;
+		while ((n = fread(buf, 1, sizeof(buf), f)) != 0)
+		{
+			data.insert(data.end(), buf, buf + n);
+		}
+		fclose(f);
+		return true;
+	}
+
+	// Compress a bootloader image and write it to a file
+	static int Compress(const char *inFileName, const char *outFileName, uint32_t maxLength) noexcept
+	{
+		std::vector<uint8_t> image;
+		if (!ReadFile(inFileName, image))
+		{
+			return 1;
+		}
+		if (image.size() > maxLength)
+		{
+			fprintf(stderr, "%s is %u bytes, which is longer than the %u byte bootloader block\n", inFileName, (unsigned int)image.size(), (unsigned int)maxLength);
+			return 1;
+		}
+		const uint32_t crcOffset = (image.size() >= 32) ? ReadWord(&image[28]) : 0;
+		if (!IsValidCrcOffset(crcOffset, maxLength) || crcOffset + 4 > image.size())
+		{
+			fprintf(stderr, "%s has an invalid CRC offset 0x%08x in vector M9\n", inFileName, (unsigned int)crcOffset);
+			return 1;
+		}
+
+		const std::vector<uint8_t> compressed = CompressImage(image);
+		if (compressed.size() > maxLength)
+		{
+			fprintf(stderr, "%s compresses to %u bytes, which is longer than the %u byte bootloader block\n", inFileName, (unsigned int)compressed.size(), (unsigned int)maxLength);
+			return 1;
+		}
+		ChunkCollector collector(maxLength);
+		if (!Decompress(compressed, maxLength, collector) || collector.output != PaddedImage(image))
+		{
+			fprintf(stderr, "The compressed image of %s does not decompress correctly\n", inFileName);
+			return 1;
+		}
+
+		FILE * const f = fopen(outFileName, "wb");
+		if (f == nullptr || fwrite(compressed.data(), 1, compressed.size(), f) != compressed.size() || fclose(f) != 0)
+		{
+			fprintf(stderr, "Can't write %s\n", outFileName);
+			return 1;
+		}
+		printf("%s: %u bytes compressed to %u bytes (%.1f%%)\n",
+				inFileName, (unsigned int)image.size(), (unsigned int)compressed.size(), 100.0 * (double)compressed.size()/(double)image.size());
+		return 0;
+	}
+
+	// Make a synthetic image that looks like Thumb code: a vector table, instructions drawn from a small set with varying register fields,
+	// literal pools, a string table, and the CRC offset in vector M9 with a CRC after the end of the image
+	static std::vector<uint8_t> MakeCodeImage(std::mt19937& rng, size_t length) noexcept
+	{
+		static const uint16_t opcodes[] = { 0x6800, 0x6000, 0x4600, 0x2000, 0x3000, 0xB500, 0xBD00, 0xF000, 0x4700, 0x1C00, 0x4200, 0xD000, 0xE000 };
+		static const char * const strings[] = { "Error: ", "temperature sensor ", "heater %u fault\n", "driver %u: ", "%.1f", "CAN bus off\n" };
+
+		std::vector<uint8_t> image;
+		WriteWord(image, 0x20008000);
+		for (unsigned int i = 1; i < 48; ++i)
+		{
+			WriteWord(image, (i == 7) ? 0 : 0x00000101 + 0x40 * (rng() % 64));
+		}
+		while (image.size() + 4 < length)
+		{
+			switch (rng() % 16)
+			{
+			case 0:													// literal pool
+				for (unsigned int i = rng() % 4; i != 0 && image.size() + 8 < length; --i)
+				{
+					WriteWord(image, 0x00000100 + 4 * (rng() % 2048));
+				}
+				break;
+
+			case 1:													// string
+				for (const char *s = strings[rng() % (sizeof(strings)/sizeof(strings[0]))]; *s != 0 && image.size() + 5 < length; ++s)
+				{
+					image.push_back((uint8_t)*s);
+				}
+				break;
+
+			default:
+				{
+					const uint16_t instruction = opcodes[rng() % (sizeof(opcodes)/sizeof(opcodes[0]))] | (rng() % 256);
+					image.push_back((uint8_t)instruction);
+					image.push_back((uint8_t)(instruction >> 8));
+				}
+				break;
+			}
+		}
+		image.resize(length - 4 - (length % 4), 0);
+		const uint32_t crcOffset = (uint32_t)image.size();
+		memcpy(&image[28], &crcOffset, 4);
+		WriteWord(image, rng());
+		return image;
+	}
+
+	struct TestResults
+	{
+		unsigned int numTests = 0;
+		unsigned int numFailures = 0;
+		unsigned int corruptRejected = 0;
+		unsigned int corruptAccepted = 0;
+
+		void Fail(const char *name, const char *msg, size_t detail) noexcept
+		{
+			++numFailures;
+			printf("FAIL %s: %s (%u)\n", name, msg, (unsigned int)detail);
+		}
+	};
+
+	// Test the decompressor on one image
+	static void TestImage(const char *name, const std::vector<uint8_t>& image, uint32_t maxLength, std::mt19937& rng, TestResults& results) noexcept
+	{
+		const std::vector<uint8_t> compressed = CompressImage(image);
+		if (compressed.size() > maxLength)
+		{
+			printf("%s: %u bytes doesn't compress to fit a %u byte block, skipped\n", name, (unsigned int)image.size(), (unsigned int)maxLength);
+			return;
+		}
+		const std::vector<uint8_t> expected = PaddedImage(image);
+		const size_t compressedLength = compressed.size() - sizeof(CompressedImageHeader);
+
+		// Round trip
+		++results.numTests;
+		{
+			ChunkCollector collector(maxLength);
+			if (!Decompress(compressed, maxLength, collector) || collector.output != expected)
+			{
+				results.Fail(name, "round trip", image.size());
+			}
+		}
+
+		// The image truncated by the header, which must be rejected. Try every length for small images and a spread of lengths plus the last 64 for large ones.
+		// An empty image is also an empty block, so it has nothing to truncate.
+		const size_t lengthStep = std::max<size_t>(compressedLength/1000, 1);
+		for (size_t length = 0; length < compressedLength && !image.empty(); length += (length + 64 < compressedLength) ? lengthStep : 1)
+		{
+			++results.numTests;
+			std::vector<uint8_t> truncated(compressed.begin(), compressed.begin() + sizeof(CompressedImageHeader) + length);
+			const uint32_t truncatedLength = (uint32_t)length;
+			memcpy(&truncated[8], &truncatedLength, 4);
+			ChunkCollector collector(maxLength);
+			if (Decompress(truncated, maxLength, collector) || collector.badChunk)
+			{
+				results.Fail(name, "truncated image accepted", length);
+			}
+		}
+
+		// The image truncated by losing the end of the transfer, so the rest of the buffer is 0xFF. This may decode to a different image, which the CRC check rejects.
+		for (size_t length = 0; length < compressedLength; length += lengthStep)
+		{
+			++results.numTests;
+			const std::vector<uint8_t> truncated(compressed.begin(), compressed.begin() + sizeof(CompressedImageHeader) + length);
+			ChunkCollector collector(maxLength);
+			(void)Decompress(truncated, maxLength, collector);
+			if (collector.badChunk)
+			{
+				results.Fail(name, "incomplete transfer wrote outside the block", length);
+			}
+		}
+
+		// Bad headers
+		const uint32_t badLengths[][2] =
+		{
+			{ (uint32_t)image.size() + 1, (uint32_t)compressedLength },
+			{ (uint32_t)image.size() - 1, (uint32_t)compressedLength },
+			{ maxLength + 1, (uint32_t)compressedLength },
+			{ (uint32_t)image.size(), maxLength - (uint32_t)sizeof(CompressedImageHeader) + 1 },
+			{ 0xFFFFFFFF, 0xFFFFFFFF },
+		};
+		for (const auto& lengths : badLengths)
+		{
+			++results.numTests;
+			std::vector<uint8_t> bad(compressed);
+			memcpy(&bad[4], &lengths[0], 4);
+			memcpy(&bad[8], &lengths[1], 4);
+			ChunkCollector collector(maxLength);
+			if (Decompress(bad, maxLength, collector) || collector.badChunk)
+			{
+				results.Fail(name, "bad header accepted", lengths[0]);
+			}
+		}
+
+		// Corrupt bytes. These may decode to a different image, which the CRC check catches, but they must never produce chunks outside the block.
+		for (unsigned int trial = 0; trial < 1000; ++trial)
+		{
+			++results.numTests;
+			std::vector<uint8_t> corrupt(compressed);
+			for (unsigned int i = 1 + rng() % 3; i != 0; --i)
+			{
+				corrupt[sizeof(CompressedImageHeader) + rng() % compressedLength] ^= (uint8_t)(1 + rng() % 255);
+			}
+			ChunkCollector collector(maxLength);
+			const bool ok = Decompress(corrupt, maxLength, collector);
+			if (collector.badChunk || collector.output.size() > maxLength)
+			{
+				results.Fail(name, "corrupt image wrote outside the block", trial);
+			}
+			else if (!ok)
+			{
+				++results.corruptRejected;
+			}
+			else if (collector.output != expected)
+			{
+				++results.corruptAccepted;
+			}
+		}
+
+		printf("%s: %u bytes compressed to %u bytes (%.1f%%) for a %uK block\n",
+				name, (unsigned int)image.size(), (unsigned int)compressed.size(), 100.0 * (double)compressed.size()/(double)std::max<size_t>(image.size(), 1), (unsigned int)(maxLength/1024));
+	}
+
+	static int RunTests(const std::vector<const char*>& fileNames, unsigned int seed) noexcept
+	{
+		std::mt19937 rng(seed);
+		TestResults results;
+
+		// The CRC offset checks that CheckCRC and the compressed image CRC check share
+		const struct { uint32_t offset; bool valid; } crcOffsets[] =
+		{
+			{ 0x1FFC, false }, { 0x2000, true }, { 0x2002, false }, { 0x3FFC, true }, { 0x3FFD, false }, { 0x4000, false }, { 0xFFFFFFFF, false }
+		};
+		for (const auto& c : crcOffsets)
+		{
+			++results.numTests;
+			if (IsValidCrcOffset(c.offset, SamC21BlockSize) != c.valid)
+			{
+				results.Fail("CRC offset", "wrong result", c.offset);
+			}
+		}
+
+		for (const uint32_t maxLength : { SamC21BlockSize, Same5xBlockSize })
+		{
+			std::vector<uint8_t> random(maxLength - maxLength/100);			// random data gets slightly longer when it is compressed
+			for (uint8_t& b : random)
+			{
+				b = (uint8_t)rng();
+			}
+			TestImage("empty", std::vector<uint8_t>(), maxLength, rng, results);
+			TestImage("short", std::vector<uint8_t>(random.begin(), random.begin() + 11), maxLength, rng, results);
+			TestImage("random", random, maxLength, rng, results);
+			TestImage("zeros", std::vector<uint8_t>(maxLength, 0), maxLength, rng, results);
+			TestImage("erased", std::vector<uint8_t>(maxLength - 100, 0xFF), maxLength, rng, results);
+			TestImage("code", MakeCodeImage(rng, maxLength - 1000), maxLength, rng, results);
+			TestImage("full code", MakeCodeImage(rng, maxLength), maxLength, rng, results);
+
+			for (const char *fileName : fileNames)
+			{
+				std::vector<uint8_t> data;
+				if (!ReadFile(fileName, data))
+				{
+					return 1;
+				}
+				data.resize(std::min<size_t>(data.size(), maxLength));
+				TestImage(fileName, data, maxLength, rng, results);
+			}
+		}
+
+		printf("%u tests, %u failures. Of the corrupt images %u were rejected and %u decoded to a different image, which the CRC check rejects\n",
+				results.numTests, results.numFailures, results.corruptRejected, results.corruptAccepted);
+		return (results.numFailures == 0) ? 0 : 1;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	using namespace ImageCompressor;
+
+	bool test = false, badArgs = false;
+	uint32_t maxLength = SamC21BlockSize;
+	unsigned int seed = 12345;
+	std::vector<const char*> fileNames;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--test") == 0)
+		{
+			test = true;
+		}
+		else if (strcmp(argv[i], "--max-length") == 0 && i + 1 < argc)
+		{
+			maxLength = (uint32_t)strtoul(argv[++i], nullptr, 0);
+		}
+		else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+		{
+			seed = (unsigned int)strtoul(argv[++i], nullptr, 0);
+		}
+		else if (argv[i][0] != '-')
+		{
+			fileNames.push_back(argv[i]);
+		}
+		else
+		{
+			badArgs = true;
+		}
+	}
+
+	if (test && !badArgs)
+	{
+		return RunTests(fileNames, seed);
+	}
+	if (badArgs || fileNames.size() != 2 || maxLength % DecompressionChunkSize != 0 || maxLength < MinImageCrcOffset + 4)
+	{
+		fprintf(stderr, "Usage: %s [--max-length <bytes>] <input.bin> <output.bin>\n       %s --test [--seed <n>] [<file>...]\n", argv[0], argv[0]);
+		return 2;
+	}
+	return Compress(fileNames[0], fileNames[1], maxLength);
+}
+
+// End
@@ -0,0 +1,218 @@
+/*
+ * CanQueueBench.cpp
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ *
+ *  Host benchmark of the CAN message queues. It compiles the firmware's own CanMessageQueue.cpp and compares the locked linked list queue
+ *  with the lock-free ring queue that the CAN receiver uses to pass moves and commands on:
+ *  - add and get in one thread, which is the cost of the queue operations themselves;
+ *  - a producer thread and a consumer thread that waits for each message, as the CAN receiver task and the Move task use the queues.
+ *    This reports the throughput and the times that the producer spent in AddMessage, and checks that every message arrives once and in order.
+ *    The longest times are mostly when the host preempted the producer thread, so the 99.9th percentile is reported as well.
+ *
+ *  On the board TaskCriticalSectionLocker suspends task switching. Here it locks a mutex, which is the nearest host equivalent, so the times of the
+ *  locked queue include the cost of the lock and of waiting for the other thread to release it.
+ *
+ *  Usage: CanQueueBench [--messages <n>]
+ *
+ *  The program fails if a message is lost, duplicated or received out of order.
+ */
+
+// Include the standard library headers first, because ecv.h defines macros such as 'value' that they use as identifiers
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <algorithm>
+#include <sched.h>
+
+#include <CAN/CanMessageQueue.h>
+
+// The step timer, which the ring queue reads to time how long messages wait. It doesn't advance, because we measure the times on the host clock.
+SimulatedTc simulatedStepTc;
+
+namespace CanQueueBench
+{
+	// Each thread is a task that can wait for a notification
+	class BenchTask : public TaskBase
+	{
+	public:
+		std::mutex mutex;
+		std::condition_variable notified;
+		unsigned int notifyCount = 0;
+	};
+
+	static thread_local BenchTask currentTask;
+	static std::mutex schedulerLock;
+
+	// The number of messages that the producer may have in the queue, which is limited by the number of CAN buffers on the board
+	constexpr size_t MaxMessagesInFlight = CanMessageRingQueue::Capacity/2;
+
+	static uint64_t Nanos() noexcept
+	{
+		return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	// Add a message to the queue and get it back, in one thread. Return the average time in nanoseconds.
+	template<class Q> static double TimeAddAndGet(Q& queue, size_t numMessages) noexcept
+	{
+		CanMessageBuffer buf(nullptr);
+		const uint64_t start = Nanos();
+		for (size_t i = 0; i < numMessages; ++i)
+		{
+			queue.AddMessage(&buf);
+			if (queue.GetMessage(0) != &buf)
+			{
+				return -1.0;
+			}
+		}
+		return (double)(Nanos() - start)/numMessages;
+	}
+
+	struct ThreadResults
+	{
+		double nanosPerMessage = 0.0;
+		uint64_t addNanos999 = 0;									// 99.9th percentile of the time taken by AddMessage
+		uint64_t maxAddNanos = 0;
+		size_t numErrors = 0;
+	};
+
+	// Pass messages from a producer thread to a consumer thread that waits for them
+	template<class Q> static ThreadResults TimeProducerConsumer(Q& queue, size_t numMessages) noexcept
+	{
+		std::vector<CanMessageBuffer> buffers(MaxMessagesInFlight, CanMessageBuffer(nullptr));
+		std::vector<uint64_t> addNanos(numMessages);
+		std::atomic<size_t> numReceived(0);
+		ThreadResults results;
+
+		const uint64_t start = Nanos();
+		std::thread consumer([&queue, &numReceived, &results, numMessages]() noexcept
+			{
+				for (size_t i = 0; i < numMessages; ++i)
+				{
+					CanMessageBuffer * const buf = queue.GetMessage(TaskBase::TimeoutUnlimited);
+					if (buf == nullptr || buf->msg.moveLinear.whenToExecute != (uint32_t)i)
+					{
+						++results.numErrors;
+					}
+					numReceived.store(i + 1, std::memory_order_release);
+				}
+			});
+
+		for (size_t i = 0; i < numMessages; ++i)
+		{
+			while (i - numReceived.load(std::memory_order_acquire) >= MaxMessagesInFlight)
+			{
+				sched_yield();										// ecv.h defines yield as a macro, so we can't use std::this_thread::yield
+			}
+			CanMessageBuffer& buf = buffers[i % MaxMessagesInFlight];
+			buf.msg.moveLinear.whenToExecute = (uint32_t)i;
+			const uint64_t addStart = Nanos();
+			queue.AddMessage(&buf);
+			addNanos[i] = Nanos() - addStart;
+		}
+		consumer.join();
+
+		results.nanosPerMessage = (double)(Nanos() - start)/numMessages;
+		if (numMessages != 0)
+		{
+			const auto percentile = addNanos.begin() + (numMessages * 999)/1000;
+			std::nth_element(addNanos.begin(), percentile, addNanos.end());
+			results.addNanos999 = *percentile;
+			results.maxAddNanos = *std::max_element(percentile, addNanos.end());
+		}
+		return results;
+	}
+}
+
+TaskBase *TaskBase::GetCallerTaskHandle() noexcept
+{
+	return &CanQueueBench::currentTask;
+}
+
+// Wait for a notification and clear the notification count, as ulTaskNotifyTake(pdTRUE, timeout) does
+bool TaskBase::Take(uint32_t timeout) noexcept
+{
+	CanQueueBench::BenchTask& task = CanQueueBench::currentTask;
+	std::unique_lock<std::mutex> lock(task.mutex);
+	auto isNotified = [&task]() noexcept { return task.notifyCount != 0; };
+	if (timeout == TimeoutUnlimited)
+	{
+		task.notified.wait(lock, isNotified);
+	}
+	else if (!task.notified.wait_for(lock, std::chrono::milliseconds(timeout), isNotified))
+	{
+		return false;
+	}
+	task.notifyCount = 0;
+	return true;
+}
+
+void TaskBase::ClearNotifyCount() noexcept
+{
+	CanQueueBench::BenchTask& task = CanQueueBench::currentTask;
+	std::lock_guard<std::mutex> lock(task.mutex);
+	task.notifyCount = 0;
+}
+
+void TaskBase::GiveFromISR(TaskBase *t) noexcept
+{
+	CanQueueBench::BenchTask * const task = static_cast<CanQueueBench::BenchTask*>(t);
+	{
+		std::lock_guard<std::mutex> lock(task->mutex);
+		++task->notifyCount;
+	}
+	task->notified.notify_one();
+}
+
+TaskCriticalSectionLocker::TaskCriticalSectionLocker() noexcept
+{
+	CanQueueBench::schedulerLock.lock();
+}
+
+TaskCriticalSectionLocker::~TaskCriticalSectionLocker() noexcept
+{
+	CanQueueBench::schedulerLock.unlock();
+}
+
+int main(int argc, char *argv[])
+{
+	using namespace CanQueueBench;
+
+	size_t numMessages = 1000000;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--messages") == 0 && i + 1 < argc)
+		{
+			numMessages = (size_t)strtoul(argv[++i], nullptr, 10);
+		}
+		else
+		{
+			fprintf(stderr, "Usage: %s [--messages <n>]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	CanMessageQueue listQueue;
+	CanMessageRingQueue ringQueue;
+
+	const double listAddGet = TimeAddAndGet(listQueue, numMessages);
+	const double ringAddGet = TimeAddAndGet(ringQueue, numMessages);
+	printf("Add and get in one thread: locked list %.1fns, lock-free ring %.1fns\n", listAddGet, ringAddGet);
+
+	const ThreadResults listResults = TimeProducerConsumer(listQueue, numMessages);
+	const ThreadResults ringResults = TimeProducerConsumer(ringQueue, numMessages);
+	printf("Producer and consumer threads: locked list %.1fns per message, add 99.9%% %.2fus max %.1fus, %u errors\n",
+			listResults.nanosPerMessage, (double)listResults.addNanos999/1000.0, (double)listResults.maxAddNanos/1000.0, (unsigned int)listResults.numErrors);
+	printf("Producer and consumer threads: lock-free ring %.1fns per message, add 99.9%% %.2fus max %.1fus, %u errors\n",
+			ringResults.nanosPerMessage, (double)ringResults.addNanos999/1000.0, (double)ringResults.maxAddNanos/1000.0, (unsigned int)ringResults.numErrors);
+
+	return (listAddGet < 0.0 || ringAddGet < 0.0 || listResults.numErrors != 0 || ringResults.numErrors != 0) ? 1 : 0;
+}
+
+// End
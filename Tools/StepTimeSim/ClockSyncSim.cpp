@@ -0,0 +1,173 @@
+/*
+ * ClockSyncSim.cpp
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ *
+ *  Host simulator for the PLL that synchronises the step clock to the main board. It feeds the firmware's own ClockSyncPll with offset
+ *  measurements in the same order as StepTimer::ProcessTimeSyncMessage does, and measures the error in converting the start time of a
+ *  move from master time to local time. It reports the same error for the old method, which used the latest measured offset.
+ *
+ *  Usage: ClockSyncSim [--max-error <clocks>]
+ *
+ *  The model:
+ *  - the local clock runs fast or slow by 50 to 100ppm, and that drifts by a random walk of 0.005ppm per sync message;
+ *  - sync messages are 100 to 200ms apart;
+ *  - the measured offset has Gaussian jitter of 1.5 step clocks RMS, then is rounded to whole step clocks;
+ *  - each measurement is only complete when the next sync message arrives, because it needs the transmit delay of the previous one;
+ *  - moves are converted from master time to local time 300ms before they start.
+ *
+ *  --max-error makes the program fail if the peak PLL conversion error is greater than that.
+ */
+
+// Include the standard library headers first, because ecv.h defines macros such as 'value' that they use as identifiers
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <random>
+
+#include <Movement/StepTimer.h>
+#include <Movement/ClockSyncPll.h>
+
+namespace ClockSyncSim
+{
+	constexpr double JitterRms = 1.5;										// step clocks
+	constexpr double DriftWanderPerSync = 0.005e-6;
+	constexpr uint32_t MinSyncInterval = StepTimer::StepClockRate/10;		// 100ms
+	constexpr uint32_t MaxSyncInterval = StepTimer::StepClockRate/5;		// 200ms
+	constexpr uint32_t MoveLeadTime = (3 * StepTimer::StepClockRate)/10;	// 300ms
+	constexpr unsigned int NumAcquireCorrections = 8;						// StepTimer uses the acquisition gains until it has received MaxSyncCount (10) messages
+	constexpr double SettleTime = 30.0;										// seconds to wait before measuring the errors
+	constexpr double RunTime = 600.0;										// seconds of each run after SettleTime
+
+	struct ErrorStats
+	{
+		double sumSquares = 0.0;
+		double maxError = 0.0;
+		size_t num = 0;
+
+		void Add(double err) noexcept
+		{
+			sumSquares += err * err;
+			if (fabs(err) > maxError)
+			{
+				maxError = fabs(err);
+			}
+			++num;
+		}
+
+		double Rms() const noexcept { return (num == 0) ? 0.0 : sqrt(sumSquares/num); }
+	};
+
+	struct RunStats
+	{
+		ErrorStats pll;					// the error in converting a move start time using the PLL
+		ErrorStats old;					// the error using the latest measured offset
+		ErrorStats phase;				// the PLL phase errors once settled
+	};
+
+	// Simulate one run with the local clock initially running fast by the specified fraction, which may be negative
+	static void Run(double initialDrift, uint32_t seed, RunStats& stats) noexcept
+	{
+		std::mt19937 rng(seed);
+		std::normal_distribution<double> jitter(0.0, JitterRms);
+		std::normal_distribution<double> wander(0.0, DriftWanderPerSync);
+		std::uniform_int_distribution<uint32_t> interval(MinSyncInterval, MaxSyncInterval);
+
+		ClockSyncPll pll;
+		double drift = initialDrift;
+		double masterTime = 0.0;
+		double offset = (double)(rng() & 0x0FFFFFFF);						// the true local time minus master time. The times stay below 2^32, so we needn't allow for wrap round.
+		bool havePrevious = false;
+		unsigned int numCorrections = 0;
+		uint32_t prevLocalTime = 0, prevMeasuredOffset = 0;
+		uint32_t latestMeasuredOffset = 0;
+
+		while (masterTime < (SettleTime + RunTime) * StepTimer::StepClockRate)
+		{
+			// The next sync message arrives
+			const double dt = (double)interval(rng);
+			masterTime += dt;
+			offset += drift * dt;
+			drift += wander(rng);
+			const uint32_t localTime = (uint32_t)(int64_t)floor(masterTime + offset);
+
+			// Process the measurement that the previous message started
+			if (havePrevious)
+			{
+				if (numCorrections == 0)
+				{
+					pll.Start(prevLocalTime, prevMeasuredOffset);
+				}
+				else
+				{
+					const int32_t phaseError = pll.GetPhaseError(prevLocalTime, prevMeasuredOffset);
+					pll.Correct(prevLocalTime, phaseError, numCorrections <= NumAcquireCorrections);
+					if (masterTime >= SettleTime * StepTimer::StepClockRate)
+					{
+						stats.phase.Add(phaseError);
+					}
+				}
+				++numCorrections;
+				latestMeasuredOffset = prevMeasuredOffset;
+			}
+
+			// Start a new measurement, which completes when the next message arrives
+			prevLocalTime = localTime;
+			prevMeasuredOffset = (uint32_t)(int64_t)lrint(offset + jitter(rng));
+			havePrevious = true;
+
+			// Convert the start time of a move that starts MoveLeadTime from now, in the same way as StepTimer::ConvertToLocalTime
+			if (masterTime >= SettleTime * StepTimer::StepClockRate)
+			{
+				const double moveMasterTime = masterTime + MoveLeadTime;
+				const double trueLocalTime = moveMasterTime + offset + drift * MoveLeadTime;
+				const uint32_t masterTicks = (uint32_t)(int64_t)floor(moveMasterTime);
+				const uint32_t approxLocalTime = masterTicks + pll.GetOffset(localTime);
+				const uint32_t pllLocalTime = masterTicks + pll.GetOffset(approxLocalTime);
+				const uint32_t oldLocalTime = masterTicks + latestMeasuredOffset;
+				stats.pll.Add((double)pllLocalTime - trueLocalTime);
+				stats.old.Add((double)oldLocalTime - trueLocalTime);
+			}
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	using namespace ClockSyncSim;
+
+	double maxAllowedError = 0.0;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--max-error") == 0 && i + 1 < argc)
+		{
+			maxAllowedError = atof(argv[++i]);
+		}
+		else
+		{
+			fprintf(stderr, "Usage: %s [--max-error <clocks>]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	static const double drifts[] = { 50.0e-6, -50.0e-6, 100.0e-6, -100.0e-6 };
+	double peakPllError = 0.0;
+	uint32_t seed = 1;
+	for (double drift : drifts)
+	{
+		RunStats stats;
+		Run(drift, seed++, stats);
+		printf("Drift %+.0fppm: move start error with PLL RMS %.2f peak %.2f clocks, with latest offset RMS %.2f peak %.2f clocks, PLL phase error RMS %.2f peak %.0f clocks\n",
+				drift * 1.0e6, stats.pll.Rms(), stats.pll.maxError, stats.old.Rms(), stats.old.maxError, stats.phase.Rms(), stats.phase.maxError);
+		if (stats.pll.maxError > peakPllError)
+		{
+			peakPllError = stats.pll.maxError;
+		}
+	}
+
+	return (maxAllowedError > 0.0 && peakPllError > maxAllowedError) ? 1 : 0;
+}
+
+// End
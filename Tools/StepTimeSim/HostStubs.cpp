@@ -0,0 +1,201 @@
+/*
+ * HostStubs.cpp
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ *
+ *  Host definitions of the firmware and CoreN2G functions that the step time code calls
+ */
+
+#include "StepTimeSim.h"
+#include <Platform.h>
+#include <Tasks.h>
+#include <Movement/StepTimer.h>
+#include <Movement/DDA.h>
+#include <CAN/CanInterface.h>
+#include <RTOSIface/RTOSIface.h>
+#if SUPPORT_INPUT_SHAPING
+# include <Movement/InputShaper.h>
+#endif
+
+#include <cstdio>
+#include <cstdlib>
+
+SimulatedTc simulatedStepTc;
+Move *moveInstance = nullptr;							// the simulator creates this when it needs it
+SimulatedSysTick simulatedSysTick;
+
+uint32_t millis() noexcept
+{
+	return (uint32_t)(((uint64_t)simulatedStepTc.COUNT.reg * 1000u)/StepTimer::StepClockRate);
+}
+
+void delay(uint32_t ms) noexcept
+{
+	simulatedStepTc.COUNT.reg += ms * (StepTimer::StepClockRate/1000);
+}
+
+uint32_t MicrosecondsTimer::ReadMicroseconds() noexcept
+{
+	return (uint32_t)(((uint64_t)simulatedStepTc.COUNT.reg * 1000000u)/StepTimer::StepClockRate);
+}
+
+extern "C" void debugPrintf(const char* fmt, ...)
+{
+	va_list vargs;
+	va_start(vargs, fmt);
+	vfprintf(stderr, fmt, vargs);
+	va_end(vargs);
+}
+
+// Tasks
+void *Tasks::AllocPermanent(size_t sz, std::align_val_t align) noexcept
+{
+	return ::operator new(sz, align);
+}
+
+// Tasks. The only task is the Move task, which runs in the simulator's thread. When it blocks, the simulator runs the step interrupts.
+static TaskBase simulatedMoveTask;
+
+TaskBase *TaskBase::GetCallerTaskHandle() noexcept
+{
+	return &simulatedMoveTask;
+}
+
+bool TaskBase::Take(uint32_t timeout) noexcept
+{
+	return StepTimeSim::WaitForWakeup(timeout);
+}
+
+void TaskBase::GiveFromISR(TaskBase *t) noexcept
+{
+	StepTimeSim::WakeTask();
+}
+
+// CAN. The move messages come from the simulator. The queue status messages are discarded.
+static CanMessageBuffer statusBuffer(nullptr);
+
+CanMessageBuffer *CanMessageBuffer::Allocate() noexcept
+{
+	return &statusBuffer;
+}
+
+void CanMessageBuffer::Free(CanMessageBuffer*& buf) noexcept
+{
+	buf = nullptr;
+}
+
+CanMessageBuffer *CanInterface::GetCanMove(uint32_t timeout) noexcept
+{
+	return StepTimeSim::GetNextMove();
+}
+
+void CanInterface::SendAndFree(CanMessageBuffer *buf) noexcept
+{
+}
+
+// Platform. Step pulses are passed to the simulator, and errors are counted. Everything else does nothing.
+static unsigned int numBadMoves = 0;
+
+bool Platform::Debug(Module module) noexcept { return false; }
+
+void Platform::LogError(ErrorCode e) noexcept
+{
+	if (e == ErrorCode::BadMove)
+	{
+		++numBadMoves;
+	}
+}
+
+unsigned int StepTimeSim::GetAndClearBadMoves() noexcept
+{
+	const unsigned int ret = numBadMoves;
+	numBadMoves = 0;
+	return ret;
+}
+
+void Platform::Message(MessageType type, const char *message) noexcept { fputs(message, stderr); }
+
+void Platform::MessageF(MessageType type, const char *fmt, ...) noexcept
+{
+	va_list vargs;
+	va_start(vargs, fmt);
+	vfprintf(stderr, fmt, vargs);
+	va_end(vargs);
+}
+
+float Platform::DriveStepsPerUnit(size_t drive) noexcept { return 80.0; }
+float simulatedPressureAdvanceClocks = 0.0;				// the simulator sets this when it checks shaped moves with pressure advance
+
+float Platform::GetPressureAdvanceClocks(size_t driver) noexcept { return simulatedPressureAdvanceClocks; }
+float Platform::GetPressureAdvanceSmoothingClocks(size_t driver) noexcept { return 0.0; }
+float Platform::GetPressureAdvanceNonlinear(size_t driver) noexcept { return 0.0; }
+void Platform::EnableDrive(size_t driver) noexcept { }
+void Platform::SetDirection(bool direction) noexcept { }
+void Platform::SetDirection(size_t driver, bool direction) noexcept { }
+
+void Platform::StepDriversHigh(uint32_t driverMap) noexcept
+{
+	StepTimeSim::RecordSteps(driverMap);
+}
+
+// StepTimer. The simulator owns the clock, so scheduling a callback just records when it is wanted. Only one callback can be pending, which is all the Move task needs.
+StepTimer * volatile StepTimer::pendingList = nullptr;
+
+StepTimer::StepTimer() : next(nullptr), callback(nullptr), active(false)
+{
+}
+
+void StepTimer::DisableTimerInterrupt()
+{
+	pendingList = nullptr;
+}
+
+// The step interrupt, which the simulator calls when the pending callback is due
+void StepTimer::Interrupt()
+{
+	StepTimer * const tmr = pendingList;
+	if (tmr != nullptr)
+	{
+		pendingList = nullptr;
+		tmr->active = false;
+		tmr->callback(tmr->cbParam);
+	}
+}
+
+void StepTimer::SetCallback(TimerCallbackFunction cb, CallbackParameter param)
+{
+	callback = cb;
+	cbParam = param;
+}
+
+bool StepTimer::ScheduleCallbackFromIsr(Ticks when)
+{
+	whenDue = when;
+	if ((int32_t)(when - GetTimerTicks()) <= 0)
+	{
+		return true;
+	}
+	active = true;
+	pendingList = this;
+	StepTimeSim::SetNextInterruptTime(when);
+	return false;
+}
+
+#if SUPPORT_INPUT_SHAPING
+
+InputShaperImpulses simulatedImpulses = { 0 };			// the simulator sets these when it checks shaped moves
+
+void InputShaper::GetImpulses(InputShaperImpulses& impulses)
+{
+	impulses = simulatedImpulses;
+}
+
+bool InputShaper::IsEnabled()
+{
+	return simulatedImpulses.numImpulses != 0;
+}
+
+#endif
+
+// End
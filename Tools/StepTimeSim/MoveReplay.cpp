@@ -0,0 +1,392 @@
+/*
+ * MoveReplay.cpp
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ *
+ *  Replays a stream of linear move messages through the firmware's own Move task, DDA ring and step ISR, driven by the simulated step clock,
+ *  and checks the step times against the exact trapezoidal profiles. The Move task runs in the simulator's thread. When it waits for a move
+ *  to complete, the simulator runs the step interrupts until the step ISR wakes it. When the stream is exhausted we let the queued moves finish
+ *  and leave the Move task loop using longjmp, because it never returns.
+ *
+ *  The simulated step clock advances by a modelled number of CPU cycles for each step interrupt and for each step generated, so the step ISR
+ *  can fall behind at high step rates and insert hiccups as it does on a board. The default cycle counts are estimates, which can be calibrated
+ *  against the ISR time per step that M122 reports on a real board.
+ *
+ *  The replay file has one move per line, in the format that the Move task prints when Move debugging is enabled:
+ *    mv <whenToExecute> <accelerationClocks> <steadyClocks> <decelClocks> <initialSpeedFraction> <finalSpeedFraction> <pressureAdvanceDrives> <steps>...
+ *  where pressureAdvanceDrives is a hexadecimal bitmap and there is one steps value per driver. Other lines are ignored, so a capture of the
+ *  debug output can be replayed as it is. The start times are moved so that the first move starts soon after the replay starts.
+ *
+ *  On builds with delta movement the replay also sends the geometry of a delta tower to the Move task before the first move, which it must accept,
+ *  and again while moves are queued, which it must refuse.
+ */
+
+// Include the standard library headers first, because ecv.h defines macros such as 'value' that they use as identifiers
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <csetjmp>
+#include <vector>
+
+#include "StepTimeSim.h"
+#include <CanMessageFormats.h>
+#include <CanMessageBuffer.h>
+#include <Movement/Move.h>
+
+namespace StepTimeSim
+{
+	constexpr uint32_t ReplayLeadClocks = StepTimer::StepClockRate/100;		// start the first move 10ms after the replay starts
+	constexpr uint32_t MaxWaitMillis = 2000;									// don't let a blocked Move task wait longer than this
+
+	static std::vector<CanMessageMovementLinear> replayMoves;
+	static size_t nextReplayMove = 0;
+	static uint32_t replayTimeOffset = 0;
+	static CanMessageBuffer replayBuffer(nullptr);
+	static jmp_buf replayDone;
+	static bool taskWoken = false;
+#if SUPPORT_DELTA_MOVEMENT
+	constexpr size_t ReconfigureDeltaMove = 2;								// the move before which we try to change the delta geometry while moves are queued
+	static unsigned int deltaConfigErrors = 0;
+#endif
+
+	// Take the step interrupt that is pending, advancing the clock to when it is due if it isn't due yet
+	static void RunInterrupt() noexcept
+	{
+		if ((int32_t)(nextInterruptTime - StepTimer::GetTimerTicks()) > 0)
+		{
+			simulatedStepTc.COUNT.reg = nextInterruptTime;
+		}
+		interruptPending = false;
+		AddCpuCycles(isrEntryCycles);
+		StepTimer::Interrupt();
+	}
+
+	// Run the step interrupts until the step ISR wakes the Move task or the timeout expires. Return true if the task was woken.
+	bool WaitForWakeup(uint32_t timeoutMillis) noexcept
+	{
+		const uint32_t timeoutClocks = min<uint32_t>(timeoutMillis, MaxWaitMillis) * (StepTimer::StepClockRate/1000);
+		const uint32_t startTime = StepTimer::GetTimerTicks();
+		while (!taskWoken)
+		{
+			if (!interruptPending || (int32_t)(nextInterruptTime - startTime) >= (int32_t)timeoutClocks)
+			{
+				if ((int32_t)(StepTimer::GetTimerTicks() - startTime) < (int32_t)timeoutClocks)
+				{
+					simulatedStepTc.COUNT.reg = startTime + timeoutClocks;
+				}
+				return false;
+			}
+			RunInterrupt();
+		}
+		taskWoken = false;
+		return true;
+	}
+
+	void WakeTask() noexcept
+	{
+		taskWoken = true;
+	}
+
+	// Return the next move message of the stream. When there are none left, run the moves that are queued and return to ReplayMoves.
+	CanMessageBuffer *GetNextMove() noexcept
+	{
+		if (nextReplayMove < replayMoves.size())
+		{
+#if SUPPORT_DELTA_MOVEMENT
+			// The Move task must accept delta tower geometry before the first move and refuse to change it while moves are queued
+			if (nextReplayMove == 0 || nextReplayMove == ReconfigureDeltaMove)
+			{
+				if (ConfigureDeltaTower(0, -91.45, -52.8, 215.0) != (nextReplayMove == 0))
+				{
+					++deltaConfigErrors;
+				}
+			}
+#endif
+			CanMessageMovementLinear& msg = replayMoves[nextReplayMove++];
+			if (nextReplayMove == 1)
+			{
+				replayTimeOffset = StepTimer::GetTimerTicks() + ReplayLeadClocks - msg.whenToExecute;
+			}
+			msg.whenToExecute += replayTimeOffset;
+			replayBuffer.id.SetMsgType(CanMessageType::movementLinear);
+			replayBuffer.msg.moveLinear = msg;
+			return &replayBuffer;
+		}
+
+		while (interruptPending)
+		{
+			RunInterrupt();
+		}
+		longjmp(replayDone, 1);
+	}
+
+	// Read a move stream. Return false if the file can't be read or has no moves.
+	static bool ReadMoves(const char *fileName) noexcept
+	{
+		FILE * const f = fopen(fileName, "r");
+		if (f == nullptr)
+		{
+			fprintf(stderr, "Can't open %s\n", fileName);
+			return false;
+		}
+
+		char line[256];
+		while (fgets(line, sizeof(line), f) != nullptr)
+		{
+			CanMessageMovementLinear msg;
+			memset(&msg, 0, sizeof(msg));
+			unsigned int paDrives;
+			int numChars;
+			if (sscanf(line, "mv %" SCNu32 " %" SCNu32 " %" SCNu32 " %" SCNu32 " %f %f %x%n",
+						&msg.whenToExecute, &msg.accelerationClocks, &msg.steadyClocks, &msg.decelClocks,
+						&msg.initialSpeedFraction, &msg.finalSpeedFraction, &paDrives, &numChars) != 7)
+			{
+				continue;
+			}
+
+			// The board only gets the steps for its own drivers, so we ignore any more than we have
+			const char *p = line + numChars;
+			size_t numDrivers = 0;
+			for (;;)
+			{
+				char *end;
+				const long steps = strtol(p, &end, 10);
+				if (end == p)
+				{
+					break;
+				}
+				if (numDrivers < NumDrivers)
+				{
+					msg.perDrive[numDrivers++].steps = (int32_t)steps;
+				}
+				p = end;
+			}
+			msg.numDrivers = numDrivers;
+			msg.pressureAdvanceDrives = paDrives & ((1u << NumDrivers) - 1);
+			replayMoves.push_back(msg);
+		}
+		fclose(f);
+
+		if (replayMoves.empty())
+		{
+			fprintf(stderr, "No moves in %s\n", fileName);
+			return false;
+		}
+		return true;
+	}
+
+	// Check the step times of each drive against the moves that were replayed. The moves of each drive execute in order, so we can tell which move
+	// each step belongs to from the number of steps in the moves before it. If a step is missing then the following moves are checked against the
+	// wrong steps, but the missing step is still counted.
+	static void CheckReplayedSteps(MoveStats& stats, FILE *dumpFile) noexcept
+	{
+		for (size_t drive = 0; drive < NumDrivers; ++drive)
+		{
+			const std::vector<uint32_t>& times = stepTimes[drive];
+			size_t index = 0;
+			for (const CanMessageMovementLinear& msg : replayMoves)
+			{
+				const size_t numSteps = (drive < msg.numDrivers) ? (size_t)labs(msg.perDrive[drive].steps) : 0;
+				if (numSteps == 0)
+				{
+					continue;
+				}
+
+				const size_t numTimes = min<size_t>(numSteps, times.size() - index);
+				std::vector<uint32_t> relativeTimes(numTimes);
+				for (size_t i = 0; i < numTimes; ++i)
+				{
+					relativeTimes[i] = times[index + i] - msg.whenToExecute;
+				}
+				CheckStepTimes(msg, &msg - replayMoves.data(), drive, relativeTimes.data(), numTimes, !USE_EVEN_STEPS, stats);
+				if (dumpFile != nullptr)
+				{
+					DumpSteps(dumpFile, &msg - replayMoves.data(), drive, relativeTimes.data(), numTimes, numSteps);
+				}
+				index += numTimes;
+			}
+			stats.changing.numMissing += times.size() - index;				// any extra steps
+		}
+		stats.numMoves = replayMoves.size();
+	}
+
+	// Replay a move stream through the Move task and report the step timing errors and the firmware's own step generation statistics
+	int ReplayMoves(const char *fileName, const char *dumpFileName) noexcept
+	{
+		if (!ReadMoves(fileName))
+		{
+			return 2;
+		}
+
+		for (size_t drive = 0; drive < NumDrivers; ++drive)
+		{
+			stepTimes[drive].clear();
+		}
+		stepTimeOrigin = 0;
+
+		Move * const move = new Move();
+		moveInstance = move;
+		move->Init();
+		if (setjmp(replayDone) == 0)
+		{
+			move->TaskLoop();
+		}
+
+		FILE * const dumpFile = (dumpFileName != nullptr) ? fopen(dumpFileName, "w") : nullptr;
+		MoveStats stats;
+		CheckReplayedSteps(stats, dumpFile);
+		printf("Replayed %u moves from %s, step ISR modelled as %" PRIu32 " cycles per interrupt and %" PRIu32 " per step at %" PRIu32 "MHz\n",
+				(unsigned int)replayMoves.size(), fileName, isrEntryCycles, isrCyclesPerStep, SystemCoreClockFreq/1000000);
+		PrintStats("Replayed moves", stats);
+
+		// The firmware's own reports include the hiccup count, the step errors and the ISR time per step
+		char buffer[1000];
+		const StringRef reply(buffer, sizeof(buffer));
+		reply.Clear();
+		move->Diagnostics(reply);
+		printf("%s\n", reply.c_str());
+		reply.Clear();
+		move->StepDiagnostics(reply);
+		printf("%s\n", reply.c_str());
+
+		const unsigned int badMoves = GetAndClearBadMoves();
+		if (badMoves != 0)
+		{
+			printf("Moves with step errors: %u\n", badMoves);
+		}
+		unsigned int configErrors = 0;
+#if SUPPORT_DELTA_MOVEMENT
+		configErrors = deltaConfigErrors;
+		if (configErrors != 0)
+		{
+			printf("Delta tower geometry accepted while moves were queued or refused when none were: %u\n", configErrors);
+		}
+#endif
+		if (dumpFile != nullptr)
+		{
+			DumpSummary(dumpFile, badMoves, 0.0, 0.0);
+			fclose(dumpFile);
+		}
+		return (badMoves != 0 || stats.changing.numMissing != 0 || configErrors != 0) ? 1 : 0;
+	}
+
+	// A segment of the test toolpath
+	struct PathSegment
+	{
+		float x, y;								// the end point in mm
+		float speed;							// the requested speed in mm/sec
+		bool extrude;
+	};
+
+	// Write the moves that a main board would send for a short section of a print, planned with the usual trapezoidal speed profiles and
+	// junction speeds that fall with the angle between segments. It has a fast travel move, a circle made of short segments, a square with
+	// sharp corners, and zigzag infill with very short moves between the lines. The drivers are X, Y and the extruder, which uses pressure advance.
+	int WriteToolpath(const char *fileName) noexcept
+	{
+		constexpr float StepsPerMm[3] = { 80.0, 80.0, 420.0 };
+		constexpr float Acceleration = 3000.0;				// mm/sec^2
+		constexpr float ExtrusionPerMm = 0.033;				// mm of filament per mm of path
+
+		std::vector<PathSegment> path;
+		path.push_back({ 10.0, 10.0, 250.0, false });
+		for (unsigned int i = 1; i <= 72; ++i)
+		{
+			const float angle = (float)i * (2.0 * M_PI/72.0);
+			path.push_back({ 20.0f - 10.0f * cosf(angle), 10.0f - 10.0f * sinf(angle), 60.0, true });
+		}
+		path.push_back({ 40.0, 10.0, 250.0, false });
+		path.push_back({ 70.0, 10.0, 100.0, true });
+		path.push_back({ 70.0, 40.0, 100.0, true });
+		path.push_back({ 40.0, 40.0, 100.0, true });
+		path.push_back({ 40.0, 10.0, 100.0, true });
+		for (unsigned int i = 0; i < 20; ++i)
+		{
+			const float y = 11.0 + 0.4 * i;
+			path.push_back({ (i & 1) ? 41.0f : 69.0f, y, 150.0, true });
+			path.push_back({ (i & 1) ? 41.0f : 69.0f, y + 0.4f, 150.0, true });
+		}
+		path.push_back({ 0.0, 0.0, 300.0, false });
+
+		// Calculate the segment lengths and the junction speed limits
+		const size_t numSegs = path.size();
+		std::vector<float> lengths(numSegs), junctionSpeeds(numSegs + 1, 0.0);
+		float prevX = 0.0, prevY = 0.0, prevDx = 0.0, prevDy = 0.0;
+		for (size_t i = 0; i < numSegs; ++i)
+		{
+			const float dx = path[i].x - prevX, dy = path[i].y - prevY;
+			lengths[i] = sqrtf(dx * dx + dy * dy);
+			if (i != 0 && lengths[i] > 0.0 && path[i].extrude == path[i - 1].extrude)
+			{
+				const float cosAngle = (dx * prevDx + dy * prevDy)/lengths[i];
+				junctionSpeeds[i] = min<float>(path[i].speed, path[i - 1].speed) * max<float>(cosAngle, 0.0);
+			}
+			if (lengths[i] > 0.0)
+			{
+				prevDx = dx/lengths[i];
+				prevDy = dy/lengths[i];
+			}
+			prevX = path[i].x;
+			prevY = path[i].y;
+		}
+
+		// Make sure that we can decelerate to each junction speed and accelerate from it
+		for (size_t i = numSegs; i-- != 0; )
+		{
+			junctionSpeeds[i] = min<float>(junctionSpeeds[i], sqrtf(junctionSpeeds[i + 1] * junctionSpeeds[i + 1] + 2.0 * Acceleration * lengths[i]));
+		}
+		for (size_t i = 0; i < numSegs; ++i)
+		{
+			junctionSpeeds[i + 1] = min<float>(junctionSpeeds[i + 1], sqrtf(junctionSpeeds[i] * junctionSpeeds[i] + 2.0 * Acceleration * lengths[i]));
+		}
+
+		FILE * const f = fopen(fileName, "w");
+		if (f == nullptr)
+		{
+			fprintf(stderr, "Can't create %s\n", fileName);
+			return 2;
+		}
+		fprintf(f, "# Test toolpath written by StepTimeSim --write-toolpath. Drivers X, Y and extruder, %.0f, %.0f and %.0f steps/mm, acceleration %.0fmm/s^2\n",
+					(double)StepsPerMm[0], (double)StepsPerMm[1], (double)StepsPerMm[2], (double)Acceleration);
+
+		uint32_t whenToExecute = 0;
+		float pos[3] = { 0.0, 0.0, 0.0 };
+		for (size_t i = 0; i < numSegs; ++i)
+		{
+			const float length = lengths[i];
+			if (length <= 0.0)
+			{
+				continue;
+			}
+
+			// Plan the trapezoid
+			const float startSpeed = junctionSpeeds[i], endSpeed = junctionSpeeds[i + 1];
+			const float topSpeed = min<float>(path[i].speed, sqrtf((2.0 * Acceleration * length + startSpeed * startSpeed + endSpeed * endSpeed) * 0.5));
+			const float accelDistance = (topSpeed * topSpeed - startSpeed * startSpeed)/(2.0 * Acceleration);
+			const float decelDistance = (topSpeed * topSpeed - endSpeed * endSpeed)/(2.0 * Acceleration);
+			const float steadyDistance = max<float>(length - accelDistance - decelDistance, 0.0);
+			const uint32_t accelClocks = lrintf(max<float>(topSpeed - startSpeed, 0.0)/Acceleration * StepTimer::StepClockRate);
+			const uint32_t decelClocks = lrintf(max<float>(topSpeed - endSpeed, 0.0)/Acceleration * StepTimer::StepClockRate);
+			const uint32_t steadyClocks = lrintf(steadyDistance/topSpeed * StepTimer::StepClockRate);
+
+			// Calculate the steps from the rounded positions, so that the rounding errors don't accumulate
+			const float newPos[3] = { path[i].x, path[i].y, pos[2] + ((path[i].extrude) ? length * ExtrusionPerMm : 0.0f) };
+			int32_t steps[3];
+			for (size_t axis = 0; axis < 3; ++axis)
+			{
+				steps[axis] = lrintf(newPos[axis] * StepsPerMm[axis]) - lrintf(pos[axis] * StepsPerMm[axis]);
+				pos[axis] = newPos[axis];
+			}
+
+			fprintf(f, "mv %" PRIu32 " %" PRIu32 " %" PRIu32 " %" PRIu32 " %.7f %.7f %x %" PRIi32 " %" PRIi32 " %" PRIi32 "\n",
+						whenToExecute, accelClocks, steadyClocks, decelClocks,
+						(double)((accelClocks == 0) ? 1.0 : startSpeed/topSpeed), (double)((decelClocks == 0) ? 1.0 : endSpeed/topSpeed),
+						(path[i].extrude) ? 4u : 0u, steps[0], steps[1], steps[2]);
+			whenToExecute += accelClocks + steadyClocks + decelClocks;
+		}
+		fclose(f);
+		return 0;
+	}
+}
+
+// End
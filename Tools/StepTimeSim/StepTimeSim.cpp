@@ -0,0 +1,1097 @@
+/*
+ * StepTimeSim.cpp
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ *
+ *  Host simulator for the step time code. It runs a set of moves through the firmware's own DDA and DriveMovement code,
+ *  driving the step interrupt from a simulated step clock, and compares the step times generated with the exact step times.
+ *
+ *  Usage: StepTimeSim [--max-error <clocks>] [--max-delta-error <clocks>] [--dump <file>] [--seed <n>]
+ *         StepTimeSim --compare <file1> <file2> [--max-error <clocks>]
+ *         StepTimeSim --replay <file> [--isr-cycles <per interrupt> <per step>] [--dump <file>]
+ *         StepTimeSim --write-toolpath <file>
+ *
+ *  The moves are run twice on one driver, first single stepping and then with the step bunching that the firmware uses at high step rates.
+ *  Without even steps, all the steps of a bunch are generated when the last one is due, so only the last step of each bunch is checked.
+ *  The errors are reported separately for the accelerating and decelerating parts of the moves and the steady speed parts.
+ *  On builds with more than one driver the moves are then run single stepping on all drivers; steps due within StepTimer::MinInterruptInterval
+ *  of each other are generated together, so those errors are larger and are reported but not checked.
+ *
+ *  On builds with input shaping the moves are then run with a ZVD shaper, and all the steps are checked against the exact shaped motion,
+ *  which the simulator calculates in double precision from the move and the shaper impulses. Then they are run again on two drivers, with
+ *  pressure advance on the second one. The extruder is shaped too, with the advance applied on top of the shaped speed, unless that would make
+ *  it reverse, in which case the firmware doesn't shape the move at all. So the axis steps of those moves are checked against the unshaped motion.
+ *
+ *  On builds with delta movement the moves are then run as delta moves, with every driver moving a tower of a delta printer with the default geometry of
+ *  LinearDeltaKinematics, which the simulator sends to the Move task as the main board does. The head moves between random points and heights with the
+ *  speed profiles of the test moves, and every step is checked against the exact carriage height, which the simulator calculates in double precision.
+ *  Many of the carriages rise to a peak and then fall within a move. Near the peak the carriage is almost still, so the time of the step at the peak
+ *  is very sensitive to rounding, as are the last steps of a move that decelerates to a stop.
+ *
+ *  The moves are random, with the same sequence each time unless --seed is given. The host time taken by DDA::StepDrivers when single stepping is
+ *  reported per step. Each call calculates one step time, so this measures the cost of CalcNextStepTime in this build. The host time taken by
+ *  DDA::Init is reported per move, which includes calculating the step segments on builds that use them.
+ *
+ *  --max-error makes the program fail if a step of an accelerating or decelerating part is further than that from its exact time,
+ *  or any step of a shaped move is. The limit for the shaped moves with pressure advance is StepTimer::MinInterruptInterval more, because they use two drivers.
+ *  --max-delta-error makes it fail if any step of a delta move is further than that from its exact time.
+ *  --dump writes the single stepping step times to a file, one record per step giving the move, drive, step number and time, followed by
+ *  the number of moves with step errors and the timings. With --replay it writes the replayed step times instead.
+ *  --compare reports the differences between the step times in two dump files, the steps that differ most and the step errors of each build.
+ *  Only the drives that are in both files are compared. --max-error makes it fail if any step differs by more than that.
+ *  --replay runs a move stream through the Move task instead, see MoveReplay.cpp. --isr-cycles sets the cost model of the step ISR.
+ *  --write-toolpath writes the moves of a test toolpath in the replay format.
+ */
+
+// Include the standard library headers first, because ecv.h defines macros such as 'value' that they use as identifiers
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <cinttypes>
+#include <chrono>
+#include <map>
+#include <tuple>
+#include <algorithm>
+#include <vector>
+
+#include "StepTimeSim.h"
+#include <CanMessageFormats.h>
+#include <Movement/DDA.h>
+
+#if SUPPORT_INPUT_SHAPING
+extern InputShaperImpulses simulatedImpulses;
+extern float simulatedPressureAdvanceClocks;
+#endif
+#if SUPPORT_DELTA_MOVEMENT
+# include <Movement/Move.h>
+#endif
+
+namespace StepTimeSim
+{
+	constexpr size_t MaxSimDrivers = 3;						// the test moves are the same whichever build we are
+
+	// The default cost model of the step ISR when replaying moves. These are estimates, not measurements. The SAME5x executes most of the step ISR
+	// from cache and calculates step times in floating point. The SAMC21 has no cache or FPU, so the 64-bit integer step time calculations cost more.
+#if SAME5x
+	constexpr uint32_t DefaultIsrEntryCycles = 150;
+	constexpr uint32_t DefaultIsrCyclesPerStep = 300;
+#else
+	constexpr uint32_t DefaultIsrEntryCycles = 100;
+	constexpr uint32_t DefaultIsrCyclesPerStep = 450;
+#endif
+
+	std::vector<uint32_t> stepTimes[NumDrivers];
+	uint32_t stepTimeOrigin = 0;
+	uint32_t isrEntryCycles = 0;
+	uint32_t isrCyclesPerStep = 0;
+
+	uint32_t nextInterruptTime = 0;
+	bool interruptPending = false;
+
+	static uint64_t cpuCyclesOwed = 0;
+
+	// Host time spent in the firmware's step generation and move preparation
+	static uint64_t stepDriversNanos = 0;
+	static uint64_t initNanos = 0;
+	static unsigned int numInits = 0;
+
+	static unsigned int movesWithStepErrors = 0;				// the number of moves for which DDA::HasStepError returned true
+
+	static uint64_t HostNanos() noexcept
+	{
+		return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	void ErrorStats::Add(double err, size_t move, size_t drive, size_t step) noexcept
+	{
+		sumSquares += err * err;
+		if (fabs(err) > maxError)
+		{
+			maxError = fabs(err);
+			worstMove = move;
+			worstDrive = drive;
+			worstStep = step;
+		}
+		++numSteps;
+	}
+
+	double ErrorStats::Rms() const noexcept
+	{
+		return (numSteps == 0) ? 0.0 : sqrt(sumSquares/numSteps);
+	}
+
+	// Advance the simulated step clock by the time the CPU takes to execute some cycles, carrying the part of a step clock left over
+	void AddCpuCycles(uint32_t cycles) noexcept
+	{
+		cpuCyclesOwed += (uint64_t)cycles * StepTimer::StepClockRate;
+		simulatedStepTc.COUNT.reg += (uint32_t)(cpuCyclesOwed/SystemCoreClockFreq);
+		cpuCyclesOwed %= SystemCoreClockFreq;
+	}
+
+	void RecordSteps(uint32_t driverMap) noexcept
+	{
+		const uint32_t now = StepTimer::GetTimerTicks();
+		for (size_t drive = 0; drive < NumDrivers; ++drive)
+		{
+			if (driverMap & (1u << drive))
+			{
+				stepTimes[drive].push_back(now - stepTimeOrigin);
+				AddCpuCycles(isrCyclesPerStep);
+			}
+		}
+	}
+
+	void SetNextInterruptTime(uint32_t when) noexcept
+	{
+		nextInterruptTime = when;
+		interruptPending = true;
+	}
+
+	// Return the exact time after the start of the move when the fraction 'distance' of the move has been completed, and whether the speed is steady then
+	double ExactTime(const CanMessageMovementLinear& m, double distance, bool& steady) noexcept
+	{
+		steady = false;
+		const double u = m.initialSpeedFraction, f = m.finalSpeedFraction;
+		const double topSpeed = 2.0/(2.0 * m.steadyClocks + (u + 1.0) * m.accelerationClocks + (f + 1.0) * m.decelClocks);
+		const double startSpeed = topSpeed * u;
+		const double accelDistance = topSpeed * (1.0 + u) * m.accelerationClocks * 0.5;
+		const double decelDistance = topSpeed * (1.0 + f) * m.decelClocks * 0.5;
+		if (distance <= accelDistance && m.accelerationClocks != 0)
+		{
+			const double acceleration = topSpeed * (1.0 - u)/m.accelerationClocks;
+			return (2.0 * distance)/(startSpeed + sqrt(startSpeed * startSpeed + 2.0 * acceleration * distance));
+		}
+		if (distance <= 1.0 - decelDistance || m.decelClocks == 0)
+		{
+			steady = true;
+			return m.accelerationClocks + (distance - accelDistance)/topSpeed;
+		}
+		const double deceleration = topSpeed * (1.0 - f)/m.decelClocks;
+		const double d = distance - (1.0 - decelDistance);
+		const double discriminant = topSpeed * topSpeed - 2.0 * deceleration * d;
+		return m.accelerationClocks + m.steadyClocks + (2.0 * d)/(topSpeed + sqrt((discriminant > 0.0) ? discriminant : 0.0));
+	}
+
+	// Set up the DDA for a move to start soon. Return false if it has no steps.
+	static bool InitMove(DDA& dda, CanMessageMovementLinear& msg, const CanMessageMovementDelta *deltaMsg = nullptr) noexcept
+	{
+		for (size_t drive = 0; drive < NumDrivers; ++drive)
+		{
+			stepTimes[drive].clear();
+		}
+		stepTimeOrigin = msg.whenToExecute = StepTimer::GetTimerTicks() + 1000;
+		const uint64_t startNanos = HostNanos();
+		const bool ret = dda.Init(msg, deltaMsg);
+		initNanos += HostNanos() - startNanos;
+		++numInits;
+		return ret;
+	}
+
+	// Run one move through the firmware's step generation code, in the same way that Move::Interrupt does.
+	// If stopFraction is less than 1.0 then abort the move when that fraction of its time has elapsed.
+	// If skipDrivers is true then stop all the drivers before the move starts, as Move::StopDrivers does to moves that are waiting to start.
+	// If deltaMsg is not null then msg is its linear move, and the drivers that it says move delta towers follow the carriage heights.
+	static bool RunMove(DDA& dda, StepTimer& timer, CanMessageMovementLinear& msg, double stopFraction = 1.0, bool skipDrivers = false,
+						const CanMessageMovementDelta *deltaMsg = nullptr) noexcept
+	{
+		if (!InitMove(dda, msg, deltaMsg))
+		{
+			return false;
+		}
+
+		if (skipDrivers)
+		{
+			const int32_t positions[NumDrivers] = { 0 };
+			dda.SkipDrivers((1u << NumDrivers) - 1, positions);
+		}
+
+		const uint32_t moveStartTime = msg.whenToExecute;
+		simulatedStepTc.COUNT.reg = moveStartTime;
+		dda.Start(moveStartTime);
+		const uint32_t clocksNeeded = dda.GetClocksNeeded();
+		const uint32_t stopClocks = (uint32_t)(stopFraction * clocksNeeded);
+		uint32_t now = moveStartTime;
+		for (;;)
+		{
+			if (stopFraction < 1.0 && now - moveStartTime >= stopClocks)
+			{
+				dda.MoveAborted();
+				break;
+			}
+			const uint64_t startNanos = HostNanos();
+			dda.StepDrivers(now);
+			stepDriversNanos += HostNanos() - startNanos;
+			if (dda.GetState() == DDA::completed)
+			{
+				break;
+			}
+			if (!dda.ScheduleNextStepInterrupt(timer))
+			{
+				simulatedStepTc.COUNT.reg = nextInterruptTime;				// advance the clock to when the next interrupt is due
+			}
+			now = StepTimer::GetTimerTicks();
+			if (now - moveStartTime > 2 * clocksNeeded + 1000)
+			{
+				fprintf(stderr, "Move did not complete\n");
+				break;
+			}
+		}
+		if (dda.HasStepError())
+		{
+			++movesWithStepErrors;
+		}
+		dda.Free();
+		return true;
+	}
+
+	// Compare the step times of one drive in a move with the exact ones, adding the errors to the statistics. The times are relative to the start of the move.
+	// If lastOfBunch is true then check only steps that are not due at the same time as the following step.
+	void CheckStepTimes(const CanMessageMovementLinear& msg, size_t moveNumber, size_t drive, const uint32_t *times, size_t numTimes, bool lastOfBunch, MoveStats& stats) noexcept
+	{
+		const uint32_t totalSteps = (uint32_t)labs(msg.perDrive[drive].steps);
+		if (numTimes != totalSteps)
+		{
+			stats.changing.numMissing += (numTimes > totalSteps) ? numTimes - totalSteps : totalSteps - numTimes;
+		}
+		for (size_t i = 0; i < numTimes && i < totalSteps; ++i)
+		{
+			if (!lastOfBunch || i + 1 == numTimes || times[i + 1] != times[i])
+			{
+				bool steady;
+				const double err = (double)times[i] - ExactTime(msg, (double)(i + 1)/totalSteps, steady);
+				((steady) ? stats.steady : stats.changing).Add(err, moveNumber, drive, i);
+			}
+		}
+	}
+
+	const char *BuildName() noexcept
+	{
+		return (DM_USE_FPU)
+				? ((SUPPORT_STEP_SEGMENTS) ? "floating point, step segments" : "floating point, no step segments")
+				: (USE_EVEN_STEPS)
+				  ? ((DM_USE_STEP_RECURRENCE) ? "integer, even steps, recurrence" : "integer, even steps, square root")
+					: ((DM_USE_STEP_RECURRENCE) ? "integer, bunched steps, recurrence" : "integer, bunched steps, square root");
+	}
+
+	void DumpSteps(FILE *f, size_t moveNumber, size_t drive, const uint32_t *times, size_t numTimes, size_t totalSteps) noexcept
+	{
+		for (size_t i = 0; i < numTimes && i < totalSteps; ++i)
+		{
+			fprintf(f, "%u %u %u %" PRIu32 "\n", (unsigned int)moveNumber, (unsigned int)drive, (unsigned int)i, times[i]);
+		}
+	}
+
+	void DumpSummary(FILE *f, unsigned int stepErrors, double nsPerStep, double usPerMove) noexcept
+	{
+		fprintf(f, "# stepErrors %u nsPerStep %.1f usPerMove %.2f build %s\n", stepErrors, nsPerStep, usPerMove, BuildName());
+	}
+
+	// Check the step times of a move that RunMove has just run. Optionally write the step times to a file.
+	static void CheckSteps(const CanMessageMovementLinear& msg, size_t moveNumber, size_t drive, bool lastOfBunch, MoveStats& stats, FILE *dumpFile) noexcept
+	{
+		const std::vector<uint32_t>& times = stepTimes[drive];
+		CheckStepTimes(msg, moveNumber, drive, times.data(), times.size(), lastOfBunch, stats);
+		if (dumpFile != nullptr)
+		{
+			DumpSteps(dumpFile, moveNumber, drive, times.data(), times.size(), (size_t)labs(msg.perDrive[drive].steps));
+		}
+	}
+
+#if SUPPORT_INPUT_SHAPING
+
+	// The exact motion of a shaped move, calculated in double precision from the move and the shaper impulses independently of DDA::PrepareShaping.
+	// Each acceleration or deceleration phase that is long enough is replaced by one copy per impulse, scaled by the impulse amplitude and delayed by the
+	// impulse delay. The copies are compressed so that they fit in the phase and the mean time of the speed change is unchanged.
+	// An extruder with pressure advance is ahead of the shaped motion by the compensation time multiplied by the speed change since the start of the move.
+	struct ExactShapedMotion
+	{
+		struct Piece
+		{
+			double startTime, startDistance, startSpeed, acceleration;
+		};
+
+		std::vector<Piece> pieces;
+		double startSpeed = 0.0;
+		bool shaped = false;						// true if any phase was long enough to shape
+
+		ExactShapedMotion(const CanMessageMovementLinear& m, const InputShaperImpulses& impulses) noexcept;
+		double Advance(const Piece& piece, double compensationClocks) const noexcept { return compensationClocks * (piece.startSpeed - startSpeed); }
+		double EndDistance(double compensationClocks) const noexcept { return pieces.back().startDistance + Advance(pieces.back(), compensationClocks); }
+		double Time(double distance, double compensationClocks, size_t& pieceIndex, bool& steady) const noexcept;
+	};
+
+	ExactShapedMotion::ExactShapedMotion(const CanMessageMovementLinear& m, const InputShaperImpulses& impulses) noexcept
+	{
+		const double u = m.initialSpeedFraction, f = m.finalSpeedFraction;
+		const double topSpeed = 2.0/(2.0 * m.steadyClocks + (u + 1.0) * m.accelerationClocks + (f + 1.0) * m.decelClocks);
+		startSpeed = topSpeed * u;
+
+		double meanDelay = 0.0;
+		for (size_t i = 0; i < impulses.numImpulses; ++i)
+		{
+			meanDelay += (double)impulses.amplitudes[i] * impulses.delays[i];
+		}
+		const double shaperDuration = impulses.delays[impulses.numImpulses - 1];
+		const double leadTime = max<double>(shaperDuration - 2.0 * meanDelay, 0.0);
+		const double tailTime = max<double>(2.0 * meanDelay - shaperDuration, 0.0);
+
+		std::vector<std::pair<double, double>> changes;		// the times at which the acceleration changes, and the changes
+		auto addPhase = [&](double phaseStart, double duration, double accel) noexcept
+			{
+				const double shapedDuration = duration - leadTime - shaperDuration - tailTime;
+				if (shapedDuration > 0.0)
+				{
+					for (size_t i = 0; i < impulses.numImpulses; ++i)
+					{
+						const double copyAccel = accel * (duration/shapedDuration) * impulses.amplitudes[i];
+						const double copyStart = phaseStart + leadTime + impulses.delays[i];
+						changes.push_back(std::make_pair(copyStart, copyAccel));
+						changes.push_back(std::make_pair(copyStart + shapedDuration, -copyAccel));
+					}
+					shaped = true;
+				}
+				else if (duration > 0.0)
+				{
+					changes.push_back(std::make_pair(phaseStart, accel));
+					changes.push_back(std::make_pair(phaseStart + duration, -accel));
+				}
+			};
+		if (m.accelerationClocks != 0)
+		{
+			addPhase(0.0, m.accelerationClocks, topSpeed * (1.0 - u)/m.accelerationClocks);
+		}
+		if (m.decelClocks != 0)
+		{
+			addPhase((double)m.accelerationClocks + m.steadyClocks, m.decelClocks, -topSpeed * (1.0 - f)/m.decelClocks);
+		}
+		std::stable_sort(changes.begin(), changes.end(), [](const std::pair<double, double>& a, const std::pair<double, double>& b) noexcept { return a.first < b.first; });
+
+		double time = 0.0, distance = 0.0, speed = startSpeed, accel = 0.0;
+		for (const std::pair<double, double>& change : changes)
+		{
+			if (change.first > time)
+			{
+				pieces.push_back(Piece{time, distance, speed, accel});
+				const double dt = change.first - time;
+				distance += (speed + 0.5 * accel * dt) * dt;
+				speed += accel * dt;
+				time = change.first;
+			}
+			accel += change.second;
+		}
+		const double totalClocks = (double)m.accelerationClocks + m.steadyClocks + m.decelClocks;
+		if (totalClocks > time)
+		{
+			pieces.push_back(Piece{time, distance, speed, 0.0});
+			distance += speed * (totalClocks - time);
+			time = totalClocks;
+		}
+		pieces.push_back(Piece{time, distance, speed, 0.0});
+	}
+
+	// Return the time at which a drive reaches the fraction 'distance' of the move, including any pressure advance, and whether the speed is steady then.
+	// pieceIndex is the piece that the previous step was in. The caller has checked that the distance is reached, so the drive doesn't reverse before it.
+	double ExactShapedMotion::Time(double distance, double compensationClocks, size_t& pieceIndex, bool& steady) const noexcept
+	{
+		while (pieceIndex + 1 < pieces.size() && distance >= pieces[pieceIndex + 1].startDistance + Advance(pieces[pieceIndex + 1], compensationClocks))
+		{
+			++pieceIndex;
+		}
+		const Piece& piece = pieces[pieceIndex];
+		steady = (piece.acceleration == 0.0);
+		const double speed = piece.startSpeed + compensationClocks * piece.acceleration;
+		const double d = distance - piece.startDistance - Advance(piece, compensationClocks);
+		const double discriminant = speed * speed + 2.0 * piece.acceleration * d;
+		const double denominator = speed + sqrt((discriminant > 0.0) ? discriminant : 0.0);
+		return (denominator > 0.0) ? piece.startTime + (2.0 * d)/denominator : pieces.back().startTime;
+	}
+
+	// Compare the step times of one drive in a shaped move with the exact ones. compensationClocks is the pressure advance of the drive, zero for an axis.
+	// Pressure advance changes the number of steps, which may be up to one step more than the exact motion reaches. That step is counted but not checked.
+	static void CheckShapedStepTimes(const CanMessageMovementLinear& msg, const ExactShapedMotion& motion, double compensationClocks, size_t moveNumber, size_t drive,
+										const uint32_t *times, size_t numTimes, MoveStats& stats) noexcept
+	{
+		const uint32_t requestedSteps = (uint32_t)labs(msg.perDrive[drive].steps);
+		const double exactSteps = motion.EndDistance(compensationClocks) * requestedSteps;
+		if (fabs((double)numTimes - exactSteps) >= 1.0 + 1.0e-6)
+		{
+			stats.changing.numMissing += (size_t)fabs((double)numTimes - exactSteps);
+		}
+		size_t pieceIndex = 0;
+		for (size_t i = 0; i < numTimes && (double)(i + 1) <= exactSteps; ++i)
+		{
+			bool steady;
+			const double err = (double)times[i] - motion.Time((double)(i + 1)/requestedSteps, compensationClocks, pieceIndex, steady);
+			((steady) ? stats.steady : stats.changing).Add(err, moveNumber, drive, i);
+		}
+	}
+
+#endif
+
+	static uint32_t randomSeed = 12345;
+
+	// Generate the test moves. They cover step intervals from a few clocks to many thousands, with and without acceleration, deceleration and steady speed.
+	static std::vector<CanMessageMovementLinear> MakeTestMoves(size_t numDriversMoving) noexcept
+	{
+		std::vector<CanMessageMovementLinear> moves;
+		uint32_t seed = randomSeed;
+		auto random = [&seed](uint32_t limit) noexcept -> uint32_t
+			{
+				seed = seed * 1103515245u + 12345u;
+				return (seed >> 8) % limit;
+			};
+
+		for (unsigned int i = 0; i < 400; ++i)
+		{
+			CanMessageMovementLinear m;
+			memset(&m, 0, sizeof(m));
+			const unsigned int shape = i % 8;
+			m.accelerationClocks = (shape & 1) ? 0 : 2000 + random(100000);
+			m.steadyClocks = (shape & 2) ? 0 : random(200000);
+			m.decelClocks = (shape & 4) ? 0 : 2000 + random(100000);
+			if (m.accelerationClocks + m.steadyClocks + m.decelClocks == 0)
+			{
+				m.steadyClocks = 10000 + random(100000);
+			}
+			m.initialSpeedFraction = (m.accelerationClocks == 0) ? 1.0 : (float)random(1000)/1000.0;
+			m.finalSpeedFraction = (m.decelClocks == 0) ? 1.0 : (float)random(1000)/1000.0;
+			m.numDrivers = NumDrivers;
+
+			// Choose the number of steps to give an average step interval between 4 and about 1000 clocks
+			const uint32_t totalClocks = m.accelerationClocks + m.steadyClocks + m.decelClocks;
+			const uint32_t averageInterval = 4 + random((i & 8) ? 1000 : 60);
+			for (size_t drive = 0; drive < MaxSimDrivers; ++drive)
+			{
+				const int32_t steps = (drive < numDriversMoving) ? (int32_t)max<uint32_t>(totalClocks/(averageInterval * (drive + 1)), 1) : 0;
+				const bool forwards = (random(2) == 0);
+				if (drive < NumDrivers)
+				{
+					m.perDrive[drive].steps = (forwards) ? steps : -steps;
+				}
+			}
+			moves.push_back(m);
+		}
+		return moves;
+	}
+
+	// Run the test moves and check their step times. If abandonMoves is true then before each move, run it and abort it part way through,
+	// then set it up and free it without executing it, as Move::Exit does, then run it with all its drivers skipped, which must generate no steps.
+	// That checks that abandoned moves don't leave step segments behind.
+	static void RunMoves(DDA& dda, StepTimer& timer, size_t numDriversMoving, bool lastOfBunch, MoveStats& stats, FILE *dumpFile, bool abandonMoves = false) noexcept
+	{
+		std::vector<CanMessageMovementLinear> moves = MakeTestMoves(numDriversMoving);
+		for (size_t moveNumber = 0; moveNumber < moves.size(); ++moveNumber)
+		{
+			CanMessageMovementLinear& m = moves[moveNumber];
+			if (abandonMoves)
+			{
+				(void)RunMove(dda, timer, m, 0.3);
+				if (InitMove(dda, m))
+				{
+					dda.Complete();
+					dda.Free();
+				}
+				if (RunMove(dda, timer, m, 1.0, true))
+				{
+					for (size_t drive = 0; drive < numDriversMoving; ++drive)
+					{
+						stats.changing.numMissing += stepTimes[drive].size();
+					}
+				}
+			}
+			if (RunMove(dda, timer, m))
+			{
+				++stats.numMoves;
+				for (size_t drive = 0; drive < numDriversMoving; ++drive)
+				{
+					CheckSteps(m, moveNumber, drive, lastOfBunch, stats, dumpFile);
+				}
+			}
+		}
+	}
+
+#if SUPPORT_INPUT_SHAPING
+
+	// Run the test moves with the current shaper, with pressure advance on the second driver if compensationClocks is not zero, and check all the steps
+	// against the exact shaped motion. If pressure advance would make the extruder reverse then the firmware doesn't shape the move, and we check that the axis
+	// wasn't shaped either. Extruder steps are only checked in shaped moves, because the exact motion doesn't model the reverse phase.
+	static void RunShapedMoves(DDA& dda, StepTimer& timer, size_t numDriversMoving, float compensationClocks, MoveStats& stats, unsigned int& numUnshapedMoves) noexcept
+	{
+		constexpr size_t ExtruderDrive = 1;
+		simulatedPressureAdvanceClocks = compensationClocks;
+		(void)ShapedProfile::GetAndClearUnshapedMoves();
+		std::vector<CanMessageMovementLinear> moves = MakeTestMoves(numDriversMoving);
+		for (size_t moveNumber = 0; moveNumber < moves.size(); ++moveNumber)
+		{
+			CanMessageMovementLinear& m = moves[moveNumber];
+			if (compensationClocks != 0.0 && ExtruderDrive < numDriversMoving)
+			{
+				m.pressureAdvanceDrives = 1u << ExtruderDrive;
+			}
+			if (RunMove(dda, timer, m))
+			{
+				++stats.numMoves;
+				const ExactShapedMotion motion(m, simulatedImpulses);
+				const bool unshapedForPressureAdvance = (ShapedProfile::GetAndClearUnshapedMoves() != 0);
+				if (unshapedForPressureAdvance)
+				{
+					++numUnshapedMoves;
+				}
+				for (size_t drive = 0; drive < numDriversMoving; ++drive)
+				{
+					const bool hasPressureAdvance = (m.pressureAdvanceDrives & (1u << drive)) != 0;
+					if (unshapedForPressureAdvance || (hasPressureAdvance && !motion.shaped))
+					{
+						if (!hasPressureAdvance)
+						{
+							CheckSteps(m, moveNumber, drive, false, stats, nullptr);
+						}
+					}
+					else
+					{
+						const std::vector<uint32_t>& times = stepTimes[drive];
+						CheckShapedStepTimes(m, motion, (hasPressureAdvance) ? compensationClocks : 0.0, moveNumber, drive, times.data(), times.size(), stats);
+					}
+				}
+			}
+		}
+		simulatedPressureAdvanceClocks = 0.0;
+	}
+
+#endif
+
+#if SUPPORT_DELTA_MOVEMENT
+
+	// The delta geometry of the test moves, which is the default geometry of LinearDeltaKinematics. The drivers move towers A, B and C in turn.
+	constexpr double DeltaRadius = 105.6;
+	constexpr float DeltaDiagonal = 215.0;
+	constexpr double DeltaPrintRadius = 80.0;
+	constexpr double DeltaStepsPerMm = 80.0;					// Platform::DriveStepsPerUnit in HostStubs.cpp
+
+	struct DeltaTower
+	{
+		float x, y;
+	};
+
+	static DeltaTower deltaTowers[NumDrivers];
+
+	// Send the geometry of a delta tower to the Move task, as the main board does. Return true if it was accepted.
+	bool ConfigureDeltaTower(size_t driver, float x, float y, float diagonal) noexcept
+	{
+		CanMessageGeneric msg;
+		msg.requestId = 0;
+		msg.numParams = 4;
+		msg.params[0].letter = 'P';
+		msg.params[0].value = (float)driver;
+		msg.params[1].letter = 'X';
+		msg.params[1].value = x;
+		msg.params[2].letter = 'Y';
+		msg.params[2].value = y;
+		msg.params[3].letter = 'D';
+		msg.params[3].value = diagonal;
+		char buffer[100];
+		const StringRef reply(buffer, sizeof(buffer));
+		reply.Clear();
+		return moveInstance->ConfigureDeltaTower(msg, reply) == GCodeResult::ok;
+	}
+
+	// The exact motion of a delta tower carriage, calculated in double precision from the Cartesian parameters of the move, independently of
+	// DriveMovement::PrepareDeltaAxis. Distances are in mm along the move and heights are relative to the initial carriage height.
+	// The carriage height is a concave function of the distance, so it rises to at most one peak and then falls.
+	struct ExactDeltaMotion
+	{
+		const CanMessageMovementDelta& msg;
+		const DeltaTower& tower;
+		double h0;
+		double peakDistance;
+		bool peakWithinMove;
+
+		ExactDeltaMotion(const CanMessageMovementDelta& m, const DeltaTower& t) noexcept;
+		double Height(double distance) const noexcept;
+		double Slope(double distance) const noexcept;
+		double Distance(double height, bool rising) const noexcept;
+	};
+
+	ExactDeltaMotion::ExactDeltaMotion(const CanMessageMovementDelta& m, const DeltaTower& t) noexcept : msg(m), tower(t), h0(0.0)
+	{
+		h0 = Height(0.0);
+		const double length = msg.totalDistance;
+		peakWithinMove = (msg.dvecX != 0.0 || msg.dvecY != 0.0) && Slope(0.0) > 0.0 && Slope(length) < 0.0;
+		if (peakWithinMove)
+		{
+			double low = 0.0, high = length;
+			for (unsigned int i = 0; i < 100; ++i)
+			{
+				const double mid = 0.5 * (low + high);
+				((Slope(mid) > 0.0) ? low : high) = mid;
+			}
+			peakDistance = 0.5 * (low + high);
+		}
+		else
+		{
+			peakDistance = (Slope(0.0) > 0.0) ? length : 0.0;
+		}
+	}
+
+	double ExactDeltaMotion::Height(double distance) const noexcept
+	{
+		const double x = (double)msg.initialX + (double)msg.dvecX * distance - (double)tower.x;
+		const double y = (double)msg.initialY + (double)msg.dvecY * distance - (double)tower.y;
+		return (double)msg.dvecZ * distance + sqrt((double)DeltaDiagonal * (double)DeltaDiagonal - x * x - y * y) - h0;
+	}
+
+	double ExactDeltaMotion::Slope(double distance) const noexcept
+	{
+		const double x = (double)msg.initialX + (double)msg.dvecX * distance - (double)tower.x;
+		const double y = (double)msg.initialY + (double)msg.dvecY * distance - (double)tower.y;
+		return (double)msg.dvecZ - (x * (double)msg.dvecX + y * (double)msg.dvecY)/sqrt((double)DeltaDiagonal * (double)DeltaDiagonal - x * x - y * y);
+	}
+
+	// Return the distance at which the carriage reaches a height while rising before the peak or falling after it, or the end of that part of the move if it doesn't
+	double ExactDeltaMotion::Distance(double height, bool rising) const noexcept
+	{
+		double low = (rising) ? 0.0 : peakDistance;
+		double high = (rising) ? peakDistance : (double)msg.totalDistance;
+		if ((rising) ? Height(high) <= height : Height(high) >= height)
+		{
+			return high;
+		}
+		for (unsigned int i = 0; i < 100; ++i)
+		{
+			const double mid = 0.5 * (low + high);
+			((Height(mid) < height) == rising ? low : high) = mid;
+		}
+		return 0.5 * (low + high);
+	}
+
+	// Compare the step times of a delta tower with the exact ones. A carriage steps each time it reaches the height of the next whole step from its initial height.
+	// If the carriage rises to a peak within the move and then falls below the height that it ends at, or it falls overall, then it steps up to the last
+	// whole step below the peak and then down, as the firmware does. Return true if it reversed.
+	static bool CheckDeltaStepTimes(const CanMessageMovementDelta& m, size_t moveNumber, size_t drive, const uint32_t *times, size_t numTimes, MoveStats& stats) noexcept
+	{
+		const ExactDeltaMotion motion(m, deltaTowers[drive]);
+		const int32_t netSteps = m.linear.perDrive[drive].steps;
+		const int32_t stepsUp = (motion.peakWithinMove) ? (int32_t)(motion.Height(motion.peakDistance) * DeltaStepsPerMm) : 0;
+		const bool reverses = netSteps != 0 && stepsUp >= 1 && (netSteps < 0 || stepsUp > netSteps);
+		const size_t totalSteps = (reverses) ? (size_t)(2 * stepsUp - netSteps) : (size_t)labs(netSteps);
+		if (numTimes != totalSteps)
+		{
+			stats.changing.numMissing += (numTimes > totalSteps) ? numTimes - totalSteps : totalSteps - numTimes;
+		}
+		for (size_t i = 0; i < numTimes && i < totalSteps; ++i)
+		{
+			const int32_t step = (int32_t)i + 1;
+			const bool rising = (reverses) ? step <= stepsUp : netSteps > 0;
+			const int32_t position = (!reverses) ? ((rising) ? step : -step) : (rising) ? step : 2 * stepsUp - step;
+			bool steady;
+			const double err = (double)times[i] - ExactTime(m.linear, motion.Distance((double)position/DeltaStepsPerMm, rising)/(double)m.totalDistance, steady);
+			((steady) ? stats.steady : stats.changing).Add(err, moveNumber, drive, i);
+		}
+		return reverses;
+	}
+
+	// Generate the delta test moves. They use the speed profiles of the linear test moves. Each one goes between random points within the print radius,
+	// with a random height change. Every 8th move is a pure Z move. The number of steps of each tower is the whole number of steps that the carriage moves
+	// from its initial height, so that it reaches all of them. The lengths are limited so that the average head speed is no more than one step per 20 clocks.
+	static std::vector<CanMessageMovementDelta> MakeDeltaTestMoves() noexcept
+	{
+		std::vector<CanMessageMovementDelta> moves;
+		uint32_t seed = randomSeed;
+		auto random = [&seed]() noexcept -> double
+			{
+				seed = seed * 1103515245u + 12345u;
+				return (double)(seed >> 8)/(double)(1u << 24);
+			};
+		auto randomPoint = [&random](double& x, double& y) noexcept
+			{
+				const double r = DeltaPrintRadius * sqrt(random()), theta = 2.0 * M_PI * random();
+				x = r * cos(theta);
+				y = r * sin(theta);
+			};
+
+		const std::vector<CanMessageMovementLinear> linearMoves = MakeTestMoves(NumDrivers);
+		for (size_t i = 0; i < linearMoves.size(); ++i)
+		{
+			CanMessageMovementDelta m;
+			memset(&m, 0, sizeof(m));
+			m.linear = linearMoves[i];
+			m.deltaDrives = (1u << NumDrivers) - 1;
+
+			double x0, y0, x1, y1;
+			randomPoint(x0, y0);
+			randomPoint(x1, y1);
+			if (i % 8 == 7)
+			{
+				x1 = x0;
+				y1 = y0;
+			}
+			double dx = x1 - x0, dy = y1 - y0, dz = (random() - 0.5) * 40.0;
+			const double length = sqrt(dx * dx + dy * dy + dz * dz);
+			const double totalClocks = (double)m.linear.accelerationClocks + m.linear.steadyClocks + m.linear.decelClocks;
+			const double maxLength = min<double>(totalClocks/(20.0 * DeltaStepsPerMm), 150.0);
+			const double scale = (length > maxLength) ? maxLength/length : 1.0;
+			m.initialX = (float)x0;
+			m.initialY = (float)y0;
+			m.totalDistance = (float)(length * scale);
+			m.dvecX = (float)(dx/length);
+			m.dvecY = (float)(dy/length);
+			m.dvecZ = (float)(dz/length);
+			for (size_t drive = 0; drive < NumDrivers; ++drive)
+			{
+				const ExactDeltaMotion motion(m, deltaTowers[drive]);
+				m.linear.perDrive[drive].steps = (int32_t)(motion.Height(m.totalDistance) * DeltaStepsPerMm);
+			}
+			moves.push_back(m);
+		}
+		return moves;
+	}
+
+	// Configure the delta towers, then run the delta test moves and check the step times of every tower against the exact carriage heights
+	static bool RunDeltaMoves(DDA& dda, StepTimer& timer, MoveStats& stats, unsigned int& numReversals) noexcept
+	{
+		for (size_t drive = 0; drive < NumDrivers; ++drive)
+		{
+			const double angle = (210.0 + 120.0 * drive) * (M_PI/180.0);
+			deltaTowers[drive].x = (float)(DeltaRadius * cos(angle));
+			deltaTowers[drive].y = (float)(DeltaRadius * sin(angle));
+			if (!ConfigureDeltaTower(drive, deltaTowers[drive].x, deltaTowers[drive].y, DeltaDiagonal))
+			{
+				printf("Delta tower %u was not accepted\n", (unsigned int)drive);
+				return false;
+			}
+		}
+
+		std::vector<CanMessageMovementDelta> moves = MakeDeltaTestMoves();
+		for (size_t moveNumber = 0; moveNumber < moves.size(); ++moveNumber)
+		{
+			CanMessageMovementDelta& m = moves[moveNumber];
+			if (RunMove(dda, timer, m.linear, 1.0, false, &m))
+			{
+				++stats.numMoves;
+				for (size_t drive = 0; drive < NumDrivers; ++drive)
+				{
+					const std::vector<uint32_t>& times = stepTimes[drive];
+					if (CheckDeltaStepTimes(m, moveNumber, drive, times.data(), times.size(), stats))
+					{
+						++numReversals;
+					}
+				}
+			}
+		}
+		return true;
+	}
+
+#endif
+
+	void PrintStats(const char *name, const MoveStats& stats) noexcept
+	{
+		printf("%s: %u moves, %u steps checked, %u missing or extra, error max/RMS %.2f/%.2f clocks changing speed, %.2f/%.2f clocks steady speed\n",
+				name, (unsigned int)stats.numMoves, (unsigned int)(stats.changing.numSteps + stats.steady.numSteps), (unsigned int)stats.changing.numMissing,
+				stats.changing.maxError, stats.changing.Rms(), stats.steady.maxError, stats.steady.Rms());
+		printf("  largest errors at move %u drive %u step %u changing speed, move %u drive %u step %u steady speed\n",
+				(unsigned int)stats.changing.worstMove, (unsigned int)stats.changing.worstDrive, (unsigned int)stats.changing.worstStep,
+				(unsigned int)stats.steady.worstMove, (unsigned int)stats.steady.worstDrive, (unsigned int)stats.steady.worstStep);
+	}
+
+	// The step times in a dump file, keyed by move, drive and step number
+	typedef std::tuple<unsigned int, unsigned int, unsigned int> StepKey;
+
+	struct DumpFile
+	{
+		std::map<StepKey, uint32_t> steps;
+		uint32_t drivesPresent = 0;
+		unsigned int stepErrors = 0;
+		double nsPerStep = 0.0;
+		double usPerMove = 0.0;
+		char build[100] = "unknown";
+	};
+
+	static bool ReadDump(const char *fileName, DumpFile& dump) noexcept
+	{
+		FILE * const f = fopen(fileName, "r");
+		if (f == nullptr)
+		{
+			fprintf(stderr, "Can't open dump file %s\n", fileName);
+			return false;
+		}
+		char line[200];
+		while (fgets(line, sizeof(line), f) != nullptr)
+		{
+			unsigned int move, drive, step;
+			uint32_t time;
+			if (line[0] == '#')
+			{
+				(void)sscanf(line, "# stepErrors %u nsPerStep %lf usPerMove %lf build %99[^\n]", &dump.stepErrors, &dump.nsPerStep, &dump.usPerMove, dump.build);
+			}
+			else if (sscanf(line, "%u %u %u %" SCNu32, &move, &drive, &step, &time) == 4 && drive < 32)
+			{
+				dump.steps[StepKey(move, drive, step)] = time;
+				dump.drivesPresent |= 1u << drive;
+			}
+		}
+		fclose(f);
+		return true;
+	}
+
+	// Compare two files of step times written using --dump
+	static int Compare(const char *file1, const char *file2, double maxAllowedError) noexcept
+	{
+		constexpr size_t NumWorstSteps = 5;
+
+		DumpFile dumps[2];
+		if (!ReadDump(file1, dumps[0]) || !ReadDump(file2, dumps[1]))
+		{
+			return 2;
+		}
+
+		// Compare the steps of the drives in both files. A step that is in only one of them is missing from the other.
+		const uint32_t drivesCompared = dumps[0].drivesPresent & dumps[1].drivesPresent;
+		ErrorStats stats;
+		std::vector<std::pair<double, StepKey>> differences;
+		for (const auto& step : dumps[0].steps)
+		{
+			if (drivesCompared & (1u << std::get<1>(step.first)))
+			{
+				const auto other = dumps[1].steps.find(step.first);
+				if (other == dumps[1].steps.end())
+				{
+					++stats.numMissing;
+				}
+				else
+				{
+					const double diff = (double)(int32_t)(other->second - step.second);
+					stats.Add(diff);
+					differences.push_back(std::make_pair(fabs(diff), step.first));
+				}
+			}
+		}
+		for (const auto& step : dumps[1].steps)
+		{
+			if ((drivesCompared & (1u << std::get<1>(step.first))) && dumps[0].steps.find(step.first) == dumps[0].steps.end())
+			{
+				++stats.numMissing;
+			}
+		}
+
+		for (const DumpFile& dump : dumps)
+		{
+			printf("%s: %u steps, %u moves with step errors", dump.build, (unsigned int)dump.steps.size(), dump.stepErrors);
+			if (dump.nsPerStep != 0.0)
+			{
+				printf(", step calculation %.1fns per step, move preparation %.2fus per move (host times)", dump.nsPerStep, dump.usPerMove);
+			}
+			printf("\n");
+		}
+		printf("Difference: %u steps compared, %u missing or extra, max %.2f RMS %.2f clocks\n",
+				(unsigned int)stats.numSteps, (unsigned int)stats.numMissing, stats.maxError, stats.Rms());
+
+		// Report the steps that differ most, so that they can be found in the moves
+		const size_t numWorst = min<size_t>(NumWorstSteps, differences.size());
+		std::partial_sort(differences.begin(), differences.begin() + numWorst, differences.end(),
+							[](const std::pair<double, StepKey>& a, const std::pair<double, StepKey>& b) noexcept { return a.first > b.first; });
+		for (size_t i = 0; i < numWorst && differences[i].first != 0.0; ++i)
+		{
+			const StepKey& key = differences[i].second;
+			printf("  move %u drive %u step %u: %" PRIu32 " v. %" PRIu32 "\n",
+					std::get<0>(key), std::get<1>(key), std::get<2>(key), dumps[0].steps[key], dumps[1].steps[key]);
+		}
+
+		return (   stats.numMissing != 0 || dumps[0].stepErrors != 0 || dumps[1].stepErrors != 0
+				|| (maxAllowedError > 0.0 && stats.maxError > maxAllowedError)) ? 1 : 0;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	using namespace StepTimeSim;
+
+	double maxAllowedError = 0.0, maxAllowedDeltaError = 0.0;
+	const char *dumpFileName = nullptr;
+	const char *compareFiles[2] = { nullptr, nullptr };
+	const char *replayFileName = nullptr;
+	const char *toolpathFileName = nullptr;
+	uint32_t entryCycles = DefaultIsrEntryCycles, cyclesPerStep = DefaultIsrCyclesPerStep;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--max-error") == 0 && i + 1 < argc)
+		{
+			maxAllowedError = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--max-delta-error") == 0 && i + 1 < argc)
+		{
+			maxAllowedDeltaError = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--dump") == 0 && i + 1 < argc)
+		{
+			dumpFileName = argv[++i];
+		}
+		else if (strcmp(argv[i], "--compare") == 0 && i + 2 < argc)
+		{
+			compareFiles[0] = argv[++i];
+			compareFiles[1] = argv[++i];
+		}
+		else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+		{
+			randomSeed = (uint32_t)strtoul(argv[++i], nullptr, 0);
+		}
+		else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc)
+		{
+			replayFileName = argv[++i];
+		}
+		else if (strcmp(argv[i], "--isr-cycles") == 0 && i + 2 < argc)
+		{
+			entryCycles = (uint32_t)atoi(argv[++i]);
+			cyclesPerStep = (uint32_t)atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--write-toolpath") == 0 && i + 1 < argc)
+		{
+			toolpathFileName = argv[++i];
+		}
+		else
+		{
+			fprintf(stderr, "Usage: %s [--max-error <clocks>] [--max-delta-error <clocks>] [--dump <file>] [--seed <n>]\n"
+							"       %s --compare <file1> <file2> [--max-error <clocks>]\n"
+							"       %s --replay <file> [--isr-cycles <per interrupt> <per step>] [--dump <file>]\n"
+							"       %s --write-toolpath <file>\n", argv[0], argv[0], argv[0], argv[0]);
+			return 2;
+		}
+	}
+
+	if (compareFiles[0] != nullptr)
+	{
+		return Compare(compareFiles[0], compareFiles[1], maxAllowedError);
+	}
+
+	if (toolpathFileName != nullptr)
+	{
+		return WriteToolpath(toolpathFileName);
+	}
+
+	if (replayFileName != nullptr)
+	{
+		isrEntryCycles = entryCycles;
+		isrCyclesPerStep = cyclesPerStep;
+		return ReplayMoves(replayFileName, dumpFileName);
+	}
+
+	DriveMovement::InitialAllocate(NumDrivers);
+#if SUPPORT_STEP_SEGMENTS
+	DriveMovement::InitSegmentQueues();
+#endif
+	DDA * const initialDda = new DDA(nullptr);
+	initialDda->Init();
+	DDA * const dda = new DDA(initialDda);
+	dda->Init();
+	dda->SetPrevious(initialDda);
+	StepTimer timer;
+
+	printf("Build: %s, random seed %" PRIu32 "\n", BuildName(), randomSeed);
+
+	// Single stepping, which checks the step time calculations on their own. Each step interrupt calculates one step time, so we time them here.
+	const uint32_t minCalcInterval = DriveMovement::GetMinCalcInterval();
+	DriveMovement::SetMinCalcInterval(0);
+	FILE * const dumpFile = (dumpFileName != nullptr) ? fopen(dumpFileName, "w") : nullptr;
+	MoveStats singleStats;
+	stepDriversNanos = initNanos = 0;
+	numInits = 0;
+	RunMoves(*dda, timer, 1, false, singleStats, dumpFile);
+	const size_t singleSteps = singleStats.changing.numSteps + singleStats.steady.numSteps;
+	const double nsPerStep = (singleSteps == 0) ? 0.0 : (double)stepDriversNanos/singleSteps;
+	const double usPerMove = (numInits == 0) ? 0.0 : (double)initNanos/(1000.0 * numInits);
+	const unsigned int singleStepErrors = movesWithStepErrors;
+	PrintStats("Single stepping", singleStats);
+	printf("Host time: step calculation %.1fns per step, move preparation %.2fus per move\n", nsPerStep, usPerMove);
+	if (dumpFile != nullptr)
+	{
+		DumpSummary(dumpFile, singleStepErrors, nsPerStep, usPerMove);
+		fclose(dumpFile);
+	}
+
+	// Step bunching as the firmware does it
+	DriveMovement::SetMinCalcInterval(minCalcInterval);
+	MoveStats bunchedStats;
+	RunMoves(*dda, timer, 1, !USE_EVEN_STEPS, bunchedStats, nullptr);
+	PrintStats("Bunched steps", bunchedStats);
+
+	// All drivers, single stepping because a bunch of steps can be split between interrupts by the steps of other drivers
+	MoveStats multiStats;
+	if (NumDrivers > 1)
+	{
+		DriveMovement::SetMinCalcInterval(0);
+		RunMoves(*dda, timer, NumDrivers, false, multiStats, nullptr);
+		PrintStats("All drivers", multiStats);
+	}
+
+	// Bunched steps again, with aborted and discarded moves in between
+	DriveMovement::SetMinCalcInterval(minCalcInterval);
+	MoveStats abandonedStats;
+	RunMoves(*dda, timer, 1, !USE_EVEN_STEPS, abandonedStats, nullptr, true);
+	PrintStats("After abandoned moves", abandonedStats);
+
+	// Shaped moves, using a ZVD shaper at 100Hz with damping factor 0.1 so that many of the acceleration and deceleration phases are long enough to shape
+	MoveStats shapedStats, shapedPaStats;
+#if SUPPORT_INPUT_SHAPING
+	ShapedProfile::InitialAllocate(1);
+	{
+		constexpr double Zeta = 0.1;
+		const double dampedPeriod = (double)StepTimer::StepClockRate/(100.0 * sqrt(1.0 - Zeta * Zeta));
+		const double k = exp(-Zeta * M_PI/sqrt(1.0 - Zeta * Zeta));
+		const double sum = 1.0 + 2.0 * k + k * k;
+		simulatedImpulses.numImpulses = 3;
+		simulatedImpulses.amplitudes[0] = 1.0/sum;
+		simulatedImpulses.amplitudes[1] = 2.0 * k/sum;
+		simulatedImpulses.amplitudes[2] = k * k/sum;
+		simulatedImpulses.delays[0] = 0.0;
+		simulatedImpulses.delays[1] = 0.5 * dampedPeriod;
+		simulatedImpulses.delays[2] = dampedPeriod;
+	}
+	DriveMovement::SetMinCalcInterval(0);
+	unsigned int numUnshapedMoves = 0;
+	RunShapedMoves(*dda, timer, 1, 0.0, shapedStats, numUnshapedMoves);
+	PrintStats("Shaped moves", shapedStats);
+
+	// Shaped moves with pressure advance of 0.01 seconds on the extruder, which makes the extruder reverse in some of the shaped moves but not others
+	const float compensationClocks = 0.01 * StepTimer::StepClockRate;
+	RunShapedMoves(*dda, timer, 2, compensationClocks, shapedPaStats, numUnshapedMoves);
+	simulatedImpulses.numImpulses = 0;
+	PrintStats("Shaped moves with pressure advance", shapedPaStats);
+	printf("  %u moves not shaped because pressure advance would reverse the extruder\n", numUnshapedMoves);
+#endif
+
+	// Delta moves, with every driver moving a delta tower. This checks every step, because a bunch of steps can be split between interrupts by the steps of other towers.
+	MoveStats deltaStats;
+#if SUPPORT_DELTA_MOVEMENT
+	moveInstance = new Move();
+	DriveMovement::SetMinCalcInterval(0);
+	unsigned int numDeltaReversals = 0;
+	const bool deltaConfigured = RunDeltaMoves(*dda, timer, deltaStats, numDeltaReversals);
+	PrintStats("Delta moves", deltaStats);
+	printf("  %u tower moves reversed direction\n", numDeltaReversals);
+	if (!deltaConfigured || numDeltaReversals == 0)
+	{
+		++deltaStats.changing.numMissing;									// make sure that we fail if the moves didn't test what they should
+	}
+#endif
+
+	const unsigned int stepErrors = movesWithStepErrors;
+	if (stepErrors != 0)
+	{
+		printf("Moves with step errors: %u, of which %u single stepping\n", stepErrors, singleStepErrors);
+	}
+
+	// When two drivers are moving, a step that is due within StepTimer::MinInterruptInterval of a step of the other driver is generated with it
+	const double maxAllowedMultiError = maxAllowedError + StepTimer::MinInterruptInterval;
+	const bool failed = stepErrors != 0
+						|| singleStats.changing.numMissing != 0 || bunchedStats.changing.numMissing != 0 || multiStats.changing.numMissing != 0
+						|| abandonedStats.changing.numMissing != 0 || shapedStats.changing.numMissing != 0 || shapedPaStats.changing.numMissing != 0
+						|| deltaStats.changing.numMissing != 0
+						|| (maxAllowedDeltaError > 0.0 && (deltaStats.changing.maxError > maxAllowedDeltaError || deltaStats.steady.maxError > maxAllowedDeltaError))
+						|| (maxAllowedError > 0.0 && (   singleStats.changing.maxError > maxAllowedError || bunchedStats.changing.maxError > maxAllowedError
+													  || abandonedStats.changing.maxError > maxAllowedError
+													  || shapedStats.changing.maxError > maxAllowedError || shapedStats.steady.maxError > maxAllowedError
+													  || shapedPaStats.changing.maxError > maxAllowedMultiError || shapedPaStats.steady.maxError > maxAllowedMultiError));
+	return (failed) ? 1 : 0;
+}
+
+// End
@@ -0,0 +1,81 @@
+/*
+ * StepTimeSim.h
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ *
+ *  Interface between the host stubs, the step time simulator and the move stream replay
+ */
+
+#ifndef TOOLS_STEPTIMESIM_STEPTIMESIM_H_
+#define TOOLS_STEPTIMESIM_STEPTIMESIM_H_
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <vector>
+
+class CanMessageBuffer;
+struct CanMessageMovementLinear;
+
+namespace StepTimeSim
+{
+	// Functions that the host stubs call
+	void RecordSteps(uint32_t driverMap) noexcept;			// called when the firmware generates step pulses
+	void SetNextInterruptTime(uint32_t when) noexcept;		// called when the firmware schedules the next step interrupt
+	bool WaitForWakeup(uint32_t timeoutMillis) noexcept;	// called when the Move task blocks, runs the step interrupts until it is woken
+	void WakeTask() noexcept;								// called when the step ISR wakes the Move task
+	CanMessageBuffer *GetNextMove() noexcept;				// called when the Move task asks for the next move message
+
+	// The error statistics of a set of steps, and where the largest error was
+	struct ErrorStats
+	{
+		double sumSquares = 0.0;
+		double maxError = 0.0;
+		size_t numSteps = 0;
+		size_t numMissing = 0;
+		size_t worstMove = 0, worstDrive = 0, worstStep = 0;
+
+		void Add(double err, size_t move = 0, size_t drive = 0, size_t step = 0) noexcept;
+		double Rms() const noexcept;
+	};
+
+	// The error statistics of the parts of the moves where the speed is changing and where it is steady
+	struct MoveStats
+	{
+		ErrorStats changing;
+		ErrorStats steady;
+		size_t numMoves = 0;
+	};
+
+	// Step times recorded by RecordSteps, per driver, relative to stepTimeOrigin
+	extern std::vector<uint32_t> stepTimes[];
+	extern uint32_t stepTimeOrigin;
+
+	// The step interrupt that the firmware has scheduled
+	extern uint32_t nextInterruptTime;
+	extern bool interruptPending;
+
+	// The cost model of the step ISR, in CPU cycles. The simulated step clock advances by this much when an interrupt is taken and for each step generated.
+	extern uint32_t isrEntryCycles;
+	extern uint32_t isrCyclesPerStep;
+
+	void AddCpuCycles(uint32_t cycles) noexcept;
+	unsigned int GetAndClearBadMoves() noexcept;						// get the number of moves that the Move task found step errors in
+
+	double ExactTime(const CanMessageMovementLinear& msg, double distance, bool& steady) noexcept;
+	void CheckStepTimes(const CanMessageMovementLinear& msg, size_t moveNumber, size_t drive, const uint32_t *times, size_t numTimes, bool lastOfBunch, MoveStats& stats) noexcept;
+	void PrintStats(const char *name, const MoveStats& stats) noexcept;
+
+	// Dump files hold one record per step, "<move> <drive> <step> <time>", then a summary line starting with '#'
+	void DumpSteps(FILE *f, size_t moveNumber, size_t drive, const uint32_t *times, size_t numTimes, size_t totalSteps) noexcept;
+	void DumpSummary(FILE *f, unsigned int stepErrors, double nsPerStep, double usPerMove) noexcept;
+	const char *BuildName() noexcept;
+
+	bool ConfigureDeltaTower(size_t driver, float x, float y, float diagonal) noexcept;	// send delta tower geometry to the Move task, return true if it was accepted
+
+	int ReplayMoves(const char *fileName, const char *dumpFileName) noexcept;	// replay a move stream through the Move task, return the exit code
+	int WriteToolpath(const char *fileName) noexcept;					// write the moves of a test toolpath to a file in the replay format
+}
+
+#endif /* TOOLS_STEPTIMESIM_STEPTIMESIM_H_ */
@@ -0,0 +1,23 @@
+/*
+ * CanInterface.h
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ *
+ *  Host replacement for the CAN interface. The simulator supplies the move messages and counts the status messages sent.
+ */
+
+#ifndef TOOLS_STEPTIMESIM_CANINTERFACE_H_
+#define TOOLS_STEPTIMESIM_CANINTERFACE_H_
+
+#include <CanMessageBuffer.h>
+
+namespace CanInterface
+{
+	CanMessageBuffer *GetCanMove(uint32_t timeout) noexcept;
+	void SendAndFree(CanMessageBuffer *buf) noexcept;
+	inline uint8_t GetCanAddress() noexcept { return 1; }
+	inline uint8_t GetCurrentMasterAddress() noexcept { return 0; }
+}
+
+#endif /* TOOLS_STEPTIMESIM_CANINTERFACE_H_ */
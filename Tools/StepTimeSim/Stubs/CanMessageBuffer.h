@@ -0,0 +1,51 @@
+/*
+ * CanMessageBuffer.h
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ *
+ *  Host replacement for the CANlib message buffer. The simulator passes move messages to the Move task in these.
+ */
+
+#ifndef TOOLS_STEPTIMESIM_CANMESSAGEBUFFER_H_
+#define TOOLS_STEPTIMESIM_CANMESSAGEBUFFER_H_
+
+#include <CanMessageFormats.h>
+
+class CanId
+{
+public:
+	CanMessageType MsgType() const noexcept { return msgType; }
+	void SetMsgType(CanMessageType t) noexcept { msgType = t; }
+
+private:
+	CanMessageType msgType;
+};
+
+class CanMessageBuffer
+{
+public:
+	CanMessageBuffer(CanMessageBuffer *prev) noexcept : next(prev), dataLength(0) { }
+
+	static CanMessageBuffer *Allocate() noexcept;
+	static void Free(CanMessageBuffer*& buf) noexcept;
+
+	template<class T> T *SetupStatusMessage(uint8_t src, uint8_t dst) noexcept
+	{
+		id.SetMsgType(CanMessageType::moveQueueStatus);
+		return reinterpret_cast<T*>(&msg);
+	}
+
+	CanMessageBuffer *next;
+	CanId id;
+	size_t dataLength;
+	union
+	{
+		CanMessageMovementLinear moveLinear;
+		CanMessageMovementLinearBatch moveLinearBatch;
+		CanMessageMovementDelta moveDelta;
+		CanMessageMoveQueueStatus moveQueueStatus;
+	} msg;
+};
+
+#endif /* TOOLS_STEPTIMESIM_CANMESSAGEBUFFER_H_ */
@@ -0,0 +1,96 @@
+/*
+ * CanMessageFormats.h
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ *
+ *  Host replacement for the CANlib move messages, with the fields that DDA::Init and the Move task use
+ */
+
+#ifndef TOOLS_STEPTIMESIM_CANMESSAGEFORMATS_H_
+#define TOOLS_STEPTIMESIM_CANMESSAGEFORMATS_H_
+
+#include "RepRapFirmware.h"
+
+enum class CanMessageType : uint16_t
+{
+	movementLinear,
+	movementLinearBatch,
+	movementDelta,
+	movementLinearPwm,
+	moveQueueStatus
+};
+
+struct CanMessageMovementLinear
+{
+	uint32_t whenToExecute;
+	uint32_t accelerationClocks;
+	uint32_t steadyClocks;
+	uint32_t decelClocks;
+	uint32_t numDrivers : 4,
+			 pressureAdvanceDrives : 8,
+			 seq : 7,
+			 zero : 13;
+	float initialSpeedFraction;
+	float finalSpeedFraction;
+
+	struct
+	{
+		int32_t steps;
+	} perDrive[MaxLinearDriversPerCanSlave];
+};
+
+// The host batch holds whole linear moves, because the simulator doesn't need the compact CAN encoding
+struct CanMessageMovementLinearBatch
+{
+	static constexpr size_t MaxMoves = 4;
+
+	uint32_t whenToExecute;
+	uint32_t numMoves;
+	CanMessageMovementLinear moves[MaxMoves];
+
+	void GetMove(size_t index, CanMessageMovementLinear& move) const noexcept { move = moves[index]; }
+};
+
+// The host delta move holds a whole linear move followed by the Cartesian parameters of the move
+struct CanMessageMovementDelta
+{
+	CanMessageMovementLinear linear;
+	uint32_t deltaDrives;								// bitmap of the drivers that move delta towers
+	float initialX, initialY;							// the initial head position in mm
+	float dvecX, dvecY, dvecZ;							// the direction of the XYZ movement, normalised
+	float totalDistance;								// the length of the XYZ movement in mm
+
+	void GetLinearMove(CanMessageMovementLinear& move) const noexcept { move = linear; }
+};
+
+// The host generic message holds the parameters as letters and values, because the simulator doesn't need the CAN encoding
+class CanMessageGeneric
+{
+public:
+	static constexpr size_t MaxParams = 4;
+
+	uint16_t requestId;
+	size_t numParams;
+	struct
+	{
+		char letter;
+		float value;
+	} params[MaxParams];
+};
+
+struct CanMessageMoveQueueStatus
+{
+	static constexpr uint8_t FlagQueueLow = 0x01;
+	static constexpr uint8_t FlagQueueFull = 0x02;
+
+	uint32_t timeAhead;
+	uint16_t movesQueued;
+	uint16_t ringLength;
+	uint8_t flags;
+	uint8_t zero;
+
+	size_t GetActualDataLength() const noexcept { return sizeof(*this); }
+};
+
+#endif /* TOOLS_STEPTIMESIM_CANMESSAGEFORMATS_H_ */
@@ -0,0 +1,55 @@
+/*
+ * CanMessageGenericParser.h
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ *
+ *  Host replacement for the CANlib generic message parser, which finds the parameters of a host CanMessageGeneric by letter
+ */
+
+#ifndef TOOLS_STEPTIMESIM_CANMESSAGEGENERICPARSER_H_
+#define TOOLS_STEPTIMESIM_CANMESSAGEGENERICPARSER_H_
+
+#include <CanMessageFormats.h>
+
+// The host messages say which parameters they have, so the parameter tables are empty
+struct ParamDescriptor
+{
+};
+
+constexpr ParamDescriptor M665Params[] = { { } };
+
+class CanMessageGenericParser
+{
+public:
+	CanMessageGenericParser(const CanMessageGeneric& p_msg, const ParamDescriptor *p_paramTable) noexcept : msg(p_msg) { }
+
+	bool GetFloatParam(char c, float& v) const noexcept
+	{
+		for (size_t i = 0; i < msg.numParams; ++i)
+		{
+			if (msg.params[i].letter == c)
+			{
+				v = msg.params[i].value;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool GetUintParam(char c, uint8_t& v) const noexcept
+	{
+		float f;
+		if (!GetFloatParam(c, f) || f < 0.0 || f > 255.0)
+		{
+			return false;
+		}
+		v = (uint8_t)f;
+		return true;
+	}
+
+private:
+	const CanMessageGeneric& msg;
+};
+
+#endif /* TOOLS_STEPTIMESIM_CANMESSAGEGENERICPARSER_H_ */
@@ -0,0 +1,86 @@
+/*
+ * CoreIO.h
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ *
+ *  Host replacement for the parts of CoreN2G that the step time code uses
+ */
+
+#ifndef TOOLS_STEPTIMESIM_COREIO_H_
+#define TOOLS_STEPTIMESIM_COREIO_H_
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <cinttypes>
+#include <new>
+#include <limits>
+#include <atomic>
+
+#include "HostConfig.h"
+#include "ecv.h"
+
+typedef uint16_t PwmFrequency;
+
+union CallbackParameter
+{
+	void *vp;
+	uint32_t u32;
+	int32_t i32;
+
+	CallbackParameter(void *pp) noexcept : vp(pp) { }
+	CallbackParameter(uint32_t pp) noexcept : u32(pp) { }
+	CallbackParameter(int32_t pp) noexcept : i32(pp) { }
+	CallbackParameter() noexcept : u32(0) { }
+};
+
+typedef uint8_t Pin;
+typedef uint32_t irqflags_t;
+
+uint32_t millis() noexcept;
+void delay(uint32_t ms) noexcept;
+
+inline void IrqDisable() noexcept { }
+inline void IrqEnable() noexcept { }
+inline irqflags_t IrqSave() noexcept { return 0; }
+inline void IrqRestore(irqflags_t) noexcept { }
+inline uint32_t ChangeBasePriority(uint32_t) noexcept { return 0; }
+inline void RestoreBasePriority(uint32_t) noexcept { }
+inline void __DMB() noexcept { std::atomic_thread_fence(std::memory_order_seq_cst); }	// a full fence, so that CanQueueBench can run the lock-free queue on two threads
+constexpr uint32_t NvicPriorityStep = 3;
+constexpr uint32_t SystemCoreClockFreq = (SAME5x) ? 120000000 : 48000000;
+
+// Times how long something takes. The firmware uses this to time DDA::Init, so on the host it measures simulated time, which doesn't advance while a move is prepared.
+class MicrosecondsTimer
+{
+public:
+	MicrosecondsTimer() noexcept : start(ReadMicroseconds()) { }
+	uint32_t Read() const noexcept { return ReadMicroseconds() - start; }
+
+private:
+	static uint32_t ReadMicroseconds() noexcept;
+
+	uint32_t start;
+};
+
+// SysTick is only used by the on-board benchmarks, which the simulator does not run
+struct SimulatedSysTick { uint32_t VAL; uint32_t LOAD; };
+extern SimulatedSysTick simulatedSysTick;
+#define SysTick					(&simulatedSysTick)
+
+// The step timer. Reading the count returns the simulated step clock, which the simulator advances.
+struct SimulatedTc
+{
+	struct { uint32_t reg; struct { uint32_t CMD; } bit; } CTRLBSET;
+	struct { uint32_t reg; struct { uint32_t COUNT; } bit; } SYNCBUSY;
+	struct { uint32_t reg; } COUNT;
+};
+
+extern SimulatedTc simulatedStepTc;
+#define StepTc					(&simulatedStepTc)
+#define TC_CTRLBSET_CMD_READSYNC	(0)
+
+#endif /* TOOLS_STEPTIMESIM_COREIO_H_ */
@@ -0,0 +1,17 @@
+/*
+ * Duet3Common.h
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ *
+ *  Host replacement for the CANlib definitions that the step time code uses
+ */
+
+#ifndef TOOLS_STEPTIMESIM_DUET3COMMON_H_
+#define TOOLS_STEPTIMESIM_DUET3COMMON_H_
+
+#include <cstddef>
+
+constexpr size_t MaxLinearDriversPerCanSlave = 6;
+
+#endif /* TOOLS_STEPTIMESIM_DUET3COMMON_H_ */
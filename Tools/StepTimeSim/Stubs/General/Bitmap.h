@@ -0,0 +1,34 @@
+/*
+ * Bitmap.h
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ *
+ *  Host replacement for the CoreN2G bitmap class
+ */
+
+#ifndef TOOLS_STEPTIMESIM_BITMAP_H_
+#define TOOLS_STEPTIMESIM_BITMAP_H_
+
+#include <cstdint>
+
+template<class BaseType> class Bitmap
+{
+public:
+	constexpr Bitmap() noexcept : bits(0) { }
+	constexpr Bitmap(BaseType n) noexcept : bits(n) { }
+
+	static constexpr unsigned int MaxBits() noexcept { return sizeof(BaseType) * 8; }
+	constexpr BaseType GetRaw() const noexcept { return bits; }
+	constexpr bool IsBitSet(unsigned int n) const noexcept { return (bits & ((BaseType)1 << n)) != 0; }
+	void SetBit(unsigned int n) noexcept { bits |= (BaseType)1 << n; }
+	void ClearBit(unsigned int n) noexcept { bits &= ~((BaseType)1 << n); }
+	constexpr Bitmap operator|(Bitmap other) const noexcept { return Bitmap(bits | other.bits); }
+
+private:
+	BaseType bits;
+};
+
+template<class T> constexpr T MakeBitmap(unsigned int n) noexcept { return T((decltype(T().GetRaw()))1 << n); }
+
+#endif /* TOOLS_STEPTIMESIM_BITMAP_H_ */
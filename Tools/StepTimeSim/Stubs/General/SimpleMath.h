@@ -0,0 +1,26 @@
+/*
+ * SimpleMath.h
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ *
+ *  Host replacement for the CoreN2G maths helpers that the step time code uses
+ */
+
+#ifndef TOOLS_STEPTIMESIM_SIMPLEMATH_H_
+#define TOOLS_STEPTIMESIM_SIMPLEMATH_H_
+
+#include <cstdint>
+#include <cmath>
+
+template<class X> inline constexpr X min(X _a, X _b) noexcept { return (_a < _b) ? _a : _b; }
+template<class X> inline constexpr X max(X _a, X _b) noexcept { return (_a > _b) ? _a : _b; }
+template<class T> inline constexpr T constrain(T val, T vmin, T vmax) noexcept { return (val < vmin) ? vmin : (val > vmax) ? vmax : val; }
+
+inline constexpr float fsquare(float arg) noexcept { return arg * arg; }
+inline constexpr double dsquare(double arg) noexcept { return arg * arg; }
+inline constexpr uint64_t isquare64(int32_t arg) noexcept { return (uint64_t)((int64_t)arg * arg); }
+inline constexpr uint64_t isquare64(uint32_t arg) noexcept { return (uint64_t)arg * arg; }
+inline float fastSqrtf(float f) noexcept { return sqrtf(f); }
+
+#endif /* TOOLS_STEPTIMESIM_SIMPLEMATH_H_ */
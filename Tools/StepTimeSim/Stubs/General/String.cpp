@@ -0,0 +1,50 @@
+/*
+ * String.cpp
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ *
+ *  Host definitions of the string reference functions, shared by the host tools
+ */
+
+#include <General/String.h>
+
+int StringRef::vcatf(const char *fmt, va_list vargs) const noexcept
+{
+	const size_t n = strlen();
+	return (n + 1 < len) ? vsnprintf(p + n, len - n, fmt, vargs) : 0;
+}
+
+int StringRef::printf(const char *fmt, ...) const noexcept
+{
+	Clear();
+	va_list vargs;
+	va_start(vargs, fmt);
+	const int ret = vcatf(fmt, vargs);
+	va_end(vargs);
+	return ret;
+}
+
+int StringRef::catf(const char *fmt, ...) const noexcept
+{
+	va_list vargs;
+	va_start(vargs, fmt);
+	const int ret = vcatf(fmt, vargs);
+	va_end(vargs);
+	return ret;
+}
+
+int StringRef::lcatf(const char *fmt, ...) const noexcept
+{
+	if (strlen() != 0)
+	{
+		cat("\n");
+	}
+	va_list vargs;
+	va_start(vargs, fmt);
+	const int ret = vcatf(fmt, vargs);
+	va_end(vargs);
+	return ret;
+}
+
+// End
@@ -0,0 +1,40 @@
+/*
+ * String.h
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ *
+ *  Host replacement for the CoreN2G string reference class
+ */
+
+#ifndef TOOLS_STEPTIMESIM_STRING_H_
+#define TOOLS_STEPTIMESIM_STRING_H_
+
+#include <cstddef>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+
+
+class StringRef
+{
+public:
+	StringRef(char *pp, size_t pl) noexcept : p(pp), len(pl) { }
+
+	size_t strlen() const noexcept { return ::strlen(p); }
+	const char *c_str() const noexcept { return p; }
+	void Clear() const noexcept { p[0] = 0; }
+	int copy(const char *s) const noexcept { p[0] = 0; return cat(s); }
+	int cat(const char *s) const noexcept { return catf("%s", s); }
+	int printf(const char *fmt, ...) const noexcept __attribute__ ((format (printf, 2, 3)));
+	int catf(const char *fmt, ...) const noexcept __attribute__ ((format (printf, 2, 3)));
+	int lcatf(const char *fmt, ...) const noexcept __attribute__ ((format (printf, 2, 3)));
+
+private:
+	int vcatf(const char *fmt, va_list vargs) const noexcept;
+
+	char *p;
+	size_t len;
+};
+
+#endif /* TOOLS_STEPTIMESIM_STRING_H_ */
@@ -0,0 +1,11 @@
+/*
+ * StringFunctions.h
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ */
+
+#ifndef TOOLS_STEPTIMESIM_STRINGFUNCTIONS_H_
+#define TOOLS_STEPTIMESIM_STRINGFUNCTIONS_H_
+
+#endif /* TOOLS_STEPTIMESIM_STRINGFUNCTIONS_H_ */
@@ -0,0 +1,15 @@
+/*
+ * StringRef.h
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ *
+ *  Host replacement for the RRFLibraries string reference header. The host StringRef is declared in String.h.
+ */
+
+#ifndef TOOLS_STEPTIMESIM_STRINGREF_H_
+#define TOOLS_STEPTIMESIM_STRINGREF_H_
+
+#include "String.h"
+
+#endif /* TOOLS_STEPTIMESIM_STRINGREF_H_ */
@@ -0,0 +1,56 @@
+/*
+ * HostConfig.h
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ *
+ *  Board configuration for the host build of the step time code. The Makefile selects the variant.
+ */
+
+#ifndef TOOLS_STEPTIMESIM_HOSTCONFIG_H_
+#define TOOLS_STEPTIMESIM_HOSTCONFIG_H_
+
+#include <cstddef>
+
+#ifndef SIM_FPU
+# define SIM_FPU				1
+#endif
+#ifndef SIM_DELTA
+# define SIM_DELTA				0
+#endif
+
+#define BOARD_TYPE_NAME			"HOSTSIM"
+#define SUPPORT_DRIVERS			1
+#define HAS_SMART_DRIVERS		0
+#define SUPPORT_SLOW_DRIVERS	0
+#define SUPPORT_DELTA_MOVEMENT	SIM_DELTA
+
+#if SIM_FPU
+
+// Like the EXP3HC
+# define __FPU_USED				1
+# define SAME5x					1
+# define SAMC21					0
+# define SINGLE_DRIVER			0
+# define USE_EVEN_STEPS			0
+# define SUPPORT_STEP_SEGMENTS	SIM_SEGMENTS
+# define USE_BITMAP_STEP_SCHEDULER	1
+# define SUPPORT_INPUT_SHAPING	1
+constexpr size_t NumDrivers = 3;
+
+#else
+
+// Like the SAMC21 boards. TOOL1LC has USE_EVEN_STEPS 0, the others have USE_EVEN_STEPS 1.
+# define __FPU_USED				0
+# define SAME5x					0
+# define SAMC21					1
+# define SINGLE_DRIVER			1
+# define USE_EVEN_STEPS			SIM_EVEN_STEPS
+constexpr size_t NumDrivers = 1;
+
+#endif
+
+constexpr size_t MaxFans = 1;
+constexpr size_t MaxSensors = 1;
+
+#endif /* TOOLS_STEPTIMESIM_HOSTCONFIG_H_ */
@@ -0,0 +1,30 @@
+/*
+ * Isqrt.h
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ *
+ *  Host replacement for the CoreN2G integer square root, which returns the square root rounded down
+ */
+
+#ifndef TOOLS_STEPTIMESIM_ISQRT_H_
+#define TOOLS_STEPTIMESIM_ISQRT_H_
+
+#include <cstdint>
+#include <cmath>
+
+inline uint32_t isqrt64(uint64_t num) noexcept
+{
+	uint64_t root = (uint64_t)sqrtl((long double)num);
+	while (root * root > num)
+	{
+		--root;
+	}
+	while ((root + 1) * (root + 1) <= num)
+	{
+		++root;
+	}
+	return (uint32_t)root;
+}
+
+#endif /* TOOLS_STEPTIMESIM_ISQRT_H_ */
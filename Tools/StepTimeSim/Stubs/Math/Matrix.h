@@ -0,0 +1,23 @@
+/*
+ * Matrix.h
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ *
+ *  Host replacement for the RRFLibraries matrix class, with just the functions that Kinematics::PrintMatrix uses
+ */
+
+#ifndef TOOLS_STEPTIMESIM_MATRIX_H_
+#define TOOLS_STEPTIMESIM_MATRIX_H_
+
+#include <cstddef>
+
+template<class T> class MathMatrix
+{
+public:
+	virtual size_t rows() const noexcept = 0;
+	virtual size_t cols() const noexcept = 0;
+	virtual T operator() (size_t r, size_t c) const noexcept = 0;
+};
+
+#endif /* TOOLS_STEPTIMESIM_MATRIX_H_ */
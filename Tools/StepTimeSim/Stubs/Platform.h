@@ -0,0 +1,46 @@
+/*
+ * Platform.h
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ *
+ *  Host replacement for the Platform functions that the step time code uses. Step pulses are recorded by the simulator.
+ */
+
+#ifndef TOOLS_STEPTIMESIM_PLATFORM_H_
+#define TOOLS_STEPTIMESIM_PLATFORM_H_
+
+#include "RepRapFirmware.h"
+#include <Movement/StepTimer.h>
+
+#include "MessageType.h"
+
+enum class ErrorCode : uint32_t
+{
+	BadTemp = 1u << 0,
+	BadMove = 1u << 1
+};
+
+namespace Platform
+{
+	bool Debug(Module module) noexcept;
+	void LogError(ErrorCode e) noexcept;
+	void Message(MessageType type, const char *message) noexcept;
+	void MessageF(MessageType type, const char *fmt, ...) noexcept;
+
+	float DriveStepsPerUnit(size_t drive) noexcept;
+	float GetPressureAdvanceClocks(size_t driver) noexcept;
+	float GetPressureAdvanceSmoothingClocks(size_t driver) noexcept;
+	float GetPressureAdvanceNonlinear(size_t driver) noexcept;
+
+	void EnableDrive(size_t driver) noexcept;
+	void SetDirection(bool direction) noexcept;
+	void SetDirection(size_t driver, bool direction) noexcept;
+	void StepDriversHigh(uint32_t driverMap) noexcept;
+	inline void StepDriversLow() noexcept { }
+	inline void StepDriverHigh() noexcept { StepDriversHigh(1); }
+	inline void StepDriverLow() noexcept { }
+	inline uint32_t GetDriversBitmap(size_t driver) noexcept { return 1u << driver; }
+}
+
+#endif /* TOOLS_STEPTIMESIM_PLATFORM_H_ */
@@ -0,0 +1,92 @@
+/*
+ * RTOSIface.h
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ *
+ *  Host replacement for the RTOS interface. The simulator has a single thread, which runs the Move task.
+ *  When the Move task blocks, the simulator runs the step interrupts until the task is woken or the timeout expires.
+ *  CanQueueBench runs real threads instead, and provides its own definitions of the functions that are not inline.
+ */
+
+#ifndef TOOLS_STEPTIMESIM_RTOSIFACE_H_
+#define TOOLS_STEPTIMESIM_RTOSIFACE_H_
+
+#include <cstdint>
+
+typedef void (*TaskFunction_t)(void *);
+
+class TaskBase
+{
+public:
+	static constexpr uint32_t TimeoutUnlimited = 0xFFFFFFFF;
+
+	static TaskBase *GetCallerTaskHandle() noexcept;
+	static bool Take(uint32_t timeout = TimeoutUnlimited) noexcept;
+	static void ClearNotifyCount() noexcept;
+	static void GiveFromISR(TaskBase *t) noexcept;
+	void GiveFromISR() noexcept { GiveFromISR(this); }
+	void Give() noexcept { GiveFromISR(this); }
+	void TerminateAndUnlink() noexcept { }
+};
+
+template<unsigned int StackWords> class Task : public TaskBase
+{
+public:
+	void Create(TaskFunction_t pxTaskCode, const char *pcName, void *pvParameters, unsigned int uxPriority) noexcept { }
+};
+
+// The simulator's thread can always take a mutex that it doesn't already hold, so the host mutex only records whether it is held
+class Mutex
+{
+public:
+	static constexpr uint32_t TimeoutUnlimited = 0xFFFFFFFF;
+
+	void Create(const char *pName) noexcept { }
+	bool Take(uint32_t timeout = TimeoutUnlimited) noexcept
+	{
+		if (held)
+		{
+			return false;
+		}
+		held = true;
+		return true;
+	}
+	void Release() noexcept { held = false; }
+
+private:
+	bool held = false;
+};
+
+class MutexLocker
+{
+public:
+	MutexLocker(Mutex& m, uint32_t timeout = Mutex::TimeoutUnlimited) noexcept : mutex(m), acquired(m.Take(timeout)) { }
+	~MutexLocker() noexcept
+	{
+		if (acquired)
+		{
+			mutex.Release();
+		}
+	}
+	explicit operator bool() const noexcept { return acquired; }
+
+private:
+	Mutex& mutex;
+	bool acquired;
+};
+
+class AtomicCriticalSectionLocker
+{
+public:
+	AtomicCriticalSectionLocker() noexcept { }
+};
+
+class TaskCriticalSectionLocker
+{
+public:
+	TaskCriticalSectionLocker() noexcept;
+	~TaskCriticalSectionLocker() noexcept;
+};
+
+#endif /* TOOLS_STEPTIMESIM_RTOSIFACE_H_ */
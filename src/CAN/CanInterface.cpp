@@ -7,6 +7,7 @@
 
 #include "CanInterface.h"
 #include "CanMessageQueue.h"
+#include "CanStats.h"
 
 #include <CanSettings.h>
 #include <CanMessageFormats.h>
@@ -64,6 +65,13 @@ constexpr CanDevice::Config Can0Config =
 
 static_assert(Can0Config.IsValid());
 
+// We read the receive FIFO fill level directly from the CAN peripheral, because the CAN driver doesn't provide a way to get it
+#if SAME5x
+static Can * const CanHardware = CAN1;
+#elif SAMC21
+static Can * const CanHardware = CAN0;
+#endif
+
 // CAN buffer memory must be in the first 64Kb of RAM (SAME5x) or in non-cached RAM (SAME70), so put it in its own segment
 static uint32_t can0Memory[Can0Config.GetMemorySize()] __attribute__ ((section (".CanMessage")));
 
@@ -89,6 +97,8 @@ static unsigned int duplicateMotionMessages = 0;
 static unsigned int oosMessages1Ahead = 0, oosMessages2Ahead = 0, oosMessages2Behind = 0, oosMessagesOther = 0;
 static unsigned int badMoveCommands = 0;
 static uint32_t worstBadMove = 0;
+static uint32_t lastMoveEndedAt = 0;							// when the last move that we received ends, or zero if we don't know
+static unsigned int badBatchMessages = 0;						// how many batches of moves we rejected because their move count didn't fit the message
 static int32_t minAdvance, maxAdvance;
 static uint32_t maxMotionProcessingDelay = 0;
 
@@ -105,10 +115,64 @@ uint8_t expectedSeq = 0xFF;
 //DEBUG
 //static int32_t accumulatedMotion = 0;
 
-static CanMessageQueue PendingMoves;
-static CanMessageQueue PendingCommands;
+// These queues are only added to by the CAN receiver task, and PendingMoves is only read by the Move task and PendingCommands only by the command processor task
+static_assert(NumCanBuffers <= CanMessageRingQueue::Capacity);
+static CanMessageRingQueue PendingMoves;
+static CanMessageRingQueue PendingCommands;
 
 static Mutex txFifoMutex;
+static Mutex txUrgentMutex;
+
+constexpr size_t TxFrameOverheadBytes = 12;						// approximate number of bytes in a CAN-FD frame in addition to the data, including bit stuffing
+constexpr uint32_t TxTimeoutMillis = 1000;
+
+// Token bucket that limits the share of the CAN bus bandwidth used by one class of transmitted messages
+class TxBudget
+{
+public:
+	void Init(uint32_t p_bytesPerSecond) noexcept;
+	bool TryTake(size_t numBytes) noexcept;
+
+private:
+	static constexpr uint32_t MaxCredit = 4 * (64 + TxFrameOverheadBytes) * 1000;	// allow a burst of up to 4 full-size messages
+
+	uint32_t bytesPerSecond = 0;								// zero means unlimited
+	uint32_t credit = 0;										// in units of 1/1000 byte
+	uint32_t lastRefillMillis = 0;
+};
+
+void TxBudget::Init(uint32_t p_bytesPerSecond) noexcept
+{
+	bytesPerSecond = p_bytesPerSecond;
+	credit = MaxCredit;
+	lastRefillMillis = millis();
+}
+
+// Take the credit needed to send a message, returning false if we don't have enough yet
+bool TxBudget::TryTake(size_t numBytes) noexcept
+{
+	if (bytesPerSecond == 0)
+	{
+		return true;
+	}
+
+	TaskCriticalSectionLocker lock;								// several tasks may send messages in the same class
+	const uint32_t now = millis();
+	const uint32_t elapsed = min<uint32_t>(now - lastRefillMillis, 1000);	// limit the elapsed time to avoid overflow
+	lastRefillMillis = now;
+	credit = min<uint32_t>(credit + elapsed * bytesPerSecond, MaxCredit);
+	if (credit < numBytes * 1000)
+	{
+		return false;
+	}
+	credit -= numBytes * 1000;
+	return true;
+}
+
+static TxBudget normalTxBudget, bulkTxBudget;
+static volatile unsigned int normalSendersPending = 0;			// how many tasks are waiting to send normal priority messages
+static unsigned int txMessagesSent[(size_t)CanTxClass::numClasses] = { 0 };
+static unsigned int txNormalDeferrals = 0, txBulkDeferrals = 0;
 
 #if OOS_DEBUG
 
@@ -138,6 +202,7 @@ void CanInterface::Init(CanAddress defaultBoardAddress, bool useAlternatePins, b
 {
 	// Create the mutex
 	txFifoMutex.Create("CANtx");
+	txUrgentMutex.Create("CANtxU");
 
 	// Read the CAN timing data from the top part of the NVM User Row
 	canConfigData = *reinterpret_cast<CanUserAreaData*>(NVMCTRL_USER + CanUserAreaDataOffset);
@@ -197,6 +262,15 @@ void CanInterface::Init(CanAddress defaultBoardAddress, bool useAlternatePins, b
 	can0dev->SetExtendedIdMask(0x1FFFFFFF & ~(CanId::BoardAddressMask << CanId::SrcAddressShift));
 	can0dev->Enable();
 
+	// Set up the transmit bandwidth budgets from the nominal bit rate
+	{
+		CanTiming actualTiming;
+		can0dev->GetLocalCanTiming(actualTiming);
+		const uint32_t busBytesPerSecond = CanTiming::ClockFrequency/(8 * actualTiming.period);
+		normalTxBudget.Init((CAN_TX_NORMAL_SHARE >= 100) ? 0 : (busBytesPerSecond * CAN_TX_NORMAL_SHARE)/100);
+		bulkTxBudget.Init((CAN_TX_BULK_SHARE >= 100) ? 0 : (busBytesPerSecond * CAN_TX_BULK_SHARE)/100);
+	}
+
 	enabled = true;
 
 	if (full)
@@ -243,30 +317,83 @@ CanAddress CanInterface::GetCurrentMasterAddress() noexcept
 	return currentMasterAddress;
 }
 
-// Send a message. On return the buffer is available to the caller to re-use or free.
-// Any extra bytes needed as padding are set to zero by the CAN driver.
-bool CanInterface::Send(CanMessageBuffer *buf) noexcept
+// Send a message using the specified transmit buffer. The caller must own the mutex for that buffer.
+static void SendUsingBuffer(CanDevice::TxBufferNumber whichBuffer, CanMessageBuffer *buf) noexcept
 {
-	//TODO option to not force sending, and return true only if successful?
-	MutexLocker lock(txFifoMutex);
-	const uint32_t cancelledId = can0dev->SendMessage(CanDevice::TxBufferNumber::fifo, 1000, buf);
+	const uint32_t cancelledId = can0dev->SendMessage(whichBuffer, TxTimeoutMillis, buf);
 	if (cancelledId != 0)
 	{
 		lastCancelledId = cancelledId;
 		++txTimeouts;
+		CanId id;
+		id.SetReceivedId(cancelledId);
+		CanStats::RecordCancelled(id.MsgType());
 	}
+	CanStats::RecordSent(buf->id.MsgType());
+}
+
+// Send a message. On return the buffer is available to the caller to re-use or free.
+// Any extra bytes needed as padding are set to zero by the CAN driver.
+bool CanInterface::Send(CanMessageBuffer *buf, CanTxClass txClass) noexcept
+{
+	//TODO option to not force sending, and return true only if successful?
+	const size_t numBytes = buf->dataLength + TxFrameOverheadBytes;
+	switch (txClass)
+	{
+	case CanTxClass::urgent:
+		{
+			MutexLocker lock(txUrgentMutex);
+			SendUsingBuffer(CanDevice::TxBufferNumber::buffer0, buf);
+		}
+		break;
+
+	case CanTxClass::bulk:
+		// Give way to normal messages, and don't exceed our share of the bandwidth
+		while (normalSendersPending != 0 || !bulkTxBudget.TryTake(numBytes))
+		{
+			++txBulkDeferrals;
+			delay(1);
+		}
+		{
+			MutexLocker lock(txFifoMutex);
+			SendUsingBuffer(CanDevice::TxBufferNumber::fifo, buf);
+		}
+		break;
+
+	case CanTxClass::normal:
+	default:
+		while (!normalTxBudget.TryTake(numBytes))
+		{
+			++txNormalDeferrals;
+			delay(1);
+		}
+		{
+			TaskCriticalSectionLocker lock;
+			++normalSendersPending;
+		}
+		{
+			MutexLocker lock(txFifoMutex);
+			{
+				TaskCriticalSectionLocker lock2;
+				--normalSendersPending;
+			}
+			SendUsingBuffer(CanDevice::TxBufferNumber::fifo, buf);
+		}
+		break;
+	}
+
+	++txMessagesSent[(size_t)txClass];
 	return true;
 }
 
 bool CanInterface::SendAsync(CanMessageBuffer *buf) noexcept
 {
-	//TODO use a dedicated buffer to send these high-priority messages
-	return Send(buf);
+	return Send(buf, CanTxClass::urgent);
 }
 
-bool CanInterface::SendAndFree(CanMessageBuffer *buf) noexcept
+bool CanInterface::SendAndFree(CanMessageBuffer *buf, CanTxClass txClass) noexcept
 {
-	const bool ok = Send(buf);
+	const bool ok = Send(buf, txClass);
 	CanMessageBuffer::Free(buf);
 	return ok;
 }
@@ -282,6 +409,104 @@ CanMessageBuffer *CanInterface::GetCanCommand(uint32_t timeout) noexcept
 	return PendingCommands.GetMessage(timeout);
 }
 
+#if SUPPORT_DRIVERS
+
+// Check for duplicate and out-of-sequence motion messages. Return false if the message is a duplicate, in which case the caller should discard it.
+// We can get out-of-sequence messages because of a bug in the CAN hardware; so use only the sequence number to detect duplicates
+static bool CheckMotionMessageSequence(uint8_t seq, uint32_t whenToExecute) noexcept
+{
+	if (((seq + 1) & 0x7F) == expectedSeq)
+	{
+		++duplicateMotionMessages;
+#if OOS_DEBUG
+		if (oosCount != 0)
+		{
+			oosBuffer[oosCount].seq = seq;
+			oosBuffer[oosCount].startTime = whenToExecute;
+		}
+#endif
+		return false;
+	}
+
+	lastMotionMessageScheduledTime = whenToExecute;
+	lastMotionMessageReceivedAt = millis();
+
+	if (seq != expectedSeq && expectedSeq != 0xFF)
+	{
+		switch ((seq - expectedSeq) & 0x7F)
+		{
+		case 1:
+			++oosMessages1Ahead;
+			break;
+
+		case 2:
+			++oosMessages2Ahead;
+			break;
+
+		case 0x7E:
+			++oosMessages2Behind;
+			break;
+
+		default:
+			++oosMessagesOther;
+			break;
+		}
+#if OOS_DEBUG
+		if (oosCount == 0)
+		{
+			qq;
+			oosCount = 1;
+		}
+#endif
+	}
+
+#if OOS_DEBUG
+	if (oosCount != 0)
+	{
+		oosBuffer[oosCount].seq = seq;
+		oosBuffer[oosCount].startTime = whenToExecute;
+	}
+#endif
+	expectedSeq = (seq + 1) & 0x7F;
+	return true;
+}
+
+// Convert the start time of a motion message to local time, and track how much processing delay there was and how far in advance we were sent it
+static uint32_t ConvertMotionMessageStartTime(uint32_t whenToExecute, uint16_t timeStamp) noexcept
+{
+	const uint32_t localStartTime = StepTimer::ConvertToLocalTime(whenToExecute);
+
+	// Track how much processing delay there was
+	{
+		const uint16_t timeStampNow = CanInterface::GetTimeStampCounter();
+
+		// The time stamp counter runs at the CAN normal bit rate, but the step clock runs at 48MHz/64. Calculate the delay to in step clocks.
+		// Datasheet suggests that on the SAMC21 only 15 bits of timestamp counter are readable, but Microchip confirmed this is a documentation error (case 00625843)
+		const uint32_t timeStampDelay = ((uint32_t)((timeStampNow - timeStamp) & 0xFFFF) * CanInterface::GetTimeStampPeriod()) >> 6;	// timestamp counter is 16 bits
+		if (timeStampDelay > maxMotionProcessingDelay)
+		{
+			maxMotionProcessingDelay = timeStampDelay;
+		}
+	}
+
+	// Track how much we are given moves in advance
+	{
+		const int32_t advance = (int32_t)(localStartTime - StepTimer::GetTimerTicks());
+		if (advance < minAdvance)
+		{
+			minAdvance = advance;
+		}
+		if (advance > maxAdvance)
+		{
+			maxAdvance = advance;
+		}
+	}
+
+	return localStartTime;
+}
+
+#endif
+
 // Process a received message. Return the buffer it arrived in if it is free for re-use, else nullptr.
 CanMessageBuffer *CanInterface::ProcessReceivedMessage(CanMessageBuffer *buf) noexcept
 {
@@ -296,69 +521,14 @@ CanMessageBuffer *CanInterface::ProcessReceivedMessage(CanMessageBuffer *buf) no
 		{
 #if SUPPORT_DRIVERS
 		case CanMessageType::movementLinear:
-			// Check for duplicate and out-of-sequence message
-			// We can get out-of-sequence messages because of a bug in the CAN hardware; so use only the sequence number to detect duplicates
+			if (!CheckMotionMessageSequence(buf->msg.moveLinear.seq, buf->msg.moveLinear.whenToExecute))
 			{
-				const int8_t seq = buf->msg.moveLinear.seq;
-				if (((seq + 1) & 0x7F) == expectedSeq)
-				{
-					++duplicateMotionMessages;
-#if OOS_DEBUG
-					if (oosCount != 0)
-					{
-						oosBuffer[oosCount].seq = buf->msg.moveLinear.seq;
-						oosBuffer[oosCount].startTime = buf->msg.moveLinear.whenToExecute;
-					}
-#endif
-					break;
-				}
-
-				lastMotionMessageScheduledTime = buf->msg.moveLinear.whenToExecute;
-				lastMotionMessageReceivedAt = millis();
-
-				if (seq != expectedSeq && expectedSeq != 0xFF)
-				{
-					switch ((seq - expectedSeq) & 0x7F)
-					{
-					case 1:
-						++oosMessages1Ahead;
-						break;
-
-					case 2:
-						++oosMessages2Ahead;
-						break;
-
-					case 0x7E:
-						++oosMessages2Behind;
-						break;
-
-					default:
-						++oosMessagesOther;
-						break;
-					}
-#if OOS_DEBUG
-					if (oosCount == 0)
-					{
-						qq;
-						oosCount = 1;
-					}
-#endif
-				}
-
-#if OOS_DEBUG
-				if (oosCount != 0)
-				{
-					oosBuffer[oosCount].seq = seq;
-					oosBuffer[oosCount].startTime = buf->msg.moveLinear.whenToExecute;
-				}
-#endif
-				expectedSeq = (seq + 1) & 0x7F;
+				break;
 			}
 
 			//TODO if we haven't established time sync yet then we should defer this
 # if 1
 			//DEBUG
-			static uint32_t lastMoveEndedAt = 0;
 			if (lastMoveEndedAt != 0)
 			{
 				const int32_t gap = (int32_t)(buf->msg.moveLinear.whenToExecute - lastMoveEndedAt);
@@ -373,40 +543,62 @@ CanMessageBuffer *CanInterface::ProcessReceivedMessage(CanMessageBuffer *buf) no
 			}
 			lastMoveEndedAt = buf->msg.moveLinear.whenToExecute + buf->msg.moveLinear.accelerationClocks + buf->msg.moveLinear.steadyClocks + buf->msg.moveLinear.decelClocks;
 # endif
-			buf->msg.moveLinear.whenToExecute += StepTimer::GetLocalTimeOffset();
+			buf->msg.moveLinear.whenToExecute = ConvertMotionMessageStartTime(buf->msg.moveLinear.whenToExecute, buf->timeStamp);
 
-			// Track how much processing delay there was
-			{
-				const uint16_t timeStampNow = CanInterface::GetTimeStampCounter();
+			//DEBUG
+			//accumulatedMotion +=buf->msg.moveLinear.perDrive[0].steps;
+			//END
+			PendingMoves.AddMessage(buf);
+			Platform::OnProcessingCanMessage();
+			return nullptr;
 
-				// The time stamp counter runs at the CAN normal bit rate, but the step clock runs at 48MHz/64. Calculate the delay to in step clocks.
-				// Datasheet suggests that on the SAMC21 only 15 bits of timestamp counter are readable, but Microchip confirmed this is a documentation error (case 00625843)
-				const uint32_t timeStampDelay = ((uint32_t)((timeStampNow - buf->timeStamp) & 0xFFFF) * CanInterface::GetTimeStampPeriod()) >> 6;	// timestamp counter is 16 bits
-				if (timeStampDelay > maxMotionProcessingDelay)
-				{
-					maxMotionProcessingDelay = timeStampDelay;
-				}
+		case CanMessageType::movementLinearBatch:
+			// Several short moves that follow each other with no gaps. The Move task adds them all to the ring when it gets the message.
+			if (!CheckMotionMessageSequence(buf->msg.moveLinearBatch.seq, buf->msg.moveLinearBatch.whenToExecute))
+			{
+				break;
+			}
+			if (   buf->msg.moveLinearBatch.numMoves == 0
+				|| buf->msg.moveLinearBatch.numMoves > CanMessageMovementLinearBatch::MaxMoves
+				|| buf->dataLength < buf->msg.moveLinearBatch.GetActualDataLength()
+			   )
+			{
+				++badBatchMessages;						// the move count doesn't fit the message, so reject the whole batch
+				break;
 			}
+			lastMoveEndedAt = 0;						// we don't track where the moves in a batch end, so don't check the gap before the next single move
+			buf->msg.moveLinearBatch.whenToExecute = ConvertMotionMessageStartTime(buf->msg.moveLinearBatch.whenToExecute, buf->timeStamp);
+			PendingMoves.AddMessage(buf);
+			Platform::OnProcessingCanMessage();
+			return nullptr;
 
-			// Track how much we are given moves in advance
+# if SUPPORT_DELTA_MOVEMENT
+		case CanMessageType::movementDelta:
+			// A linear move that also carries the Cartesian parameters, so that we can step our delta towers along the true trajectory
+			if (!CheckMotionMessageSequence(buf->msg.moveDelta.seq, buf->msg.moveDelta.whenToExecute))
 			{
-				const int32_t advance = (int32_t)(buf->msg.moveLinear.whenToExecute - StepTimer::GetTimerTicks());
-				if (advance < minAdvance)
-				{
-					minAdvance = advance;
-				}
-				if (advance > maxAdvance)
-				{
-					maxAdvance = advance;
-				}
+				break;
 			}
+			lastMoveEndedAt = buf->msg.moveDelta.whenToExecute + buf->msg.moveDelta.accelerationClocks + buf->msg.moveDelta.steadyClocks + buf->msg.moveDelta.decelClocks;
+			buf->msg.moveDelta.whenToExecute = ConvertMotionMessageStartTime(buf->msg.moveDelta.whenToExecute, buf->timeStamp);
+			PendingMoves.AddMessage(buf);
+			Platform::OnProcessingCanMessage();
+			return nullptr;
+# endif
 
-			//DEBUG
-			//accumulatedMotion +=buf->msg.moveLinear.perDrive[0].steps;
-			//END
+# if SUPPORT_MOVE_PWM
+		case CanMessageType::movementLinearPwm:
+			// A linear move that also carries a laser or spindle PWM level, which the Move task applies when the move starts and completes
+			if (!CheckMotionMessageSequence(buf->msg.moveLinearPwm.seq, buf->msg.moveLinearPwm.whenToExecute))
+			{
+				break;
+			}
+			lastMoveEndedAt = buf->msg.moveLinearPwm.whenToExecute + buf->msg.moveLinearPwm.accelerationClocks + buf->msg.moveLinearPwm.steadyClocks + buf->msg.moveLinearPwm.decelClocks;
+			buf->msg.moveLinearPwm.whenToExecute = ConvertMotionMessageStartTime(buf->msg.moveLinearPwm.whenToExecute, buf->timeStamp);
 			PendingMoves.AddMessage(buf);
 			Platform::OnProcessingCanMessage();
 			return nullptr;
+# endif
 
 		case CanMessageType::stopMovement:
 			moveInstance->StopDrivers(buf->msg.stopMovement.whichDrives);
@@ -461,6 +653,11 @@ void CanInterface::Diagnostics(const StringRef& reply) noexcept
 	reply.lcatf("CAN messages queued %u, send timeouts %u, received %u, lost %u, free buffers %u, min %u, error reg %" PRIx32,
 					messagesQueuedForSending, txTimeouts, messagesReceived, messagesLost, CanMessageBuffer::GetFreeBuffers(), CanMessageBuffer::GetAndClearMinFreeBuffers(), can0dev->GetErrorRegister());
 	txTimeouts = 0;
+	reply.lcatf("CAN tx urgent %u, normal %u, bulk %u, deferred normal %u, bulk %u",
+					txMessagesSent[(size_t)CanTxClass::urgent], txMessagesSent[(size_t)CanTxClass::normal], txMessagesSent[(size_t)CanTxClass::bulk],
+						txNormalDeferrals, txBulkDeferrals);
+	memset(txMessagesSent, 0, sizeof(txMessagesSent));
+	txNormalDeferrals = txBulkDeferrals = 0;
 	if (lastCancelledId != 0)
 	{
 		CanId id;
@@ -469,9 +666,9 @@ void CanInterface::Diagnostics(const StringRef& reply) noexcept
 		reply.lcatf("Last cancelled message type %u dest %u", (unsigned int)id.MsgType(), id.Dst());
 	}
 #if SUPPORT_DRIVERS
-	reply.lcatf("dup %u, oos %u/%u/%u/%u, bm %u, wbm %" PRIu32 ", rxMotionDelay %" PRIu32,
-					duplicateMotionMessages, oosMessages1Ahead, oosMessages2Ahead, oosMessages2Behind, oosMessagesOther, badMoveCommands, worstBadMove, maxMotionProcessingDelay);
-	duplicateMotionMessages = oosMessages1Ahead = oosMessages2Ahead = oosMessages2Behind = oosMessagesOther = badMoveCommands = 0;
+	reply.lcatf("dup %u, oos %u/%u/%u/%u, bm %u, wbm %" PRIu32 ", bb %u, rxMotionDelay %" PRIu32,
+					duplicateMotionMessages, oosMessages1Ahead, oosMessages2Ahead, oosMessages2Behind, oosMessagesOther, badMoveCommands, worstBadMove, badBatchMessages, maxMotionProcessingDelay);
+	duplicateMotionMessages = oosMessages1Ahead = oosMessages2Ahead = oosMessages2Behind = oosMessagesOther = badMoveCommands = badBatchMessages = 0;
 	worstBadMove = maxMotionProcessingDelay = 0;
 	if (minAdvance <= maxAdvance)
 	{
@@ -552,6 +749,13 @@ GCodeResult CanInterface::ChangeAddressAndDataRate(const CanMessageSetAddressAnd
 	return GCodeResult::error;
 }
 
+// Report and clear the statistics of the queues of received messages
+void CanInterface::QueueDiagnostics(const StringRef& reply) noexcept
+{
+	PendingMoves.Diagnostics(reply, "move");
+	PendingCommands.Diagnostics(reply, "command");
+}
+
 // Get a message, if there is one
 bool CanInterface::GetCanMessage(CanMessageBuffer *buf) noexcept
 {
@@ -606,6 +810,8 @@ extern "C" [[noreturn]] void CanReceiverLoop(void *) noexcept
 
 			if (can0dev->ReceiveMessage(CanDevice::RxBufferNumber::fifo0, TaskBase::TimeoutUnlimited, buf))
 			{
+				CanStats::RecordRxFifoLevel(CanHardware->RXF0S.bit.F0FL + 1);		// include the message we just fetched
+				CanStats::RecordReceived(buf->id.MsgType());
 				buf = CanInterface::ProcessReceivedMessage(buf);
 			}
 			else
@@ -626,6 +832,14 @@ extern "C" [[noreturn]] void CanAsyncSenderLoop(void *) noexcept
 
 	for (;;)
 	{
+#if SUPPORT_DRIVERS
+		// If any input monitors stopped some drivers, tell the main board where they stopped before we tell it that the inputs changed
+		while (InputMonitor::BuildStopReport(buf))
+		{
+			CanInterface::SendAsync(buf);
+		}
+#endif
+
 		// Set up a message ready
 		auto msg = buf->SetupStatusMessage<CanMessageInputChanged>(CanInterface::GetCanAddress(), currentMasterAddress);
 		msg->states = 0;
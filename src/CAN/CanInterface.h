@@ -16,20 +16,31 @@
 struct CanMessageMovement;
 class CanMessageBuffer;
 
+// Transmit priority classes. Urgent messages use a dedicated transmit buffer so that they never wait behind messages in the transmit FIFO.
+// Bulk messages give way to normal messages, and each of these classes is limited to a configurable share of the bus bandwidth.
+enum class CanTxClass : uint8_t
+{
+	urgent = 0,						// command replies and input monitor events
+	normal,							// status reports
+	bulk,							// accelerometer data and other uploads of recorded data
+	numClasses
+};
+
 namespace CanInterface
 {
 	void Init(CanAddress defaultBoardAddress, bool useAlternatePins, bool full) noexcept;
 	void Shutdown() noexcept;
 	void Diagnostics(const StringRef& reply) noexcept;
+	void QueueDiagnostics(const StringRef& reply) noexcept;
 
 	CanAddress GetCanAddress() noexcept;
 	CanAddress GetCurrentMasterAddress() noexcept;
 	GCodeResult ChangeAddressAndDataRate(const CanMessageSetAddressAndNormalTiming& msg, const StringRef& reply) noexcept;
 	bool GetCanMessage(CanMessageBuffer *buf) noexcept;
 	CanMessageBuffer *GetCanMove(uint32_t timeout) noexcept;
-	bool Send(CanMessageBuffer *buf) noexcept;
+	bool Send(CanMessageBuffer *buf, CanTxClass txClass = CanTxClass::normal) noexcept;
 	bool SendAsync(CanMessageBuffer *buf) noexcept;
-	bool SendAndFree(CanMessageBuffer *buf) noexcept;
+	bool SendAndFree(CanMessageBuffer *buf, CanTxClass txClass = CanTxClass::normal) noexcept;
 	CanMessageBuffer *GetCanCommand(uint32_t timeout) noexcept;
 
 #if !SAME70
@@ -6,6 +6,8 @@
  */
 
 #include "CanMessageQueue.h"
+#include <RepRapFirmware.h>
+#include <Movement/StepTimer.h>
 
 CanMessageQueue::CanMessageQueue() noexcept : pendingMessages(nullptr), taskWaitingToGet(nullptr) { }
 
@@ -65,4 +67,85 @@ CanMessageBuffer *CanMessageQueue::GetMessage(uint32_t timeout) noexcept
 	}
 }
 
+CanMessageRingQueue::CanMessageRingQueue() noexcept : putCount(0), getCount(0), taskWaitingToGet(nullptr), maxQueued(0), maxWaitTicks(0) { }
+
+void CanMessageRingQueue::AddMessage(CanMessageBuffer *buf) noexcept
+{
+	const uint32_t pc = putCount;
+	slots[pc % Capacity] = buf;
+	whenQueued[pc % Capacity] = StepTimer::GetTimerTicks();
+	if (pc + 1 - getCount > maxQueued)
+	{
+		maxQueued = pc + 1 - getCount;
+	}
+	__DMB();											// make sure the consumer can see the slot contents before it sees the new put count
+	putCount = pc + 1;
+	__DMB();											// make sure the new put count is visible before we check for a waiting task
+
+	TaskBase * const waitingTask = taskWaitingToGet;
+	if (waitingTask != nullptr)
+	{
+		taskWaitingToGet = nullptr;
+		waitingTask->Give();
+	}
+}
+
+// Fetch a message from the queue if there is one
+inline CanMessageBuffer *CanMessageRingQueue::TryGetMessage() noexcept
+{
+	const uint32_t gc = getCount;
+	if (gc == putCount)
+	{
+		return nullptr;
+	}
+
+	__DMB();											// don't read the slot until we have read the put count
+	CanMessageBuffer * const buf = slots[gc % Capacity];
+	const uint32_t waitTicks = StepTimer::GetTimerTicks() - whenQueued[gc % Capacity];
+	if (waitTicks > maxWaitTicks)
+	{
+		maxWaitTicks = waitTicks;
+	}
+	__DMB();											// finish reading the slot before we release it to the producer
+	getCount = gc + 1;
+	return buf;
+}
+
+// Fetch a message from the queue, optionally waiting if necessary
+CanMessageBuffer *CanMessageRingQueue::GetMessage(uint32_t timeout) noexcept
+{
+	while (true)
+	{
+		CanMessageBuffer * const buf = TryGetMessage();
+		if (buf != nullptr || timeout == 0)
+		{
+			return buf;
+		}
+
+		TaskBase::ClearNotifyCount();
+		taskWaitingToGet = TaskBase::GetCallerTaskHandle();
+		__DMB();
+
+		// A message may have been added after we looked but before the producer could see that we are waiting, so look again
+		if (getCount != putCount)
+		{
+			taskWaitingToGet = nullptr;
+			continue;
+		}
+
+		const bool notified = TaskBase::Take(timeout);
+		taskWaitingToGet = nullptr;
+		if (!notified)
+		{
+			return TryGetMessage();						// a message may have arrived just as we timed out
+		}
+	}
+}
+
+void CanMessageRingQueue::Diagnostics(const StringRef& reply, const char *queueName) noexcept
+{
+	reply.catf(", %s queue max %" PRIu32 " wait max %.2fms", queueName, maxQueued, (double)(maxWaitTicks * StepTimer::StepClocksToMillis));
+	maxQueued = maxWaitTicks = 0;
+}
+
 // End
@@ -10,6 +10,7 @@
 
 #include "CanMessageBuffer.h"
 #include <RTOSIface/RTOSIface.h>
+#include <General/StringRef.h>
 
 class CanMessageQueue
 {
@@ -24,4 +25,30 @@ private:
 	TaskBase * volatile taskWaitingToGet;
 };
 
+// Lock-free queue for use when there is exactly one producer task and one consumer task.
+// Neither side disables interrupts or suspends task switching, so using this queue doesn't delay the step interrupt.
+class CanMessageRingQueue
+{
+public:
+	static constexpr size_t Capacity = 64;				// must be a power of 2 and at least the total number of CAN buffers, so that the queue can never be full
+
+	CanMessageRingQueue() noexcept;
+	void AddMessage(CanMessageBuffer *buf) noexcept;	// must only be called by the producer task
+	CanMessageBuffer *GetMessage(uint32_t timeout) noexcept;	// must only be called by the consumer task
+	void Diagnostics(const StringRef& reply, const char *queueName) noexcept;	// report and clear the queue statistics
+
+private:
+	CanMessageBuffer *TryGetMessage() noexcept;
+
+	static_assert((Capacity & (Capacity - 1)) == 0);
+
+	CanMessageBuffer *slots[Capacity];
+	uint32_t whenQueued[Capacity];						// the step clock time at which each message was added
+	volatile uint32_t putCount;							// only written by the producer
+	volatile uint32_t getCount;							// only written by the consumer
+	TaskBase * volatile taskWaitingToGet;
+	uint32_t maxQueued;									// only written by the producer, except when cleared
+	uint32_t maxWaitTicks;								// only written by the consumer, except when cleared
+};
+
 #endif /* SRC_CAN_CANMESSAGEQUEUE_H_ */
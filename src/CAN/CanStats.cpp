@@ -0,0 +1,197 @@
+/*
+ * CanStats.cpp
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ */
+
+#include "CanStats.h"
+#include "CanInterface.h"
+#include <Movement/StepTimer.h>
+#include <RTOSIface/RTOSIface.h>
+
+// There are too many message types to keep counts for all of them, so we keep them for the first ones we see after their slots were last cleared
+constexpr size_t NumTypeSlots = 24;
+
+// The most message types that we report at a time, so that the report fits in the reply. We report the busiest types first.
+constexpr size_t MaxTypesReported = 5;
+
+struct TypeStats
+{
+	uint16_t type;
+	uint16_t inUse;
+	uint32_t received;
+	uint32_t sent;
+	uint32_t cancelled;									// messages we gave up trying to send
+	uint32_t handled;									// messages processed by the command processor
+	uint32_t totalHandlerTicks;
+	uint32_t maxHandlerTicks;
+
+	uint32_t Activity() const noexcept { return received + sent + handled; }
+};
+
+// Several tasks record statistics, so we update them with interrupts disabled. Each update is only a few instructions.
+static TypeStats typeStats[NumTypeSlots];
+static uint32_t otherTypeMessages = 0;					// messages whose type we had no slot for
+static unsigned int maxRxFifoLevel = 0;
+
+// Find the slot for this message type, allocating one if necessary. Return nullptr if we don't have a slot for it.
+// Call this with interrupts disabled. We look for a slot that already has this type before we allocate one, because slots may be freed in any order.
+static TypeStats *GetSlot(CanMessageType type) noexcept
+{
+	TypeStats *freeSlot = nullptr;
+	for (TypeStats& ts : typeStats)
+	{
+		if (!ts.inUse)
+		{
+			if (freeSlot == nullptr)
+			{
+				freeSlot = &ts;
+			}
+		}
+		else if (ts.type == (uint16_t)type)
+		{
+			return &ts;
+		}
+	}
+
+	if (freeSlot != nullptr)
+	{
+		freeSlot->type = (uint16_t)type;
+		freeSlot->inUse = true;
+		return freeSlot;
+	}
+	++otherTypeMessages;
+	return nullptr;
+}
+
+void CanStats::RecordReceived(CanMessageType type) noexcept
+{
+	AtomicCriticalSectionLocker lock;
+	TypeStats * const ts = GetSlot(type);
+	if (ts != nullptr)
+	{
+		++ts->received;
+	}
+}
+
+void CanStats::RecordSent(CanMessageType type) noexcept
+{
+	AtomicCriticalSectionLocker lock;
+	TypeStats * const ts = GetSlot(type);
+	if (ts != nullptr)
+	{
+		++ts->sent;
+	}
+}
+
+void CanStats::RecordCancelled(CanMessageType type) noexcept
+{
+	AtomicCriticalSectionLocker lock;
+	TypeStats * const ts = GetSlot(type);
+	if (ts != nullptr)
+	{
+		++ts->cancelled;
+	}
+}
+
+void CanStats::RecordHandled(CanMessageType type, uint32_t handlerTicks) noexcept
+{
+	AtomicCriticalSectionLocker lock;
+	TypeStats * const ts = GetSlot(type);
+	if (ts != nullptr)
+	{
+		++ts->handled;
+		ts->totalHandlerTicks += handlerTicks;
+		if (handlerTicks > ts->maxHandlerTicks)
+		{
+			ts->maxHandlerTicks = handlerTicks;
+		}
+	}
+}
+
+void CanStats::RecordRxFifoLevel(unsigned int level) noexcept
+{
+	AtomicCriticalSectionLocker lock;
+	if (level > maxRxFifoLevel)
+	{
+		maxRxFifoLevel = level;
+	}
+}
+
+// Report the statistics of the busiest message types and clear only those, so that the report fits in the reply. We report the other types next time.
+void CanStats::Diagnostics(const StringRef& reply) noexcept
+{
+	// Choose the busiest types, busiest first. We don't need to disable interrupts for this, because it doesn't matter if the counts change while we look at them.
+	size_t chosen[MaxTypesReported];
+	size_t numChosen = 0;
+	unsigned int numInUse = 0;
+	for (size_t i = 0; i < NumTypeSlots; ++i)
+	{
+		if (typeStats[i].inUse)
+		{
+			++numInUse;
+			const uint32_t activity = typeStats[i].Activity();
+			if (numChosen == MaxTypesReported)
+			{
+				if (activity <= typeStats[chosen[numChosen - 1]].Activity())
+				{
+					continue;
+				}
+				--numChosen;							// drop the least busy type that we have chosen so far
+			}
+			size_t j = numChosen++;
+			while (j != 0 && typeStats[chosen[j - 1]].Activity() < activity)
+			{
+				chosen[j] = chosen[j - 1];
+				--j;
+			}
+			chosen[j] = i;
+		}
+	}
+
+	// Take copies of the statistics we are going to report and free their slots. Only this function frees slots, so the chosen slots are still in use.
+	TypeStats reported[MaxTypesReported];
+	uint32_t locOtherTypeMessages;
+	unsigned int locMaxRxFifoLevel;
+	{
+		AtomicCriticalSectionLocker lock;
+		for (size_t i = 0; i < numChosen; ++i)
+		{
+			reported[i] = typeStats[chosen[i]];
+			memset(&typeStats[chosen[i]], 0, sizeof(TypeStats));
+		}
+		locOtherTypeMessages = otherTypeMessages;
+		locMaxRxFifoLevel = maxRxFifoLevel;
+		otherTypeMessages = 0;
+		maxRxFifoLevel = 0;
+	}
+
+	reply.lcatf("CAN msgs by type (type:rx/tx/cancelled):");
+	for (size_t i = 0; i < numChosen; ++i)
+	{
+		const TypeStats& ts = reported[i];
+		reply.catf(" %u:%" PRIu32 "/%" PRIu32 "/%" PRIu32, ts.type, ts.received, ts.sent, ts.cancelled);
+	}
+	reply.catf(", other %" PRIu32, locOtherTypeMessages);
+	if (numInUse > numChosen)
+	{
+		reply.catf(", %u more types next time", numInUse - numChosen);
+	}
+
+	reply.lcatf("CAN handlers (type:count/avg/max us):");
+	for (size_t i = 0; i < numChosen; ++i)
+	{
+		const TypeStats& ts = reported[i];
+		if (ts.handled != 0)
+		{
+			reply.catf(" %u:%" PRIu32 "/%.0f/%.0f", ts.type, ts.handled,
+						(double)(StepTimer::TicksToFloatMicroseconds(ts.totalHandlerTicks)/ts.handled), (double)StepTimer::TicksToFloatMicroseconds(ts.maxHandlerTicks));
+		}
+	}
+
+	reply.lcatf("CAN rx fifo max %u", locMaxRxFifoLevel);
+	CanInterface::QueueDiagnostics(reply);
+}
+
+// End
@@ -0,0 +1,26 @@
+/*
+ * CanStats.h
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ *
+ *  Per message type CAN traffic and command handler statistics. M122 reports and clears those of the busiest types.
+ */
+
+#ifndef SRC_CAN_CANSTATS_H_
+#define SRC_CAN_CANSTATS_H_
+
+#include <RepRapFirmware.h>
+#include <CanId.h>
+
+namespace CanStats
+{
+	void RecordReceived(CanMessageType type) noexcept;
+	void RecordSent(CanMessageType type) noexcept;
+	void RecordCancelled(CanMessageType type) noexcept;
+	void RecordHandled(CanMessageType type, uint32_t handlerTicks) noexcept;
+	void RecordRxFifoLevel(unsigned int level) noexcept;
+	void Diagnostics(const StringRef& reply) noexcept;
+}
+
+#endif /* SRC_CAN_CANSTATS_H_ */
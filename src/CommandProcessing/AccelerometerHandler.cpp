@@ -141,7 +141,7 @@ static bool axisInverted[3];
 							msg.zero = 0;
 
 							buf.dataLength = msg.GetActualDataLength();
-							CanInterface::Send(&buf);
+							CanInterface::Send(&buf, CanTxClass::bulk);
 
 							samplesSent += samplesInBuffer;
 							samplesInBuffer = 0;
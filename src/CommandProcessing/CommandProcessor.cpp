@@ -7,6 +7,8 @@
 
 #include "CommandProcessor.h"
 #include <CAN/CanInterface.h>
+#include <CAN/CanStats.h>
+#include <Movement/StepTimer.h>
 #include "CanMessageBuffer.h"
 #include "GCodes/GCodeResult.h"
 #include "Heating/Heat.h"
@@ -34,12 +36,22 @@
 # if SUPPORT_CLOSED_LOOP
 #  include <ClosedLoop/ClosedLoop.h>
 # endif
+# if SUPPORT_INPUT_SHAPING
+#  include <Movement/InputShaper.h>
+# endif
+# if SUPPORT_STEP_TRACE
+#  include <Movement/StepTrace.h>
+# endif
 #endif
 
 #if SUPPORT_I2C_SENSORS && SUPPORT_LIS3DH
 # include "AccelerometerHandler.h"
 #endif
 
+#if SUPPORT_TIMED_OUTPUTS
+# include <GPIO/TimedOutputs.h>
+#endif
+
 #if HAS_VOLTAGE_MONITOR
 constexpr float MinVin = 11.0;
 constexpr float MaxVin = 32.0;
@@ -249,6 +261,40 @@ static GCodeResult HandlePressureAdvance(const CanMessageMultipleDrivesRequest<f
 	return rslt;
 }
 
+// Handle a request to set smoothed and/or nonlinear pressure advance. Each value holds the advance time and smoothing window in seconds,
+// and the increase in advance time in seconds per mm/sec of extruder speed.
+static GCodeResult HandlePressureAdvance(const CanMessageMultipleDrivesRequest<PressureAdvanceParams>& msg, size_t dataLength, const StringRef& reply)
+{
+	const auto drivers = Bitmap<uint16_t>::MakeFromRaw(msg.driversToUpdate);
+	if (dataLength < msg.GetActualDataLength(drivers.CountSetBits()))
+	{
+		reply.copy("bad data length");
+		return GCodeResult::error;
+	}
+
+	GCodeResult rslt = GCodeResult::ok;
+	drivers.Iterate([&msg, &reply, &rslt](unsigned int driver, unsigned int count) -> void
+						{
+							const PressureAdvanceParams& params = msg.values[count];
+							if (driver >= NumDrivers)
+							{
+								reply.lcatf("No such driver %u.%u", CanInterface::GetCanAddress(), driver);
+								rslt = GCodeResult::error;
+							}
+							else if (params.advance < 0.0 || params.smoothingTime < 0.0 || params.nonlinear < 0.0)
+							{
+								reply.lcatf("Negative pressure advance parameter for driver %u.%u", CanInterface::GetCanAddress(), driver);
+								rslt = GCodeResult::error;
+							}
+							else
+							{
+								Platform::SetPressureAdvance(driver, params.advance, params.smoothingTime, params.nonlinear);
+							}
+						}
+				   );
+	return rslt;
+}
+
 static GCodeResult SetStepsPerMmAndMicrostepping(const CanMessageMultipleDrivesRequest<StepsPerUnitAndMicrostepping>& msg, size_t dataLength, const StringRef& reply)
 {
 	const auto drivers = Bitmap<uint16_t>::MakeFromRaw(msg.driversToUpdate);
@@ -632,7 +678,12 @@ static GCodeResult InitiateReset(const CanMessageReset& msg, const StringRef& re
 
 static GCodeResult GetInfo(const CanMessageReturnInfo& msg, const StringRef& reply, uint8_t& extra)
 {
-	static constexpr uint8_t LastDiagnosticsPart = 7;				// the last diagnostics part is typeDiagnosticsPart0 + 7
+	static constexpr uint8_t FirstHistogramPart = 8;				// the timing histograms are reported one per part starting at typeDiagnosticsPart0 + 8
+	static constexpr uint8_t NumHistogramParts = 4;
+	static constexpr uint8_t CanStatsPart = FirstHistogramPart + NumHistogramParts;
+	static constexpr uint8_t MoveQueuePart = CanStatsPart + 1;
+	static constexpr uint8_t StepGenerationPart = MoveQueuePart + 1;
+	static constexpr uint8_t LastDiagnosticsPart = StepGenerationPart;	// the last diagnostics part is typeDiagnosticsPart0 + 14
 
 	switch (msg.type)
 	{
@@ -745,9 +796,7 @@ static GCodeResult GetInfo(const CanMessageReturnInfo& msg, const StringRef& rep
 	case CanMessageReturnInfo::typeDiagnosticsPart0 + 5:
 		extra = LastDiagnosticsPart;
 		{
-#if SUPPORT_DRIVERS
-			moveInstance->Diagnostics(reply);
-#endif
+			// The move queue and step generation statistics have their own parts, because with them this part would overflow the reply
 			StepTimer::Diagnostics(reply);
 
 #if HAS_VOLTAGE_MONITOR && HAS_12V_MONITOR
@@ -799,8 +848,46 @@ static GCodeResult GetInfo(const CanMessageReturnInfo& msg, const StringRef& rep
 		Platform::GetSharedI2C().Diagnostics(reply);
 #endif
 
+#if SUPPORT_STEP_TRACE
+		StepTrace::Diagnostics(reply);
+#endif
+
+#if SUPPORT_TIMED_OUTPUTS
+		TimedOutputs::Diagnostics(reply);
+#endif
+
 #if SUPPORT_DRIVERS
 		FilamentMonitor::GetDiagnostics(reply);
+#endif
+		break;
+
+	case CanMessageReturnInfo::typeDiagnosticsPart0 + FirstHistogramPart:
+	case CanMessageReturnInfo::typeDiagnosticsPart0 + FirstHistogramPart + 1:
+	case CanMessageReturnInfo::typeDiagnosticsPart0 + FirstHistogramPart + 2:
+	case CanMessageReturnInfo::typeDiagnosticsPart0 + FirstHistogramPart + 3:
+		extra = LastDiagnosticsPart;
+#if SUPPORT_DRIVERS
+		static_assert(Move::NumHistograms == NumHistogramParts);
+		moveInstance->HistogramDiagnostics(reply, msg.type - (CanMessageReturnInfo::typeDiagnosticsPart0 + FirstHistogramPart), msg.param == 1);	// param 1 means clear the histogram after reporting it
+#endif
+		break;
+
+	case CanMessageReturnInfo::typeDiagnosticsPart0 + CanStatsPart:
+		extra = LastDiagnosticsPart;
+		CanStats::Diagnostics(reply);
+		break;
+
+	case CanMessageReturnInfo::typeDiagnosticsPart0 + MoveQueuePart:
+		extra = LastDiagnosticsPart;
+#if SUPPORT_DRIVERS
+		moveInstance->Diagnostics(reply);
+#endif
+		break;
+
+	case CanMessageReturnInfo::typeDiagnosticsPart0 + StepGenerationPart:
+		extra = LastDiagnosticsPart;
+#if SUPPORT_DRIVERS
+		moveInstance->StepDiagnostics(reply);
 #endif
 		break;
 	}
@@ -819,6 +906,7 @@ void CommandProcessor::Spin()
 		GCodeResult rslt;
 		CanRequestId requestId;
 		uint8_t extra = 0;
+		const uint32_t startTicks = StepTimer::GetTimerTicks();
 
 		switch (id)
 		{
@@ -874,7 +962,7 @@ void CommandProcessor::Spin()
 
 		case CanMessageType::writeGpio:
 			requestId = buf->msg.writeGpio.requestId;
-			rslt = GpioPorts::HandleGpioWrite(buf->msg.writeGpio, replyRef);
+			rslt = GpioPorts::HandleGpioWrite(buf->msg.writeGpio, buf->dataLength, replyRef);
 			break;
 
 #if SUPPORT_DRIVERS
@@ -921,6 +1009,25 @@ void CommandProcessor::Spin()
 			requestId = buf->msg.multipleDrivesRequestFloat.requestId;
 			rslt = HandlePressureAdvance(buf->msg.multipleDrivesRequestFloat, buf->dataLength, replyRef);
 			break;
+
+		case CanMessageType::setPressureAdvanceSmoothed:
+			requestId = buf->msg.multipleDrivesPressureAdvance.requestId;
+			rslt = HandlePressureAdvance(buf->msg.multipleDrivesPressureAdvance, buf->dataLength, replyRef);
+			break;
+
+# if SUPPORT_INPUT_SHAPING
+		case CanMessageType::setInputShaping:
+			requestId = buf->msg.generic.requestId;
+			rslt = InputShaper::Configure(buf->msg.generic, replyRef);
+			break;
+# endif
+
+# if SUPPORT_DELTA_MOVEMENT
+		case CanMessageType::setDeltaTower:
+			requestId = buf->msg.generic.requestId;
+			rslt = moveInstance->ConfigureDeltaTower(buf->msg.generic, replyRef);
+			break;
+# endif
 #endif
 
 		case CanMessageType::updateFirmware:
@@ -940,7 +1047,7 @@ void CommandProcessor::Spin()
 
 		case CanMessageType::setFanSpeed:
 			requestId = buf->msg.setFanSpeed.requestId;
-			rslt = FansManager::SetFanSpeed(buf->msg.setFanSpeed, replyRef);
+			rslt = FansManager::SetFanSpeed(buf->msg.setFanSpeed, buf->dataLength, replyRef);
 			break;
 
 		case CanMessageType::setHeaterFaultDetection:
@@ -953,6 +1060,11 @@ void CommandProcessor::Spin()
 			rslt = Heat::SetHeaterMonitors(buf->msg.setHeaterMonitors, replyRef);
 			break;
 
+		case CanMessageType::configureStatusReports:
+			requestId = buf->msg.generic.requestId;
+			rslt = Heat::ConfigureStatusReports(buf->msg.generic, replyRef);
+			break;
+
 		case CanMessageType::createInputMonitor:
 			requestId = buf->msg.createInputMonitor.requestId;
 			rslt = InputMonitor::Create(buf->msg.createInputMonitor, buf->dataLength, replyRef, extra);
@@ -966,7 +1078,7 @@ void CommandProcessor::Spin()
 		case CanMessageType::readInputsRequest:
 			// This one has its own reply message type
 			InputMonitor::ReadInputs(buf);
-			CanInterface::SendAndFree(buf);
+			CanInterface::SendAndFree(buf, CanTxClass::urgent);
 			return;
 
 		case CanMessageType::setAddressAndNormalTiming:
@@ -1014,6 +1126,20 @@ void CommandProcessor::Spin()
 			rslt = AccelerometerHandler::ProcessStartRequest(buf->msg.startAccelerometer, replyRef);
 			break;
 #endif
+
+#if SUPPORT_MOVE_PROFILE
+		case CanMessageType::moveProfileRequest:
+			requestId = buf->msg.moveProfileRequest.requestId;
+			rslt = moveInstance->ProcessMoveProfileRequest(buf->msg.moveProfileRequest, replyRef);
+			break;
+#endif
+
+#if SUPPORT_STEP_TRACE
+		case CanMessageType::startStepTrace:
+			requestId = buf->msg.startStepTrace.requestId;
+			rslt = StepTrace::ProcessStartRequest(buf->msg.startStepTrace, replyRef);
+			break;
+#endif
 		default:
 			requestId = CanRequestIdAcceptAlways;
 			reply.printf("Board %u received unknown msg type %u", CanInterface::GetCanAddress(), (unsigned int)buf->id.MsgType());
@@ -1021,6 +1147,8 @@ void CommandProcessor::Spin()
 			break;
 		}
 
+		CanStats::RecordHandled(id, StepTimer::GetTimerTicks() - startTicks);
+
 		if (requestId == CanRequestIdNoReplyNeeded)
 		{
 			CanMessageBuffer::Free(buf);					// no reply wanted so discard the response and free the buffer
@@ -1045,11 +1173,11 @@ void CommandProcessor::Spin()
 				if (lengthDone == totalLength)
 				{
 					msg->moreFollows = false;
-					CanInterface::SendAndFree(buf);
+					CanInterface::SendAndFree(buf, CanTxClass::urgent);
 					break;
 				}
 				msg->moreFollows = true;
-				CanInterface::Send(buf);
+				CanInterface::Send(buf, CanTxClass::urgent);
 				++fragmentNumber;
 			}
 		}
@@ -51,6 +51,62 @@
 # define SUPPORT_CLOSED_LOOP			0
 #endif
 
+#ifndef SUPPORT_STEP_SEGMENTS
+# define SUPPORT_STEP_SEGMENTS			0
+#endif
+
+#ifndef USE_BITMAP_STEP_SCHEDULER
+# define USE_BITMAP_STEP_SCHEDULER		0
+#endif
+
+#ifndef SUPPORT_INPUT_SHAPING
+# define SUPPORT_INPUT_SHAPING			0
+#endif
+
+#ifndef SUPPORT_STEP_TRACE
+# define SUPPORT_STEP_TRACE				0
+#endif
+
+#if SUPPORT_STEP_TRACE && !defined(STEP_TRACE_BUFFER_LENGTH)
+# define STEP_TRACE_BUFFER_LENGTH		1024	// how many step trace samples we can buffer before they are uploaded
+#endif
+
+#ifndef SUPPORT_MOVE_PROFILE
+# define SUPPORT_MOVE_PROFILE			0
+#endif
+
+#if SUPPORT_MOVE_PROFILE && !defined(MOVE_PROFILE_LENGTH)
+# define MOVE_PROFILE_LENGTH			256		// how many executed moves we keep the timing profile of
+#endif
+
+#ifndef SUPPORT_TIMED_OUTPUTS
+# define SUPPORT_TIMED_OUTPUTS			0
+#endif
+
+#ifndef SUPPORT_MOVE_PWM
+# define SUPPORT_MOVE_PWM				0
+#endif
+
+#ifndef CAN_TX_NORMAL_SHARE
+# define CAN_TX_NORMAL_SHARE			100		// percentage of the CAN bus bandwidth that normal priority messages may use
+#endif
+
+#ifndef CAN_TX_BULK_SHARE
+# define CAN_TX_BULK_SHARE				50		// percentage of the CAN bus bandwidth that bulk data such as accelerometer samples may use
+#endif
+
+#ifndef DDA_RING_LENGTH
+# define DDA_RING_LENGTH				50		// how many moves we can queue
+#endif
+
+#ifndef NUM_DMS
+# define NUM_DMS						(DDA_RING_LENGTH * NumDrivers)	// how many DriveMovement objects we allocate for the queued moves to share
+#endif
+
+#ifndef NUM_SHAPED_PROFILES
+# define NUM_SHAPED_PROFILES			DDA_RING_LENGTH			// how many shaped motion profiles we allocate for the queued moves to share
+#endif
+
 #if !SUPPORT_DRIVERS
 # define HAS_SMART_DRIVERS				0
 # define SUPPORT_TMC22xx				0
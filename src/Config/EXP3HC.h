@@ -28,6 +28,16 @@
 #define SUPPORT_SLOW_DRIVERS	0
 #define SUPPORT_DELTA_MOVEMENT	1
 #define USE_EVEN_STEPS			0
+#define SUPPORT_STEP_SEGMENTS	1		// precompute the step intervals for fast moves in the Move task
+#define USE_BITMAP_STEP_SCHEDULER	1	// find the drivers due for stepping by scanning them instead of keeping them in a sorted list
+#define SUPPORT_INPUT_SHAPING	1		// shape the acceleration and deceleration of moves to reduce ringing
+#define SUPPORT_STEP_TRACE		1		// record the steps we generate so that they can be uploaded to the main board
+#define SUPPORT_MOVE_PROFILE	1		// record the start and finish lateness of each move so that they can be uploaded to the main board
+#define SUPPORT_TIMED_OUTPUTS	1		// make GPIO and fan changes at the master time requested by the main board
+#define SUPPORT_MOVE_PWM		1		// set or ramp a laser or spindle PWM port in step with the moves that carry a PWM level
+#define DDA_RING_LENGTH			60		// how many moves we can queue
+#define NUM_DMS					180		// enough for every move in the ring to use all three drivers
+#define NUM_SHAPED_PROFILES		20		// only moves with acceleration or deceleration phases longer than the shaper are shaped, and they are long moves
 
 #define ACTIVE_HIGH_STEP		1		// 1 = active high, 0 = active low
 #define ACTIVE_HIGH_DIR			1		// 1 = active high, 0 = active low
@@ -12,6 +12,10 @@
 #include "CanMessageGenericParser.h"
 #include "CAN/CanInterface.h"
 
+#if SUPPORT_TIMED_OUTPUTS
+# include <GPIO/TimedOutputs.h>
+#endif
+
 #include <utility>
 
 static ReadWriteLock fansLock;
@@ -121,7 +125,8 @@ GCodeResult FansManager::ConfigureFan(const CanMessageFanParameters& msg, const
 	return fan->Configure(msg, reply);
 }
 
-GCodeResult FansManager::SetFanSpeed(const CanMessageSetFanSpeed& msg, const StringRef& reply)
+// Set the speed of a fan. Messages from older main boards don't include the execution time, in which case we set the speed immediately.
+GCodeResult FansManager::SetFanSpeed(const CanMessageSetFanSpeed& msg, size_t dataLength, const StringRef& reply)
 {
 	auto fan = FindFan(msg.fanNumber);
 	if (fan.IsNull())
@@ -130,12 +135,18 @@ GCodeResult FansManager::SetFanSpeed(const CanMessageSetFanSpeed& msg, const Str
 		return GCodeResult::error;
 	}
 
+#if SUPPORT_TIMED_OUTPUTS
+	if (dataLength >= offsetof(CanMessageSetFanSpeed, whenToExecute) + sizeof(msg.whenToExecute) && msg.whenToExecute != 0)
+	{
+		return TimedOutputs::Schedule(TimedOutputs::OutputType::fan, msg.fanNumber, msg.pwm, msg.whenToExecute, reply);
+	}
+#endif
+
 	fan->SetPwm(msg.pwm);
 	return GCodeResult::ok;
 }
 
-#if 0
-
+// Set the speed of a fan if it still exists. Used to make timed fan speed changes.
 void FansManager::SetFanValue(uint32_t fanNum, float speed)
 {
 	auto fan = FindFan(fanNum);
@@ -145,8 +156,6 @@ void FansManager::SetFanValue(uint32_t fanNum, float speed)
 	}
 }
 
-#endif
-
 // Initialise fans. Call this only once, and only during initialisation.
 void FansManager::Init()
 {
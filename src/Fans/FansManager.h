@@ -24,11 +24,9 @@ namespace FansManager
 	bool CheckFans(bool checkSensors);
 	GCodeResult ConfigureFanPort(const CanMessageGeneric& msg, const StringRef& reply);
 	GCodeResult ConfigureFan(const CanMessageFanParameters& gb, const StringRef& reply);
-	GCodeResult SetFanSpeed(const CanMessageSetFanSpeed& msg, const StringRef& reply);
+	GCodeResult SetFanSpeed(const CanMessageSetFanSpeed& msg, size_t dataLength, const StringRef& reply);
 	unsigned int PopulateFansReport(CanMessageFansReport& msg);
-#if 0
 	void SetFanValue(uint32_t fanNum, float speed);
-#endif
 };
 
 #endif /* SRC_FANS_FANSMANAGER_H_ */
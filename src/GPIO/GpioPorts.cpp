@@ -9,6 +9,15 @@
 #include <CAN/CanInterface.h>
 #include <CanMessageGenericParser.h>
 
+#if SUPPORT_TIMED_OUTPUTS
+# include "TimedOutputs.h"
+#endif
+
+#if SUPPORT_MOVE_PWM
+# include <RTOSIface/RTOSIface.h>
+# include <TaskPriorities.h>
+#endif
+
 static PwmPort ports[MaxGpOutPorts];
 
 GCodeResult GpioPorts::HandleM950Gpio(const CanMessageGeneric &msg, const StringRef &reply)
@@ -74,7 +83,8 @@ GCodeResult GpioPorts::HandleM950Gpio(const CanMessageGeneric &msg, const String
 	}
 }
 
-GCodeResult GpioPorts::HandleGpioWrite(const CanMessageWriteGpio &msg, const StringRef &reply)
+// Write a GPIO port. Messages from older main boards don't include the execution time, in which case we write the port immediately.
+GCodeResult GpioPorts::HandleGpioWrite(const CanMessageWriteGpio &msg, size_t dataLength, const StringRef &reply)
 {
 	if (msg.portNumber >= MaxGpOutPorts)
 	{
@@ -82,8 +92,89 @@ GCodeResult GpioPorts::HandleGpioWrite(const CanMessageWriteGpio &msg, const Str
 		return GCodeResult::error;
 	}
 
+#if SUPPORT_TIMED_OUTPUTS
+	if (dataLength >= offsetof(CanMessageWriteGpio, whenToExecute) + sizeof(msg.whenToExecute) && msg.whenToExecute != 0)
+	{
+		return TimedOutputs::Schedule(TimedOutputs::OutputType::gpio, msg.portNumber, msg.pwm, msg.whenToExecute, reply);
+	}
+#endif
+
 	ports[msg.portNumber].WriteAnalog(msg.pwm);
 	return GCodeResult::ok;
 }
 
+// Write a GPIO port that has already been validated
+void GpioPorts::WriteOutput(uint16_t portNumber, float pwm)
+{
+	ports[portNumber].WriteAnalog(pwm);
+}
+
+#if SUPPORT_MOVE_PWM
+
+// The step ISR can't write a port itself, because PwmPort::WriteAnalog isn't safe to call from an ISR or with interrupts disabled.
+// So it stores the value it wants and wakes a task to write it, in the same way that timed outputs are written.
+constexpr size_t IsrWritesTaskStackWords = 100;
+
+static Task<IsrWritesTaskStackWords> *isrWritesTask = nullptr;
+static float isrPwm[MaxGpOutPorts];						// the latest value that the ISR asked for on each port
+static volatile uint32_t isrPortsPending = 0;			// which ports have a value waiting to be written
+
+static_assert(MaxGpOutPorts <= 32, "isrPortsPending is too small");
+
+[[noreturn]] static void IsrWritesTaskCode(void*) noexcept
+{
+	for (;;)
+	{
+		TaskBase::Take();
+		for (;;)
+		{
+			unsigned int portNumber;
+			float pwm;
+			{
+				AtomicCriticalSectionLocker lock;
+				const uint32_t pending = isrPortsPending;
+				if (pending == 0)
+				{
+					break;
+				}
+				portNumber = __builtin_ctz(pending);
+				isrPortsPending = pending & ~(1u << portNumber);
+				pwm = isrPwm[portNumber];
+			}
+			ports[portNumber].WriteAnalog(pwm);
+		}
+	}
+}
+
+// Create the task that makes the writes that the step ISR asks for. Must be called from a task before a move that writes a port is queued.
+// We create it when it is first needed so that we don't use the RAM for its stack unless moves carry a PWM.
+void GpioPorts::StartIsrWrites() noexcept
+{
+	if (isrWritesTask == nullptr)
+	{
+		isrWritesTask = new Task<IsrWritesTaskStackWords>;
+		isrWritesTask->Create(IsrWritesTaskCode, "GPIOISR", nullptr, TaskPriority::GpioIsrWrites);
+	}
+}
+
+// Ask for a GPIO port that has already been validated to be written as soon as possible.
+// Called from the step ISR, or from a task with interrupts disabled. If it is called again for the same port before the write is made then only the latest value is written.
+void GpioPorts::WriteOutputFromIsr(uint16_t portNumber, float pwm) noexcept
+{
+	isrPwm[portNumber] = pwm;
+	isrPortsPending |= 1u << portNumber;
+	if (isrWritesTask != nullptr)
+	{
+		isrWritesTask->GiveFromISR();
+	}
+}
+
+// Discard any writes that the step ISR asked for but that haven't been made yet. Called after the step interrupt has been disabled.
+void GpioPorts::CancelIsrWrites() noexcept
+{
+	isrPortsPending = 0;
+}
+
+#endif
+
 // End
@@ -16,7 +16,13 @@
 namespace GpioPorts
 {
 	GCodeResult HandleM950Gpio(const CanMessageGeneric& msg, const StringRef& reply);
-	GCodeResult HandleGpioWrite(const CanMessageWriteGpio& msg, const StringRef& reply);
+	GCodeResult HandleGpioWrite(const CanMessageWriteGpio& msg, size_t dataLength, const StringRef& reply);
+	void WriteOutput(uint16_t portNumber, float pwm);
+#if SUPPORT_MOVE_PWM
+	void StartIsrWrites() noexcept;
+	void WriteOutputFromIsr(uint16_t portNumber, float pwm) noexcept;
+	void CancelIsrWrites() noexcept;
+#endif
 }
 
 #endif /* SRC_GPIO_GPODEVICE_H_ */
@@ -0,0 +1,163 @@
+/*
+ * TimedOutputs.cpp
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ */
+
+#include "TimedOutputs.h"
+
+#if SUPPORT_TIMED_OUTPUTS
+
+#include "GpioPorts.h"
+#include <Fans/FansManager.h>
+#include <Movement/StepTimer.h>
+#include <CAN/CanInterface.h>
+#include <RTOSIface/RTOSIface.h>
+#include <TaskPriorities.h>
+
+constexpr size_t TimedOutputsTaskStackWords = 120;
+constexpr size_t MaxPendingOutputs = 16;
+constexpr uint32_t MaxScheduleAhead = StepTimer::StepClockRate * 60;		// we don't accept changes scheduled more than a minute ahead, because they are probably the result of a clock sync problem
+
+static Task<TimedOutputsTaskStackWords> *timedOutputsTask = nullptr;
+
+// A change to an output that is waiting to be made
+struct PendingOutput
+{
+	uint32_t whenDue;																// local step clock time
+	float pwm;
+	uint16_t number;
+	TimedOutputs::OutputType type;
+};
+
+// The pending changes, soonest first. Only accessed by tasks, inside a task critical section.
+static PendingOutput pendingOutputs[MaxPendingOutputs];
+static size_t numPending = 0;
+
+static StepTimer timer;
+static uint32_t numScheduled = 0, numLate = 0, maxLatenessTicks = 0;
+
+// Timer callback, called from the step ISR
+static void TimerCallback(CallbackParameter) noexcept
+{
+	timedOutputsTask->GiveFromISR();
+}
+
+// Make a change to an output
+static void Apply(const PendingOutput& po) noexcept
+{
+	switch (po.type)
+	{
+	case TimedOutputs::OutputType::gpio:
+		GpioPorts::WriteOutput(po.number, po.pwm);
+		break;
+
+	case TimedOutputs::OutputType::fan:
+		FansManager::SetFanValue(po.number, po.pwm);
+		break;
+	}
+}
+
+// Task that makes the changes when they are due. It is woken by the timer callback.
+[[noreturn]] static void TimedOutputsTaskCode(void*) noexcept
+{
+	for (;;)
+	{
+		TaskBase::Take();
+		for (;;)
+		{
+			PendingOutput po;
+			{
+				TaskCriticalSectionLocker lock;
+				if (numPending == 0)
+				{
+					break;
+				}
+
+				const int32_t timeToWait = (int32_t)(pendingOutputs[0].whenDue - StepTimer::GetTimerTicks());
+				if (timeToWait > 0 && !timer.ScheduleCallback(pendingOutputs[0].whenDue))
+				{
+					break;															// the next change isn't due yet and we have scheduled a callback when it is
+				}
+
+				po = pendingOutputs[0];
+				--numPending;
+				memmove(pendingOutputs, pendingOutputs + 1, numPending * sizeof(PendingOutput));
+			}
+
+			Apply(po);
+			const uint32_t lateness = StepTimer::GetTimerTicks() - po.whenDue;
+			if (lateness > maxLatenessTicks && lateness < MaxScheduleAhead)
+			{
+				maxLatenessTicks = lateness;
+			}
+		}
+	}
+}
+
+// Schedule a change to a GPIO port or fan at the specified master time. If the time has already passed then we make the change immediately.
+GCodeResult TimedOutputs::Schedule(OutputType type, uint16_t number, float pwm, uint32_t whenToExecute, const StringRef& reply) noexcept
+{
+	PendingOutput po;
+	po.whenDue = StepTimer::ConvertToLocalTime(whenToExecute);
+	po.pwm = pwm;
+	po.number = number;
+	po.type = type;
+
+	const int32_t timeToWait = (int32_t)(po.whenDue - StepTimer::GetTimerTicks());
+	if (timeToWait <= 0 || !StepTimer::IsSynced())
+	{
+		++numLate;
+		Apply(po);
+		return GCodeResult::ok;
+	}
+
+	if ((uint32_t)timeToWait > MaxScheduleAhead)
+	{
+		reply.printf("Board %u: output change scheduled too far ahead", CanInterface::GetCanAddress());
+		return GCodeResult::error;
+	}
+
+	// We create the task when the first change is scheduled, so that we don't use the RAM for its stack unless timed outputs are used
+	if (timedOutputsTask == nullptr)
+	{
+		timer.SetCallback(TimerCallback, static_cast<void*>(nullptr));
+		timedOutputsTask = new Task<TimedOutputsTaskStackWords>;
+		timedOutputsTask->Create(TimedOutputsTaskCode, "TIMEDOUT", nullptr, TaskPriority::TimedOutputs);
+	}
+
+	{
+		TaskCriticalSectionLocker lock;
+		if (numPending == MaxPendingOutputs)
+		{
+			reply.printf("Board %u has too many timed output changes pending", CanInterface::GetCanAddress());
+			return GCodeResult::error;
+		}
+
+		// Insert the new change after any others that are due at the same time, so that changes to the same output are made in the order they were sent
+		size_t index = numPending;
+		while (index != 0 && (int32_t)(pendingOutputs[index - 1].whenDue - po.whenDue) > 0)
+		{
+			pendingOutputs[index] = pendingOutputs[index - 1];
+			--index;
+		}
+		pendingOutputs[index] = po;
+		++numPending;
+		++numScheduled;
+	}
+
+	timedOutputsTask->Give();											// get the task to reschedule the callback in case this change is the soonest
+	return GCodeResult::ok;
+}
+
+void TimedOutputs::Diagnostics(const StringRef& reply) noexcept
+{
+	reply.lcatf("Timed outputs scheduled %" PRIu32 ", late %" PRIu32 ", max lateness %.1fus, pending %u",
+					numScheduled, numLate, (double)StepTimer::TicksToFloatMicroseconds(maxLatenessTicks), numPending);
+	numScheduled = numLate = maxLatenessTicks = 0;
+}
+
+#endif
+
+// End
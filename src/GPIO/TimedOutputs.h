@@ -0,0 +1,29 @@
+/*
+ * TimedOutputs.h
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ *
+ *  GPIO port and fan changes that the main board has asked us to make at a particular master time, so that they line up with motion
+ */
+
+#ifndef SRC_GPIO_TIMEDOUTPUTS_H_
+#define SRC_GPIO_TIMEDOUTPUTS_H_
+
+#include "RepRapFirmware.h"
+
+#if SUPPORT_TIMED_OUTPUTS
+
+#include "GCodes/GCodeResult.h"
+
+namespace TimedOutputs
+{
+	enum class OutputType : uint8_t { gpio = 0, fan };
+
+	GCodeResult Schedule(OutputType type, uint16_t number, float pwm, uint32_t whenToExecute, const StringRef& reply) noexcept;	// whenToExecute is in master time
+	void Diagnostics(const StringRef& reply) noexcept;
+}
+
+#endif
+
+#endif /* SRC_GPIO_TIMEDOUTPUTS_H_ */
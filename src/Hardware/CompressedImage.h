@@ -0,0 +1,165 @@
+/*
+ * CompressedImage.h
+ *
+ * Decompression of the compressed bootloader images that the main board can send us. This file has no dependencies on the hardware,
+ * so that Tools/ImageCompressor can test it on the host against the images that it produces.
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ */
+
+#ifndef SRC_HARDWARE_COMPRESSEDIMAGE_H_
+#define SRC_HARDWARE_COMPRESSEDIMAGE_H_
+
+#include <cstdint>
+#include <cstddef>
+
+// A compressed bootloader image starts with this header. It is followed by a LZ4 block whose match offsets are no greater than DecompressionWindowSize.
+// We decompress it twice: once to check the CRC of the decompressed image before we erase the old bootloader, and again to write it to flash.
+// So we only need RAM for the compressed image and the decompression window, not for the decompressed image as well.
+struct CompressedImageHeader
+{
+	static constexpr uint32_t MagicValue = 0x315A4344;				// "DCZ1"
+
+	uint32_t magic;
+	uint32_t uncompressedLength;
+	uint32_t compressedLength;										// the length of the LZ4 block that follows this header
+};
+
+static_assert(sizeof(CompressedImageHeader) == 12);
+
+constexpr size_t DecompressionWindowSize = 2048;					// must be a power of 2 and a multiple of DecompressionChunkSize
+constexpr size_t DecompressionChunkSize = 512;						// we check and write the decompressed image in chunks of this size
+constexpr uint32_t MinImageCrcOffset = 0x2000;						// images shorter than 8K are not valid bootloaders
+
+static_assert((DecompressionWindowSize & (DecompressionWindowSize - 1)) == 0 && DecompressionWindowSize % DecompressionChunkSize == 0);
+
+// Return true if the CRC offset that vector M9 of an image gives is valid for an image no longer than maxLength bytes.
+// The CRC is the dword that follows the image, so its offset must be dword aligned.
+inline bool IsValidCrcOffset(uint32_t crcOffset, uint32_t maxLength) noexcept
+{
+	return crcOffset >= MinImageCrcOffset && crcOffset <= maxLength - 4 && (crcOffset & 3) == 0;
+}
+
+// Decompress an image that may be no longer than maxLength bytes, passing each chunk of the output to the consumer. The last chunk is padded with 0xFF bytes.
+// The compressed data follows the header and may be up to maxLength - sizeof(CompressedImageHeader) bytes long.
+// 'window' must be DecompressionWindowSize bytes long and dword aligned, and the chunks passed to the consumer are in it.
+// Return false if the compressed data is corrupt or the consumer returns false.
+template<class Consumer> bool DecompressImage(const CompressedImageHeader& header, uint32_t maxLength, uint8_t *window, Consumer& consumer) noexcept
+{
+	if (header.uncompressedLength > maxLength || header.compressedLength > maxLength - sizeof(CompressedImageHeader))
+	{
+		return false;
+	}
+
+	const uint8_t * const input = reinterpret_cast<const uint8_t*>(&header + 1);
+	const uint32_t inputLength = header.compressedLength;
+	const uint32_t outputLength = header.uncompressedLength;
+	uint32_t inPos = 0, outPos = 0;
+
+	// Append a byte to the output, passing the last chunk to the consumer if the byte completes it
+	auto emit = [window, &outPos, &consumer](uint8_t b) noexcept -> bool
+				{
+					window[outPos & (DecompressionWindowSize - 1)] = b;
+					++outPos;
+					if (outPos % DecompressionChunkSize == 0)
+					{
+						const uint32_t chunkStart = outPos - DecompressionChunkSize;
+						return consumer(chunkStart, reinterpret_cast<const uint32_t*>(window + (chunkStart & (DecompressionWindowSize - 1))));
+					}
+					return true;
+				};
+
+	// Read a LZ4 length extension, returning UINT32_MAX if we run out of input
+	auto getLength = [input, inputLength, maxLength, &inPos](uint32_t length) noexcept -> uint32_t
+					{
+						uint8_t b;
+						do
+						{
+							if (inPos >= inputLength)
+							{
+								return UINT32_MAX;
+							}
+							b = input[inPos++];
+							length += b;
+						} while (b == 255 && length < maxLength);
+						return length;
+					};
+
+	while (inPos < inputLength)
+	{
+		const uint8_t token = input[inPos++];
+		uint32_t literalLength = token >> 4;
+		if (literalLength == 15)
+		{
+			literalLength = getLength(literalLength);
+		}
+		if (literalLength > inputLength - inPos || literalLength > outputLength - outPos)
+		{
+			return false;
+		}
+		while (literalLength != 0)
+		{
+			if (!emit(input[inPos++]))
+			{
+				return false;
+			}
+			--literalLength;
+		}
+
+		if (inPos == inputLength)
+		{
+			break;													// the last sequence has literals only
+		}
+
+		if (inputLength - inPos < 2)
+		{
+			return false;
+		}
+		const uint32_t offset = input[inPos] | ((uint32_t)input[inPos + 1] << 8);
+		inPos += 2;
+		if (offset == 0 || offset > outPos || offset > DecompressionWindowSize)
+		{
+			return false;
+		}
+
+		uint32_t matchLength = token & 0x0F;
+		if (matchLength == 15)
+		{
+			matchLength = getLength(matchLength);
+			if (matchLength == UINT32_MAX)
+			{
+				return false;
+			}
+		}
+		matchLength += 4;
+		if (matchLength > outputLength - outPos)
+		{
+			return false;
+		}
+		while (matchLength != 0)
+		{
+			if (!emit(window[(outPos - offset) & (DecompressionWindowSize - 1)]))
+			{
+				return false;
+			}
+			--matchLength;
+		}
+	}
+
+	if (outPos != outputLength)
+	{
+		return false;
+	}
+
+	// Pad the last chunk with erased flash values
+	while (outPos % DecompressionChunkSize != 0)
+	{
+		if (!emit(0xFF))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+#endif /* SRC_HARDWARE_COMPRESSEDIMAGE_H_ */
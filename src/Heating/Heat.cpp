@@ -66,6 +66,56 @@ namespace Heat
 	static unsigned int lastSensorsFound = 0;					// for diagnostics
 	static uint32_t heatTaskLoopTime = 0;						// for diagnostics
 
+	// Change-driven status reports. In this mode each report is only sent when something in it has changed by more than the configured amount,
+	// or when the keep-alive interval has expired. The keep-alive interval must be short enough that the main board doesn't time out our sensors,
+	// which it does when it hasn't had a reading for TemperatureReadingTimeout. We allow for one lost report and the time it takes to send a report.
+	static constexpr uint32_t MinKeepAliveMillis = HeatSampleIntervalMillis;
+	static constexpr uint32_t MaxKeepAliveMillis = TemperatureSensor::TemperatureReadingTimeout/2 - HeatSampleIntervalMillis;
+	static_assert(MaxKeepAliveMillis >= MinKeepAliveMillis, "keep-alive interval range is empty");
+
+	static bool changeDrivenReports = false;
+	static float reportTemperatureDelta = 0.5;					// in degC
+	static float reportPwmDelta = 0.02;							// as a fraction of full PWM
+	static uint32_t reportRpmDelta = 50;
+	static uint32_t reportKeepAliveMillis = 500;
+
+	constexpr size_t MaxSensorReports = sizeof(CanMessageSensorTemperatures::temperatureReports)/sizeof(CanMessageSensorTemperatures::temperatureReports[0]);
+	constexpr size_t MaxFanReports = sizeof(CanMessageFansReport::fanReports)/sizeof(CanMessageFansReport::fanReports[0]);
+
+	// The values that we sent in the last report of one kind, so that we can tell whether they have changed enough for it to be worth sending another
+	template<size_t N> struct LastReport
+	{
+		uint64_t which = 0;										// the bitmap of sensors, heaters or fans in the report
+		uint32_t whenSent = 0;
+		bool valid = false;
+		uint8_t codes[N];										// sensor error codes or heater modes
+		float values[N];										// sensor or heater temperatures, or fan PWMs
+		float values2[N];										// heater PWMs or fan RPMs
+		unsigned int numSent = 0, numSuppressed = 0;			// for diagnostics
+
+		bool IsDue(uint64_t p_which, bool changed) noexcept;
+	};
+
+	// Decide whether to send a report containing the specified items, given whether any of their values has changed enough. Update the statistics.
+	template<size_t N> bool LastReport<N>::IsDue(uint64_t p_which, bool changed) noexcept
+	{
+		const uint32_t now = millis();
+		if (!changeDrivenReports || !valid || changed || p_which != which || now - whenSent >= reportKeepAliveMillis)
+		{
+			which = p_which;
+			whenSent = now;
+			valid = true;
+			++numSent;
+			return true;
+		}
+		++numSuppressed;
+		return false;
+	}
+
+	static LastReport<MaxSensorReports> lastSensorsReport;
+	static LastReport<MaxHeaters> lastHeatersReport;
+	static LastReport<MaxFanReports> lastFansReport;
+
 	static ReadLockedPointer<Heater> FindHeater(int heater)
 	{
 		ReadLocker locker(heatersLock);
@@ -196,6 +246,8 @@ void Heat::Exit()
 			CanMessageSensorTemperatures * const sensorTempsMsg = buf.SetupBroadcastMessage<CanMessageSensorTemperatures>(CanInterface::GetCanAddress());
 			sensorTempsMsg->whichSensors = 0;
 			unsigned int sensorsFound = 0;
+			bool sensorsChanged = false;
+			float temperatures[MaxSensorReports];
 			{
 				ReadLocker lock(sensorsLock);
 				for (TemperatureSensor *currentSensor = sensorsRoot; currentSensor != nullptr; currentSensor = currentSensor->GetNext())
@@ -205,8 +257,14 @@ void Heat::Exit()
 					{
 						sensorTempsMsg->whichSensors |= (uint64_t)1u << currentSensor->GetSensorNumber();
 						float temperature;
-						sensorTempsMsg->temperatureReports[sensorsFound].errorCode = (uint8_t)(currentSensor->GetLatestTemperature(temperature));
+						const uint8_t errorCode = (uint8_t)(currentSensor->GetLatestTemperature(temperature));
+						sensorTempsMsg->temperatureReports[sensorsFound].errorCode = errorCode;
 						sensorTempsMsg->temperatureReports[sensorsFound].SetTemperature(temperature);
+						if (errorCode != lastSensorsReport.codes[sensorsFound] || fabsf(temperature - lastSensorsReport.values[sensorsFound]) > reportTemperatureDelta)
+						{
+							sensorsChanged = true;
+						}
+						temperatures[sensorsFound] = temperature;
 						++sensorsFound;
 					}
 				}
@@ -228,8 +286,13 @@ void Heat::Exit()
 			lastSensorsBroadcastWhich = sensorTempsMsg->whichSensors;	// for diagnostics
 			lastSensorsBroadcastWhen = millis();						// for diagnostics
 			lastSensorsFound = sensorsFound;
-			if (sensorsFound != 0)
+			if (sensorsFound != 0 && lastSensorsReport.IsDue(sensorTempsMsg->whichSensors, sensorsChanged))
 			{
+				for (size_t i = 0; i < sensorsFound; ++i)
+				{
+					lastSensorsReport.codes[i] = sensorTempsMsg->temperatureReports[i].errorCode;
+					lastSensorsReport.values[i] = temperatures[i];
+				}
 				buf.dataLength = sensorTempsMsg->GetActualDataLength(sensorsFound);
 				CanInterface::Send(&buf);
 			}
@@ -259,6 +322,8 @@ void Heat::Exit()
 			CanMessageHeatersStatus * const msg = buf.SetupStatusMessage<CanMessageHeatersStatus>(CanInterface::GetCanAddress(), CanInterface::GetCurrentMasterAddress());
 			msg->whichHeaters = 0;
 			unsigned int heatersFound = 0;
+			bool heatersChanged = false;
+			float temperatures[MaxHeaters], pwms[MaxHeaters];
 
 			{
 				ReadLocker lock(heatersLock);
@@ -269,16 +334,34 @@ void Heat::Exit()
 					if (h != nullptr)
 					{
 						msg->whichHeaters |= (uint64_t)1u << heater;
-						msg->reports[heatersFound].mode = h->GetModeByte();
-						msg->reports[heatersFound].averagePwm = (uint8_t)(h->GetAveragePWM() * 255.0);
-						msg->reports[heatersFound].temperature = h->GetTemperature();
+						const uint8_t mode = h->GetModeByte();
+						const float pwm = h->GetAveragePWM();
+						const float temperature = h->GetTemperature();
+						msg->reports[heatersFound].mode = mode;
+						msg->reports[heatersFound].averagePwm = (uint8_t)(pwm * 255.0);
+						msg->reports[heatersFound].temperature = temperature;
+						if (   mode != lastHeatersReport.codes[heatersFound]
+							|| fabsf(temperature - lastHeatersReport.values[heatersFound]) > reportTemperatureDelta
+							|| fabsf(pwm - lastHeatersReport.values2[heatersFound]) > reportPwmDelta
+						   )
+						{
+							heatersChanged = true;
+						}
+						temperatures[heatersFound] = temperature;
+						pwms[heatersFound] = pwm;
 						++heatersFound;
 					}
 				}
 			}
 
-			if (heatersFound != 0)
+			if (heatersFound != 0 && lastHeatersReport.IsDue(msg->whichHeaters, heatersChanged))
 			{
+				for (size_t i = 0; i < heatersFound; ++i)
+				{
+					lastHeatersReport.codes[i] = msg->reports[i].mode;
+					lastHeatersReport.values[i] = temperatures[i];
+					lastHeatersReport.values2[i] = pwms[i];
+				}
 				buf.dataLength = msg->GetActualDataLength(heatersFound);
 				CanInterface::Send(&buf);
 			}
@@ -288,8 +371,24 @@ void Heat::Exit()
 		{
 			CanMessageFansReport * const msg = buf.SetupStatusMessage<CanMessageFansReport>(CanInterface::GetCanAddress(), CanInterface::GetCurrentMasterAddress());
 			const unsigned int numReported = FansManager::PopulateFansReport(*msg);
-			if (numReported != 0)
+			bool fansChanged = false;
+			for (size_t i = 0; i < numReported; ++i)
 			{
+				const float pwm = (float)msg->fanReports[i].actualPwm * (1.0f/65535);
+				if (   fabsf(pwm - lastFansReport.values[i]) > reportPwmDelta
+					|| fabsf((float)msg->fanReports[i].rpm - lastFansReport.values2[i]) > (float)reportRpmDelta
+				   )
+				{
+					fansChanged = true;
+				}
+			}
+			if (numReported != 0 && lastFansReport.IsDue(msg->whichFans, fansChanged))
+			{
+				for (size_t i = 0; i < numReported; ++i)
+				{
+					lastFansReport.values[i] = (float)msg->fanReports[i].actualPwm * (1.0f/65535);
+					lastFansReport.values2[i] = (float)msg->fanReports[i].rpm;
+				}
 				buf.dataLength = msg->GetActualDataLength(numReported);
 				CanInterface::Send(&buf);
 			}
@@ -590,6 +689,70 @@ void Heat::Diagnostics(const StringRef& reply)
 {
 	reply.lcatf("Last sensors broadcast 0x%08" PRIx64 " found %u %" PRIu32 " ticks ago, loop time %" PRIu32,
 					lastSensorsBroadcastWhich, lastSensorsFound, millis() - lastSensorsBroadcastWhen, heatTaskLoopTime);
+	reply.lcatf("Status reports sent/suppressed: sensors %u/%u, heaters %u/%u, fans %u/%u",
+					lastSensorsReport.numSent, lastSensorsReport.numSuppressed, lastHeatersReport.numSent, lastHeatersReport.numSuppressed,
+						lastFansReport.numSent, lastFansReport.numSuppressed);
+	lastSensorsReport.numSent = lastSensorsReport.numSuppressed = 0;
+	lastHeatersReport.numSent = lastHeatersReport.numSuppressed = 0;
+	lastFansReport.numSent = lastFansReport.numSuppressed = 0;
+}
+
+// Configure the status reports that we send to the main board. Parameters are S (0 = send every sample interval, 1 = only send changes),
+// T (temperature change in degC), P (heater or fan PWM change as a fraction), R (fan RPM change) and K (keep-alive interval in milliseconds).
+GCodeResult Heat::ConfigureStatusReports(const CanMessageGeneric& msg, const StringRef& reply)
+{
+	CanMessageGenericParser parser(msg, StatusReportParams);
+	bool seen = false;
+
+	uint8_t mode;
+	if (parser.GetUintParam('S', mode))
+	{
+		seen = true;
+		changeDrivenReports = (mode != 0);
+	}
+
+	float fVal;
+	if (parser.GetFloatParam('T', fVal))
+	{
+		seen = true;
+		reportTemperatureDelta = max<float>(fVal, 0.0);
+	}
+	if (parser.GetFloatParam('P', fVal))
+	{
+		seen = true;
+		reportPwmDelta = max<float>(fVal, 0.0);
+	}
+
+	uint32_t uVal;
+	if (parser.GetUintParam('R', uVal))
+	{
+		seen = true;
+		reportRpmDelta = uVal;
+	}
+	if (parser.GetUintParam('K', uVal))
+	{
+		if (uVal < MinKeepAliveMillis || uVal > MaxKeepAliveMillis)
+		{
+			reply.printf("Keep-alive interval must be between %" PRIu32 " and %" PRIu32 "ms", MinKeepAliveMillis, MaxKeepAliveMillis);
+			return GCodeResult::error;
+		}
+		seen = true;
+		reportKeepAliveMillis = uVal;
+	}
+
+	if (!seen)
+	{
+		if (changeDrivenReports)
+		{
+			reply.printf("Board %u sends status reports on change of %.1fC, %.3f PWM or %" PRIu32 "RPM, keep-alive interval %" PRIu32 "ms",
+							CanInterface::GetCanAddress(), (double)reportTemperatureDelta, (double)reportPwmDelta, reportRpmDelta, reportKeepAliveMillis);
+		}
+		else
+		{
+			reply.printf("Board %u sends status reports every %" PRIu32 "ms", CanInterface::GetCanAddress(), HeatSampleIntervalMillis);
+		}
+	}
+	return GCodeResult::ok;
 }
 
 // End
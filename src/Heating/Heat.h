@@ -37,6 +37,7 @@ namespace Heat
 	GCodeResult SetPidParameters(const CanMessageGeneric& msg, const StringRef& reply);
 	GCodeResult SetFaultDetection(const CanMessageSetHeaterFaultDetectionParameters& msg, const StringRef& reply);
 	GCodeResult SetHeaterMonitors(const CanMessageSetHeaterMonitors& msg, const StringRef& reply);
+	GCodeResult ConfigureStatusReports(const CanMessageGeneric& msg, const StringRef& reply);
 
 	void SwitchOffAll();										// Turn all heaters off
 	void ResetFault(int heater);								// Reset a heater fault - only call this if you know what you are doing
@@ -13,6 +13,8 @@ class CanTemperatureReport;
 class TemperatureSensor
 {
 public:
+	static constexpr uint32_t TemperatureReadingTimeout = 2000;			// any reading older than this number of milliseconds is considered unreliable, also on the main board
+
 	TemperatureSensor(unsigned int sensorNum, const char *type);
 
 	// Virtual destructor
@@ -64,8 +66,6 @@ protected:
 	static TemperatureError GetPT100Temperature(float& t, uint16_t ohmsx100);		// shared function used by two derived classes
 
 private:
-	static constexpr uint32_t TemperatureReadingTimeout = 2000;			// any reading older than this number of milliseconds is considered unreliable
-
 	TemperatureSensor *next;
 	unsigned int sensorNumber;					// the number of this sensor
 	const char * const sensorType;
@@ -12,6 +12,11 @@
 #include <CAN/CanInterface.h>
 #include <CanMessageBuffer.h>
 
+#if SUPPORT_DRIVERS
+# include <Movement/Move.h>
+# include <Movement/StepTimer.h>
+#endif
+
 InputMonitor * volatile InputMonitor::monitorsList = nullptr;
 InputMonitor * volatile InputMonitor::freeList = nullptr;
 ReadWriteLock InputMonitor::listLock;
@@ -74,8 +79,7 @@ void InputMonitor::DigitalInterrupt() noexcept
 		state = newState;
 		if (active)
 		{
-			sendDue = true;
-			CanInterface::WakeAsyncSenderFromIsr();
+			StateChanged();
 		}
 	}
 }
@@ -88,12 +92,29 @@ void InputMonitor::AnalogInterrupt(uint16_t reading) noexcept
 		state = newState;
 		if (active)
 		{
-			sendDue = true;
-			CanInterface::WakeAsyncSenderFromIsr();
+			StateChanged();
 		}
 	}
 }
 
+// Handle a change of state of an active monitor. Called from the interrupt or callback that detected the change.
+void InputMonitor::StateChanged() noexcept
+{
+#if SUPPORT_DRIVERS
+	// If the main board asked us to stop some drivers when this input becomes active, stop them now instead of waiting for the main board to tell us to
+	const uint16_t drivers = driversToStop;
+	if (state && drivers != 0)
+	{
+		driversToStop = 0;								// only stop the drivers once, so that switch bounce can't stop the next move
+		whenStopped = moveInstance->StopDrivers(drivers, stoppedPositions);
+		stoppedDrivers = drivers;
+		stopReportDue = true;							// each monitor has its own report, so a stop by one monitor can't overwrite a stop by another that we haven't reported yet
+	}
+#endif
+	sendDue = true;
+	CanInterface::WakeAsyncSenderFromIsr();
+}
+
 /*static*/ void InputMonitor::Init() noexcept
 {
 	// Nothing needed here yet
@@ -172,6 +193,10 @@ void InputMonitor::AnalogInterrupt(uint16_t reading) noexcept
 	newMonitor->minInterval = msg.minInterval;
 	newMonitor->threshold = msg.threshold;
 	newMonitor->sendDue = false;
+#if SUPPORT_DRIVERS
+	newMonitor->driversToStop = 0;
+	newMonitor->stopReportDue = false;
+#endif
 	String<StringLength50> pinName;
 	pinName.copy(msg.pinName, msg.GetMaxPinNameLength(dataLength));
 	if (newMonitor->port.AssignPort(pinName.c_str(), reply, PinUsedBy::endstop, (msg.threshold == 0) ? PinAccess::read : PinAccess::readAnalog))
@@ -243,6 +268,25 @@ void InputMonitor::AnalogInterrupt(uint16_t reading) noexcept
 		rslt = GCodeResult::ok;
 		break;
 
+	case CanMessageChangeInputMonitor::actionSetDriversToStop:
+		// The parameter is a bitmap of the local drivers to stop when the input next becomes active, or zero to cancel
+#if SUPPORT_DRIVERS
+		if ((msg.param & ~((1u << NumDrivers) - 1)) != 0)
+		{
+			reply.printf("Board %u does not have all the requested drivers", CanInterface::GetCanAddress());
+			rslt = GCodeResult::error;
+		}
+		else
+		{
+			m->driversToStop = msg.param;
+			rslt = GCodeResult::ok;
+		}
+#else
+		reply.printf("Board %u does not have drivers", CanInterface::GetCanAddress());
+		rslt = GCodeResult::error;
+#endif
+		break;
+
 	default:
 		reply.printf("ChangeInputMonitor action #%u not implemented", msg.action);
 		rslt = GCodeResult::error;
@@ -299,6 +343,44 @@ void InputMonitor::AnalogInterrupt(uint16_t reading) noexcept
 	return timeToWait;
 }
 
+#if SUPPORT_DRIVERS
+
+// If an input monitor has stopped some drivers since we last reported it, build a message to tell the main board when it happened and where the drivers stopped.
+// We report one stop per call, so the caller should keep calling this until it returns false.
+/*static*/ bool InputMonitor::BuildStopReport(CanMessageBuffer *buf) noexcept
+{
+	ReadLocker lock(listLock);
+
+	for (InputMonitor *p = monitorsList; p != nullptr; p = p->next)
+	{
+		if (p->stopReportDue)
+		{
+			auto msg = buf->SetupStatusMessage<CanMessageDriversStopped>(CanInterface::GetCanAddress(), CanInterface::GetCurrentMasterAddress());
+			msg->handle.Set(p->handle);
+			unsigned int numReported = 0;
+			{
+				InterruptCriticalSectionLocker ilock;
+				p->stopReportDue = false;
+				msg->whichDrivers = p->stoppedDrivers;
+				msg->whenStopped = p->whenStopped;
+				for (size_t driver = 0; driver < NumDrivers; ++driver)
+				{
+					if (p->stoppedDrivers & (1u << driver))
+					{
+						msg->positions[numReported++] = p->stoppedPositions[driver];
+					}
+				}
+			}
+			msg->whenStopped = StepTimer::ConvertToMasterTime(msg->whenStopped);
+			buf->dataLength = msg->GetActualDataLength(numReported);
+			return true;
+		}
+	}
+	return false;
+}
+
+#endif
+
 // Read the specified inputs. The incoming message is a CanMessageReadInputsRequest. We return a CanMessageReadInputsReply in the same buffer.
 /*static*/ void InputMonitor::ReadInputs(CanMessageBuffer *buf) noexcept
 {
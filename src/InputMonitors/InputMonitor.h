@@ -30,6 +30,9 @@ public:
 
 	static uint32_t AddStateChanges(CanMessageInputChanged *msg) noexcept;
 	static void ReadInputs(CanMessageBuffer *buf) noexcept;
+#if SUPPORT_DRIVERS
+	static bool BuildStopReport(CanMessageBuffer *buf) noexcept;
+#endif
 
 	static void CommonDigitalPortInterrupt(CallbackParameter cbp) noexcept;
 	static void CommonAnalogPortInterrupt(CallbackParameter cbp, uint16_t reading) noexcept;
@@ -39,6 +42,7 @@ private:
 	void Deactivate() noexcept;
 	void DigitalInterrupt() noexcept;
 	void AnalogInterrupt(uint16_t reading) noexcept;
+	void StateChanged() noexcept;
 	uint16_t GetAnalogValue() const noexcept;
 
 	static bool Delete(uint16_t hndl) noexcept;
@@ -53,6 +57,13 @@ private:
 	bool active;
 	volatile bool state;
 	volatile bool sendDue;
+#if SUPPORT_DRIVERS
+	volatile uint16_t driversToStop;					// local drivers to stop when this input becomes active, cleared when we stop them
+	volatile bool stopReportDue;						// true if this monitor stopped some drivers and we haven't reported it to the main board yet
+	uint16_t stoppedDrivers;							// the drivers that this monitor stopped
+	uint32_t whenStopped;								// the local step clock time at which we stopped them
+	int32_t stoppedPositions[NumDrivers];				// the positions of the stopped drivers in steps
+#endif
 
 	static InputMonitor * volatile monitorsList;
 	static InputMonitor * volatile freeList;
@@ -0,0 +1,73 @@
+/*
+ * ClockSyncPll.h
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ *
+ *  The loop filter of the PLL that synchronises the step clock to the main board. It is separate from StepTimer so that it can be simulated on a host.
+ */
+
+#ifndef SRC_MOVEMENT_CLOCKSYNCPLL_H_
+#define SRC_MOVEMENT_CLOCKSYNCPLL_H_
+
+#include <cstdint>
+
+// The PLL models local time minus master time as offsetQ16/65536 + clockDrift/2^32 * (local time - offsetRefTime).
+// The caller must make sure that the offset isn't read while it is being corrected.
+class ClockSyncPll
+{
+public:
+	ClockSyncPll() noexcept : offsetQ16(0), offsetRefTime(0), clockDrift(0) { }
+
+	// Start again from a measured offset, assuming that the clocks run at the same speed
+	void Start(uint32_t localTime, uint32_t measuredOffset) noexcept
+	{
+		offsetQ16 = (uint64_t)measuredOffset << 16;
+		offsetRefTime = localTime;
+		clockDrift = 0;
+	}
+
+	// Return the difference between an offset that we measured at the specified local time and the offset that we predicted for that time
+	int32_t GetPhaseError(uint32_t localTime, uint32_t measuredOffset) const noexcept
+	{
+		return (int32_t)(measuredOffset - (uint32_t)(PredictOffsetQ16(localTime) >> 16));
+	}
+
+	// Correct the offset and drift using the phase error of a measurement made at the specified local time.
+	// We use higher gains while we acquire sync so that we lock faster, then lower gains to filter out more of the measurement jitter.
+	void Correct(uint32_t localTime, int32_t phaseError, bool acquiring) noexcept
+	{
+		const int32_t timeSinceCorrection = (int32_t)(localTime - offsetRefTime);
+		const uint64_t predictedOffsetQ16 = PredictOffsetQ16(localTime);
+		if (timeSinceCorrection > 0)
+		{
+			clockDrift += (int32_t)(((int64_t)phaseError * (1ll << (32 - ((acquiring) ? AcquireFrequencyGainShift : TrackFrequencyGainShift))))/timeSinceCorrection);
+		}
+		offsetQ16 = predictedOffsetQ16 + (int64_t)phaseError * (1ll << (16 - ((acquiring) ? AcquirePhaseGainShift : TrackPhaseGainShift)));
+		offsetRefTime = localTime;
+	}
+
+	// Get the offset of local time from master time at the specified local time
+	uint32_t GetOffset(uint32_t localTime) const noexcept { return (uint32_t)(PredictOffsetQ16(localTime) >> 16); }
+
+	// Get the rate of change of the offset, in parts per million
+	float GetDriftPpm() const noexcept { return (float)clockDrift * (1.0e6/4294967296.0); }
+
+	// PLL gains, as right shifts
+	static constexpr unsigned int AcquirePhaseGainShift = 1;
+	static constexpr unsigned int AcquireFrequencyGainShift = 4;
+	static constexpr unsigned int TrackPhaseGainShift = 3;
+	static constexpr unsigned int TrackFrequencyGainShift = 7;
+
+private:
+	uint64_t PredictOffsetQ16(uint32_t localTime) const noexcept
+	{
+		return offsetQ16 + (((int64_t)(int32_t)(localTime - offsetRefTime) * clockDrift) >> 16);
+	}
+
+	uint64_t offsetQ16;						// local time minus master time at offsetRefTime, in 1/65536 step clocks
+	uint32_t offsetRefTime;					// the local time at which we last corrected the offset
+	int32_t clockDrift;						// how fast the offset changes, in step clocks per 2^32 local step clocks
+};
+
+#endif /* SRC_MOVEMENT_CLOCKSYNCPLL_H_ */
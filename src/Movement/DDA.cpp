@@ -15,6 +15,14 @@
 #include "CanMessageFormats.h"
 #include <CAN/CanInterface.h>
 
+#if SUPPORT_MOVE_PWM
+# include <GPIO/GpioPorts.h>
+#endif
+
+#if SUPPORT_STEP_TRACE
+# include "StepTrace.h"
+#endif
+
 #ifdef DUET_NG
 # define DDA_MOVE_DEBUG	(0)
 #else
@@ -86,17 +94,22 @@ static size_t savedMovePointer = 0;
 unsigned int DDA::stepErrors = 0;
 uint32_t DDA::maxTicksOverdue = 0;
 uint32_t DDA::maxOverdueIncrement = 0;
+uint32_t DDA::maxStepLateness = 0;
+uint32_t DDA::stepsGenerated = 0;
+Histogram DDA::stepLatenessHistogram;
 
 uint32_t DDA::stepsRequested[NumDrivers];
 uint32_t DDA::stepsDone[NumDrivers];
 
 DDA::DDA(DDA* n) : next(n), prev(nullptr), state(empty)
+#if SUPPORT_INPUT_SHAPING
+	, shapedProfile(nullptr)
+#endif
 {
 	for (size_t i = 0; i < NumDrivers; ++i)
 	{
 		endPoint[i] = 0;
-		ddms[i].state = DMState::idle;
-		ddms[i].drive = i;
+		pddms[i] = nullptr;
 	}
 }
 
@@ -110,7 +123,24 @@ pre(state == executing || state == frozen || state == completed)
 			: (int32_t)clocksNeeded;
 }
 
-#if !SINGLE_DRIVER
+#if USE_BITMAP_STEP_SCHEDULER
+
+// Find the earliest step time of the DMs that still need steps. Because we have only a few drivers, it is faster to scan all of them
+// after each step interrupt than to keep the active DMs in a list sorted by step time.
+inline void DDA::UpdateNextStepDueTime()
+{
+	uint32_t earliest = NoStepDue;
+	for (const DriveMovement *dm : pddms)
+	{
+		if (dm != nullptr && dm->state == DMState::moving && dm->nextStepTime < earliest)
+		{
+			earliest = dm->nextStepTime;
+		}
+	}
+	nextStepDueTime = earliest;
+}
+
+#elif !SINGLE_DRIVER
 
 // Insert the specified drive into the step list, in step time order.
 // We insert the drive before any existing entries with the same step time for best performance. Now that we generate step pulses
@@ -170,7 +200,10 @@ void DDA::DebugPrintAll() const
 	DebugPrint();
 	for (size_t axis = 0; axis < NumDrivers; ++axis)
 	{
-		ddms[axis].DebugPrint("ABCDEF"[axis]);
+		if (pddms[axis] != nullptr)
+		{
+			pddms[axis]->DebugPrint("ABCDEF"[axis]);
+		}
 	}
 }
 
@@ -178,44 +211,53 @@ void DDA::DebugPrintAll() const
 void DDA::Init()
 {
 	state = empty;
-	for (DriveMovement& ddm : ddms)
+	for (DriveMovement*& pdm : pddms)
 	{
-		ddm.state = DMState::idle;
+		pdm = nullptr;
 	}
 }
 
+// Return how many DMs we need to set up a move from this message
+/*static*/ unsigned int DDA::NumDmsNeeded(const CanMessageMovementLinear& msg) noexcept
+{
+	const size_t numDrivers = min<size_t>(msg.numDrivers, NumDrivers);
+	unsigned int numNeeded = 0;
+	for (size_t drive = 0; drive < numDrivers; ++drive)
+	{
+		if (msg.perDrive[drive].steps != 0)
+		{
+			++numNeeded;
+		}
+	}
+	return numNeeded;
+}
+
 // Set up a real move. Return true if it represents real movement, else false.
+// If deltaMsg is not null then it holds the Cartesian parameters of a delta move, and the drives that it flags as towers follow the delta trajectory.
 // Return true if it is a real move
-bool DDA::Init(const CanMessageMovementLinear& msg)
+bool DDA::Init(const CanMessageMovementLinear& msg, const CanMessageMovementDelta *deltaMsg)
 {
-	// 0. Initialise the endpoints, which are used for diagnostic purposes, and set up the DriveMovement objects
+	// 0. Initialise the endpoints, which are used for diagnostic purposes, and allocate DriveMovement objects for the drives that move.
+	// The Move task has already checked that there are enough free DMs.
 	bool realMove = false;
 
 	const size_t numDrivers = min<size_t>(msg.numDrivers, NumDrivers);
 	for (size_t drive = 0; drive < NumDrivers; drive++)
 	{
-		endPoint[drive] = prev->endPoint[drive];		// the steps for this move will be added later
-		DriveMovement& dm = ddms[drive];
-
-#if !SINGLE_DRIVER
-		dm.nextDM = nullptr;
-#endif
+		endPoint[drive] = 0;							// this accumulates the net steps for this move, and we add the previous endpoint when we freeze it
 		const int32_t delta = (drive < numDrivers) ? msg.perDrive[drive].steps : 0;
 		if (delta != 0)
 		{
 			realMove = true;
-			dm.totalSteps = labs(delta);				// for now this is the number of net steps, but gets adjusted later if there is a reverse in direction
-			dm.direction = (delta >= 0);				// for now this is the direction of net movement, but gets adjusted later if it is a delta movement
+			DriveMovement * const dm = DriveMovement::Allocate(drive);
+			dm->totalSteps = labs(delta);				// for now this is the number of net steps, but gets adjusted later if there is a reverse in direction
+			dm->direction = (delta >= 0);				// for now this is the direction of net movement, but gets adjusted later if it is a delta movement
 			stepsRequested[drive] += labs(delta);
-			dm.state = DMState::moving;
+			pddms[drive] = dm;
 		}
 		else
 		{
-			// Set up the steps so that GetStepsTaken will return zero
-			dm.totalSteps = 0;
-			dm.nextStep = 0;
-			dm.reverseStartStep = 1;
-			dm.state = DMState::idle;
+			pddms[drive] = nullptr;
 		}
 	}
 
@@ -228,9 +270,14 @@ bool DDA::Init(const CanMessageMovementLinear& msg)
 	// 3. Store some values
 	afterPrepare.moveStartTime = msg.whenToExecute;
 	clocksNeeded = msg.accelerationClocks + msg.steadyClocks + msg.decelClocks;
+#if SUPPORT_MOVE_PROFILE
+	scheduledStartTime = msg.whenToExecute;
+	numHiccups = 0;
+#endif
 	flags.isPrintingMove = (msg.pressureAdvanceDrives != 0);
 	flags.hadHiccup = false;
 	flags.goingSlow = false;
+	flags.aborted = false;
 
 	topSpeed = 2.0/(2 * msg.steadyClocks + (msg.initialSpeedFraction + 1.0) * msg.accelerationClocks + (msg.finalSpeedFraction + 1.0) * msg.decelClocks);
 	startSpeed = topSpeed * msg.initialSpeedFraction;
@@ -260,22 +307,74 @@ bool DDA::Init(const CanMessageMovementLinear& msg)
 #endif
 	afterPrepare.extraAccelerationClocks = msg.accelerationClocks - roundS32(accelDistance/topSpeed);
 
-#if !SINGLE_DRIVER
+#if SUPPORT_DELTA_MOVEMENT
+	uint32_t deltaDrives = 0;
+	if (deltaMsg != nullptr)
+	{
+		// The caller has checked that the kinematics is linear delta
+		params.dparams = static_cast<const LinearDeltaKinematics*>(&moveInstance->GetKinematics());
+		deltaDrives = deltaMsg->deltaDrives & params.dparams->GetConfiguredTowers();
+		params.totalDistance = deltaMsg->totalDistance;
+		params.initialX = deltaMsg->initialX;
+		params.initialY = deltaMsg->initialY;
+		params.dvecX = deltaMsg->dvecX;
+		params.dvecY = deltaMsg->dvecY;
+		params.dvecZ = deltaMsg->dvecZ;
+		params.a2plusb2 = fsquare(params.dvecX) + fsquare(params.dvecY);
+# if DM_USE_FPU
+		afterPrepare.zFraction = params.dvecZ;
+# else
+		afterPrepare.cKc = roundS32(params.dvecZ * DriveMovement::Kc);
+# endif
+	}
+#endif
+
+#if !SINGLE_DRIVER && !USE_BITMAP_STEP_SCHEDULER
 	activeDMs = nullptr;
 #endif
 
+#if SUPPORT_INPUT_SHAPING
+	PrepareShaping(msg);
+	bool canShapeExtruders = true;
+#endif
+
 	for (size_t drive = 0; drive < numDrivers; ++drive)
 	{
-		DriveMovement& dm = ddms[drive];
-		if (dm.state == DMState::moving)
+		if (pddms[drive] != nullptr)
 		{
+			DriveMovement& dm = *pddms[drive];
 			Platform::EnableDrive(drive);
+#if SUPPORT_INPUT_SHAPING
+			dm.isShaped = false;
+			dm.shapedPiece = 0;
+			dm.fShapedDistancePerStep = 1.0/(float)dm.totalSteps;	// the shaped motion is based on the steps requested, before pressure advance changes totalSteps
+			dm.fShapedAccelCompensationClocks = dm.fShapedDecelCompensationClocks = 0.0;
+#endif
+#if SUPPORT_DELTA_MOVEMENT
+			if ((deltaDrives & (1u << drive)) != 0)
+			{
+				dm.PrepareDeltaAxis(*this, params);			// we don't shape delta tower movement because the step times come from the carriage height
+
+				// Check for sensible values, print them if they look dubious
+				if (Platform::Debug(moduleDda) && dm.totalSteps > 1000000)
+				{
+					DebugPrintAll();
+				}
+			}
+			else
+#endif
 			if ((msg.pressureAdvanceDrives & (1u << drive)) != 0)
 			{
 				// If there is any extruder jerk in this move, in theory that means we need to instantly extrude or retract some amount of filament.
 				// Pass the speed change to PrepareExtruder
 				// But PrepareExtruder doesn't use it currently, so don't bother
 				dm.PrepareExtruder(*this, params, 0.0);
+#if SUPPORT_INPUT_SHAPING
+				if (shapedProfile != nullptr && !IsShapedMotionMonotonic(dm.fShapedAccelCompensationClocks, dm.fShapedDecelCompensationClocks))
+				{
+					canShapeExtruders = false;
+				}
+#endif
 
 				// Check for sensible values, print them if they look dubious
 				if (Platform::Debug(moduleDda)
@@ -297,6 +396,7 @@ bool DDA::Init(const CanMessageMovementLinear& msg)
 			else
 			{
 				dm.PrepareCartesianAxis(*this, params);
+				DriveMovement::ResetPressureAdvance(drive);		// if this is an extruder then any smoothed advance no longer applies after a move without pressure advance
 
 				// Check for sensible values, print them if they look dubious
 				if (Platform::Debug(moduleDda) && dm.totalSteps > 1000000)
@@ -304,7 +404,38 @@ bool DDA::Init(const CanMessageMovementLinear& msg)
 					DebugPrintAll();
 				}
 			}
+		}
+	}
 
+#if SUPPORT_INPUT_SHAPING
+	// Shape all the drives except delta towers, including extruders with pressure advance so that they stay in step with the axes.
+	// If pressure advance would make an extruder reverse during the shaped motion then we can't shape it, so we don't shape any of the drives.
+	if (shapedProfile != nullptr)
+	{
+		if (canShapeExtruders)
+		{
+			for (size_t drive = 0; drive < numDrivers; ++drive)
+			{
+				if (pddms[drive] != nullptr && !pddms[drive]->IsDeltaMovement())
+				{
+					pddms[drive]->SetShaped();
+				}
+			}
+		}
+		else
+		{
+			ShapedProfile::Release(shapedProfile);
+			shapedProfile = nullptr;
+			ShapedProfile::RecordUnshapedMove();
+		}
+	}
+#endif
+
+	for (size_t drive = 0; drive < numDrivers; ++drive)
+	{
+		if (pddms[drive] != nullptr)
+		{
+			DriveMovement& dm = *pddms[drive];
 			const uint32_t netSteps = (dm.reverseStartStep < dm.totalSteps) ? (2 * dm.reverseStartStep) - dm.totalSteps : dm.totalSteps;
 			if (dm.direction)
 			{
@@ -320,12 +451,23 @@ bool DDA::Init(const CanMessageMovementLinear& msg)
 			dm.nextStepTime = 0;
 			dm.stepInterval = 999999;							// initialise to a large value so that we will calculate the time for just one step
 			dm.stepsTillRecalc = 0;							// so that we don't skip the calculation
+#if DM_USE_STEP_RECURRENCE
+			dm.recurrenceCalcs = 0;
+			dm.lastCalcStepTime = 0;
+#endif
+#if SUPPORT_STEP_SEGMENTS
+			dm.numSegmentSteps = 0;							// so that we calculate the first step time
+			dm.segmentsLeft = 0;
+#endif
 
 			const bool stepsToDo = dm.CalcNextStepTime(*this);
 			if (stepsToDo)
 			{
 				dm.directionChanged = false;
-#if !SINGLE_DRIVER
+#if SUPPORT_STEP_SEGMENTS
+				dm.PrepareSegments(*this);
+#endif
+#if !SINGLE_DRIVER && !USE_BITMAP_STEP_SCHEDULER
 				InsertDM(&dm);
 #endif
 			}
@@ -342,20 +484,272 @@ bool DDA::Init(const CanMessageMovementLinear& msg)
 		}
 	}
 
+#if USE_BITMAP_STEP_SCHEDULER
+	UpdateNextStepDueTime();
+#endif
+
 	if (Platform::Debug(moduleDda) && Platform::Debug(moduleMove))		// temp show the prepared DDA if debug enabled for both modules
 	{
 		DebugPrintAll();
 	}
 
-	state = frozen;					// must do this last so that the ISR doesn't start executing it before we have finished setting it up
+	{
+		// Move::StopDrivers may change the endpoints of the moves already in the ring from an ISR, so read the previous endpoint and freeze this move atomically
+		AtomicCriticalSectionLocker lock;
+		for (size_t drive = 0; drive < NumDrivers; drive++)
+		{
+			endPoint[drive] += prev->endPoint[drive];
+		}
+		state = frozen;				// must do this last so that the ISR doesn't start executing it before we have finished setting it up
+	}
 	return true;
 }
 
+#if SUPPORT_INPUT_SHAPING
+
+ShapedProfile *ShapedProfile::freeList = nullptr;
+unsigned int ShapedProfile::numFree = 0;
+unsigned int ShapedProfile::minFree = 0;
+unsigned int ShapedProfile::numUnshapedMoves = 0;
+
+// Create shaped profiles and put them on the free list. This is called during initialisation only.
+/*static*/ void ShapedProfile::InitialAllocate(unsigned int num) noexcept
+{
+	while (num > numFree)
+	{
+		freeList = new ShapedProfile(freeList);
+		++numFree;
+	}
+	minFree = numFree;
+}
+
+// Allocate a shaped profile from the free list, returning nullptr if there are none
+/*static*/ ShapedProfile *ShapedProfile::Allocate() noexcept
+{
+	ShapedProfile * const ret = freeList;
+	if (ret != nullptr)
+	{
+		freeList = ret->next;
+		--numFree;
+		if (numFree < minFree)
+		{
+			minFree = numFree;
+		}
+	}
+	return ret;
+}
+
+// Return a shaped profile to the free list
+/*static*/ void ShapedProfile::Release(ShapedProfile *item) noexcept
+{
+	item->next = freeList;
+	freeList = item;
+	++numFree;
+}
+
+// Return the lowest number of free shaped profiles since we last reported it
+/*static*/ unsigned int ShapedProfile::GetAndClearMinFree() noexcept
+{
+	const unsigned int ret = minFree;
+	minFree = numFree;
+	return ret;
+}
+
+// Return how many moves we didn't shape because of pressure advance since we last reported it
+/*static*/ unsigned int ShapedProfile::GetAndClearUnshapedMoves() noexcept
+{
+	const unsigned int ret = numUnshapedMoves;
+	numUnshapedMoves = 0;
+	return ret;
+}
+
+// Calculate the shaped motion profile of this move. We shape the acceleration and deceleration phases separately. Each phase that is long enough
+// is replaced by the sum of one copy per impulse, delayed by the impulse delay and compressed so that all the copies fit within the original phase.
+// We place and compress the copies so that the mean time of the speed change, weighted by the impulse amplitudes, is the middle of the phase as it was
+// before shaping. Then each shaped phase covers the same distance in the same time as the original one, and the speeds at the start and end of
+// each phase are unchanged, so the speed is continuous from one move to the next. Phases that are too short are left unshaped.
+// If no phase can be shaped, or there is no free shaped profile, then we leave shapedProfile null and the drives use the normal step time calculations.
+void DDA::PrepareShaping(const CanMessageMovementLinear& msg) noexcept
+{
+	shapedProfile = nullptr;
+
+	InputShaperImpulses impulses;
+	InputShaper::GetImpulses(impulses);
+	if (impulses.numImpulses == 0)
+	{
+		return;
+	}
+
+	// Build a list of the times at which the acceleration changes, sorted into time order
+	struct AccelChange
+	{
+		float time;
+		float change;
+	};
+
+	AccelChange changes[ShapedProfile::MaxPieces - 1];
+	size_t numChanges = 0;
+	bool shaped = false;
+
+	// The copies start at leadTime after the start of the phase, and the last one finishes at tailTime before the end of it.
+	// One of these is zero, and the other one moves the mean delay of the copies to the middle of the time that they span.
+	const float shaperDuration = impulses.GetDuration();
+	const float meanDelay = impulses.GetMeanDelay();
+	const float leadTime = max<float>(shaperDuration - 2 * meanDelay, 0.0);
+	const float tailTime = max<float>(2 * meanDelay - shaperDuration, 0.0);
+
+	auto addChange = [&changes, &numChanges](float time, float change) noexcept -> void
+	{
+		size_t i = numChanges;
+		while (i != 0 && changes[i - 1].time > time)
+		{
+			changes[i] = changes[i - 1];
+			--i;
+		}
+		changes[i].time = time;
+		changes[i].change = change;
+		++numChanges;
+	};
+
+	auto addPhase = [&](float startTime, float duration, float accel) noexcept -> void
+	{
+		const float shapedDuration = duration - leadTime - shaperDuration - tailTime;
+		if (shapedDuration > 0.0)
+		{
+			const float shapedAccel = accel * duration/shapedDuration;
+			for (size_t i = 0; i < impulses.numImpulses; ++i)
+			{
+				const float copyStartTime = startTime + leadTime + impulses.delays[i];
+				addChange(copyStartTime, shapedAccel * impulses.amplitudes[i]);
+				addChange(copyStartTime + shapedDuration, -shapedAccel * impulses.amplitudes[i]);
+			}
+			shaped = true;
+		}
+		else if (duration > 0.0)
+		{
+			addChange(startTime, accel);
+			addChange(startTime + duration, -accel);
+		}
+	};
+
+	addPhase(0.0, (float)msg.accelerationClocks, acceleration);
+	addPhase((float)(msg.accelerationClocks + msg.steadyClocks), (float)msg.decelClocks, -deceleration);
+	if (!shaped)
+	{
+		return;
+	}
+
+	ShapedProfile * const profile = ShapedProfile::Allocate();
+	if (profile == nullptr)
+	{
+		return;												// the Move task waits for a free profile when shaping is enabled, so this only happens if shaping was enabled just now
+	}
+
+	// Integrate the acceleration changes to get the pieces of the motion profile
+	float time = 0.0, distance = 0.0, speed = startSpeed, accel = 0.0;
+	size_t numPieces = 0;
+	for (size_t i = 0; i < numChanges; ++i)
+	{
+		if (changes[i].time > time)
+		{
+			profile->pieces[numPieces++] = { time, distance, speed, accel };
+			const float dt = changes[i].time - time;
+			distance += (speed + 0.5 * accel * dt) * dt;
+			speed += accel * dt;
+			time = changes[i].time;
+		}
+		accel += changes[i].change;
+	}
+	profile->pieces[numPieces++] = { time, distance, speed, 0.0 };
+	profile->numPieces = numPieces;
+	profile->decelStartTime = (float)(msg.accelerationClocks + msg.steadyClocks);
+	shapedProfile = profile;
+}
+
+// Return true if an extruder whose position is the shaped motion plus pressure advance with these compensation times never moves backwards.
+// Within each piece of the profile the extruder speed is the speed of the piece plus the compensation time multiplied by the acceleration,
+// which changes linearly, so it is enough to check the speeds at the start and end of each piece.
+// The shaped step time calculation has no reverse phase, so we don't shape moves in which an extruder would reverse. We couldn't use the unshaped reverse phase
+// instead, because in the deceleration phase the shaped acceleration rises and falls again, so an extruder that reverses may go forwards again before the end of the move.
+bool DDA::IsShapedMotionMonotonic(float accelCompensationClocks, float decelCompensationClocks) const noexcept
+{
+	for (size_t i = 0; i + 1 < shapedProfile->numPieces; ++i)
+	{
+		const ShapedPiece& piece = shapedProfile->pieces[i];
+		const float compensationClocks = (piece.startTime < shapedProfile->decelStartTime) ? accelCompensationClocks : decelCompensationClocks;
+		const float advanceSpeed = compensationClocks * piece.acceleration;
+		if (advanceSpeed < 0.0 && (piece.startSpeed + advanceSpeed < 0.0 || shapedProfile->pieces[i + 1].startSpeed + advanceSpeed < 0.0))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+#endif
+
+#if SUPPORT_MOVE_PWM
+
+// Set the laser or spindle PWM that this move carries, or clear it if p is null. This must be called before Init, because Init freezes the move.
+void DDA::SetPwm(const MovePwm *p) noexcept
+{
+	if (p == nullptr)
+	{
+		flags.hasPwm = false;
+	}
+	else
+	{
+		pwm = *p;
+		flags.hasPwm = true;
+	}
+}
+
+// Ramp the PWM according to how far through the move we are in time. Called from the step ISR.
+// Hiccups move the start time forward, so the ramp stays in step with the motion.
+void DDA::UpdatePwm(uint32_t now) const noexcept
+{
+	const int32_t clocksDone = (int32_t)(now - afterPrepare.moveStartTime);
+	const float fraction = (clocksDone <= 0) ? 0.0
+							: ((uint32_t)clocksDone >= clocksNeeded) ? 1.0
+								: (float)clocksDone/(float)clocksNeeded;
+	GpioPorts::WriteOutputFromIsr(pwm.port, pwm.startPwm + (pwm.endPwm - pwm.startPwm) * fraction);
+}
+
+// Write the end PWM, which clears the port or leaves it at the level that the next move starts at. Called from the step ISR when the move completes or is aborted.
+// If we stopped any drivers during the move then the main board will replan from the stopped position, so we turn the port off instead.
+void DDA::FinishPwm() const noexcept
+{
+	if (flags.hasPwm)
+	{
+		GpioPorts::WriteOutputFromIsr(pwm.port, (flags.aborted) ? 0.0 : pwm.endPwm);
+	}
+}
+
+// Turn off the PWM of a move that we have aborted while it was executing, instead of leaving it on until the move finishes
+void DDA::TurnOffPwm() const noexcept
+{
+	if (flags.hasPwm)
+	{
+		GpioPorts::WriteOutputFromIsr(pwm.port, 0.0);
+	}
+}
+
+#endif
+
 // Start executing this move. Must be called with interrupts disabled, to avoid a race condition.
 // startTime is the earliest that we can start the move, but we must not start it before its planned time
 void DDA::Start(uint32_t tim)
 {
 	const int32_t ticksOverdue = (int32_t)(tim - afterPrepare.moveStartTime);
+#if SUPPORT_MOVE_PROFILE
+	startLateness = ticksOverdue;
+#endif
+#if SUPPORT_MOVE_PWM
+	if (flags.hasPwm)
+	{
+		GpioPorts::WriteOutputFromIsr(pwm.port, (flags.aborted) ? 0.0 : pwm.startPwm);
+	}
+#endif
 	if (ticksOverdue > 0)
 	{
 		// Record the maximum overdue time
@@ -377,19 +771,22 @@ void DDA::Start(uint32_t tim)
 	state = executing;
 
 #if SINGLE_DRIVER
-	if (ddms[0].state == DMState::moving)
+	if (pddms[0] != nullptr && pddms[0]->state == DMState::moving)
 	{
-		Platform::SetDirection(ddms[0].direction);
+		Platform::SetDirection(pddms[0]->direction);
 	}
 #else
+# if USE_BITMAP_STEP_SCHEDULER
+	if (nextStepDueTime != NoStepDue)
+# else
 	if (activeDMs != nullptr)
+# endif
 	{
-		for (size_t i = 0; i < NumDrivers; ++i)
+		for (const DriveMovement *dm : pddms)
 		{
-			DriveMovement& dm = ddms[i];
-			if (dm.state == DMState::moving)
+			if (dm != nullptr && dm->state == DMState::moving)
 			{
-				Platform::SetDirection(dm.drive, dm.direction);
+				Platform::SetDirection(dm->drive, dm->direction);
 			}
 		}
 	}
@@ -411,9 +808,23 @@ uint32_t DDA::lastDirChangeTime = 0;
 // This may occasionally get called prematurely, so it must check that a step is actually due before generating one.
 void DDA::StepDrivers(uint32_t now)
 {
+	// A move that we are executing always moves our only driver, so pddms[0] is not null
+	DriveMovement& dm = *pddms[0];
+
 	// Determine whether the driver is due for stepping, overdue, or will be due very shortly
-	if (ddms[0].state == DMState::moving && (now - afterPrepare.moveStartTime) + StepTimer::MinInterruptInterval >= ddms[0].nextStepTime)	// if the next step is due
+	if (dm.state == DMState::moving && (now - afterPrepare.moveStartTime) + StepTimer::MinInterruptInterval >= dm.nextStepTime)	// if the next step is due
 	{
+		// Record how late we are generating this step
+		const int32_t lateness = (int32_t)(now - afterPrepare.moveStartTime - dm.nextStepTime);
+		if (lateness > (int32_t)maxStepLateness)
+		{
+			maxStepLateness = (uint32_t)lateness;
+		}
+		stepLatenessHistogram.AddLog(lateness);
+# if SUPPORT_STEP_TRACE
+		StepTrace::CheckRecordStep(0, dm.direction, now);
+# endif
+
 		// Step the driver
 		bool hasMoreSteps;
 
@@ -428,7 +839,7 @@ void DDA::StepDrivers(uint32_t now)
 			}
 			StepGenTc->CTRLBSET.reg = TC_CTRLBSET_CMD_RETRIGGER;
 			lastStepHighTime = StepTimer::GetTimerTicks();				//TODO adjust lastStepLowTime to allow for the pulse length
-			hasMoreSteps = ddms[0].CalcNextStepTime(*this);
+			hasMoreSteps = dm.CalcNextStepTime(*this);
 #  else
 			uint32_t lastStepPulseTime = lastStepLowTime;
 			while (now - lastStepPulseTime < Platform::GetSlowDriverStepLowClocks() || now - lastDirChangeTime < Platform::GetSlowDriverDirSetupClocks())
@@ -437,7 +848,7 @@ void DDA::StepDrivers(uint32_t now)
 			}
 			Platform::StepDriverHigh();									// generate the step
 			lastStepPulseTime = StepTimer::GetTimerTicks();
-			hasMoreSteps = ddms[0].CalcNextStepTime(*this);
+			hasMoreSteps = dm.CalcNextStepTime(*this);
 
 			// 3a. Reset the step pin low
 			while (StepTimer::GetTimerTicks() - lastStepPulseTime < Platform::GetSlowDriverStepHighClocks()) {}
@@ -450,24 +861,123 @@ void DDA::StepDrivers(uint32_t now)
 		{
 # if USE_TC_FOR_STEP
 			StepGenTc->CTRLBSET.reg = TC_CTRLBSET_CMD_RETRIGGER;
-			hasMoreSteps = ddms[0].CalcNextStepTime(*this);
+			hasMoreSteps = dm.CalcNextStepTime(*this);
 # else
 			Platform::StepDriverHigh();									// generate the step
-			hasMoreSteps = ddms[0].CalcNextStepTime(*this);
+			hasMoreSteps = dm.CalcNextStepTime(*this);
 			Platform::StepDriverLow();									// set the step pin low
 # endif
 		}
 
 		++stepsDone[0];
-		if (hasMoreSteps && ddms[0].directionChanged)
+		++stepsGenerated;
+		if (hasMoreSteps && dm.directionChanged)
 		{
-			ddms[0].directionChanged = false;
-			Platform::SetDirection(ddms[0].direction);
+			dm.directionChanged = false;
+			Platform::SetDirection(dm.direction);
 		}
 	}
 
 	// If there are no more steps to do and the time for the move has nearly expired, flag the move as complete
-	if (ddms[0].state != DMState::moving && StepTimer::GetTimerTicks() - afterPrepare.moveStartTime + WakeupTime >= clocksNeeded)
+	if (dm.state != DMState::moving && StepTimer::GetTimerTicks() - afterPrepare.moveStartTime + WakeupTime >= clocksNeeded)
+	{
+		state = completed;
+	}
+}
+
+#elif USE_BITMAP_STEP_SCHEDULER
+
+// This is called by the interrupt service routine to execute steps.
+// This must be as fast as possible, because it determines the maximum movement speed.
+// This may occasionally get called prematurely, so it must check that a step is actually due before generating one.
+// This version finds the drives that are due by scanning all of them and building a bitmap, instead of walking a sorted list and re-inserting the DMs afterwards.
+void DDA::StepDrivers(uint32_t now)
+{
+	// 1. Determine which drivers are due for stepping, overdue, or will be due very shortly
+	const uint32_t elapsedTime = (now - afterPrepare.moveStartTime) + StepTimer::MinInterruptInterval;
+	if (elapsedTime >= nextStepDueTime)
+	{
+		uint32_t drivesDue = 0;
+		uint32_t driversStepping = 0;
+		for (size_t drive = 0; drive < NumDrivers; ++drive)
+		{
+			const DriveMovement * const dm = pddms[drive];
+			if (dm != nullptr && dm->state == DMState::moving && elapsedTime >= dm->nextStepTime)
+			{
+				drivesDue |= 1u << drive;
+				driversStepping |= Platform::GetDriversBitmap(drive);
+				++stepsDone[drive];
+				++stepsGenerated;
+				stepLatenessHistogram.AddLog((int32_t)(elapsedTime - StepTimer::MinInterruptInterval - dm->nextStepTime));
+# if SUPPORT_STEP_TRACE
+				StepTrace::CheckRecordStep(drive, dm->direction, now);
+# endif
+			}
+		}
+
+		// Record how late we are generating the earliest step. Steps due within MinInterruptInterval are generated early, so ignore those.
+		const int32_t lateness = (int32_t)(elapsedTime - StepTimer::MinInterruptInterval - nextStepDueTime);
+		if (lateness > (int32_t)maxStepLateness)
+		{
+			maxStepLateness = (uint32_t)lateness;
+		}
+
+		// 2. Generate the steps and calculate the next step times
+# if SUPPORT_SLOW_DRIVERS
+		if ((driversStepping & Platform::GetSlowDriversBitmap().GetRaw()) != 0)	// if using any slow drivers
+		{
+			uint32_t lastStepPulseTime = lastStepLowTime;
+			while (now - lastStepPulseTime < Platform::GetSlowDriverStepLowClocks() || now - lastDirChangeTime < Platform::GetSlowDriverDirSetupClocks())
+			{
+				now = StepTimer::GetTimerTicks();
+			}
+			Platform::StepDriversHigh(driversStepping);					// set the step pins high
+			lastStepPulseTime = StepTimer::GetTimerTicks();
+
+			for (size_t drive = 0; drive < NumDrivers; ++drive)
+			{
+				if (drivesDue & (1u << drive))
+				{
+					(void)pddms[drive]->CalcNextStepTime(*this);			// calculate next step times
+				}
+			}
+
+			while (StepTimer::GetTimerTicks() - lastStepPulseTime < Platform::GetSlowDriverStepHighClocks()) {}
+			Platform::StepDriversLow();									// set all step pins low
+			lastStepLowTime = StepTimer::GetTimerTicks();
+		}
+		else
+# endif
+		{
+			Platform::StepDriversHigh(driversStepping);					// set the step pins high
+			for (size_t drive = 0; drive < NumDrivers; ++drive)
+			{
+				if (drivesDue & (1u << drive))
+				{
+					(void)pddms[drive]->CalcNextStepTime(*this);			// calculate next step times
+				}
+			}
+			Platform::StepDriversLow();									// set all step pins low
+		}
+
+		// 3. Update the direction pins where necessary and find when the next step is due
+		for (size_t drive = 0; drive < NumDrivers; ++drive)
+		{
+			if (drivesDue & (1u << drive))
+			{
+				DriveMovement& dm = *pddms[drive];
+				if (dm.state == DMState::moving && dm.directionChanged)
+				{
+					dm.directionChanged = false;
+					Platform::SetDirection(dm.drive, dm.direction);
+				}
+			}
+		}
+		UpdateNextStepDueTime();
+	}
+
+	// 4. If there are no more steps to do and the time for the move has nearly expired, flag the move as complete
+	if (nextStepDueTime == NoStepDue && StepTimer::GetTimerTicks() - afterPrepare.moveStartTime + WakeupTime >= clocksNeeded)
 	{
 		state = completed;
 	}
@@ -490,9 +1000,24 @@ void DDA::StepDrivers(uint32_t now)
 	{
 		driversStepping |= Platform::GetDriversBitmap(dm->drive);
 		++stepsDone[dm->drive];
+		++stepsGenerated;
+		stepLatenessHistogram.AddLog((int32_t)(elapsedTime - StepTimer::MinInterruptInterval - dm->nextStepTime));
+# if SUPPORT_STEP_TRACE
+		StepTrace::CheckRecordStep(dm->drive, dm->direction, now);
+# endif
 		dm = dm->nextDM;
 	}
 
+	// Record how late we are generating the earliest step. Steps due within MinInterruptInterval are generated early, so ignore those.
+	if (dm != activeDMs)
+	{
+		const int32_t lateness = (int32_t)(elapsedTime - StepTimer::MinInterruptInterval - activeDMs->nextStepTime);
+		if (lateness > (int32_t)maxStepLateness)
+		{
+			maxStepLateness = (uint32_t)lateness;
+		}
+	}
+
 # if SUPPORT_SLOW_DRIVERS
 	if ((driversStepping & Platform::GetSlowDriversBitmap().GetRaw()) != 0)	// if using any slow drivers
 	{
@@ -551,16 +1076,25 @@ void DDA::StepDrivers(uint32_t now)
 
 #endif
 
-// Stop a drive and re-calculate the corresponding endpoint.
+// Stop a drive and re-calculate the corresponding endpoint. Return true if the drive was moving.
 // For extruder drivers, we need to be able to calculate how much of the extrusion was completed after calling this.
-void DDA::StopDrive(size_t drive)
+bool DDA::StopDrive(size_t drive)
 {
-	DriveMovement& dm = ddms[drive];
-	if (dm.state == DMState::moving)
+	DriveMovement * const dm = pddms[drive];
+	if (dm != nullptr && dm->state == DMState::moving)
 	{
-		dm.state = DMState::idle;
+		dm->state = DMState::idle;
+#if SUPPORT_STEP_SEGMENTS
+		dm->ReleaseSegments();
+#endif
 #if SINGLE_DRIVER
 		state = completed;
+#elif USE_BITMAP_STEP_SCHEDULER
+		UpdateNextStepDueTime();
+		if (nextStepDueTime == NoStepDue)
+		{
+			state = completed;
+		}
 #else
 		RemoveDM(drive);
 		if (activeDMs == nullptr)
@@ -568,7 +1102,9 @@ void DDA::StopDrive(size_t drive)
 			state = completed;
 		}
 #endif
+		return true;
 	}
+	return false;
 }
 
 // This is called when we abort a move because we have hit an endstop or we are doing an emergency pause.
@@ -580,26 +1116,73 @@ void DDA::MoveAborted()
 	{
 		for (size_t drive = 0; drive < NumDrivers; ++drive)
 		{
-			StopDrive(drive);
+			(void)StopDrive(drive);
 		}
+#if SUPPORT_MOVE_PWM
+		TurnOffPwm();
+#endif
 	}
+	flags.aborted = true;
 	state = completed;
 }
 
-void DDA::StopDrivers(uint16_t whichDrivers)
+// Stop some drivers of this move while it is executing, and set their endpoints to the positions at which they stopped
+void DDA::StopDrivers(uint16_t whichDrivers, const int32_t *positions)
 {
 	if (state == executing)
 	{
+		bool stoppedAny = false;
 		for (size_t drive = 0; drive < NumDrivers; ++drive)
 		{
 			if (whichDrivers & (1 << drive))
 			{
-				StopDrive(drive);
+				if (StopDrive(drive))
+				{
+					stoppedAny = true;
+				}
+				endPoint[drive] = positions[drive];
 			}
 		}
+		if (stoppedAny)
+		{
+			flags.aborted = true;
+#if SUPPORT_MOVE_PWM
+			TurnOffPwm();
+#endif
+		}
 	}
 }
 
+// Stop some drivers taking part in this move, which is frozen but hasn't started yet, and set their endpoints to the positions at which they stopped.
+// Called with the step interrupt disabled for each move that is waiting to start, in ring order, so that we discard each drive's segments in the order they were queued.
+// Unlike StopDrive we don't change the state of the move, so it still starts on time and takes the same time, and any other drives still move.
+// If any of the drives was going to move then we mark the move aborted so that it doesn't turn on its laser or spindle PWM.
+void DDA::SkipDrivers(uint16_t whichDrivers, const int32_t *positions)
+{
+	for (size_t drive = 0; drive < NumDrivers; ++drive)
+	{
+		if (whichDrivers & (1 << drive))
+		{
+			endPoint[drive] = positions[drive];
+			DriveMovement * const dm = pddms[drive];
+			if (dm != nullptr && dm->state == DMState::moving)
+			{
+				dm->state = DMState::idle;
+#if SUPPORT_STEP_SEGMENTS
+				dm->ReleaseSegments();
+#endif
+#if !SINGLE_DRIVER && !USE_BITMAP_STEP_SCHEDULER
+				RemoveDM(drive);
+#endif
+				flags.aborted = true;
+			}
+		}
+	}
+#if USE_BITMAP_STEP_SCHEDULER
+	UpdateNextStepDueTime();
+#endif
+}
+
 bool DDA::HasStepError() const
 {
 #if 0	//debug
@@ -611,7 +1194,7 @@ bool DDA::HasStepError() const
 
 	for (size_t drive = 0; drive < NumDrivers; ++drive)
 	{
-		if (ddms[drive].state == DMState::stepError)
+		if (pddms[drive] != nullptr && pddms[drive]->state == DMState::stepError)
 		{
 			return true;
 		}
@@ -619,18 +1202,176 @@ bool DDA::HasStepError() const
 	return false;
 }
 
-// Free up this DDA, returning true if the lookahead underrun flag was set
+// Free up this DDA, returning its DMs to the free list
 void DDA::Free()
 {
+	for (DriveMovement*& pdm : pddms)
+	{
+		if (pdm != nullptr)
+		{
+#if SUPPORT_STEP_SEGMENTS
+			if (pdm->segmentsLeft != 0)
+			{
+				// This move didn't execute all its segments, for example because it was discarded before it started.
+				// Discard them before any later move for this drive starts. The step ISR also updates the queue, so do it with interrupts disabled.
+				AtomicCriticalSectionLocker lock;
+				pdm->ReleaseSegments();
+			}
+#endif
+			DriveMovement::Release(pdm);
+			pdm = nullptr;
+		}
+	}
+#if SUPPORT_INPUT_SHAPING
+	if (shapedProfile != nullptr)
+	{
+		ShapedProfile::Release(shapedProfile);
+		shapedProfile = nullptr;
+	}
+#endif
 	state = empty;
 }
 
 // Return the number of net steps already taken in this move by a particular drive
 int32_t DDA::GetStepsTaken(size_t drive) const
 {
-	return ddms[drive].GetNetStepsTaken();
+	const DriveMovement * const dm = pddms[drive];
+	return (dm != nullptr) ? dm->GetNetStepsTaken() : 0;
 }
 
+#if !SINGLE_DRIVER
+
+// Step scheduler benchmark. This models just the scheduling part of StepDrivers using both methods, so that we can compare them for up to 8 drives
+// whichever method this build uses. Each drive steps at a fixed rate, and pairs of drives have the same rate so that several drives often step together.
+namespace StepSchedulerBenchmark
+{
+	constexpr size_t MaxDrives = 8;
+	constexpr unsigned int NumInterrupts = 100;
+
+	struct Drive
+	{
+		Drive *next;
+		uint32_t nextStepTime;
+		uint32_t interval;
+	};
+
+	static Drive drives[MaxDrives];
+
+	static void InitDrives(size_t numDrives) noexcept
+	{
+		for (size_t i = 0; i < numDrives; ++i)
+		{
+			drives[i].interval = 20 + 13 * (i/2);
+			drives[i].nextStepTime = drives[i].interval;
+			drives[i].next = (i + 1 < numDrives) ? &drives[i + 1] : nullptr;		// already in step time order
+		}
+	}
+
+	// Step the drives that are due at the head of the sorted list and re-insert them in step time order, returning the new list head
+	static Drive *StepUsingList(Drive *head) noexcept
+	{
+		const uint32_t now = head->nextStepTime;
+		Drive *d = head;
+		while (d != nullptr && now >= d->nextStepTime)
+		{
+			d->nextStepTime += d->interval;
+			d = d->next;
+		}
+
+		Drive *toInsert = head;
+		head = d;
+		while (toInsert != d)
+		{
+			Drive * const nextToInsert = toInsert->next;
+			Drive **dp = &head;
+			while (*dp != nullptr && (*dp)->nextStepTime < toInsert->nextStepTime)
+			{
+				dp = &((*dp)->next);
+			}
+			toInsert->next = *dp;
+			*dp = toInsert;
+			toInsert = nextToInsert;
+		}
+		return head;
+	}
+
+	// Step the drives that are due by building a bitmap of them, returning the next step due time
+	static uint32_t StepUsingBitmap(size_t numDrives, uint32_t now) noexcept
+	{
+		uint32_t drivesDue = 0;
+		for (size_t i = 0; i < numDrives; ++i)
+		{
+			if (now >= drives[i].nextStepTime)
+			{
+				drivesDue |= 1u << i;
+			}
+		}
+
+		uint32_t earliest = 0xFFFFFFFF;
+		for (size_t i = 0; i < numDrives; ++i)
+		{
+			if (drivesDue & (1u << i))
+			{
+				drives[i].nextStepTime += drives[i].interval;
+			}
+			if (drives[i].nextStepTime < earliest)
+			{
+				earliest = drives[i].nextStepTime;
+			}
+		}
+		return earliest;
+	}
+
+	static inline uint32_t SysTicksSince(uint32_t startVal) noexcept
+	{
+		const uint32_t now = SysTick->VAL & 0x00FFFFFF;
+		startVal &= 0x00FFFFFF;
+		return ((startVal > now) ? startVal : startVal + (SysTick->LOAD & 0x00FFFFFF) + 1) - now;
+	}
+}
+
+// Compare the time taken by the sorted list and the bitmap methods of scheduling steps, for 1 to 8 drives.
+// Caution: this disables interrupts for a few microseconds at a time.
+/*static*/ void DDA::TimeStepSchedulers(const StringRef& reply) noexcept
+{
+	using namespace StepSchedulerBenchmark;
+
+	reply.copy("Step scheduling time per interrupt (list/bitmap), drives 1-8:");
+	for (size_t numDrives = 1; numDrives <= MaxDrives; ++numDrives)
+	{
+		uint32_t listTime = 0;
+		InitDrives(numDrives);
+		Drive *head = &drives[0];
+		for (unsigned int i = 0; i < NumInterrupts; ++i)
+		{
+			IrqDisable();
+			const uint32_t startVal = SysTick->VAL;
+			head = StepUsingList(head);
+			listTime += SysTicksSince(startVal);
+			IrqEnable();
+		}
+
+		uint32_t bitmapTime = 0;
+		InitDrives(numDrives);
+		uint32_t nextDue = drives[0].nextStepTime;
+		for (unsigned int i = 0; i < NumInterrupts; ++i)
+		{
+			IrqDisable();
+			const uint32_t startVal = SysTick->VAL;
+			nextDue = StepUsingBitmap(numDrives, nextDue);
+			bitmapTime += SysTicksSince(startVal);
+			IrqEnable();
+		}
+
+		reply.catf(" %.2f/%.2fus",
+					(double)((float)listTime * (1'000'000.0f/NumInterrupts)/(float)SystemCoreClockFreq),
+					(double)((float)bitmapTime * (1'000'000.0f/NumInterrupts)/(float)SystemCoreClockFreq));
+	}
+	reply.lcatf("This build uses the %s scheduler", (USE_BITMAP_STEP_SCHEDULER) ? "bitmap" : "list");
+}
+
+#endif
+
 unsigned int DDA::GetAndClearStepErrors() noexcept
 {
 	const unsigned int ret = stepErrors;
@@ -652,6 +1393,20 @@ uint32_t DDA::GetAndClearMaxOverdueIncrement() noexcept
 	return ret;
 }
 
+uint32_t DDA::GetAndClearMaxStepLateness() noexcept
+{
+	const uint32_t ret = maxStepLateness;
+	maxStepLateness = 0;
+	return ret;
+}
+
+uint32_t DDA::GetAndClearStepsGenerated() noexcept
+{
+	const uint32_t ret = stepsGenerated;
+	stepsGenerated = 0;
+	return ret;
+}
+
 #endif	// SUPPORT_DRIVERS
 
 // End
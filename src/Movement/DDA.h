@@ -15,8 +15,66 @@
 
 #include "DriveMovement.h"
 #include "StepTimer.h"
+#include "Histogram.h"
+
+#if SUPPORT_INPUT_SHAPING
+# include "InputShaper.h"
+#endif
 
 struct CanMessageMovementLinear;
+struct CanMessageMovementDelta;
+
+// The laser or spindle PWM carried by a move
+struct MovePwm
+{
+	float startPwm;							// the PWM to write when the move starts
+	float endPwm;							// the PWM to write when the move completes, and to ramp towards during the move if ramp is true
+	uint16_t port;							// the GPIO port number, already validated
+	bool ramp;								// true to ramp the PWM linearly from startPwm to endPwm over the duration of the move
+};
+
+#if SUPPORT_INPUT_SHAPING
+
+// A piece of the shaped motion profile of a move, during which the acceleration is constant. Distances are fractions of the total move.
+struct ShapedPiece
+{
+	float startTime;						// step clocks after the start of the move that this piece starts
+	float startDistance;					// the fraction of the move completed at the start of this piece
+	float startSpeed;						// the speed at the start of this piece in fractions of the move per step clock
+	float acceleration;						// the acceleration during this piece
+};
+
+// The shaped motion profile of a move. These are large and only moves with long acceleration or deceleration phases are shaped,
+// so instead of giving every DDA one we allocate a pool of them for the shaped moves to share, in the same way as DMs.
+class ShapedProfile
+{
+public:
+	static constexpr size_t MaxPieces = 4 * InputShaperImpulses::MaxImpulses + 1;
+
+	static void InitialAllocate(unsigned int num) noexcept;
+	static ShapedProfile *Allocate() noexcept;			// returns nullptr if there are none free
+	static void Release(ShapedProfile *item) noexcept;
+	static unsigned int NumFree() noexcept { return numFree; }
+	static unsigned int GetAndClearMinFree() noexcept;
+	static void RecordUnshapedMove() noexcept { ++numUnshapedMoves; }
+	static unsigned int GetAndClearUnshapedMoves() noexcept;
+
+	ShapedPiece pieces[MaxPieces];
+	float decelStartTime;					// step clocks after the start of the move that the deceleration phase starts
+	uint8_t numPieces;
+
+private:
+	explicit ShapedProfile(ShapedProfile *p) noexcept : next(p) { }
+
+	ShapedProfile *next;
+
+	static ShapedProfile *freeList;
+	static unsigned int numFree;
+	static unsigned int minFree;
+	static unsigned int numUnshapedMoves;	// how many moves we didn't shape because pressure advance would have reversed an extruder
+};
+
+#endif
 
 // This defines a single coordinated movement of one or several motors
 class DDA
@@ -42,7 +100,7 @@ public:
 	void operator delete(void* ptr, std::align_val_t align) noexcept {}
 
 	void Init() noexcept;														// Set up initial positions for machine startup
-	bool Init(const CanMessageMovementLinear& msg) noexcept SPEED_CRITICAL;		// Set up a move from a CAN message
+	bool Init(const CanMessageMovementLinear& msg, const CanMessageMovementDelta *deltaMsg) noexcept SPEED_CRITICAL;	// Set up a move from a CAN message
 	void Start(uint32_t tim) noexcept SPEED_CRITICAL;							// Start executing the DDA, i.e. move the move.
 	void StepDrivers(uint32_t now) noexcept SPEED_CRITICAL;						// Take one step of the DDA, called by timed interrupt.
 	bool ScheduleNextStepInterrupt(StepTimer& timer) const noexcept SPEED_CRITICAL;		// Schedule the next interrupt, returning true if we can't because it is already due
@@ -64,11 +122,25 @@ public:
 	int32_t GetStepsTaken(size_t drive) const noexcept;
 
 	void MoveAborted() noexcept;
-	void StopDrivers(uint16_t whichDrivers) noexcept;
+	void StopDrivers(uint16_t whichDrivers, const int32_t *positions) noexcept;
+	void SkipDrivers(uint16_t whichDrivers, const int32_t *positions) noexcept;
 
 	uint32_t GetClocksNeeded() const noexcept { return clocksNeeded; }
 	uint32_t GetMoveFinishTime() const noexcept { return afterPrepare.moveStartTime + clocksNeeded; }
 
+#if SUPPORT_MOVE_PROFILE
+	uint32_t GetScheduledStartTime() const noexcept { return scheduledStartTime; }
+	int32_t GetStartLateness() const noexcept { return startLateness; }
+	unsigned int GetNumHiccups() const noexcept { return numHiccups; }
+#endif
+
+#if SUPPORT_MOVE_PWM
+	void SetPwm(const MovePwm *p) noexcept;										// Set or clear the PWM that this move carries, must be called before Init
+	bool HasRampedPwm() const noexcept { return flags.hasPwm && pwm.ramp && !flags.aborted; }
+	void UpdatePwm(uint32_t now) const noexcept SPEED_CRITICAL;					// Ramp the PWM according to how far through the move we are
+	void FinishPwm() const noexcept SPEED_CRITICAL;								// Write the end PWM when the move completes, or 0 if it was aborted
+#endif
+
 	int32_t GetPosition(size_t driver) const noexcept { return endPoint[driver]; }
 
 #if HAS_SMART_DRIVERS
@@ -78,12 +150,18 @@ public:
 	void DebugPrint() const noexcept;												// print the DDA only
 	void DebugPrintAll() const noexcept;												// print the DDA and active DMs
 
+	static unsigned int NumDmsNeeded(const CanMessageMovementLinear& msg) noexcept;	// Return how many DMs we need to set up a move from this message
+
 	static unsigned int GetAndClearStepErrors() noexcept;
 	static uint32_t GetAndClearMaxTicksOverdue() noexcept;
 	static uint32_t GetAndClearMaxOverdueIncrement() noexcept;
+	static uint32_t GetAndClearMaxStepLateness() noexcept;
+	static uint32_t GetAndClearStepsGenerated() noexcept;
 
 	static void RecordStepError() noexcept { ++stepErrors; }
 
+	static Histogram stepLatenessHistogram;							// how late each step was generated, in step clocks
+
 	// Note on the following constant:
 	// If we calculate the step interval on every clock, we reach a point where the calculation time exceeds the step interval.
 	// The worst case is pure Z movement on a delta. On a Mini Kossel with 80 steps/mm with this firmware running on a Duet (84MHx SAM3X8 processor),
@@ -91,14 +169,14 @@ public:
 	// Therefore, where the step interval falls below 60us, we don't calculate on every step.
 	// Note: the above measurements were taken some time ago, before some firmware optimisations.
 	// The system clock of the SAME70 is running at 150MHz. Use the same defaults as for the SAM4E for now.
+	// MinCalcIntervalCartesian is now only the starting value and the step segment threshold. The step bunching governor in class Move adjusts the interval
+	// that the ISR uses according to the measured ISR load, between MinCalcIntervalCartesian/4 and MinCalcIntervalCartesian * 2.
 #if SAMC21
-	static constexpr uint32_t MinCalcIntervalDelta = (100 * StepTimer::StepClockRate)/1000000; 		// the smallest sensible interval between calculations (40us) in step timer clocks
-	static constexpr uint32_t MinCalcIntervalCartesian = (100 * StepTimer::StepClockRate)/1000000;	// same as delta for now, but could be lower
+	static constexpr uint32_t MinCalcIntervalCartesian = (100 * StepTimer::StepClockRate)/1000000;	// the smallest sensible interval between calculations in step timer clocks
 	static constexpr uint32_t HiccupTime = (50 * StepTimer::StepClockRate)/1000000;					// how long we hiccup for
 	static constexpr uint32_t MaxStepInterruptTime = (80 * StepTimer::StepClockRate)/1000000;		// the maximum time we spend looping in the ISR in step clocks
 #elif SAME5x
-	static constexpr uint32_t MinCalcIntervalDelta = (50 * StepTimer::StepClockRate)/1000000; 		// the smallest sensible interval between calculations (40us) in step timer clocks
-	static constexpr uint32_t MinCalcIntervalCartesian = (50 * StepTimer::StepClockRate)/1000000;	// same as delta for now, but could be lower
+	static constexpr uint32_t MinCalcIntervalCartesian = (50 * StepTimer::StepClockRate)/1000000;	// the smallest sensible interval between calculations in step timer clocks
 	static constexpr uint32_t HiccupTime = (40 * StepTimer::StepClockRate)/1000000;					// how long we hiccup for
 	static constexpr uint32_t MaxStepInterruptTime = (80 * StepTimer::StepClockRate)/1000000;		// the maximum time we spend looping in the ISR in step clocks
 #endif
@@ -106,6 +184,10 @@ public:
 
 	static void PrintMoves();										// print saved moves for debugging
 
+#if !SINGLE_DRIVER
+	static void TimeStepSchedulers(const StringRef& reply) noexcept;	// compare the speed of the step scheduling methods
+#endif
+
 #if USE_TC_FOR_STEP
 	static uint32_t lastStepHighTime;								// when we last started a step pulse to a slow driver
 #else
@@ -116,14 +198,26 @@ public:
 	static uint32_t stepsRequested[NumDrivers], stepsDone[NumDrivers];
 
 private:
-	void StopDrive(size_t drive) noexcept;							// stop movement of a drive and recalculate the endpoint
+	bool StopDrive(size_t drive) noexcept;							// stop movement of a drive and recalculate the endpoint, return true if it was moving
+#if SUPPORT_MOVE_PWM
+	void TurnOffPwm() const noexcept;								// turn off the laser or spindle PWM of an aborted move that has started
+#endif
 	uint32_t WhenNextInterruptDue() const noexcept;					// return when the next interrupt is due relative to the move start time
 
-#if !SINGLE_DRIVER
+#if USE_BITMAP_STEP_SCHEDULER
+	void UpdateNextStepDueTime() noexcept SPEED_CRITICAL;			// find the earliest step time of the drives that are still moving
+#elif !SINGLE_DRIVER
 	void InsertDM(DriveMovement *dm) noexcept SPEED_CRITICAL;
 	void RemoveDM(size_t drive) noexcept;
 #endif
 
+#if SUPPORT_INPUT_SHAPING
+	void PrepareShaping(const CanMessageMovementLinear& msg) noexcept;		// Calculate the shaped motion profile of this move
+	bool IsShapedMotionMonotonic(float accelCompensationClocks, float decelCompensationClocks) const noexcept;
+	float GetShapedAdvance(const ShapedPiece& piece, float accelCompensationClocks, float decelCompensationClocks) const noexcept SPEED_CRITICAL;
+	uint32_t CalcShapedStepTime(float distance, uint8_t& pieceIndex, float accelCompensationClocks, float decelCompensationClocks) const noexcept SPEED_CRITICAL;
+#endif
+
 	void DebugPrintVector(const char *name, const float *vec, size_t len) const noexcept;
 
     DDA *next;								// The next one in the ring
@@ -137,7 +231,9 @@ private:
 		{
 			uint16_t isPrintingMove : 1,			// True if this is a printing move and any of our extruders is moving
 					 goingSlow : 1,					// True if we have slowed the movement because the Z probe is approaching its threshold
-					 hadHiccup : 1;					// True if we had a hiccup while executing this move
+					 hadHiccup : 1,					// True if we had a hiccup while executing this move
+					 hasPwm : 1,					// True if this move carries a laser or spindle PWM
+					 aborted : 1;					// True if the move was aborted, or we stopped or skipped any drivers that were still moving
 		} flags;
 		uint16_t all;								// so that we can print all the flags at once for debugging
 	};
@@ -156,6 +252,16 @@ private:
 
 	uint32_t clocksNeeded;
 
+#if SUPPORT_MOVE_PROFILE
+	uint32_t scheduledStartTime;			// the local clock count at which the main board asked us to start the move
+	int32_t startLateness;					// how many clocks late we started the move, before we brought the first step forward
+	uint8_t numHiccups;						// how many hiccups we inserted while executing the move
+#endif
+
+#if SUPPORT_MOVE_PWM
+	MovePwm pwm;							// the laser or spindle PWM, valid only if flags.hasPwm is set
+#endif
+
 	// Values that are not set or accessed before Prepare is called
 	struct
 	{
@@ -173,15 +279,27 @@ private:
 #endif
 	} afterPrepare;
 
-#if !SINGLE_DRIVER
+#if USE_BITMAP_STEP_SCHEDULER
+	uint32_t nextStepDueTime;				// the earliest next step time of the contained DMs that need steps, or NoStepDue if there are none
+#elif !SINGLE_DRIVER
     DriveMovement* activeDMs;				// list of contained DMs that need steps, in step time order
 #endif
 
-    DriveMovement ddms[NumDrivers];			// These describe the state of each drive movement
+#if SUPPORT_INPUT_SHAPING
+	ShapedProfile *shapedProfile;			// the shaped motion profile, or nullptr if this move is not shaped
+#endif
+
+    DriveMovement* pddms[NumDrivers];		// These describe the state of each drive movement, or are nullptr for drives that this move doesn't use
 
 	static unsigned int stepErrors;
 	static uint32_t maxTicksOverdue;
 	static uint32_t maxOverdueIncrement;
+	static uint32_t maxStepLateness;		// the maximum number of step clocks that a step was generated after its due time
+	static uint32_t stepsGenerated;			// the total number of steps generated on all drivers
+
+#if USE_BITMAP_STEP_SCHEDULER
+	static constexpr uint32_t NoStepDue = 0xFFFFFFFF;
+#endif
 };
 
 // Return when the next interrupt is due relative to the move start time
@@ -189,7 +307,9 @@ inline uint32_t DDA::WhenNextInterruptDue() const noexcept
 {
 	return
 #if SINGLE_DRIVER
-			(ddms[0].state == DMState::moving) ? ddms[0].nextStepTime
+			(pddms[0] != nullptr && pddms[0]->state == DMState::moving) ? pddms[0]->nextStepTime
+#elif USE_BITMAP_STEP_SCHEDULER
+			(nextStepDueTime != NoStepDue) ? nextStepDueTime
 #else
 			(activeDMs != nullptr) ? activeDMs->nextStepTime
 #endif
@@ -213,22 +333,66 @@ inline void DDA::InsertHiccup(uint32_t now) noexcept
 {
 	const uint32_t ticksDueAfterStart =
 #if SINGLE_DRIVER
-		(ddms[0].state == DMState::moving) ? ddms[0].nextStepTime
+		(pddms[0] != nullptr && pddms[0]->state == DMState::moving) ? pddms[0]->nextStepTime
+#elif USE_BITMAP_STEP_SCHEDULER
+									(nextStepDueTime != NoStepDue) ? nextStepDueTime
 #else
 									(activeDMs != nullptr) ? activeDMs->nextStepTime
 #endif
 										: (clocksNeeded > DDA::WakeupTime) ? clocksNeeded - DDA::WakeupTime
 											: 0;
 	afterPrepare.moveStartTime = now + DDA::HiccupTime - ticksDueAfterStart;
+#if SUPPORT_MOVE_PROFILE
+	if (numHiccups != 0xFF)
+	{
+		++numHiccups;
+	}
+#endif
+}
+
+#if SUPPORT_INPUT_SHAPING
+
+// Return the advance that pressure advance adds to the position of an extruder at the start of a piece of the shaped motion profile, as a fraction of the move.
+// As in the unshaped motion, the advance is the compensation time of each phase multiplied by the speed change in that phase.
+inline float DDA::GetShapedAdvance(const ShapedPiece& piece, float accelCompensationClocks, float decelCompensationClocks) const noexcept
+{
+	return (piece.startTime < shapedProfile->decelStartTime)
+			? accelCompensationClocks * (piece.startSpeed - startSpeed)
+				: accelCompensationClocks * (topSpeed - startSpeed) + decelCompensationClocks * (piece.startSpeed - topSpeed);
+}
+
+// Calculate when the shaped motion reaches the specified fraction of the move. pieceIndex is the piece that the previous step was in,
+// which is never after the one that this step is in, so we can search forwards from it.
+// For an extruder with pressure advance, the distance includes the advance. The advance is proportional to the speed, so the motion is still quadratic within each piece.
+// The caller has checked that the extruder never reverses, using IsShapedMotionMonotonic. For axes the compensation times are zero.
+inline uint32_t DDA::CalcShapedStepTime(float distance, uint8_t& pieceIndex, float accelCompensationClocks, float decelCompensationClocks) const noexcept
+{
+	while (   pieceIndex + 1u < shapedProfile->numPieces
+		   && distance >= shapedProfile->pieces[pieceIndex + 1].startDistance + GetShapedAdvance(shapedProfile->pieces[pieceIndex + 1], accelCompensationClocks, decelCompensationClocks)
+		  )
+	{
+		++pieceIndex;
+	}
+
+	// Solve speed * t + 0.5 * acceleration * t^2 = d in a form that doesn't lose precision when the acceleration is small
+	const ShapedPiece& piece = shapedProfile->pieces[pieceIndex];
+	const float compensationClocks = (piece.startTime < shapedProfile->decelStartTime) ? accelCompensationClocks : decelCompensationClocks;
+	const float speed = piece.startSpeed + compensationClocks * piece.acceleration;
+	const float d = distance - piece.startDistance - GetShapedAdvance(piece, accelCompensationClocks, decelCompensationClocks);
+	const float discriminant = fsquare(speed) + 2 * piece.acceleration * d;
+	const float denominator = speed + ((discriminant > 0.0) ? fastSqrtf(discriminant) : 0.0);
+	return (denominator > 0.0) ? (uint32_t)(piece.startTime + (2 * d)/denominator) : clocksNeeded;
 }
 
+#endif
+
 #if HAS_SMART_DRIVERS
 
 // Get the current full step interval for this axis or extruder
 inline uint32_t DDA::GetStepInterval(size_t axis, uint32_t microstepShift) const noexcept
 {
-	const DriveMovement& dm = ddms[axis];
-	return dm.state == DMState::moving ? dm.GetStepInterval(microstepShift) : 0;
+	const DriveMovement * const dm = pddms[axis];
+	return (dm != nullptr && dm->state == DMState::moving) ? dm->GetStepInterval(microstepShift) : 0;
 }
 
 #endif
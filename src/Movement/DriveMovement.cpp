@@ -16,6 +16,43 @@
 #include "StepTimer.h"
 #include "Platform.h"
 
+DriveMovement *DriveMovement::freeList = nullptr;
+float DriveMovement::pressureAdvanceSteps[NumDrivers] = { 0.0 };
+int DriveMovement::numFree = 0;
+int DriveMovement::minFree = 0;
+uint32_t DriveMovement::minCalcInterval = DDA::MinCalcIntervalCartesian;
+uint32_t DriveMovement::bunchingCounts[MaxShiftFactor + 1] = { 0 };
+
+// Create DMs and put them on the free list. This is called during initialisation only.
+/*static*/ void DriveMovement::InitialAllocate(unsigned int num)
+{
+	while (num > (unsigned int)numFree)
+	{
+		freeList = new DriveMovement(freeList);
+		++numFree;
+	}
+	minFree = numFree;
+}
+
+// Return the lowest number of free DMs since we last reported it
+/*static*/ int DriveMovement::GetAndClearMinFree()
+{
+	const int ret = minFree;
+	minFree = numFree;
+	return ret;
+}
+
+// Return how many step time calculations we did for each number of steps at a time since we were last called
+/*static*/ void DriveMovement::GetAndClearBunchingCounts(uint32_t counts[MaxShiftFactor + 1]) noexcept
+{
+	AtomicCriticalSectionLocker lock;
+	for (size_t i = 0; i <= MaxShiftFactor; ++i)
+	{
+		counts[i] = bunchingCounts[i];
+		bunchingCounts[i] = 0;
+	}
+}
+
 // Prepare this DM for a Cartesian axis move
 void DriveMovement::PrepareCartesianAxis(const DDA& dda, const PrepParams& params)
 {
@@ -31,7 +68,7 @@ void DriveMovement::PrepareCartesianAxis(const DDA& dda, const PrepParams& param
 
 	// Acceleration phase parameters
 	mp.cart.accelStopStep = (uint32_t)(dda.accelDistance * totalSteps) + 1;
-	mp.cart.compensationClocks = mp.cart.accelCompensationClocks = 0;
+	mp.cart.compensationClocks = mp.cart.accelCompensationClocks = mp.cart.decelCompensationClocks = 0;
 
 	// Constant speed phase parameters
 #if DM_USE_FPU
@@ -70,13 +107,17 @@ void DriveMovement::PrepareCartesianAxis(const DDA& dda, const PrepParams& param
 #endif
 }
 
+#if SUPPORT_DELTA_MOVEMENT
+
 // Prepare this DM for a Delta axis move
-//TODO convert this to normalised coordinates like we did for Cartesian drives
+// The geometry is in mm, but the DDA holds distances as fractions of the move and speeds and accelerations in fractions of the move per step clock.
+// So ds, the distance travelled multiplied by the steps/mm, is converted to time using the steps per unit of normalised distance.
 void DriveMovement::PrepareDeltaAxis(const DDA& dda, const PrepParams& params)
 {
 	isDeltaMovement = true;
 
 	const float stepsPerMm = Platform::DriveStepsPerUnit(drive);
+	const float stepsPerUnitDistance = stepsPerMm * params.totalDistance;
 	const float A = params.initialX - params.dparams->GetTowerX(drive);
 	const float B = params.initialY - params.dparams->GetTowerY(drive);
 	const float aAplusbB = A * params.dvecX + B * params.dvecY;
@@ -86,14 +127,14 @@ void DriveMovement::PrepareDeltaAxis(const DDA& dda, const PrepParams& params)
 	mp.delta.fHmz0s = h0MinusZ0 * stepsPerMm;
 	mp.delta.fMinusAaPlusBbTimesS = -(aAplusbB * stepsPerMm);
 	mp.delta.fDSquaredMinusAsquaredMinusBsquaredTimesSsquared = dSquaredMinusAsquaredMinusBsquared * fsquare(stepsPerMm);
-	fTwoCsquaredTimesMmPerStepDivA = (float)((double)(2 * StepTimer::StepClockRateSquared)/((double)stepsPerMm * (double)dda.acceleration));
-	fTwoCsquaredTimesMmPerStepDivD = (float)((double)(2 * StepTimer::StepClockRateSquared)/((double)stepsPerMm * (double)dda.deceleration));
+	fTwoCsquaredTimesMmPerStepDivA = (float)((double)2.0/((double)stepsPerUnitDistance * (double)dda.acceleration));
+	fTwoCsquaredTimesMmPerStepDivD = (float)((double)2.0/((double)stepsPerUnitDistance * (double)dda.deceleration));
 #else
 	mp.delta.hmz0sK = roundS32(h0MinusZ0 * stepsPerMm * DriveMovement::K2);
 	mp.delta.minusAaPlusBbTimesKs = -roundS32(aAplusbB * stepsPerMm * DriveMovement::K2);
 	mp.delta.dSquaredMinusAsquaredMinusBsquaredTimesKsquaredSsquared = roundS64(dSquaredMinusAsquaredMinusBsquared * fsquare(stepsPerMm * DriveMovement::K2));
-	twoCsquaredTimesMmPerStepDivA = roundU64((double)(2 * StepTimer::StepClockRateSquared)/((double)stepsPerMm * (double)dda.acceleration));
-	twoCsquaredTimesMmPerStepDivD = roundU64((double)(2 * StepTimer::StepClockRateSquared)/((double)stepsPerMm * (double)dda.deceleration));
+	twoCsquaredTimesMmPerStepDivA = roundU64((double)2.0/((double)stepsPerUnitDistance * (double)dda.acceleration));
+	twoCsquaredTimesMmPerStepDivD = roundU64((double)2.0/((double)stepsPerUnitDistance * (double)dda.deceleration));
 #endif
 
 	// Calculate the distance at which we need to reverse direction.
@@ -109,7 +150,7 @@ void DriveMovement::PrepareDeltaAxis(const DDA& dda, const PrepParams& params)
 		// the other root corresponds to the carriages being above the bed.
 		const float drev = ((params.dvecZ * fastSqrtf(params.a2plusb2 * params.dparams->GetDiagonalSquared(drive) - fsquare(A * params.dvecY - B * params.dvecX)))
 							- aAplusbB)/params.a2plusb2;
-		if (drev > 0.0 && drev < 1.0)		// if the reversal point is within range
+		if (drev > 0.0 && drev < params.totalDistance)		// if the reversal point is within range
 		{
 			// Calculate how many steps we need to move up before reversing
 			const float hrev = params.dvecZ * drev + fastSqrtf(dSquaredMinusAsquaredMinusBsquared - 2 * drev * aAplusbB - params.a2plusb2 * fsquare(drev));
@@ -146,21 +187,21 @@ void DriveMovement::PrepareDeltaAxis(const DDA& dda, const PrepParams& params)
 
 	// Acceleration phase parameters
 #if DM_USE_FPU
-	mp.delta.fAccelStopDs = dda.accelDistance * stepsPerMm;
+	mp.delta.fAccelStopDs = dda.accelDistance * stepsPerUnitDistance;
 #else
-	mp.delta.accelStopDsK = roundU32(dda.accelDistance * stepsPerMm * K2);
+	mp.delta.accelStopDsK = roundU32(dda.accelDistance * stepsPerUnitDistance * K2);
 #endif
 
 	// Constant speed phase parameters
 #if DM_USE_FPU
-	fMmPerStepTimesCdivtopSpeed = 1.0/(stepsPerMm * dda.topSpeed);
+	fMmPerStepTimesCdivtopSpeed = 1.0/(stepsPerUnitDistance * dda.topSpeed);
 #else
-	mmPerStepTimesCKdivtopSpeed = roundU32((float)K1/(stepsPerMm * dda.topSpeed));
+	mmPerStepTimesCKdivtopSpeed = roundU32((float)K1/(stepsPerUnitDistance * dda.topSpeed));
 #endif
 
 	// Deceleration phase parameters
 	// First check whether there is any deceleration at all, otherwise we may get strange results because of rounding errors
-	if (dda.decelDistance * stepsPerMm < 0.5)
+	if (dda.decelDistance * stepsPerUnitDistance < 0.5)
 	{
 #if DM_USE_FPU
 		mp.delta.fDecelStartDs = std::numeric_limits<float>::max();
@@ -173,35 +214,102 @@ void DriveMovement::PrepareDeltaAxis(const DDA& dda, const PrepParams& params)
 	else
 	{
 #if DM_USE_FPU
-		mp.delta.fDecelStartDs = params.decelStartDistance * stepsPerMm;
+		mp.delta.fDecelStartDs = params.decelStartDistance * stepsPerUnitDistance;
 		fTwoDistanceToStopTimesCsquaredDivD = fsquare(params.fTopSpeedTimesCdivD) + (params.decelStartDistance * 2)/dda.deceleration;
 #else
-		mp.delta.decelStartDsK = roundU32(params.decelStartDistance * stepsPerMm * K2);
+		mp.delta.decelStartDsK = roundU32(params.decelStartDistance * stepsPerUnitDistance * K2);
 		twoDistanceToStopTimesCsquaredDivD = isquare64(params.topSpeedTimesCdivD) + roundU64((params.decelStartDistance * 2)/dda.deceleration);
 #endif
 	}
 }
 
+#endif
+
+// Calculate the pressure advance times to use in the acceleration and deceleration phases when smoothing or the nonlinear term is enabled.
+// The advance we want at extruder speed v steps/clock is v * (K + N * v) steps. Instead of reaching it during each phase, we move the advance towards it
+// by the fraction of the smoothing window that the phase lasts, so that short speed changes cause proportionally less advance and retraction.
+// The part that we don't apply is carried over to the following moves by pressureAdvanceSteps, so the amount extruded is unchanged.
+// We never use more compensation than we would without smoothing, so smoothing never creates reverse phases, except that when the move ends
+// at zero speed we remove all the remaining advance in the deceleration phase. Otherwise the advance would still be applied while the extruder is stopped.
+void DriveMovement::CalcSmoothedPressureAdvance(const DDA& dda, float compensationClocks, float smoothingClocks, float nonlinearClocks,
+													float& accelCompensationClocks, float& decelCompensationClocks) const
+{
+	const float stepsPerUnitDistance = (float)totalSteps;
+	const float currentAdvance = pressureAdvanceSteps[drive];
+
+	auto wantedAdvance = [stepsPerUnitDistance, compensationClocks, nonlinearClocks](float speed) noexcept -> float
+	{
+		const float stepSpeed = speed * stepsPerUnitDistance;
+		return stepSpeed * (compensationClocks + nonlinearClocks * stepSpeed);
+	};
+
+	auto phaseCompensation = [&](float startSpeed, float endSpeed, float duration, float advanceAtStart) noexcept -> float
+	{
+		const float speedChange = (endSpeed - startSpeed) * stepsPerUnitDistance;
+		if (endSpeed == 0.0)
+		{
+			// The extruder stops at the end of this phase, so bring the advance back to zero regardless of the smoothing window
+			return (speedChange < 0.0 && advanceAtStart > 0.0) ? -advanceAtStart/speedChange : 0.0;
+		}
+		const float unsmoothedAdvanceChange = wantedAdvance(endSpeed) - wantedAdvance(startSpeed);
+		if (fabsf(unsmoothedAdvanceChange) < 0.5)
+		{
+			return 0.0;												// less than half a step of advance to apply, so don't bother
+		}
+		const float unsmoothedCompensation = unsmoothedAdvanceChange/speedChange;
+		const float fraction = (duration < smoothingClocks) ? duration/smoothingClocks : 1.0;
+		return constrain<float>(fraction * (wantedAdvance(endSpeed) - advanceAtStart)/speedChange, 0.0, unsmoothedCompensation);
+	};
+
+	accelCompensationClocks = phaseCompensation(dda.startSpeed, dda.topSpeed, (dda.topSpeed - dda.startSpeed)/dda.acceleration, currentAdvance);
+	const float advanceAtDecelStart = currentAdvance + accelCompensationClocks * (dda.topSpeed - dda.startSpeed) * stepsPerUnitDistance;
+	decelCompensationClocks = phaseCompensation(dda.topSpeed, dda.endSpeed, (dda.topSpeed - dda.endSpeed)/dda.deceleration, advanceAtDecelStart);
+}
+
 // Prepare this DM for an extruder move. The caller has already checked that pressure advance is enabled.
 void DriveMovement::PrepareExtruder(const DDA& dda, const PrepParams& params, float speedChange)
 {
 	// Calculate the pressure advance parameters
 	const float compensationClocks = Platform::GetPressureAdvanceClocks(drive);
-	if (compensationClocks < 1.0)
+	const float smoothingClocks = Platform::GetPressureAdvanceSmoothingClocks(drive);
+	const bool smoothed = (smoothingClocks >= 1.0 || Platform::GetPressureAdvanceNonlinear(drive) != 0.0);
+	float accelCompensationClocks, decelCompensationClocks;
+	if (smoothed)
 	{
+		// Convert the nonlinear coefficient from seconds per mm/sec of extruder speed to clocks per step/clock
+		const float nonlinearClocks = Platform::GetPressureAdvanceNonlinear(drive) * (float)StepTimer::StepClockRateSquared/Platform::DriveStepsPerUnit(drive);
+		CalcSmoothedPressureAdvance(dda, compensationClocks, smoothingClocks, nonlinearClocks, accelCompensationClocks, decelCompensationClocks);
+	}
+	else
+	{
+		accelCompensationClocks = decelCompensationClocks = compensationClocks;
+	}
+
+	if (accelCompensationClocks < 1.0 && decelCompensationClocks < 1.0)
+	{
+		if (smoothed && dda.endSpeed == 0.0)
+		{
+			ResetPressureAdvance(drive);					// the extruder stops at the end of this move, so there must be no advance left over
+		}
 		return PrepareCartesianAxis(dda, params);			// no compensation active, so use the simpler calculation
 	}
 
 	isDeltaMovement = false;
+#if SUPPORT_INPUT_SHAPING
+	fShapedAccelCompensationClocks = accelCompensationClocks;
+	fShapedDecelCompensationClocks = decelCompensationClocks;
+#endif
 
-	mp.cart.compensationClocks = roundU32(compensationClocks);
+	const uint32_t originalTotalSteps = totalSteps;
+	mp.cart.compensationClocks = roundU32(accelCompensationClocks);
+	mp.cart.decelCompensationClocks = roundU32(decelCompensationClocks);
 
 	// Recalculate the net total step count to allow for compensation. It may be negative.
-	const int32_t extraSteps = (dda.endSpeed - dda.startSpeed) * compensationClocks * totalSteps;
+	const int32_t extraSteps = ((dda.topSpeed - dda.startSpeed) * accelCompensationClocks + (dda.endSpeed - dda.topSpeed) * decelCompensationClocks) * totalSteps;
 	int32_t netSteps = (int32_t)totalSteps + extraSteps;
 
 	// Calculate the acceleration phase parameters
-	const float accelCompensationDistance = compensationClocks * (dda.topSpeed - dda.startSpeed);
+	const float accelCompensationDistance = accelCompensationClocks * (dda.topSpeed - dda.startSpeed);
 	mp.cart.accelCompensationClocks = roundU32(accelCompensationDistance/dda.topSpeed);
 	mp.cart.accelStopStep = (uint32_t)((dda.accelDistance + accelCompensationDistance) * totalSteps) + 1;
 
@@ -240,19 +348,19 @@ void DriveMovement::PrepareExtruder(const DDA& dda, const PrepParams& params, fl
 	{
 		mp.cart.decelStartStep = (uint32_t)((params.decelStartDistance + accelCompensationDistance) * totalSteps) + 1;
 #if DM_USE_FPU
-		const float initialDecelSpeedTimesCdivD = params.fTopSpeedTimesCdivD - (float)mp.cart.compensationClocks;
+		const float initialDecelSpeedTimesCdivD = params.fTopSpeedTimesCdivD - (float)mp.cart.decelCompensationClocks;
 		const float initialDecelSpeedTimesCdivDSquared = fsquare(initialDecelSpeedTimesCdivD);
 		fTwoDistanceToStopTimesCsquaredDivD =
 			initialDecelSpeedTimesCdivDSquared + ((params.decelStartDistance + accelCompensationDistance) * 2)/dda.deceleration;
 #else
-		const int32_t initialDecelSpeedTimesCdivD = (int32_t)params.topSpeedTimesCdivD - (int32_t)mp.cart.compensationClocks;	// signed because it may be negative and we square it
+		const int32_t initialDecelSpeedTimesCdivD = (int32_t)params.topSpeedTimesCdivD - (int32_t)mp.cart.decelCompensationClocks;	// signed because it may be negative and we square it
 		const uint64_t initialDecelSpeedTimesCdivDSquared = isquare64(initialDecelSpeedTimesCdivD);
 		twoDistanceToStopTimesCsquaredDivD =
 			initialDecelSpeedTimesCdivDSquared + roundU64(((params.decelStartDistance + accelCompensationDistance) * 2)/dda.deceleration);
 #endif
 
 		// See whether there is a reverse phase
-		const float compensationSpeedChange = dda.deceleration * compensationClocks;
+		const float compensationSpeedChange = dda.deceleration * decelCompensationClocks;
 		const uint32_t stepsBeforeReverse = (compensationSpeedChange > dda.topSpeed)
 											? mp.cart.decelStartStep - 1
 #if DM_USE_FPU
@@ -287,10 +395,42 @@ void DriveMovement::PrepareExtruder(const DDA& dda, const PrepParams& params, fl
 #endif
 		}
 	}
+	if (smoothed)
+	{
+		// Record the advance that we actually applied, which is the net movement less the steps that the main board asked for
+		const int32_t netStepsMoved = (reverseStartStep <= newTotalSteps) ? (int32_t)(2 * (reverseStartStep - 1)) - (int32_t)newTotalSteps : (int32_t)newTotalSteps;
+		if (dda.endSpeed == 0.0)
+		{
+			ResetPressureAdvance(drive);					// the extruder stops at the end of this move, so drop the rounding error in the steps we applied
+		}
+		else
+		{
+			pressureAdvanceSteps[drive] += (float)(netStepsMoved - (int32_t)originalTotalSteps);
+		}
+	}
 	DDA::stepsRequested[drive] += newTotalSteps - totalSteps;
 	totalSteps = newTotalSteps;
 }
 
+#if SUPPORT_INPUT_SHAPING
+
+// Take the step times from the shaped motion profile of the DDA. This is called after PrepareCartesianAxis or PrepareExtruder.
+// The DDA has checked that the shaped motion of an extruder with pressure advance doesn't reverse, so if the unshaped motion has a reverse phase
+// then we do just the net steps, which are the same in the shaped motion.
+void DriveMovement::SetShaped()
+{
+	if (reverseStartStep <= totalSteps)
+	{
+		const uint32_t netSteps = (uint32_t)max<int32_t>((int32_t)(2 * (reverseStartStep - 1)) - (int32_t)totalSteps, 0);
+		DDA::stepsRequested[drive] -= totalSteps - netSteps;
+		totalSteps = netSteps;
+		reverseStartStep = totalSteps + 1;
+	}
+	isShaped = true;
+}
+
+#endif
+
 void DriveMovement::DebugPrint(char c) const
 {
 	if (state != DMState::idle)
@@ -327,15 +467,17 @@ void DriveMovement::DebugPrint(char c) const
 		{
 #if DM_USE_FPU
 			debugPrintf("accelStopStep=%" PRIu32 " decelStartStep=%" PRIu32 " 2c2mmsda=%.2f 2c2mmsdd=%.2f\n"
-						"mmPerStepTimesCdivtopSpeed=%.2f fmsdmtstdca2=%.2f cc=%" PRIu32 " acc=%" PRIu32 "\n",
+						"mmPerStepTimesCdivtopSpeed=%.2f fmsdmtstdca2=%.2f cc=%" PRIu32 " acc=%" PRIu32 " dcc=%" PRIu32 "\n",
 						mp.cart.accelStopStep, mp.cart.decelStartStep, (double)fTwoCsquaredTimesMmPerStepDivA, (double)fTwoCsquaredTimesMmPerStepDivD,
-						(double)fMmPerStepTimesCdivtopSpeed, (double)mp.cart.fFourMaxStepDistanceMinusTwoDistanceToStopTimesCsquaredDivD, mp.cart.compensationClocks, mp.cart.accelCompensationClocks
+						(double)fMmPerStepTimesCdivtopSpeed, (double)mp.cart.fFourMaxStepDistanceMinusTwoDistanceToStopTimesCsquaredDivD, mp.cart.compensationClocks, mp.cart.accelCompensationClocks,
+						mp.cart.decelCompensationClocks
 						);
 #else
 			debugPrintf("accelStopStep=%" PRIu32 " decelStartStep=%" PRIu32 " 2c2mmsda=%" PRIu64 " 2c2mmsdd=%" PRIu64 "\n"
-						"mmPerStepTimesCdivtopSpeed=%" PRIu32 " fmsdmtstdca2=%" PRId64 " cc=%" PRIu32 " acc=%" PRIu32 "\n",
+						"mmPerStepTimesCdivtopSpeed=%" PRIu32 " fmsdmtstdca2=%" PRId64 " cc=%" PRIu32 " acc=%" PRIu32 " dcc=%" PRIu32 "\n",
 						mp.cart.accelStopStep, mp.cart.decelStartStep, twoCsquaredTimesMmPerStepDivA, twoCsquaredTimesMmPerStepDivD,
-						mmPerStepTimesCKdivtopSpeed, mp.cart.fourMaxStepDistanceMinusTwoDistanceToStopTimesCsquaredDivD, mp.cart.compensationClocks, mp.cart.accelCompensationClocks
+						mmPerStepTimesCKdivtopSpeed, mp.cart.fourMaxStepDistanceMinusTwoDistanceToStopTimesCsquaredDivD, mp.cart.compensationClocks, mp.cart.accelCompensationClocks,
+						mp.cart.decelCompensationClocks
 						);
 #endif
 		}
@@ -355,17 +497,21 @@ pre(nextStep < totalSteps; stepsTillRecalc == 0)
 	// Work out how many steps to calculate at a time.
 	// The last step before reverseStartStep must be single stepped to make sure that we don't reverse the direction too soon.
 	uint32_t shiftFactor = 0;		// assume single stepping
-	if (stepInterval < DDA::MinCalcIntervalCartesian)
+	if (stepInterval < minCalcInterval)
 	{
 		const uint32_t stepsToLimit = ((nextStep <= reverseStartStep && reverseStartStep <= totalSteps)
 										? reverseStartStep
 										: totalSteps
 									  ) - nextStep;
-		if (stepInterval < DDA::MinCalcIntervalCartesian/4 && stepsToLimit > 8)
+		if (stepInterval < minCalcInterval/8 && stepsToLimit > 16)
+		{
+			shiftFactor = 4;		// hexadecimal stepping
+		}
+		else if (stepInterval < minCalcInterval/4 && stepsToLimit > 8)
 		{
 			shiftFactor = 3;		// octal stepping
 		}
-		else if (stepInterval < DDA::MinCalcIntervalCartesian/2 && stepsToLimit > 4)
+		else if (stepInterval < minCalcInterval/2 && stepsToLimit > 4)
 		{
 			shiftFactor = 2;		// quad stepping
 		}
@@ -375,10 +521,19 @@ pre(nextStep < totalSteps; stepsTillRecalc == 0)
 		}
 	}
 
+	++bunchingCounts[shiftFactor];
 	stepsTillRecalc = (1u << shiftFactor) - 1u;					// store number of additional steps to generate
 
 	const uint32_t nextCalcStep = nextStep + stepsTillRecalc;
 	uint32_t nextCalcStepTime;
+#if SUPPORT_INPUT_SHAPING
+	if (isShaped)
+	{
+		// shaped move, which has no reverse phase
+		nextCalcStepTime = dda.CalcShapedStepTime((float)nextCalcStep * fShapedDistancePerStep, shapedPiece, fShapedAccelCompensationClocks, fShapedDecelCompensationClocks);
+	}
+	else
+#endif
 	if (nextCalcStep < mp.cart.accelStopStep)
 	{
 		// acceleration phase
@@ -387,7 +542,25 @@ pre(nextStep < totalSteps; stepsTillRecalc == 0)
 		nextCalcStepTime = (uint32_t)(fastSqrtf(fsquare(adjustedStartSpeedTimesCdivA) + (fTwoCsquaredTimesMmPerStepDivA * nextCalcStep)) - adjustedStartSpeedTimesCdivA);
 #else
 		const uint32_t adjustedStartSpeedTimesCdivA = dda.afterPrepare.startSpeedTimesCdivA + mp.cart.compensationClocks;
-		nextCalcStepTime = isqrt64(isquare64(adjustedStartSpeedTimesCdivA) + (twoCsquaredTimesMmPerStepDivA * nextCalcStep)) - adjustedStartSpeedTimesCdivA;
+# if DM_USE_STEP_RECURRENCE
+		// lastCalcStepTime is the time of the last step we calculated, so lastCalcStepTime + adjustedStartSpeedTimesCdivA is the time since we would have been at rest.
+		// We don't use nextStepTime because when using even steps it has been rounded down, and the rounding errors would accumulate.
+		const uint64_t kSteps = twoCsquaredTimesMmPerStepDivA << shiftFactor;
+		const uint32_t timeFromRest = lastCalcStepTime + adjustedStartSpeedTimesCdivA;
+		const uint32_t estimate = stepInterval << shiftFactor;
+		if (recurrenceCalcs < MaxRecurrenceCalcs && (kSteps >> 32) == 0 && estimate < (timeFromRest >> RecurrenceMinTimeShift))
+		{
+			nextCalcStepTime = lastCalcStepTime + CalcAccelRecurrenceInterval(timeFromRest, estimate, (uint32_t)kSteps);
+			++recurrenceCalcs;
+		}
+		else
+# endif
+		{
+			nextCalcStepTime = isqrt64(isquare64(adjustedStartSpeedTimesCdivA) + (twoCsquaredTimesMmPerStepDivA * nextCalcStep)) - adjustedStartSpeedTimesCdivA;
+# if DM_USE_STEP_RECURRENCE
+			recurrenceCalcs = 0;
+# endif
+		}
 #endif
 	}
 	else if (nextCalcStep < mp.cart.decelStartStep)
@@ -409,7 +582,7 @@ pre(nextStep < totalSteps; stepsTillRecalc == 0)
 	else if (nextCalcStep < reverseStartStep)
 	{
 		// deceleration phase, not reversed yet
-		const uint32_t adjustedTopSpeedTimesCdivDPlusDecelStartClocks = dda.afterPrepare.topSpeedTimesCdivDPlusDecelStartClocks - mp.cart.compensationClocks;
+		const uint32_t adjustedTopSpeedTimesCdivDPlusDecelStartClocks = dda.afterPrepare.topSpeedTimesCdivDPlusDecelStartClocks - mp.cart.decelCompensationClocks;
 #if DM_USE_FPU
 		const float temp = fTwoCsquaredTimesMmPerStepDivD * nextCalcStep;
 		// Allow for possible rounding error when the end speed is zero or very small
@@ -418,10 +591,30 @@ pre(nextStep < totalSteps; stepsTillRecalc == 0)
 						: adjustedTopSpeedTimesCdivDPlusDecelStartClocks;
 #else
 		const uint64_t temp = twoCsquaredTimesMmPerStepDivD * nextCalcStep;
-		// Allow for possible rounding error when the end speed is zero or very small
-		nextCalcStepTime = (temp < twoDistanceToStopTimesCsquaredDivD)
-						? adjustedTopSpeedTimesCdivDPlusDecelStartClocks - isqrt64(twoDistanceToStopTimesCsquaredDivD - temp)
-						: adjustedTopSpeedTimesCdivDPlusDecelStartClocks;
+# if DM_USE_STEP_RECURRENCE
+		// adjustedTopSpeedTimesCdivDPlusDecelStartClocks - lastCalcStepTime is the time remaining until we would come to rest.
+		// The recurrence is only valid if the last step we calculated was on the deceleration curve too, i.e. it was not before decelStartStep.
+		const uint64_t kSteps = twoCsquaredTimesMmPerStepDivD << shiftFactor;
+		const uint32_t timeToStop = adjustedTopSpeedTimesCdivDPlusDecelStartClocks - lastCalcStepTime;
+		const uint32_t estimate = stepInterval << shiftFactor;
+		if (   recurrenceCalcs < MaxRecurrenceCalcs && nextStep > mp.cart.decelStartStep && (kSteps >> 32) == 0 && temp < twoDistanceToStopTimesCsquaredDivD
+			&& (int32_t)timeToStop > 0 && estimate < (timeToStop >> RecurrenceMinTimeShift)
+		   )
+		{
+			nextCalcStepTime = lastCalcStepTime + CalcDecelRecurrenceInterval(timeToStop, estimate, (uint32_t)kSteps);
+			++recurrenceCalcs;
+		}
+		else
+# endif
+		{
+			// Allow for possible rounding error when the end speed is zero or very small
+			nextCalcStepTime = (temp < twoDistanceToStopTimesCsquaredDivD)
+							? adjustedTopSpeedTimesCdivDPlusDecelStartClocks - isqrt64(twoDistanceToStopTimesCsquaredDivD - temp)
+							: adjustedTopSpeedTimesCdivDPlusDecelStartClocks;
+# if DM_USE_STEP_RECURRENCE
+			recurrenceCalcs = 0;
+# endif
+		}
 #endif
 	}
 	else
@@ -432,7 +625,7 @@ pre(nextStep < totalSteps; stepsTillRecalc == 0)
 			direction = !direction;
 			directionChanged = true;
 		}
-		const uint32_t adjustedTopSpeedTimesCdivDPlusDecelStartClocks = dda.afterPrepare.topSpeedTimesCdivDPlusDecelStartClocks - mp.cart.compensationClocks;
+		const uint32_t adjustedTopSpeedTimesCdivDPlusDecelStartClocks = dda.afterPrepare.topSpeedTimesCdivDPlusDecelStartClocks - mp.cart.decelCompensationClocks;
 		nextCalcStepTime = adjustedTopSpeedTimesCdivDPlusDecelStartClocks
 #if DM_USE_FPU
 							+ (uint32_t)(fastSqrtf((fTwoCsquaredTimesMmPerStepDivD * nextCalcStep) - mp.cart.fFourMaxStepDistanceMinusTwoDistanceToStopTimesCsquaredDivD));
@@ -450,6 +643,9 @@ pre(nextStep < totalSteps; stepsTillRecalc == 0)
 #else
 	nextStepTime = nextCalcStepTime;
 #endif
+#if DM_USE_STEP_RECURRENCE
+	lastCalcStepTime = nextCalcStepTime;
+#endif
 
 	if (nextCalcStepTime > dda.clocksNeeded)
 	{
@@ -467,6 +663,9 @@ pre(nextStep < totalSteps; stepsTillRecalc == 0)
 			state = DMState::stepError;
 			stepInterval = 10000000 + nextStepTime;				// so we can tell what happened in the debug print
 			DDA::RecordStepError();
+#if SUPPORT_STEP_SEGMENTS
+			ReleaseSegments();									// so that the next move for this drive doesn't execute the segments that we didn't
+#endif
 			return false;
 		}
 	}
@@ -484,21 +683,21 @@ pre(nextStep < totalSteps; stepsTillRecalc == 0)
 	// The last step before reverseStartStep must be single stepped to make sure that we don't reverse the direction too soon.
 	// The simulator suggests that at 200steps/mm, the minimum step pulse interval for 400mm/sec movement is 4.5us
 	uint32_t shiftFactor = 0;		// assume single stepping
-	if (stepInterval < DDA::MinCalcIntervalDelta)
+	if (stepInterval < minCalcInterval)
 	{
 		const uint32_t stepsToLimit = ((nextStep < reverseStartStep && reverseStartStep <= totalSteps)
 										? reverseStartStep
 										: totalSteps
 									  ) - nextStep;
-		if (stepInterval < DDA::MinCalcIntervalDelta/8 && stepsToLimit > 16)
+		if (stepInterval < minCalcInterval/8 && stepsToLimit > 16)
 		{
 			shiftFactor = 4;		// hexadecimal stepping
 		}
-		else if (stepInterval < DDA::MinCalcIntervalDelta/4 && stepsToLimit > 8)
+		else if (stepInterval < minCalcInterval/4 && stepsToLimit > 8)
 		{
 			shiftFactor = 3;		// octal stepping
 		}
-		else if (stepInterval < DDA::MinCalcIntervalDelta/2 && stepsToLimit > 4)
+		else if (stepInterval < minCalcInterval/2 && stepsToLimit > 4)
 		{
 			shiftFactor = 2;		// quad stepping
 		}
@@ -508,6 +707,7 @@ pre(nextStep < totalSteps; stepsTillRecalc == 0)
 		}
 	}
 
+	++bunchingCounts[shiftFactor];
 	stepsTillRecalc = (1u << shiftFactor) - 1;					// store number of additional steps to generate
 
 	if (nextStep == reverseStartStep)
@@ -639,6 +839,203 @@ pre(nextStep < totalSteps; stepsTillRecalc == 0)
 
 #endif
 
+#if SUPPORT_STEP_SEGMENTS
+
+StepSegmentQueue DriveMovement::segmentQueues[NumDrivers];
+uint32_t DriveMovement::segmentsGenerated = 0;
+uint32_t DriveMovement::segmentQueueFullCount = 0;
+
+/*static*/ void DriveMovement::InitSegmentQueues()
+{
+	for (StepSegmentQueue& q : segmentQueues)
+	{
+		q.Init();
+	}
+}
+
+/*static*/ uint32_t DriveMovement::GetAndClearSegmentsGenerated()
+{
+	const uint32_t ret = segmentsGenerated;
+	segmentsGenerated = 0;
+	return ret;
+}
+
+/*static*/ uint32_t DriveMovement::GetAndClearSegmentQueueFullCount()
+{
+	const uint32_t ret = segmentQueueFullCount;
+	segmentQueueFullCount = 0;
+	return ret;
+}
+
+// Calculate the time after the start of the move that the specified step is due, in the same way that CalcNextStepTimeCartesianFull does when single stepping.
+// Only valid for steps before the reverse phase.
+uint32_t DriveMovement::CalcStepTimeCartesian(const DDA& dda, uint32_t stepNumber) const
+{
+	if (stepNumber < mp.cart.accelStopStep)
+	{
+		const float adjustedStartSpeedTimesCdivA = (float)(dda.afterPrepare.startSpeedTimesCdivA + mp.cart.compensationClocks);
+		return (uint32_t)(fastSqrtf(fsquare(adjustedStartSpeedTimesCdivA) + (fTwoCsquaredTimesMmPerStepDivA * stepNumber)) - adjustedStartSpeedTimesCdivA);
+	}
+
+	if (stepNumber < mp.cart.decelStartStep)
+	{
+		return (uint32_t)((int32_t)(fMmPerStepTimesCdivtopSpeed * stepNumber) + dda.afterPrepare.extraAccelerationClocks - (int32_t)mp.cart.accelCompensationClocks);
+	}
+
+	const uint32_t adjustedTopSpeedTimesCdivDPlusDecelStartClocks = dda.afterPrepare.topSpeedTimesCdivDPlusDecelStartClocks - mp.cart.decelCompensationClocks;
+	const float temp = fTwoCsquaredTimesMmPerStepDivD * stepNumber;
+	return (temp < fTwoDistanceToStopTimesCsquaredDivD)
+			? adjustedTopSpeedTimesCdivDPlusDecelStartClocks - (uint32_t)(fastSqrtf(fTwoDistanceToStopTimesCsquaredDivD - temp))
+			: adjustedTopSpeedTimesCdivDPlusDecelStartClocks;
+}
+
+// Return the difference between the time that the step ISR will generate for a step within a segment and the exact step time
+int32_t DriveMovement::GetSegmentError(const DDA& dda, const StepSegment& seg, uint32_t firstStep, uint32_t stepsIntoSegment) const
+{
+	const int64_t k = stepsIntoSegment;
+	const uint32_t segmentStepTime = (uint32_t)((((uint64_t)seg.startTime << 16) + (k * seg.interval) + ((k * (k - 1))/2) * seg.deltaInterval) >> 16);
+	return (int32_t)(segmentStepTime - CalcStepTimeCartesian(dda, firstStep + stepsIntoSegment));
+}
+
+// Calculate step segments for this drive and put them in the queue, so that the step ISR doesn't need to calculate the step times itself.
+// This is called by the Move task after the first step time has been calculated. We only use segments for the part of the move where the step interval is
+// less than MinCalcIntervalCartesian, which is where the ISR would otherwise need to do double, quad or octal stepping to keep up.
+// Within each segment the step interval changes linearly, so the step times follow a quadratic, which we fit through the exact step times at the start,
+// middle and end of the segment. We make each segment as long as we can without the step times being out by more than MaxSegmentErrorClocks.
+void DriveMovement::PrepareSegments(const DDA& dda)
+{
+	segmentsStartStep = 0;
+	numSegmentSteps = 0;
+	segmentStepsLeft = 0;
+	segmentsLeft = 0;
+
+	const float thresholdInterval = (float)DDA::MinCalcIntervalCartesian;
+	if (isDeltaMovement || fMmPerStepTimesCdivtopSpeed >= thresholdInterval
+#if SUPPORT_INPUT_SHAPING
+		|| isShaped										// the segment error checks assume the unshaped motion profile
+#endif
+	   )
+	{
+		return;
+	}
+
+	// Find the first step for which the interval is below the threshold.
+	// When accelerating, the interval is fTwoCsquaredTimesMmPerStepDivA/(2 * time since we would have been at rest).
+	uint32_t firstStep = 2;											// the first step was calculated when the move was set up
+	if (mp.cart.accelStopStep > firstStep)
+	{
+		const float adjustedStartSpeedTimesCdivA = (float)(dda.afterPrepare.startSpeedTimesCdivA + mp.cart.compensationClocks);
+		const float timeFromRest = fTwoCsquaredTimesMmPerStepDivA/(2 * thresholdInterval);
+		if (timeFromRest > adjustedStartSpeedTimesCdivA)
+		{
+			firstStep = min<uint32_t>(max<uint32_t>((uint32_t)((fsquare(timeFromRest) - fsquare(adjustedStartSpeedTimesCdivA))/fTwoCsquaredTimesMmPerStepDivA), firstStep),
+										mp.cart.accelStopStep);
+		}
+	}
+
+	// Find the step after the last one for which the interval is below the threshold. The ISR calculates the last step and any reverse phase itself.
+	// When decelerating, the interval is fTwoCsquaredTimesMmPerStepDivD/(2 * time until we would come to rest).
+	uint32_t endStep = min<uint32_t>(totalSteps, reverseStartStep);
+	if (mp.cart.decelStartStep < endStep)
+	{
+		const float timeToStop = fTwoCsquaredTimesMmPerStepDivD/(2 * thresholdInterval);
+		const float stepsToThreshold = (fTwoDistanceToStopTimesCsquaredDivD - fsquare(timeToStop))/fTwoCsquaredTimesMmPerStepDivD;
+		if (stepsToThreshold < (float)endStep)
+		{
+			endStep = max<uint32_t>((stepsToThreshold > 0.0) ? (uint32_t)stepsToThreshold : 0, mp.cart.decelStartStep);
+		}
+	}
+
+	if (endStep <= firstStep + InitialSegmentSteps)
+	{
+		return;
+	}
+
+	StepSegmentQueue& queue = segmentQueues[drive];
+	uint32_t stepNumber = firstStep;
+	uint32_t startTime = CalcStepTimeCartesian(dda, stepNumber);
+	uint32_t segmentSteps = InitialSegmentSteps/2;
+	while (stepNumber < endStep)
+	{
+		if (queue.SpaceLeft() == 0)
+		{
+			++segmentQueueFullCount;								// the ISR will have to calculate the remaining steps
+			break;
+		}
+
+		// Don't let a segment span the boundary between two phases of the move, because the step times have a discontinuity in their second derivative there
+		const uint32_t phaseEndStep = (stepNumber < mp.cart.accelStopStep) ? min<uint32_t>(mp.cart.accelStopStep, endStep)
+										: (stepNumber < mp.cart.decelStartStep) ? min<uint32_t>(mp.cart.decelStartStep, endStep)
+											: endStep;
+		StepSegment seg;
+		seg.startTime = startTime;
+		const bool steadySpeed = (stepNumber >= mp.cart.accelStopStep && stepNumber < mp.cart.decelStartStep);
+		uint32_t numSteps = (steadySpeed) ? phaseEndStep - stepNumber : min<uint32_t>(2 * segmentSteps, phaseEndStep - stepNumber);
+		uint32_t endTime;
+		for (;;)
+		{
+			endTime = CalcStepTimeCartesian(dda, stepNumber + numSteps);
+			const int32_t totalTime = (int32_t)(endTime - startTime);
+			if (numSteps <= 2)
+			{
+				// Too short for the error to matter, so use a constant interval
+				seg.interval = (totalTime > 0) ? ((uint32_t)totalTime << 16)/numSteps : 0;
+				seg.deltaInterval = 0;
+				break;
+			}
+
+			// Fit a quadratic through the step times at the start, middle and end of the segment.
+			// The time for step k of the segment is startTime + k * interval + deltaInterval * k * (k - 1)/2
+			const uint32_t midSteps = numSteps/2;
+			const int32_t midTime = (int32_t)(CalcStepTimeCartesian(dda, stepNumber + midSteps) - startTime);
+			const float deltaInterval = (float)(2 * ((int64_t)totalTime * midSteps - (int64_t)midTime * numSteps))/((float)midSteps * numSteps * (numSteps - midSteps));
+			const float interval = ((float)midTime - deltaInterval * (float)(midSteps * (midSteps - 1))/2)/midSteps;
+			const int32_t lastInterval = lrintf((interval + deltaInterval * (numSteps - 1)) * 65536.0);
+			if (interval > 0.0 && lastInterval > 0)
+			{
+				seg.interval = (uint32_t)lrintf(interval * 65536.0);
+				seg.deltaInterval = lrintf(deltaInterval * 65536.0);
+
+				// The errors are largest about 21% and 79% of the way through the segment. Also check the last step, in case the interval rounding error has built up.
+				const uint32_t checkSteps = (numSteps * 27)/128;
+				if (   labs(GetSegmentError(dda, seg, stepNumber, checkSteps)) <= (int32_t)MaxSegmentErrorClocks
+					&& labs(GetSegmentError(dda, seg, stepNumber, numSteps - checkSteps)) <= (int32_t)MaxSegmentErrorClocks
+					&& labs(GetSegmentError(dda, seg, stepNumber, numSteps - 1)) <= (int32_t)MaxSegmentErrorClocks
+				   )
+				{
+					break;
+				}
+			}
+			numSteps = midSteps;
+		}
+
+		seg.numSteps = numSteps;
+		queue.Put(seg);
+		++segmentsLeft;
+		++segmentsGenerated;
+		stepNumber += numSteps;
+		startTime = endTime;
+		segmentSteps = numSteps;
+	}
+
+	if (segmentsLeft != 0)
+	{
+		segmentsStartStep = firstStep;
+		numSegmentSteps = stepNumber - firstStep;
+	}
+}
+
+// Discard the segments that the ISR hasn't started executing. Called when this DM stops before completing its steps, and when its DDA is freed.
+// Delta DMs never have segments, so this isn't needed when they stop.
+void DriveMovement::ReleaseSegments()
+{
+	segmentQueues[drive].Discard(segmentsLeft);
+	segmentsLeft = 0;
+	numSegmentSteps = 0;
+}
+
+#endif
+
 #endif	// SUPPORT_DRIVERS
 
 // End
@@ -9,6 +9,7 @@
 #define DRIVEMOVEMENT_H_
 
 #include "RepRapFirmware.h"
+#include <Tasks.h>
 
 #if SUPPORT_DRIVERS
 
@@ -17,6 +18,9 @@ class DDA;
 
 #define DM_USE_FPU			(__FPU_USED)
 #define ROUND_TO_NEAREST	(0)			// 1 for round to nearest (as used in 1.20beta10), 0 for round down (as used prior to 1.20beta10)
+#ifndef DM_USE_STEP_RECURRENCE
+# define DM_USE_STEP_RECURRENCE	(!DM_USE_FPU)	// 1 to calculate most accelerating and decelerating step times in the integer code using a recurrence instead of a square root
+#endif
 
 // Rounding functions, to improve code clarity. Also allows a quick switch between round-to-nearest and round down in the movement code.
 inline uint32_t roundU32(float f)
@@ -105,7 +109,7 @@ struct PrepParams
 	uint32_t topSpeedTimesCdivD;
 #endif
 
-	// Parameters used only for delta moves
+	// Parameters used only for delta moves. Distances are in mm and the direction vector is normalised to the XYZ movement.
 	float initialX;
 	float initialY;
 	const LinearDeltaKinematics *dparams;
@@ -113,6 +117,44 @@ struct PrepParams
 	float dvecX, dvecY, dvecZ;
 };
 
+#if SUPPORT_STEP_SEGMENTS
+
+# if !DM_USE_FPU
+#  error Step segments need a FPU
+# endif
+
+// Struct to describe a sequence of steps whose intervals change linearly. Segments are calculated by the Move task and executed by the step ISR.
+struct StepSegment
+{
+	uint32_t startTime;									// how many clocks after the start of the move the first step of the segment is due
+	uint32_t numSteps;									// the number of steps in this segment
+	uint32_t interval;									// the interval between the first and second steps in 1/65536 step clocks
+	int32_t deltaInterval;								// how much the interval changes after each step in 1/65536 step clocks
+};
+
+// Queue of step segments for one driver. The Move task puts segments into the queue and the step ISR takes them out.
+class StepSegmentQueue
+{
+public:
+	static constexpr size_t Length = 128;				// must be a power of 2
+
+	void Init() { getCount = putCount = 0; }
+	size_t SpaceLeft() const { return Length - (putCount - getCount); }
+	void Put(const StepSegment& seg) { segments[putCount % Length] = seg; ++putCount; }
+	const StepSegment& Get() { const StepSegment& seg = segments[getCount % Length]; ++getCount; return seg; }
+	// Discard segments that will not be executed. This is called from the step ISR when a move is stopped, and from the Move task when a move
+	// is freed or its drivers are skipped, so the caller must either be the step ISR or hold a critical section. The segments of each move must be
+	// discarded in the order in which they were queued, i.e. the moves must be processed in ring order.
+	void Discard(size_t numToDiscard) { getCount += numToDiscard; }
+
+private:
+	StepSegment segments[Length];
+	volatile uint32_t getCount;							// changed by the step ISR, and by the Move task in Discard with interrupts disabled
+	volatile uint32_t putCount;							// only changed by the Move task
+};
+
+#endif
+
 enum class DMState : uint8_t
 {
 	idle = 0,
@@ -126,43 +168,101 @@ class DriveMovement
 public:
 	friend class DDA;
 
-	DriveMovement() { };
+	DriveMovement(DriveMovement *next) : nextDM(next) { }
+
+	void* operator new(size_t count) { return Tasks::AllocPermanent(count); }
+	void* operator new(size_t count, std::align_val_t align) { return Tasks::AllocPermanent(count, align); }
+	void operator delete(void* ptr) noexcept {}
+	void operator delete(void* ptr, std::align_val_t align) noexcept {}
+
+	static void InitialAllocate(unsigned int num);
+	static DriveMovement *Allocate(size_t drive);
+	static void Release(DriveMovement *item);
+	static int NumFree() { return numFree; }
+	static int GetAndClearMinFree();
+	static void ResetPressureAdvance(size_t drive) { pressureAdvanceSteps[drive] = 0.0; }
+
+	// Step bunching. When the step interval is below minCalcInterval we calculate the step time for 2, 4, 8 or 16 steps at a time.
+	// The Move class adjusts minCalcInterval according to the measured step ISR load.
+	static constexpr unsigned int MaxShiftFactor = 4;
+	static uint32_t GetMinCalcInterval() noexcept { return minCalcInterval; }
+	static void SetMinCalcInterval(uint32_t interval) noexcept { minCalcInterval = interval; }
+	static void GetAndClearBunchingCounts(uint32_t counts[MaxShiftFactor + 1]) noexcept;
 
 	bool CalcNextStepTime(const DDA &dda) SPEED_CRITICAL;
 	void PrepareCartesianAxis(const DDA& dda, const PrepParams& params) SPEED_CRITICAL;
+#if SUPPORT_DELTA_MOVEMENT
 	void PrepareDeltaAxis(const DDA& dda, const PrepParams& params) SPEED_CRITICAL;
+#endif
 	void PrepareExtruder(const DDA& dda, const PrepParams& params, float speedChange) SPEED_CRITICAL;
 	void DebugPrint(char c) const;
 	int32_t GetNetStepsLeft() const;
 	int32_t GetNetStepsTaken() const;
 	bool IsDeltaMovement() const { return isDeltaMovement; }
+#if SUPPORT_INPUT_SHAPING
+	void SetShaped();									// Take the step times from the shaped motion profile of the DDA
+#endif
 
 #if HAS_SMART_DRIVERS
 	uint32_t GetStepInterval(uint32_t msShift) const;	// Get the current full step interval for this axis or extruder
 #endif
 
+#if SUPPORT_STEP_SEGMENTS
+	void PrepareSegments(const DDA& dda);				// Calculate step segments for the fast part of this move, if we can
+	void ReleaseSegments();								// Discard any segments that we haven't executed
+
+	static void InitSegmentQueues();
+	static uint32_t GetAndClearSegmentsGenerated();
+	static uint32_t GetAndClearSegmentQueueFullCount();
+#endif
+
+#if DM_USE_STEP_RECURRENCE
+	static uint32_t CalcAccelRecurrenceInterval(uint32_t timeFromRest, uint32_t estimate, uint32_t kSteps) SPEED_CRITICAL;
+	static uint32_t CalcDecelRecurrenceInterval(uint32_t timeToStop, uint32_t estimate, uint32_t kSteps) SPEED_CRITICAL;
+
+	// Each step time calculated using the recurrence has a rounding error of up to half a step clock, so we recalculate the exact step time using a square root
+	// after this many recurrence calculations. This limits the accumulated error to about 4 step clocks.
+	static constexpr unsigned int MaxRecurrenceCalcs = 7;
+	static constexpr unsigned int RecurrenceMinTimeShift = 4;		// only use the recurrence when the step interval is less than 1/16 of the time from rest or to stop
+#endif
+
 private:
 	bool CalcNextStepTimeCartesianFull(const DDA &dda) SPEED_CRITICAL;
 #if SUPPORT_DELTA_MOVEMENT
 	bool CalcNextStepTimeDeltaFull(const DDA &dda) SPEED_CRITICAL;
 #endif
 
+#if SUPPORT_STEP_SEGMENTS
+	void CalcNextStepTimeFromSegments() SPEED_CRITICAL;
+	uint32_t CalcStepTimeCartesian(const DDA& dda, uint32_t stepNumber) const;
+	int32_t GetSegmentError(const DDA& dda, const StepSegment& seg, uint32_t firstStep, uint32_t stepsIntoSegment) const;
+#endif
+
+	void CalcSmoothedPressureAdvance(const DDA& dda, float compensationClocks, float smoothingClocks, float nonlinearClocks,
+										float& accelCompensationClocks, float& decelCompensationClocks) const;
+
 	static DriveMovement *freeList;
 	static int numFree;
 	static int minFree;
+	static float pressureAdvanceSteps[NumDrivers];		// the advance that smoothed pressure advance has applied to each extruder, in steps
+	static uint32_t minCalcInterval;					// the step interval below which we calculate the times of several steps at once
+	static uint32_t bunchingCounts[MaxShiftFactor + 1];	// how many step time calculations we did for each number of steps at a time
 
 	// Parameters common to Cartesian, delta and extruder moves
 
-#if !SINGLE_DRIVER
-	DriveMovement *nextDM;								// link to next DM that needs a step
-#endif
+	DriveMovement *nextDM;								// link to next DM that needs a step, or to the next free DM
 
 	DMState state;										// whether this is active or not
 	uint8_t drive;										// the drive that this DM controls
 	uint8_t direction : 1,								// true=forwards, false=backwards
 			directionChanged : 1,						// set by CalcNextStepTime if the direction is changed
-			isDeltaMovement : 1;						// true if this motor is executing a delta tower move
+			isDeltaMovement : 1,						// true if this motor is executing a delta tower move
+			recurrenceCalcs : 3,						// how many step times we have calculated using the recurrence since the last exact calculation
+			isShaped : 1;								// true if the step times come from the shaped motion profile of the DDA
 	uint8_t stepsTillRecalc;							// how soon we need to recalculate
+#if SUPPORT_INPUT_SHAPING
+	uint8_t shapedPiece;								// the piece of the shaped motion profile that the last step was in
+#endif
 
 	uint32_t totalSteps;								// total number of steps for this move
 
@@ -171,6 +271,9 @@ private:
 	uint32_t reverseStartStep;							// the step number for which we need to reverse direction due to pressure advance or delta movement
 	uint32_t nextStepTime;								// how many clocks after the start of this move the next step is due
 	uint32_t stepInterval;								// how many clocks between steps
+#if DM_USE_STEP_RECURRENCE
+	uint32_t lastCalcStepTime;							// the exact time of the last step that we calculated, which the recurrence works from because nextStepTime may be rounded down
+#endif
 
 #if DM_USE_FPU
 	float fMmPerStepTimesCdivtopSpeed;
@@ -178,6 +281,17 @@ private:
 	uint32_t mmPerStepTimesCKdivtopSpeed;
 #endif
 
+#if SUPPORT_STEP_SEGMENTS
+	// Values used to execute the step segments that the Move task calculated for this move
+	uint32_t segmentsStartStep;							// the step number at which we start using segments
+	uint32_t numSegmentSteps;							// how many steps are covered by the segments, zero if we are not using segments
+	uint32_t segmentStepsLeft;							// how many more steps there are in the current segment
+	uint32_t segmentsLeft;								// how many segments in the queue belong to this move and haven't been started yet
+	uint32_t segmentInterval;							// the current step interval in 1/65536 step clocks
+	int32_t segmentDeltaInterval;						// how much the interval changes on each step in 1/65536 step clocks
+	uint64_t segmentTime;								// the time of the last step in 1/65536 step clocks
+#endif
+
 	// At this point we are 64-bit aligned
 	// The following only needs to be stored per-drive if we are supporting pressure advance
 #if DM_USE_FPU
@@ -194,6 +308,13 @@ private:
 	uint64_t twoCsquaredTimesMmPerStepDivD;				// 2 * clock^2 * mmPerStepInHyperCuboidSpace / deceleration
 #endif
 
+#if SUPPORT_INPUT_SHAPING
+	// Values used when the step times come from the shaped motion profile of the DDA
+	float fShapedDistancePerStep;						// the fraction of the move per step, based on the steps requested before pressure advance changed totalSteps
+	float fShapedAccelCompensationClocks;				// the pressure advance times of an extruder in the acceleration and deceleration phases, zero for axes
+	float fShapedDecelCompensationClocks;
+#endif
+
 	// Parameters unique to a style of move (Cartesian, delta or extruder). Currently, extruders and Cartesian moves use the same parameters.
 	union MoveParams
 	{
@@ -207,8 +328,9 @@ private:
 #endif
 			uint32_t accelStopStep;						// the first step number at which we are no longer accelerating
 			uint32_t decelStartStep;					// the first step number at which we are decelerating
-			uint32_t compensationClocks;				// the pressure advance time in clocks
+			uint32_t compensationClocks;				// the pressure advance time in clocks used in the acceleration phase
 			uint32_t accelCompensationClocks;			// compensationClocks * (1 - startSpeed/topSpeed)
+			uint32_t decelCompensationClocks;			// the pressure advance time in clocks used in the deceleration phase
 		} cart;
 
 		struct DeltaParameters							// Parameters for delta movement
@@ -237,6 +359,15 @@ private:
 
 	static constexpr uint32_t NoStepTime = 0xFFFFFFFF;	// value to indicate that no further steps are needed when calculating the next step time
 
+#if SUPPORT_STEP_SEGMENTS
+	static constexpr uint32_t MaxSegmentErrorClocks = 2;		// the maximum difference between segment and exact step times at the points we check
+	static constexpr uint32_t InitialSegmentSteps = 8;
+
+	static StepSegmentQueue segmentQueues[NumDrivers];
+	static uint32_t segmentsGenerated;					// how many segments we have calculated
+	static uint32_t segmentQueueFullCount;				// how many times we had to calculate some steps in the ISR because a segment queue was full
+#endif
+
 #if !DM_USE_FPU
 	static constexpr uint32_t K1 = 1024;				// a power of 2 used to multiply the value mmPerStepTimesCdivtopSpeed to reduce rounding errors
 	static constexpr uint32_t K2 = 512;					// a power of 2 used in delta calculations to reduce rounding errors (but too large makes things worse)
@@ -244,6 +375,30 @@ private:
 #endif
 };
 
+// Allocate a DM from the free list. The caller must have checked that there is one.
+inline DriveMovement *DriveMovement::Allocate(size_t drive)
+{
+	DriveMovement * const dm = freeList;
+	freeList = dm->nextDM;
+	--numFree;
+	if (numFree < minFree)
+	{
+		minFree = numFree;
+	}
+	dm->nextDM = nullptr;
+	dm->drive = (uint8_t)drive;
+	dm->state = DMState::moving;
+	return dm;
+}
+
+// Return a DM to the free list
+inline void DriveMovement::Release(DriveMovement *item)
+{
+	item->nextDM = freeList;
+	freeList = item;
+	++numFree;
+}
+
 // Calculate and store the time since the start of the move when the next step for the specified DriveMovement is due.
 // Return true if there are more steps to do. When finished, leave nextStep == totalSteps + 1 and state == DMState::idle.
 // This is also used for extruders on delta machines.
@@ -253,6 +408,13 @@ inline bool DriveMovement::CalcNextStepTime(const DDA &dda)
 	++nextStep;
 	if (nextStep <= totalSteps)
 	{
+#if SUPPORT_STEP_SEGMENTS
+		if (nextStep - segmentsStartStep < numSegmentSteps)
+		{
+			CalcNextStepTimeFromSegments();
+			return true;
+		}
+#endif
 		if (stepsTillRecalc != 0)
 		{
 			--stepsTillRecalc;			// we are doing double/quad/octal stepping
@@ -272,6 +434,58 @@ inline bool DriveMovement::CalcNextStepTime(const DDA &dda)
 	return false;
 }
 
+#if SUPPORT_STEP_SEGMENTS
+
+// Calculate the next step time from the segments that the Move task prepared. This needs only additions, so it is much faster than calculating the step time.
+inline void DriveMovement::CalcNextStepTimeFromSegments()
+{
+	if (segmentStepsLeft == 0)
+	{
+		// Start the next segment. Its first step time was calculated exactly, which stops rounding errors accumulating from one segment to the next.
+		const StepSegment& seg = segmentQueues[drive].Get();
+		--segmentsLeft;
+		segmentTime = (uint64_t)seg.startTime << 16;
+		segmentInterval = seg.interval;
+		segmentDeltaInterval = seg.deltaInterval;
+		segmentStepsLeft = seg.numSteps - 1;
+		stepsTillRecalc = 0;						// in case we were double stepping when we reached the first segment
+	}
+	else
+	{
+		segmentTime += segmentInterval;
+		segmentInterval += segmentDeltaInterval;
+		--segmentStepsLeft;
+	}
+	nextStepTime = (uint32_t)(segmentTime >> 16);
+	stepInterval = segmentInterval >> 16;
+}
+
+#endif
+
+#if DM_USE_STEP_RECURRENCE
+
+// Calculate the time in step clocks taken to move some steps while accelerating, given the time since the motor would have been at rest,
+// an estimate of the answer (normally the time taken by the previous steps) and kSteps = (number of steps) * 2 * clock^2 * mmPerStep/acceleration.
+// This uses the identity (T + delta)^2 - T^2 = kSteps, i.e. delta = kSteps/(2T + delta), refining the estimate once.
+// It needs just two 32-bit divisions, which is much faster than calculating a 64-bit square root on a processor without a FPU.
+inline uint32_t DriveMovement::CalcAccelRecurrenceInterval(uint32_t timeFromRest, uint32_t estimate, uint32_t kSteps)
+{
+	const uint32_t twoT = 2 * timeFromRest;
+	const uint32_t delta = (kSteps + ((twoT + estimate) >> 1))/(twoT + estimate);
+	return (kSteps + ((twoT + delta) >> 1))/(twoT + delta);
+}
+
+// Calculate the time in step clocks taken to move some steps while decelerating, given the time remaining until the motor would come to rest.
+// This uses the identity U^2 - (U - delta)^2 = kSteps, i.e. delta = kSteps/(2U - delta). The caller must ensure that estimate < timeToStop.
+inline uint32_t DriveMovement::CalcDecelRecurrenceInterval(uint32_t timeToStop, uint32_t estimate, uint32_t kSteps)
+{
+	const uint32_t twoU = 2 * timeToStop;
+	const uint32_t delta = (kSteps + ((twoU - estimate) >> 1))/(twoU - estimate);
+	return (kSteps + ((twoU - delta) >> 1))/(twoU - delta);
+}
+
+#endif
+
 // Return the number of net steps left for the move in the forwards direction.
 // We have already taken nextSteps - 1 steps, unless nextStep is zero.
 inline int32_t DriveMovement::GetNetStepsLeft() const
@@ -0,0 +1,44 @@
+/*
+ * Histogram.cpp
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ */
+
+#include "Histogram.h"
+
+void Histogram::Clear() noexcept
+{
+	for (uint32_t& c : counts)
+	{
+		c = 0;
+	}
+}
+
+// Print the non-empty buckets of a logarithmic histogram, labelling each one with the lowest value it counts
+void Histogram::PrintLog(const StringRef& reply, const char *name) const noexcept
+{
+	reply.lcatf("%s:", name);
+	for (size_t i = 0; i < NumBuckets; ++i)
+	{
+		if (counts[i] != 0)
+		{
+			reply.catf(" %" PRIu32 "%s:%" PRIu32, (i == 0) ? 0 : (uint32_t)1 << (i - 1), (i == NumBuckets - 1) ? "+" : "", counts[i]);
+		}
+	}
+}
+
+// Print the non-empty buckets of a linear histogram, labelling each one with the lowest value it counts
+void Histogram::PrintLinear(const StringRef& reply, const char *name, uint32_t bucketWidth) const noexcept
+{
+	reply.lcatf("%s:", name);
+	for (size_t i = 0; i < NumBuckets; ++i)
+	{
+		if (counts[i] != 0)
+		{
+			reply.catf(" %" PRIu32 "%s:%" PRIu32, (uint32_t)(i * bucketWidth), (i == NumBuckets - 1) ? "+" : "", counts[i]);
+		}
+	}
+}
+
+// End
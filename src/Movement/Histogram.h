@@ -0,0 +1,36 @@
+/*
+ * Histogram.h
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ *
+ *  Fixed-bucket histograms, for recording the distribution of timings of which we would otherwise record only the maximum
+ */
+
+#ifndef SRC_MOVEMENT_HISTOGRAM_H_
+#define SRC_MOVEMENT_HISTOGRAM_H_
+
+#include "RepRapFirmware.h"
+
+// Bucket 0 counts values that are zero or negative. The other buckets are either logarithmic, where bucket n counts values from 2^(n-1) to 2^n - 1,
+// or linear with a fixed width. The last bucket also counts all values that are too large for the other buckets.
+// Values may be added from an ISR, so the caller must make sure that the histogram isn't cleared at the same time.
+class Histogram
+{
+public:
+	static constexpr size_t NumBuckets = 16;
+
+	Histogram() noexcept { Clear(); }
+
+	void Clear() noexcept;
+	void AddLog(int32_t val) noexcept { ++counts[(val <= 0) ? 0 : min<size_t>(32 - __builtin_clz((uint32_t)val), NumBuckets - 1)]; }
+	void AddLinear(uint32_t val, uint32_t bucketWidth) noexcept { ++counts[min<size_t>(val/bucketWidth, NumBuckets - 1)]; }
+
+	void PrintLog(const StringRef& reply, const char *name) const noexcept;
+	void PrintLinear(const StringRef& reply, const char *name, uint32_t bucketWidth) const noexcept;
+
+private:
+	uint32_t counts[NumBuckets];
+};
+
+#endif /* SRC_MOVEMENT_HISTOGRAM_H_ */
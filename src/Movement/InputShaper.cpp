@@ -0,0 +1,182 @@
+/*
+ * InputShaper.cpp
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ */
+
+#include "InputShaper.h"
+
+#if SUPPORT_INPUT_SHAPING
+
+#include "StepTimer.h"
+#include <RTOSIface/RTOSIface.h>
+#include <CAN/CanInterface.h>
+#include <CanMessageFormats.h>
+#include <CanMessageGenericParser.h>
+
+constexpr float MinimumFrequency = 4.0;						// the lowest frequency we accept, which limits how long the shaped acceleration phases must be
+constexpr float MaximumDampingFactor = 0.99;
+constexpr float Sqrt2 = 1.41421356;
+
+static const char * const ShaperTypeNames[] = { "none", "ZV", "ZVD", "MZV", "EI" };
+static_assert(ARRAY_SIZE(ShaperTypeNames) == (size_t)InputShaperType::numTypes);
+
+static InputShaperType shaperType = InputShaperType::none;
+static float frequency = 40.0;
+static float dampingFactor = 0.1;
+static InputShaperImpulses currentImpulses = { 0 };
+
+// Calculate the impulses for the specified shaper
+static void CalcImpulses(InputShaperType type, float freq, float zeta, InputShaperImpulses& impulses)
+{
+	const float sqrtOneMinusZetaSquared = sqrtf(1.0 - fsquare(zeta));
+	const float dampedPeriod = (float)StepTimer::StepClockRate/(freq * sqrtOneMinusZetaSquared);		// in step clocks
+	const float k = expf(-zeta * Pi/sqrtOneMinusZetaSquared);
+	switch (type)
+	{
+	case InputShaperType::zv:
+		impulses.numImpulses = 2;
+		impulses.amplitudes[0] = 1.0;
+		impulses.amplitudes[1] = k;
+		impulses.delays[1] = 0.5 * dampedPeriod;
+		break;
+
+	case InputShaperType::zvd:
+		impulses.numImpulses = 3;
+		impulses.amplitudes[0] = 1.0;
+		impulses.amplitudes[1] = 2 * k;
+		impulses.amplitudes[2] = fsquare(k);
+		impulses.delays[1] = 0.5 * dampedPeriod;
+		impulses.delays[2] = dampedPeriod;
+		break;
+
+	case InputShaperType::mzv:
+		{
+			const float k2 = expf(-0.75 * zeta * Pi/sqrtOneMinusZetaSquared);
+			const float a1 = 1.0 - 1.0/Sqrt2;
+			impulses.numImpulses = 3;
+			impulses.amplitudes[0] = a1;
+			impulses.amplitudes[1] = (Sqrt2 - 1.0) * k2;
+			impulses.amplitudes[2] = a1 * fsquare(k2);
+			impulses.delays[1] = 0.375 * dampedPeriod;
+			impulses.delays[2] = 0.75 * dampedPeriod;
+		}
+		break;
+
+	case InputShaperType::ei:
+		{
+			constexpr float VibrationTolerance = 0.05;
+			const float a1 = 0.25 * (1.0 + VibrationTolerance);
+			impulses.numImpulses = 3;
+			impulses.amplitudes[0] = a1;
+			impulses.amplitudes[1] = 0.5 * (1.0 - VibrationTolerance) * k;
+			impulses.amplitudes[2] = a1 * fsquare(k);
+			impulses.delays[1] = 0.5 * dampedPeriod;
+			impulses.delays[2] = dampedPeriod;
+		}
+		break;
+
+	case InputShaperType::none:
+	default:
+		impulses.numImpulses = 0;
+		return;
+	}
+
+	// Normalise the amplitudes so that shaping doesn't change the total speed change
+	impulses.delays[0] = 0.0;
+	float sum = 0.0;
+	for (size_t i = 0; i < impulses.numImpulses; ++i)
+	{
+		sum += impulses.amplitudes[i];
+	}
+	for (size_t i = 0; i < impulses.numImpulses; ++i)
+	{
+		impulses.amplitudes[i] /= sum;
+	}
+}
+
+// Process a request from the main board to configure input shaping. Parameters are P (shaper type), F (frequency in Hz) and S (damping factor).
+GCodeResult InputShaper::Configure(const CanMessageGeneric& msg, const StringRef& reply)
+{
+	CanMessageGenericParser parser(msg, M593Params);
+	bool seen = false;
+	InputShaperType newType = shaperType;
+	float newFrequency = frequency;
+	float newDampingFactor = dampingFactor;
+
+	uint8_t typeVal;
+	if (parser.GetUintParam('P', typeVal))
+	{
+		if (typeVal >= (uint8_t)InputShaperType::numTypes)
+		{
+			reply.printf("Unknown input shaper type %u", typeVal);
+			return GCodeResult::error;
+		}
+		seen = true;
+		newType = (InputShaperType)typeVal;
+	}
+
+	if (parser.GetFloatParam('F', newFrequency))
+	{
+		if (newFrequency < MinimumFrequency)
+		{
+			reply.printf("Input shaping frequency must be at least %.1fHz", (double)MinimumFrequency);
+			return GCodeResult::error;
+		}
+		seen = true;
+	}
+
+	if (parser.GetFloatParam('S', newDampingFactor))
+	{
+		if (newDampingFactor < 0.0 || newDampingFactor > MaximumDampingFactor)
+		{
+			reply.copy("Input shaping damping factor out of range");
+			return GCodeResult::error;
+		}
+		seen = true;
+	}
+
+	if (seen)
+	{
+		InputShaperImpulses newImpulses;
+		CalcImpulses(newType, newFrequency, newDampingFactor, newImpulses);
+
+		// The Move task reads the impulses when it sets up each move, so make sure that it never sees a partly-updated set
+		TaskCriticalSectionLocker lock;
+		shaperType = newType;
+		frequency = newFrequency;
+		dampingFactor = newDampingFactor;
+		currentImpulses = newImpulses;
+	}
+	else
+	{
+		reply.printf("Board %u input shaping: %s", CanInterface::GetCanAddress(), ShaperTypeNames[(size_t)shaperType]);
+		if (shaperType != InputShaperType::none)
+		{
+			reply.catf(" at %.1fHz damping factor %.2f, impulses", (double)frequency, (double)dampingFactor);
+			for (size_t i = 0; i < currentImpulses.numImpulses; ++i)
+			{
+				reply.catf(" %.3f@%.1fms", (double)currentImpulses.amplitudes[i], (double)(currentImpulses.delays[i] * StepTimer::StepClocksToMillis));
+			}
+		}
+	}
+	return GCodeResult::ok;
+}
+
+// Get a consistent copy of the current shaper impulses
+void InputShaper::GetImpulses(InputShaperImpulses& impulses)
+{
+	TaskCriticalSectionLocker lock;
+	impulses = currentImpulses;
+}
+
+// Return true if moves may be shaped. The Move task uses this to decide whether a new move may need a shaped profile.
+bool InputShaper::IsEnabled()
+{
+	return currentImpulses.numImpulses != 0;
+}
+
+#endif
+
+// End
@@ -0,0 +1,67 @@
+/*
+ * InputShaper.h
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ *
+ *  Input shaping of the moves executed by this board, configured by the main board over CAN
+ */
+
+#ifndef SRC_MOVEMENT_INPUTSHAPER_H_
+#define SRC_MOVEMENT_INPUTSHAPER_H_
+
+#include "RepRapFirmware.h"
+
+#if SUPPORT_INPUT_SHAPING
+
+#if !__FPU_USED
+# error Input shaping needs a FPU
+#endif
+
+#include "GCodes/GCodeResult.h"
+
+class CanMessageGeneric;
+
+enum class InputShaperType : uint8_t
+{
+	none = 0,
+	zv,							// zero vibration
+	zvd,						// zero vibration and derivative
+	mzv,						// modified zero vibration
+	ei,							// extra insensitive with 5% vibration tolerance
+	numTypes
+};
+
+// The impulses of an input shaper. The amplitudes sum to 1.0 and the first impulse has zero delay.
+struct InputShaperImpulses
+{
+	static constexpr size_t MaxImpulses = 3;
+
+	size_t numImpulses;			// zero if input shaping is disabled
+	float amplitudes[MaxImpulses];
+	float delays[MaxImpulses];	// in step clocks
+
+	float GetDuration() const { return (numImpulses == 0) ? 0.0 : delays[numImpulses - 1]; }
+	float GetMeanDelay() const;	// Get the mean delay weighted by the amplitudes, which is when the speed change is centred
+};
+
+inline float InputShaperImpulses::GetMeanDelay() const
+{
+	float sum = 0.0;
+	for (size_t i = 0; i < numImpulses; ++i)
+	{
+		sum += amplitudes[i] * delays[i];
+	}
+	return sum;
+}
+
+namespace InputShaper
+{
+	GCodeResult Configure(const CanMessageGeneric& msg, const StringRef& reply);
+	void GetImpulses(InputShaperImpulses& impulses);		// Get a consistent copy of the current shaper impulses
+	bool IsEnabled();										// Return true if moves may be shaped
+}
+
+#endif
+
+#endif /* SRC_MOVEMENT_INPUTSHAPER_H_ */
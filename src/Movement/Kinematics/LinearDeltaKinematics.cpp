@@ -28,6 +28,7 @@ void LinearDeltaKinematics::Init()
 	printRadius = DefaultPrintRadius;
 	homedHeight = DefaultDeltaHomedHeight;
     doneAutoCalibration = false;
+	configuredTowers = 0;
 
 	for (size_t axis = 0; axis < UsualNumTowers; ++axis)
 	{
@@ -77,6 +78,19 @@ void LinearDeltaKinematics::Recalc()
 	printRadiusSquared = fsquare(printRadius);
 }
 
+// Set the geometry of one tower directly. The tower number is the local driver number that moves its carriage.
+void LinearDeltaKinematics::SetTowerGeometry(size_t tower, float x, float y, float diagonal)
+{
+	if (tower < MaxTowers)
+	{
+		towerX[tower] = x;
+		towerY[tower] = y;
+		diagonals[tower] = diagonal;
+		D2[tower] = fsquare(diagonal);
+		configuredTowers |= 1u << tower;
+	}
+}
+
 // Calculate the motor position for a single tower from a Cartesian coordinate.
 float LinearDeltaKinematics::Transform(const float machinePos[], size_t axis) const
 {
@@ -30,6 +30,10 @@ public:
     float GetTowerY(size_t axis) const { return towerY[axis]; }
 	float GetHomedHeight() const { return homedHeight; }
 
+	// Functions used when the main board sends us the geometry of the towers that our drivers move
+	void SetTowerGeometry(size_t tower, float x, float y, float diagonal);
+	uint32_t GetConfiguredTowers() const { return configuredTowers; }
+
 private:
 	void Init();
 	void Recalc();
@@ -72,6 +76,7 @@ private:
 	float Q, Q2;
 	float D2[MaxTowers];
 
+	uint32_t configuredTowers;							// Bitmap of the towers whose geometry the main board has sent us
 	bool doneAutoCalibration;							// True if we have done auto calibration
 };
 
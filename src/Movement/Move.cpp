@@ -42,14 +42,26 @@
 #include <CAN/CanInterface.h>
 #include <CanMessageFormats.h>
 #include <CanMessageBuffer.h>
+#include <CanMessageGenericParser.h>
 #include <TaskPriorities.h>
 
+#if SUPPORT_DELTA_MOVEMENT
+# include "Kinematics/LinearDeltaKinematics.h"
+#endif
+
+#if SUPPORT_MOVE_PWM
+# include <GPIO/GpioPorts.h>
+#endif
+
 #if 1	//debug
 unsigned int moveCompleteTimeoutErrs;
 unsigned int getCanMoveTimeoutErrs;
 #endif
 
-constexpr size_t MoveTaskStackWords = 200;
+constexpr size_t MoveTaskStackWords = 230;								// allow for expanding a batched move message on the stack
+#if SUPPORT_DELTA_MOVEMENT
+constexpr uint32_t KinematicsLockTimeoutMillis = 100;					// how long ConfigureDeltaTower waits for the Move task to finish setting up a move
+#endif
 static Task<MoveTaskStackWords> *moveTask;
 
 extern "C" [[noreturn]] void MoveLoop(void * param) noexcept
@@ -58,7 +70,17 @@ extern "C" [[noreturn]] void MoveLoop(void * param) noexcept
 }
 
 Move::Move()
-	: currentDda(nullptr), extrudersPrinting(false), taskWaitingForMoveToComplete(nullptr), scheduledMoves(0), completedMoves(0), numHiccups(0)
+	: currentDda(nullptr), extrudersPrinting(false), taskWaitingForMoveToComplete(nullptr), scheduledMoves(0), completedMoves(0), numBatchedMoves(0), numDeltaMoves(0), numHiccups(0),
+	  lastMoveFinishTime(0), lastQueueStatusMillis(0), lastReportedMovesQueued(0), queueLowReported(false), numQueueStatusMessages(0), numQueueLowWarnings(0),
+	  numStepInterrupts(0), stepInterruptClocks(0), maxStepInterruptClocks(0),
+	  governorWindowStart(0), governorIsrClocks(0), governorHiccups(0), maxIsrLoad(0),
+	  minBunchingInterval(DDA::MinCalcIntervalCartesian), maxBunchingInterval(DDA::MinCalcIntervalCartesian), numBunchingIncreases(0), numBunchingDecreases(0)
+#if SUPPORT_MOVE_PROFILE
+	  , moveProfileNextIndex(0), moveProfileCount(0), moveProfileEnabled(false)
+#endif
+#if SUPPORT_MOVE_PWM
+	  , numPwmMoves(0), lastPwmRampTime(0), pwmPortsUsed(0)
+#endif
 {
 	kinematics = Kinematics::Create(KinematicsType::cartesian);			// default to Cartesian
 
@@ -74,6 +96,11 @@ Move::Move()
 	ddaRingAddPointer->SetNext(dda);
 	dda->SetPrevious(ddaRingAddPointer);
 
+	DriveMovement::InitialAllocate(NumDms);
+#if SUPPORT_INPUT_SHAPING
+	ShapedProfile::InitialAllocate(NumShapedProfiles);
+#endif
+
 	timer.SetCallback(Move::TimerCallback, static_cast<void*>(this));
 
 	for (size_t i = 0; i < NumDrivers; ++i)
@@ -95,6 +122,13 @@ void Move::Init()
 
 	currentDda = nullptr;
 	maxPrepareTime = 0;
+#if SUPPORT_STEP_SEGMENTS
+	DriveMovement::InitSegmentQueues();
+#endif
+
+#if SUPPORT_DELTA_MOVEMENT
+	kinematicsMutex.Create("Kinematics");
+#endif
 
 	moveTask = new Task<MoveTaskStackWords>;
 	moveTask->Create(MoveLoop, "Move", this, TaskPriority::MovePriority);
@@ -105,6 +139,18 @@ void Move::Exit()
 	StepTimer::DisableTimerInterrupt();
 	moveTask->TerminateAndUnlink();
 
+#if SUPPORT_MOVE_PWM
+	// Turn off any laser or spindle that the moves were driving. The step interrupt is disabled, so we can write the ports directly.
+	GpioPorts::CancelIsrWrites();
+	for (unsigned int port = 0; port < MaxGpOutPorts; ++port)
+	{
+		if (pwmPortsUsed & (1u << port))
+		{
+			GpioPorts::WriteOutput(port, 0.0);
+		}
+	}
+#endif
+
 	// Clear the DDA ring so that we don't report any moves as pending
 	currentDda = nullptr;
 	while (ddaRingGetPointer != ddaRingAddPointer)
@@ -115,16 +161,60 @@ void Move::Exit()
 
 	while (ddaRingCheckPointer->GetState() == DDA::completed)
 	{
-		(void)ddaRingCheckPointer->Free();
+		ddaRingCheckPointer->Free();
 		ddaRingCheckPointer = ddaRingCheckPointer->GetNext();
 	}
 }
 
+// Recycle the DDAs for completed moves, checking for DDA errors to print if Move debug is enabled
+void Move::RecycleDDAs() noexcept
+{
+	while (ddaRingCheckPointer->GetState() == DDA::completed)
+	{
+		// Check for step errors and record/print them if we have any, before we lose the DMs
+		if (ddaRingCheckPointer->HasStepError())
+		{
+			if (Platform::Debug(moduleMove))
+			{
+				ddaRingCheckPointer->DebugPrintAll();
+			}
+			Platform::LogError(ErrorCode::BadMove);
+		}
+
+		// Now release the DMs and check for underrun
+		ddaRingCheckPointer->Free();
+		ddaRingCheckPointer = ddaRingCheckPointer->GetNext();
+	}
+}
+
+// Wait for the oldest move in the ring to complete, or for a timeout
+void Move::WaitForMoveToComplete() noexcept
+{
+	{
+		AtomicCriticalSectionLocker lock;
+
+		if (ddaRingCheckPointer->GetState() == DDA::completed)
+		{
+			return;
+		}
+		taskWaitingForMoveToComplete = TaskBase::GetCallerTaskHandle();
+	}
+#if 1	//debug
+	if (!TaskBase::Take(2000) && ddaRingCheckPointer->GetState() == DDA::completed)
+	{
+		++moveCompleteTimeoutErrs;
+	}
+#else
+	TaskBase::Take();
+#endif
+}
+
 // Start the next move. Return true if laser or IO bits need to be active
 // Must be called with base priority greater than or equal to the step interrupt, to avoid a race with the step ISR.
 // startTime is the earliest that we can start the move, but we must not start it before its planned time
 inline void Move::StartNextMove(DDA *cdda, uint32_t startTime)
 {
+	ringOccupancyHistogram.AddLinear(scheduledMoves - completedMoves, RingOccupancyBucketWidth);
 	if (!cdda->IsPrintingMove())
 	{
 		extrudersPrinting = false;
@@ -138,118 +228,293 @@ inline void Move::StartNextMove(DDA *cdda, uint32_t startTime)
 	cdda->Start(startTime);
 }
 
-[[noreturn]] void Move::TaskLoop() noexcept
+// Add a move to the ring, waiting until there is a free DDA and enough DMs for it, and start executing it if we are not already executing a move
+// If pwm is not null then the move writes that laser or spindle PWM when it starts and when it completes
+void Move::AddMove(const CanMessageMovementLinear& msg, const CanMessageMovementDelta *deltaMsg, const MovePwm *pwm) noexcept
 {
-	while (true)
+	for (;;)
 	{
-		for (;;)
+		RecycleDDAs();
+
+		// If we have a free slot for a new move, quit this loop
+		if (ddaRingAddPointer->GetState() == DDA::empty)
 		{
-			// Recycle the DDAs for completed moves, checking for DDA errors to print if Move debug is enabled
-			while (ddaRingCheckPointer->GetState() == DDA::completed)
-			{
-				// Check for step errors and record/print them if we have any, before we lose the DMs
-				if (ddaRingCheckPointer->HasStepError())
-				{
-					if (Platform::Debug(moduleMove))
-					{
-						ddaRingCheckPointer->DebugPrintAll();
-					}
-					Platform::LogError(ErrorCode::BadMove);
-				}
+			break;
+		}
 
-				// Now release the DMs and check for underrun
-				ddaRingCheckPointer->Free();
-				ddaRingCheckPointer = ddaRingCheckPointer->GetNext();
-			}
+		(void)CheckQueueStatus();													// tell the main board that our queue is full
+		WaitForMoveToComplete();
+	}
 
-			// If we have a free slot for a new move, quit this loop
-			if (ddaRingAddPointer->GetState() == DDA::empty)
-			{
-				break;
-			}
+	// Make sure we have enough DMs for this move. The moves that are using them will complete eventually, because whenever the ring isn't empty we are executing a move.
+	const unsigned int dmsNeeded = DDA::NumDmsNeeded(msg);
+	for (;;)
+	{
+		RecycleDDAs();
+		if ((unsigned int)DriveMovement::NumFree() >= dmsNeeded)
+		{
+			break;
+		}
+		WaitForMoveToComplete();
+	}
 
-			// Wait for a move to complete
-			{
-				AtomicCriticalSectionLocker lock;
+#if SUPPORT_INPUT_SHAPING
+	// If input shaping is enabled then this move may need a shaped profile, so make sure there is one free
+	for (;;)
+	{
+		RecycleDDAs();
+		if (ShapedProfile::NumFree() != 0 || !InputShaper::IsEnabled())
+		{
+			break;
+		}
+		WaitForMoveToComplete();
+	}
+#endif
 
-				if (ddaRingCheckPointer->GetState() == DDA::completed)
-				{
-					continue;
-				}
-				taskWaitingForMoveToComplete = TaskBase::GetCallerTaskHandle();
-			}
-#if 1	//debug
-			if (!TaskBase::Take(2000) && ddaRingCheckPointer->GetState() == DDA::completed)
+	if (Platform::Debug(moduleMove))
+	{
+		// Print the move in the format that the StepTimeSim tool replays. We use several calls because this task doesn't have the stack for a long string.
+		debugPrintf("mv %" PRIu32 " %" PRIu32 " %" PRIu32 " %" PRIu32 " %.7f %.7f %x",
+					msg.whenToExecute, msg.accelerationClocks, msg.steadyClocks, msg.decelClocks,
+					(double)msg.initialSpeedFraction, (double)msg.finalSpeedFraction, (unsigned int)msg.pressureAdvanceDrives);
+		for (size_t drive = 0; drive < msg.numDrivers; ++drive)
+		{
+			debugPrintf(" %" PRIi32, msg.perDrive[drive].steps);
+		}
+		debugPrintf("\n");
+	}
+
+	MicrosecondsTimer prepareTimer;
+#if SUPPORT_MOVE_PWM
+	ddaRingAddPointer->SetPwm(pwm);
+#endif
+	if (ddaRingAddPointer->Init(msg, deltaMsg))
+	{
+		lastMoveFinishTime = ddaRingAddPointer->GetMoveFinishTime();
+		ddaRingAddPointer = ddaRingAddPointer->GetNext();
+		scheduledMoves++;
+	}
+	const uint32_t elapsedTime = prepareTimer.Read();
+	if (elapsedTime > Move::maxPrepareTime)
+	{
+		Move::maxPrepareTime = elapsedTime;
+	}
+	prepareTimeHistogram.AddLog((int32_t)elapsedTime);
+
+	// See whether we need to kick off a move
+	if (currentDda == nullptr)
+	{
+		// No DDA is executing, so start executing a new one if possible
+		DDA * const cdda = ddaRingGetPointer;										// capture volatile variable
+		if (cdda->GetState() == DDA::frozen)
+		{
+			IrqDisable();
+			StartNextMove(cdda, StepTimer::GetTimerTicks());
+			if (cdda->ScheduleNextStepInterrupt(timer))
 			{
-				++moveCompleteTimeoutErrs;
+				Interrupt();
 			}
-#else
-			TaskBase::Take();
-#endif
-		};
+			IrqEnable();
+		}
+	}
+}
 
-		// Get another move and add it to the ring
-#if 1	//debug
+[[noreturn]] void Move::TaskLoop() noexcept
+{
+	while (true)
+	{
+		// Get another move message, reporting our queue status to the main board while we wait
 		CanMessageBuffer *buf;
 		for (;;)
 		{
-			buf = CanInterface::GetCanMove(2000);
+			const uint32_t waitTime = CheckQueueStatus();
+			buf = CanInterface::GetCanMove(waitTime);
 			if (buf != nullptr)
 			{
 				break;
 			}
-			buf = CanInterface::GetCanMove(0);
-			if (buf != nullptr)
+#if 1	//debug
+			if (waitTime == IdleMoveWaitMillis)
 			{
-				++getCanMoveTimeoutErrs;
-				break;
+				buf = CanInterface::GetCanMove(0);
+				if (buf != nullptr)
+				{
+					++getCanMoveTimeoutErrs;
+					break;
+				}
 			}
+#endif
 		}
-#else
-		CanMessageBuffer *buf = CanInterface::GetCanMove(TaskBase::TimeoutUnlimited);
+
+#if SUPPORT_DELTA_MOVEMENT
+		MutexLocker lock(kinematicsMutex);								// DDA::Init reads the kinematics, so don't let ConfigureDeltaTower change them until we have added the moves
 #endif
-		MicrosecondsTimer prepareTimer;
-		if (ddaRingAddPointer->Init(buf->msg.moveLinear))
+		if (buf->id.MsgType() == CanMessageType::movementLinearBatch)
 		{
-			ddaRingAddPointer = ddaRingAddPointer->GetNext();
-			scheduledMoves++;
+			// Add all the moves in the batch to the ring before we look for another message. Each move starts when the previous one ends.
+			// The CAN receiver has already checked that numMoves is in range and that the message is long enough to hold that many moves.
+			const CanMessageMovementLinearBatch& batch = buf->msg.moveLinearBatch;
+			CanMessageMovementLinear move;
+			uint32_t startTime = batch.whenToExecute;
+			for (size_t i = 0; i < batch.numMoves; ++i)
+			{
+				batch.GetMove(i, move);													// this sets up everything except the start time
+				move.whenToExecute = startTime;
+				startTime += move.accelerationClocks + move.steadyClocks + move.decelClocks;
+				AddMove(move);
+			}
+			numBatchedMoves += batch.numMoves;
 		}
-		const uint32_t elapsedTime = prepareTimer.Read();
-		if (elapsedTime > Move::maxPrepareTime)
+#if SUPPORT_DELTA_MOVEMENT
+		else if (buf->id.MsgType() == CanMessageType::movementDelta)
 		{
-			Move::maxPrepareTime = elapsedTime;
+			// If we haven't been told the tower geometry then we execute the move as if it were linear, which gets the end position right but not the path
+			const CanMessageMovementDelta& deltaMsg = buf->msg.moveDelta;
+			CanMessageMovementLinear move;
+			deltaMsg.GetLinearMove(move);
+			if (kinematics->GetKinematicsType() == KinematicsType::linearDelta)
+			{
+				AddMove(move, &deltaMsg);
+				++numDeltaMoves;
+			}
+			else
+			{
+				AddMove(move);
+			}
 		}
-
-		CanMessageBuffer::Free(buf);
-
-		// See whether we need to kick off a move
-		if (currentDda == nullptr)
+#endif
+#if SUPPORT_MOVE_PWM
+		else if (buf->id.MsgType() == CanMessageType::movementLinearPwm)
 		{
-			// No DDA is executing, so start executing a new one if possible
-			DDA * const cdda = ddaRingGetPointer;										// capture volatile variable
-			if (cdda->GetState() == DDA::frozen)
+			// A linear move that also sets a laser or spindle PWM port configured by M950. If we don't have that port then we execute the move without the PWM.
+			const CanMessageMovementLinearPwm& pwmMsg = buf->msg.moveLinearPwm;
+			CanMessageMovementLinear move;
+			pwmMsg.GetLinearMove(move);
+			if (pwmMsg.pwmPort < MaxGpOutPorts)
 			{
-				IrqDisable();
-				StartNextMove(cdda, StepTimer::GetTimerTicks());
-				if (cdda->ScheduleNextStepInterrupt(timer))
-				{
-					Interrupt();
-				}
-				IrqEnable();
+				MovePwm pwm;
+				pwm.startPwm = (float)pwmMsg.startPwm * (1.0/65535);
+				pwm.endPwm = (float)pwmMsg.endPwm * (1.0/65535);
+				pwm.port = pwmMsg.pwmPort;
+				pwm.ramp = pwmMsg.rampPwm;
+				GpioPorts::StartIsrWrites();
+				pwmPortsUsed |= 1u << pwm.port;
+				AddMove(move, nullptr, &pwm);
+				++numPwmMoves;
+			}
+			else
+			{
+				AddMove(move);
 			}
 		}
+#endif
+		else
+		{
+			AddMove(buf->msg.moveLinear);
+		}
+
+		CanMessageBuffer::Free(buf);
 	}
 }
 
 void Move::Diagnostics(const StringRef& reply)
 {
-	reply.catf("Moves scheduled %" PRIu32 ", completed %" PRIu32 ", in progress %d, hiccups %" PRIu32 ", step errors %u, maxPrep %" PRIu32 ", maxOverdue %" PRIu32 ", maxInc %" PRIu32,
-					scheduledMoves, completedMoves, (int)(currentDda != nullptr), numHiccups, DDA::GetAndClearStepErrors(), maxPrepareTime, DDA::GetAndClearMaxTicksOverdue(), DDA::GetAndClearMaxOverdueIncrement());
+	reply.catf("Moves scheduled %" PRIu32 " (batched %" PRIu32 ", delta %" PRIu32 "), completed %" PRIu32 ", in progress %d, hiccups %" PRIu32 ", step errors %u, maxPrep %" PRIu32 ", maxOverdue %" PRIu32 ", maxInc %" PRIu32,
+					scheduledMoves, numBatchedMoves, numDeltaMoves, completedMoves, (int)(currentDda != nullptr), numHiccups, DDA::GetAndClearStepErrors(), maxPrepareTime, DDA::GetAndClearMaxTicksOverdue(), DDA::GetAndClearMaxOverdueIncrement());
 	numHiccups = 0;
 	maxPrepareTime = 0;
 #if 1	//debug
 	reply.catf(", mcErrs %u, gcmErrs %u", moveCompleteTimeoutErrs, getCanMoveTimeoutErrs);
 #endif
+#if SUPPORT_MOVE_PWM
+	reply.catf(", PWM moves %" PRIu32, numPwmMoves);
+#endif
+	reply.lcatf("Queue status messages %" PRIu32 ", low queue warnings %" PRIu32, numQueueStatusMessages, numQueueLowWarnings);
+	numQueueStatusMessages = numQueueLowWarnings = 0;
+	reply.lcatf("DDA ring length %u, DMs %u, free %d, min free %d", DdaRingLength, NumDms, DriveMovement::NumFree(), DriveMovement::GetAndClearMinFree());
+#if SUPPORT_INPUT_SHAPING
+	reply.catf(", shaped profiles %u, free %u, min free %u, not shaped because of pressure advance %u",
+				NumShapedProfiles, ShapedProfile::NumFree(), ShapedProfile::GetAndClearMinFree(), ShapedProfile::GetAndClearUnshapedMoves());
+#endif
+}
+
+// Report the step generation statistics and the state of the step bunching governor
+void Move::StepDiagnostics(const StringRef& reply) noexcept
+{
+	// Report the step timing statistics. Capture and clear them with interrupts disabled so that they are consistent with each other.
+	uint32_t locNumStepInterrupts, locStepInterruptClocks, locMaxStepInterruptClocks, stepsGenerated, maxStepLateness;
+	uint32_t locMaxIsrLoad, locMinBunchingInterval, locMaxBunchingInterval, locNumBunchingIncreases, locNumBunchingDecreases;
+	{
+		AtomicCriticalSectionLocker lock;
+		locNumStepInterrupts = numStepInterrupts;
+		locStepInterruptClocks = stepInterruptClocks;
+		locMaxStepInterruptClocks = maxStepInterruptClocks;
+		stepsGenerated = DDA::GetAndClearStepsGenerated();
+		maxStepLateness = DDA::GetAndClearMaxStepLateness();
+		numStepInterrupts = stepInterruptClocks = maxStepInterruptClocks = 0;
+
+		locMaxIsrLoad = maxIsrLoad;
+		locMinBunchingInterval = minBunchingInterval;
+		locMaxBunchingInterval = maxBunchingInterval;
+		locNumBunchingIncreases = numBunchingIncreases;
+		locNumBunchingDecreases = numBunchingDecreases;
+		maxIsrLoad = numBunchingIncreases = numBunchingDecreases = 0;
+		minBunchingInterval = maxBunchingInterval = DriveMovement::GetMinCalcInterval();
+	}
+	uint32_t bunchingCounts[DriveMovement::MaxShiftFactor + 1];
+	DriveMovement::GetAndClearBunchingCounts(bunchingCounts);
+	reply.catf("Step interrupts %" PRIu32 ", steps %" PRIu32 ", ISR time per step %.2fus, max ISR time %.1fus, max step late %.1fus",
+					locNumStepInterrupts, stepsGenerated,
+					(double)((stepsGenerated == 0) ? 0.0f : StepTimer::TicksToFloatMicroseconds(locStepInterruptClocks)/stepsGenerated),
+					(double)StepTimer::TicksToFloatMicroseconds(locMaxStepInterruptClocks), (double)StepTimer::TicksToFloatMicroseconds(maxStepLateness));
+	reply.lcatf("Step calcs single %" PRIu32 ", double %" PRIu32 ", quad %" PRIu32 ", octal %" PRIu32 ", hex %" PRIu32,
+					bunchingCounts[0], bunchingCounts[1], bunchingCounts[2], bunchingCounts[3], bunchingCounts[4]);
+	reply.lcatf("Bunching interval %.1fus (min %.1f, max %.1f, raised %" PRIu32 ", lowered %" PRIu32 "), max ISR load %" PRIu32 "%%",
+					(double)StepTimer::TicksToFloatMicroseconds(DriveMovement::GetMinCalcInterval()),
+					(double)StepTimer::TicksToFloatMicroseconds(locMinBunchingInterval), (double)StepTimer::TicksToFloatMicroseconds(locMaxBunchingInterval),
+					locNumBunchingIncreases, locNumBunchingDecreases, (locMaxIsrLoad * 100)/256);
+#if SUPPORT_STEP_SEGMENTS
+	reply.lcatf("Step segments %" PRIu32 ", segment queue full %" PRIu32,
+					DriveMovement::GetAndClearSegmentsGenerated(), DriveMovement::GetAndClearSegmentQueueFullCount());
+#endif
+}
+
+// Report one of the timing histograms. Each bucket is labelled with the smallest value that it counts.
+// We report only one histogram per request because all of them together could overflow the reply, and then we would clear counts that we never reported.
+void Move::HistogramDiagnostics(const StringRef& reply, unsigned int which, bool clear) noexcept
+{
+	Histogram *h;
+	switch (which)
+	{
+	case 0:
+		h = &stepInterruptHistogram;
+		h->PrintLog(reply, "Step ISR clocks");
+		break;
+
+	case 1:
+		h = &DDA::stepLatenessHistogram;
+		h->PrintLog(reply, "Step lateness clocks");
+		break;
+
+	case 2:
+		h = &prepareTimeHistogram;
+		h->PrintLog(reply, "Move prepare us");
+		break;
+
+	case 3:
+		h = &ringOccupancyHistogram;
+		h->PrintLinear(reply, "Moves queued at move start", RingOccupancyBucketWidth);
+		break;
+
+	default:
+		return;
+	}
+
+	if (clear)
+	{
+		AtomicCriticalSectionLocker lock;						// the step ISR adds to some of the histograms
+		h->Clear();
+	}
 }
 
 # if 0
@@ -279,6 +544,77 @@ bool Move::SetKinematics(KinematicsType k)
 	return true;
 }
 
+#if SUPPORT_DELTA_MOVEMENT
+
+// Process a request from the main board to set the delta geometry of one of our drivers. Parameters are P (local driver number), X and Y (tower position) and D (diagonal rod length).
+// The Move task reads the geometry when it sets up each delta move, and the queued moves were planned with the old geometry, so we refuse to change it while moves are queued.
+// The Move task holds the kinematics lock while it sets up moves, including while it waits for a move to complete, so if we can't get it soon then moves are queued.
+GCodeResult Move::ConfigureDeltaTower(const CanMessageGeneric& msg, const StringRef& reply) noexcept
+{
+	CanMessageGenericParser parser(msg, M665Params);
+	uint8_t driver;
+	if (!parser.GetUintParam('P', driver) || driver >= NumDrivers)
+	{
+		reply.copy("Missing or bad driver number");
+		return GCodeResult::error;
+	}
+
+	// The get pointer is at the oldest move that hasn't completed. If there are no moves queued then it is at a DDA that is empty or waiting to be recycled.
+	MutexLocker lock(kinematicsMutex, KinematicsLockTimeoutMillis);
+	const DDA::DDAState oldestState = ddaRingGetPointer->GetState();
+	const bool movesQueued = !lock || (oldestState != DDA::empty && oldestState != DDA::completed);
+	if (kinematics->GetKinematicsType() != KinematicsType::linearDelta)
+	{
+		if (movesQueued)
+		{
+			reply.copy("Can't change to delta kinematics while moves are queued");
+			return GCodeResult::error;
+		}
+		if (!SetKinematics(KinematicsType::linearDelta))
+		{
+			reply.copy("Delta kinematics not supported");
+			return GCodeResult::error;
+		}
+	}
+
+	LinearDeltaKinematics& deltaKin = static_cast<LinearDeltaKinematics&>(*kinematics);
+	float towerX = deltaKin.GetTowerX(driver);
+	float towerY = deltaKin.GetTowerY(driver);
+	float diagonal = fastSqrtf(deltaKin.GetDiagonalSquared(driver));
+	bool seen = parser.GetFloatParam('X', towerX);
+	seen = parser.GetFloatParam('Y', towerY) || seen;
+	seen = parser.GetFloatParam('D', diagonal) || seen;
+	if (seen)
+	{
+		if (diagonal <= 0.0)
+		{
+			reply.copy("Diagonal rod length must be positive");
+			return GCodeResult::error;
+		}
+		if (movesQueued)
+		{
+			reply.copy("Can't change the delta geometry while moves are queued");
+			return GCodeResult::error;
+		}
+		deltaKin.SetTowerGeometry(driver, towerX, towerY, diagonal);
+	}
+	else
+	{
+		reply.printf("Driver %u.%u delta tower ", CanInterface::GetCanAddress(), driver);
+		if (deltaKin.GetConfiguredTowers() & (1u << driver))
+		{
+			reply.catf("at X%.3f Y%.3f diagonal %.3f", (double)towerX, (double)towerY, (double)diagonal);
+		}
+		else
+		{
+			reply.cat("not configured");
+		}
+	}
+	return GCodeResult::ok;
+}
+
+#endif
+
 // This is called from the step ISR when the current move has been completed
 // The state field of currentDda must be set to DDAState::completed before calling this
 void Move::CurrentMoveCompleted()
@@ -287,6 +623,15 @@ void Move::CurrentMoveCompleted()
 	{
 		extrusionAccumulators[driver] += currentDda->GetStepsTaken(driver);
 	}
+#if SUPPORT_MOVE_PROFILE
+	if (moveProfileEnabled)
+	{
+		RecordMoveProfile(*currentDda, StepTimer::GetTimerTicks());
+	}
+#endif
+#if SUPPORT_MOVE_PWM
+	currentDda->FinishPwm();
+#endif
 	currentDda = nullptr;
 	ddaRingGetPointer = ddaRingGetPointer->GetNext();
 	completedMoves++;
@@ -304,7 +649,18 @@ int32_t Move::GetPosition(size_t driver) const
 	return ddaRingAddPointer->GetPrevious()->GetPosition(driver);
 }
 
-void Move::StopDrivers(uint16_t whichDrivers)
+// Get the position of a driver now, including the steps taken so far in the current move. Call this with the step interrupt disabled.
+int32_t Move::GetLivePosition(size_t driver) const noexcept
+{
+	// When a move is executing the get pointer points to it, otherwise it points to the next move to be executed
+	const DDA * const cdda = currentDda;							// capture volatile variable
+	return ddaRingGetPointer->GetPrevious()->GetPosition(driver) + ((cdda == nullptr) ? 0 : cdda->GetStepsTaken(driver));
+}
+
+// Stop the specified drivers. This may be called from an ISR, provided that its priority is no higher than the step interrupt priority.
+// If stoppedPositions is not null then we store the positions in steps at which the drivers stopped in it, indexed by driver number.
+// We also stop them taking part in any moves that are queued but haven't started yet. Return the step clock time at which we stopped them.
+uint32_t Move::StopDrivers(uint16_t whichDrivers, int32_t *stoppedPositions) noexcept
 {
 #if SAME5x
 	const uint32_t oldPrio = ChangeBasePriority(NvicPriorityStep);
@@ -313,15 +669,41 @@ void Move::StopDrivers(uint16_t whichDrivers)
 #else
 # error Unsupported processor
 #endif
+	const uint32_t whenStopped = StepTimer::GetTimerTicks();
+	int32_t positions[NumDrivers];
+	for (size_t driver = 0; driver < NumDrivers; ++driver)
+	{
+		if (whichDrivers & (1u << driver))
+		{
+			positions[driver] = GetLivePosition(driver);
+			if (stoppedPositions != nullptr)
+			{
+				stoppedPositions[driver] = positions[driver];
+			}
+		}
+	}
 	DDA *cdda = currentDda;				// capture volatile
 	if (cdda != nullptr)
 	{
-		cdda->StopDrivers(whichDrivers);
+		cdda->StopDrivers(whichDrivers, positions);
 		if (cdda->GetState() == DDA::completed)
 		{
 			CurrentMoveCompleted();					// tell the DDA ring that the current move is complete
 		}
 	}
+
+	// The main board sent the moves that are waiting to start before it knew that these drivers would stop, so don't let them move these drivers.
+	// Do it before we re-enable the step interrupt, so that none of these moves can start while we discard their segments.
+	DDA *dda = ddaRingGetPointer;
+	if (dda->GetState() == DDA::executing)
+	{
+		dda = dda->GetNext();
+	}
+	while (dda->GetState() == DDA::frozen)
+	{
+		dda->SkipDrivers(whichDrivers, positions);
+		dda = dda->GetNext();
+	}
 #if SAME5x
 	RestoreBasePriority(oldPrio);
 #elif SAMC21
@@ -329,6 +711,7 @@ void Move::StopDrivers(uint16_t whichDrivers)
 #else
 # error Unsupported processor
 #endif
+	return whenStopped;
 }
 
 // Filament monitor support
@@ -359,6 +742,95 @@ void Move::PrintCurrentDda() const
 void Move::Interrupt()
 {
 	const uint32_t isrStartTime = StepTimer::GetTimerTicks();
+	GenerateSteps(isrStartTime);
+
+#if SUPPORT_MOVE_PWM
+	// Ramp the PWM of the current move if it has one. We only get here when a step interrupt is due, so the ramp is updated in step with the motion.
+	const DDA * const cdda = currentDda;							// capture volatile variable
+	if (cdda != nullptr && cdda->HasRampedPwm() && isrStartTime - lastPwmRampTime >= PwmRampIntervalClocks)
+	{
+		lastPwmRampTime = isrStartTime;
+		cdda->UpdatePwm(isrStartTime);
+	}
+#endif
+
+	// Record how long we spent in the ISR, so that we can report the average ISR time per step
+	const uint32_t isrClocks = StepTimer::GetTimerTicks() - isrStartTime;
+	++numStepInterrupts;
+	stepInterruptClocks += isrClocks;
+	if (isrClocks > maxStepInterruptClocks)
+	{
+		maxStepInterruptClocks = isrClocks;
+	}
+	stepInterruptHistogram.AddLog((int32_t)isrClocks);
+
+	// Feed the step bunching governor
+	governorIsrClocks += isrClocks;
+	const uint32_t windowClocks = isrStartTime + isrClocks - governorWindowStart;
+	if (windowClocks >= GovernorWindowClocks)
+	{
+		UpdateBunchingGovernor(windowClocks);
+	}
+}
+
+// Adjust the step bunching interval according to the fraction of time that we spent in the step ISR during the last window. Called from the step ISR.
+void Move::UpdateBunchingGovernor(uint32_t windowClocks) noexcept
+{
+	// If we didn't get a step interrupt for a long time then we were idle, which tells us nothing about how much bunching we need when we are busy
+	if (windowClocks < 4 * GovernorWindowClocks)
+	{
+		const uint32_t isrLoad = (governorIsrClocks * 256)/windowClocks;
+		if (isrLoad > maxIsrLoad)
+		{
+			maxIsrLoad = isrLoad;
+		}
+
+		uint32_t interval = DriveMovement::GetMinCalcInterval();
+		if (governorHiccups != 0)
+		{
+			// Hiccups mean that we are already well behind, so back off fast
+			interval = min<uint32_t>(interval * 2, MaxBunchingInterval);
+		}
+		else if (isrLoad > MaxIsrLoad)
+		{
+			interval = min<uint32_t>(interval + max<uint32_t>(interval/4, 1), MaxBunchingInterval);
+		}
+		else if (isrLoad < MinIsrLoad)
+		{
+			interval = max<uint32_t>(interval - interval/8, MinBunchingInterval);
+		}
+
+		const uint32_t oldInterval = DriveMovement::GetMinCalcInterval();
+		if (interval != oldInterval)
+		{
+			DriveMovement::SetMinCalcInterval(interval);
+			if (interval > oldInterval)
+			{
+				++numBunchingIncreases;
+				if (interval > maxBunchingInterval)
+				{
+					maxBunchingInterval = interval;
+				}
+			}
+			else
+			{
+				++numBunchingDecreases;
+				if (interval < minBunchingInterval)
+				{
+					minBunchingInterval = interval;
+				}
+			}
+		}
+	}
+
+	governorWindowStart += windowClocks;
+	governorIsrClocks = 0;
+	governorHiccups = 0;
+}
+
+// Generate the steps that are due for the current move and any moves that follow it, then schedule the next step interrupt
+inline void Move::GenerateSteps(uint32_t isrStartTime)
+{
 	uint32_t now = isrStartTime;
 	for (;;)
 	{
@@ -399,6 +871,7 @@ void Move::Interrupt()
 			// Force a break by updating the move start time.
 			// If the inserted hiccup is too short then it won't help. So we double the hiccup time on each iteration.
 			++numHiccups;
+			++governorHiccups;
 			cdda->InsertHiccup(now);
 
 			// Reschedule the next step interrupt. This time it should succeed if the hiccup time was long enough.
@@ -410,6 +883,170 @@ void Move::Interrupt()
 	}
 }
 
+#if SUPPORT_MOVE_PROFILE
+
+// Record the timing of a move that has just completed at the specified step clock time. Called from the step ISR when the move profile is enabled.
+// The finish lateness is measured against the finish time of the move, which allows for late starting and hiccups. The next move starts when this one finishes.
+void Move::RecordMoveProfile(const DDA& dda, uint32_t whenCompleted) noexcept
+{
+	MoveProfileEntry& entry = moveProfile[moveProfileNextIndex];
+	entry.moveNumber = completedMoves;
+	entry.scheduledStartTime = dda.GetScheduledStartTime();
+	entry.startLateness = dda.GetStartLateness();
+	entry.finishLateness = (int32_t)(whenCompleted - dda.GetMoveFinishTime());
+	entry.numHiccups = dda.GetNumHiccups();
+	entry.stepError = dda.HasStepError();
+	moveProfileNextIndex = (moveProfileNextIndex + 1) % MOVE_PROFILE_LENGTH;
+	if (moveProfileCount < MOVE_PROFILE_LENGTH)
+	{
+		++moveProfileCount;
+	}
+}
+
+// Process a request from the main board to start recording the move profile, stop recording it, or upload it
+GCodeResult Move::ProcessMoveProfileRequest(const CanMessageMoveProfileRequest& msg, const StringRef& reply) noexcept
+{
+	switch (msg.action)
+	{
+	case CanMessageMoveProfileRequest::actionStart:
+		{
+			AtomicCriticalSectionLocker lock;
+			moveProfileNextIndex = moveProfileCount = 0;
+			moveProfileEnabled = true;
+		}
+		return GCodeResult::ok;
+
+	case CanMessageMoveProfileRequest::actionStop:
+		moveProfileEnabled = false;
+		return GCodeResult::ok;
+
+	case CanMessageMoveProfileRequest::actionUpload:
+		{
+			// Stop recording while we upload so that the ISR doesn't overwrite the entries we are sending
+			const bool wasEnabled = moveProfileEnabled;
+			moveProfileEnabled = false;
+			const unsigned int numSent = UploadMoveProfile();
+			reply.printf("Board %u sent %u move profile entries", CanInterface::GetCanAddress(), numSent);
+			moveProfileEnabled = wasEnabled;
+		}
+		return GCodeResult::ok;
+
+	default:
+		reply.printf("Move profile action #%u not implemented", msg.action);
+		return GCodeResult::error;
+	}
+}
+
+// Send the recorded move profile to the main board, oldest entry first. Return the number of entries sent.
+// We convert the scheduled start times to master time here instead of in the ISR, so they may be out by the clock drift since the moves were executed.
+unsigned int Move::UploadMoveProfile() noexcept
+{
+	CanMessageBuffer buf(nullptr);
+	CanMessageMoveProfileData& msg = *(buf.SetupStatusMessage<CanMessageMoveProfileData>(CanInterface::GetCanAddress(), CanInterface::GetCurrentMasterAddress()));
+	const size_t count = moveProfileCount;
+	size_t index = (moveProfileNextIndex + MOVE_PROFILE_LENGTH - count) % MOVE_PROFILE_LENGTH;
+	unsigned int entriesInBuffer = 0;
+	unsigned int entriesSent = 0;
+	if (count == 0)
+	{
+		// Send an empty packet so that the main board knows that there is nothing more to come
+		msg.firstEntryNumber = 0;
+		msg.numEntries = 0;
+		msg.lastPacket = true;
+		msg.zero = 0;
+		buf.dataLength = msg.GetActualDataLength();
+		CanInterface::Send(&buf, CanTxClass::bulk);
+		return 0;
+	}
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		const MoveProfileEntry& entry = moveProfile[index];
+		msg.entries[entriesInBuffer].moveNumber = entry.moveNumber;
+		msg.entries[entriesInBuffer].scheduledStartTime = StepTimer::ConvertToMasterTime(entry.scheduledStartTime);
+		msg.entries[entriesInBuffer].startLateness = entry.startLateness;
+		msg.entries[entriesInBuffer].finishLateness = entry.finishLateness;
+		msg.entries[entriesInBuffer].numHiccups = entry.numHiccups;
+		msg.entries[entriesInBuffer].stepError = entry.stepError;
+		++entriesInBuffer;
+		index = (index + 1) % MOVE_PROFILE_LENGTH;
+
+		const bool lastPacket = (i + 1 == count);
+		if (entriesInBuffer == CanMessageMoveProfileData::MaxEntries || lastPacket)
+		{
+			msg.firstEntryNumber = entriesSent;
+			msg.numEntries = entriesInBuffer;
+			msg.lastPacket = lastPacket;
+			msg.zero = 0;
+			buf.dataLength = msg.GetActualDataLength();
+			CanInterface::Send(&buf, CanTxClass::bulk);
+			entriesSent += entriesInBuffer;
+			entriesInBuffer = 0;
+		}
+	}
+	return entriesSent;
+}
+
+#endif
+
+// Send a queue status message to the main board if one is due, and return how long the Move task may wait for a new move before calling this again.
+// We report the queue status periodically while we have moves queued and once more when the queue has emptied, so that the main board can pace the moves it sends us.
+// We also send a status message as soon as the queue is about to run dry, so that the main board can send more moves before we starve.
+uint32_t Move::CheckQueueStatus() noexcept
+{
+	const unsigned int movesQueued = scheduledMoves - completedMoves;
+	const int32_t timeLeft = (movesQueued == 0) ? 0 : (int32_t)(lastMoveFinishTime - StepTimer::GetTimerTicks());
+	const uint32_t timeAhead = (uint32_t)max<int32_t>(timeLeft, 0);
+	const bool queueLow = movesQueued != 0 && timeAhead < QueueLowWarningClocks;
+	if (!queueLow)
+	{
+		queueLowReported = false;
+	}
+
+	const uint32_t now = millis();
+	const bool statusDue = (movesQueued != 0) ? now - lastQueueStatusMillis >= QueueStatusIntervalMillis : lastReportedMovesQueued != 0;
+	if (statusDue || (queueLow && !queueLowReported))
+	{
+		CanMessageBuffer * const buf = CanMessageBuffer::Allocate();
+		if (buf == nullptr)
+		{
+			return 1;															// no buffer available, so try again soon
+		}
+
+		auto msg = buf->SetupStatusMessage<CanMessageMoveQueueStatus>(CanInterface::GetCanAddress(), CanInterface::GetCurrentMasterAddress());
+		msg->timeAhead = timeAhead;
+		msg->movesQueued = movesQueued;
+		msg->ringLength = DdaRingLength;
+		msg->flags = ((queueLow) ? CanMessageMoveQueueStatus::FlagQueueLow : 0)
+				   | ((movesQueued >= DdaRingLength) ? CanMessageMoveQueueStatus::FlagQueueFull : 0);
+		msg->zero = 0;
+		buf->dataLength = msg->GetActualDataLength();
+		CanInterface::SendAndFree(buf);
+
+		lastQueueStatusMillis = now;
+		lastReportedMovesQueued = movesQueued;
+		++numQueueStatusMessages;
+		if (queueLow)
+		{
+			queueLowReported = true;
+			++numQueueLowWarnings;
+		}
+	}
+
+	if (movesQueued == 0)
+	{
+		return IdleMoveWaitMillis;
+	}
+
+	// Wake up in time to send the next periodic status message, or the low queue warning if that comes sooner
+	uint32_t waitTime = QueueStatusIntervalMillis - min<uint32_t>(millis() - lastQueueStatusMillis, QueueStatusIntervalMillis - 1);
+	if (!queueLow)
+	{
+		waitTime = min<uint32_t>(waitTime, (timeAhead - QueueLowWarningClocks)/(StepTimer::StepClockRate/1000) + 1);
+	}
+	return waitTime;
+}
+
 // For debugging
 void Move::DebugPrintCdda() const noexcept
 {
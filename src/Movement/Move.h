@@ -16,13 +16,29 @@
 
 #include "DDA.h"								// needed because of our inline functions
 #include "Kinematics/Kinematics.h"
+#include "GCodes/GCodeResult.h"
+
+class CanMessageGeneric;
+struct CanMessageMoveProfileRequest;
 
 // Define the number of DDAs and DMs.
 // A DDA represents a move in the queue.
 // Each DDA needs one DM per drive that it moves.
-// However, DM's are large, so we provide fewer than DRIVES * DdaRingLength of them. The planner checks that enough DMs are available before filling in a new DDA.
+// However, DM's are large, so we provide fewer than DRIVES * DdaRingLength of them. The Move task checks that enough DMs are available before filling in a new DDA.
+// On boards with a single driver every move uses a DM, so there we need as many DMs as DDAs.
+
+constexpr unsigned int DdaRingLength = DDA_RING_LENGTH;
+constexpr unsigned int NumDms = NUM_DMS;
 
-const unsigned int DdaRingLength = 50;
+static_assert(NumDms >= NumDrivers, "Not enough DMs for a move that uses all drivers");
+static_assert(SINGLE_DRIVER == 0 || NumDms >= DdaRingLength, "Not enough DMs to fill the DDA ring");
+
+#if SUPPORT_INPUT_SHAPING
+// Shaped motion profiles are also large, and only moves with long acceleration or deceleration phases need one.
+// The Move task waits for a free one before filling in a new DDA if input shaping is enabled.
+constexpr unsigned int NumShapedProfiles = NUM_SHAPED_PROFILES;
+static_assert(NumShapedProfiles >= 1, "Need at least one shaped profile");
+#endif
 
 /**
  * This is the master movement class.  It controls all movement in the machine.
@@ -34,14 +50,22 @@ public:
 	void Init();																	// Start me up
 	void Exit();																	// Shut down
 	void Diagnostics(const StringRef& reply);										// Report useful stuff
+	void StepDiagnostics(const StringRef& reply) noexcept;							// Report the step generation and bunching statistics
+	void HistogramDiagnostics(const StringRef& reply, unsigned int which, bool clear) noexcept;	// Report one of the timing histograms and optionally clear it
+#if SUPPORT_MOVE_PROFILE
+	GCodeResult ProcessMoveProfileRequest(const CanMessageMoveProfileRequest& msg, const StringRef& reply) noexcept;	// Start, stop or upload the move profile
+#endif
 
 	void Interrupt() SPEED_CRITICAL;												// Timer callback for step generation
-	void StopDrivers(uint16_t whichDrivers);
+	uint32_t StopDrivers(uint16_t whichDrivers, int32_t *stoppedPositions = nullptr) noexcept;	// Stop some drivers and optionally get their positions, return the stop time
 	void CurrentMoveCompleted() SPEED_CRITICAL;										// Signal that the current move has just been completed
 
 	// Kinematics and related functions
 	Kinematics& GetKinematics() const { return *kinematics; }
-	bool SetKinematics(KinematicsType k);											// Set kinematics, return true if successful
+	bool SetKinematics(KinematicsType k);											// Set kinematics, return true if successful. The Move task must not be setting up moves.
+#if SUPPORT_DELTA_MOVEMENT
+	GCodeResult ConfigureDeltaTower(const CanMessageGeneric& msg, const StringRef& reply) noexcept;	// Set the delta geometry of one of our drivers
+#endif
 																					// Convert Cartesian coordinates to delta motor coordinates, return true if successful
 	static void TimerCallback(CallbackParameter cb)
 	{
@@ -50,9 +74,10 @@ public:
 
 	void PrintCurrentDda() const;													// For debugging
 
-	void ResetMoveCounters() { scheduledMoves = completedMoves = 0; }
+	void ResetMoveCounters() { scheduledMoves = completedMoves = numBatchedMoves = numDeltaMoves = 0; }
 
 	int32_t GetPosition(size_t driver) const;
+	int32_t GetLivePosition(size_t driver) const noexcept;							// Get the position of a driver now. Call this with the step interrupt disabled.
 
 	// Filament monitor support
 	int32_t GetAccumulatedExtrusion(size_t driver, bool& isPrinting) noexcept;		// Return and reset the accumulated commanded extrusion amount
@@ -71,6 +96,16 @@ private:
 	bool DDARingAdd();																// Add a processed look-ahead entry to the DDA ring
 	DDA* DDARingGet();																// Get the next DDA ring entry to be run
 	void StartNextMove(DDA *cdda, uint32_t startTime);								// Start a move
+	void AddMove(const CanMessageMovementLinear& msg, const CanMessageMovementDelta *deltaMsg = nullptr, const MovePwm *pwm = nullptr) noexcept;	// Add a move to the DDA ring
+	void RecycleDDAs() noexcept;													// Free the DDAs of completed moves
+	void WaitForMoveToComplete() noexcept;											// Wait until the oldest move in the ring has completed
+	void GenerateSteps(uint32_t isrStartTime) SPEED_CRITICAL;						// Generate the steps that are due, called from Interrupt
+	void UpdateBunchingGovernor(uint32_t windowClocks) noexcept;					// Adjust the step bunching interval according to the recent ISR load
+#if SUPPORT_MOVE_PROFILE
+	void RecordMoveProfile(const DDA& dda, uint32_t whenCompleted) noexcept SPEED_CRITICAL;	// Record the timing of a move that has just completed
+	unsigned int UploadMoveProfile() noexcept;										// Send the recorded move profile to the main board
+#endif
+	uint32_t CheckQueueStatus() noexcept;											// Send a queue status message if one is due, return how long we may wait for the next move
 
 	// Variables that are in the DDARing class in RepRapFirmware (we have only one DDARing so they are here)
 	DDA* volatile currentDda;
@@ -86,11 +121,82 @@ private:
 	// End DDARing variables
 
 	Kinematics *kinematics;															// What kinematics we are using
+#if SUPPORT_DELTA_MOVEMENT
+	Mutex kinematicsMutex;															// The Move task holds this while it sets up moves, so that ConfigureDeltaTower can't change the kinematics under it
+#endif
 
 	uint32_t scheduledMoves;														// Move counters for the code queue
 	volatile uint32_t completedMoves;												// This one is modified by an ISR, hence volatile
+	uint32_t numBatchedMoves;														// how many of the scheduled moves arrived in batched move messages
+	uint32_t numDeltaMoves;															// how many of the scheduled moves followed delta tower trajectories
+#if SUPPORT_MOVE_PWM
+	uint32_t numPwmMoves;															// how many of the scheduled moves carried a laser or spindle PWM
+	uint32_t lastPwmRampTime;														// when the step ISR last updated a ramped PWM
+	uint32_t pwmPortsUsed;															// bitmap of the GPIO ports that moves have written, so that we can turn them off in Exit
+#endif
 	uint32_t numHiccups;															// How many times we delayed an interrupt to avoid using too much CPU time in interrupts
 	uint32_t maxPrepareTime;
+
+	// Move queue status reporting to the main board
+	uint32_t lastMoveFinishTime;													// the step clock time at which the last move we added to the ring is due to finish
+	uint32_t lastQueueStatusMillis;													// when we last sent a queue status message
+	unsigned int lastReportedMovesQueued;											// how many moves were queued when we last sent a queue status message
+	bool queueLowReported;															// true if we have sent a low queue warning since the queue was last healthy
+	uint32_t numQueueStatusMessages;												// how many queue status messages we have sent
+	uint32_t numQueueLowWarnings;													// how many of them were low queue warnings
+
+	// Step timing statistics, reset each time we report them
+	uint32_t numStepInterrupts;														// how many times Interrupt has been called
+	uint32_t stepInterruptClocks;													// total step clocks spent in Interrupt
+	uint32_t maxStepInterruptClocks;												// the longest time we spent in a single call to Interrupt
+
+	// Step bunching governor. Every GovernorWindowClocks we measure the fraction of the time that we spent in the step ISR, and if it is too high we
+	// raise the step interval below which we bunch step calculations. If it is low, we lower the interval again so that the steps are as smooth as the CPU can afford.
+	uint32_t governorWindowStart;													// the step clock when the current measurement window started
+	uint32_t governorIsrClocks;														// step clocks spent in the ISR in the current window
+	uint32_t governorHiccups;														// how many hiccups we inserted in the current window
+	uint32_t maxIsrLoad;															// the highest ISR load we measured in a window, in 1/256ths
+	uint32_t minBunchingInterval, maxBunchingInterval;								// the range of bunching intervals used since we last reported them
+	uint32_t numBunchingIncreases, numBunchingDecreases;
+
+	static constexpr uint32_t GovernorWindowClocks = StepTimer::StepClockRate/100;	// measure the ISR load over 10ms windows
+	static constexpr uint32_t MaxIsrLoad = 102;										// raise the bunching interval if we spend more than 40% of the time in the step ISR
+	static constexpr uint32_t MinIsrLoad = 51;										// lower it if we spend less than 20%
+	static constexpr uint32_t MinBunchingInterval = DDA::MinCalcIntervalCartesian/4;
+	static constexpr uint32_t MaxBunchingInterval = DDA::MinCalcIntervalCartesian * 2;
+#if SUPPORT_MOVE_PWM
+	static constexpr uint32_t PwmRampIntervalClocks = StepTimer::StepClockRate/1000;	// update a ramped PWM at most once per millisecond, to limit the ISR time spent on it
+#endif
+
+#if SUPPORT_MOVE_PROFILE
+	// The timing of each executed move, recorded in a ring buffer when enabled by the main board
+	struct MoveProfileEntry
+	{
+		uint32_t moveNumber;														// the number of moves completed before this one
+		uint32_t scheduledStartTime;												// the local step clock time at which the main board asked us to start the move
+		int32_t startLateness;														// how late we started the move, in step clocks
+		int32_t finishLateness;														// how late we found that the move had finished compared with its finish time, in step clocks
+		uint8_t numHiccups;															// how many hiccups we inserted during the move
+		bool stepError;																// true if any driver had a step error
+	};
+
+	MoveProfileEntry moveProfile[MOVE_PROFILE_LENGTH];
+	size_t moveProfileNextIndex;													// where the next entry goes
+	size_t moveProfileCount;														// how many entries are valid
+	volatile bool moveProfileEnabled;
+#endif
+
+	// Timing histograms, reset only on request
+	Histogram stepInterruptHistogram;												// time spent in each call to Interrupt, in step clocks
+	Histogram prepareTimeHistogram;													// time taken by DDA::Init, in microseconds
+	Histogram ringOccupancyHistogram;												// how many moves were in the ring when we started each move
+
+	static constexpr uint32_t QueueStatusIntervalMillis = 100;						// how often we report the queue status while we have moves queued
+	static constexpr uint32_t QueueLowWarningClocks = StepTimer::StepClockRate/20;	// warn the main board when we have less than 50ms of moves queued
+	static constexpr uint32_t IdleMoveWaitMillis = 2000;							// how long we wait for a new move when we have nothing to report
+
+	static constexpr unsigned int NumHistograms = 4;								// how many histograms HistogramDiagnostics can report
+	static constexpr uint32_t RingOccupancyBucketWidth = (DdaRingLength + Histogram::NumBuckets - 1)/Histogram::NumBuckets;
 };
 
 //******************************************************************************************************
@@ -18,12 +18,15 @@
 #endif
 
 StepTimer * volatile StepTimer::pendingList = nullptr;
-volatile uint32_t StepTimer::localTimeOffset = 0;
+ClockSyncPll StepTimer::pll;
 volatile uint32_t StepTimer::whenLastSynced;
 uint32_t StepTimer::prevMasterTime;												// the previous master time received
 uint32_t StepTimer::prevLocalTime;												// the previous local time when the master time was received, corrected for receive processing delay
 int32_t StepTimer::peakPosJitter = 0;
 int32_t StepTimer::peakNegJitter = 0;
+uint64_t StepTimer::sumSquaredPhaseErrors = 0;
+unsigned int StepTimer::numPhaseErrors = 0;
+unsigned int StepTimer::numLockedSyncs = 0;
 uint32_t StepTimer::peakReceiveDelay = 0;
 volatile unsigned int StepTimer::syncCount = 0;
 unsigned int StepTimer::numJitterResyncs = 0;
@@ -110,27 +113,53 @@ void StepTimer::Init()
 		const uint32_t correctedMasterTime = oldMasterTime + msg.lastTimeAcknowledgeDelay;
 		const uint32_t newOffset = oldLocalTime - correctedMasterTime;
 
-		//TODO convert this to a PLL, but note that there could be a constant offset if the clocks run at slightly different speeds
-		const uint32_t oldOffset = localTimeOffset;
-		localTimeOffset = newOffset;
-		const int32_t diff = (int32_t)(newOffset - oldOffset);
-		if ((uint32_t)labs(diff) > MaxSyncJitter && locSyncCount > 1)
+		// Run the PLL. The phase error is the difference between the measured offset and the offset that we predicted for the local time of the measurement.
+		// The clocks of the main board and this board may run at slightly different speeds, so we track the rate of change of the offset as well as the offset.
+		const int32_t phaseError = (locSyncCount == 1) ? 0 : pll.GetPhaseError(oldLocalTime, newOffset);
+		if ((uint32_t)labs(phaseError) > MaxSyncJitter)
 		{
 			syncCount = 0;
 			++numJitterResyncs;
 		}
 		else
 		{
+			{
+				AtomicCriticalSectionLocker lock;						// other tasks convert between master and local time
+				if (locSyncCount == 1)
+				{
+					// First measurement, so start with the measured offset and assume that the clocks run at the same speed
+					pll.Start(oldLocalTime, newOffset);
+					numLockedSyncs = 0;
+				}
+				else
+				{
+					pll.Correct(oldLocalTime, phaseError, locSyncCount < MaxSyncCount);
+				}
+			}
+
 			whenLastSynced = millis();
 			if (locSyncCount == MaxSyncCount)
 			{
-				if (diff > peakPosJitter)
+				if (phaseError > peakPosJitter)
+				{
+					peakPosJitter = phaseError;
+				}
+				else if (phaseError < peakNegJitter)
+				{
+					peakNegJitter = phaseError;
+				}
+				sumSquaredPhaseErrors += (uint64_t)((int64_t)phaseError * phaseError);
+				++numPhaseErrors;
+				if ((uint32_t)labs(phaseError) <= MaxLockedPhaseError)
 				{
-					peakPosJitter = diff;
+					if (numLockedSyncs < MinLockedSyncs)
+					{
+						++numLockedSyncs;
+					}
 				}
-				else if (diff < peakNegJitter)
+				else
 				{
-					peakNegJitter = diff;
+					numLockedSyncs = 0;
 				}
 				Platform::SetPrinting(msg.isPrinting);
 				if (msgLen >= CanMessageTimeSync::SizeWithRealTime)	// if real time is included
@@ -150,6 +179,26 @@ void StepTimer::Init()
 	}
 }
 
+// Get the offset of local time from master time at the specified local time
+/*static*/ uint32_t StepTimer::GetLocalTimeOffset(uint32_t localTime) noexcept
+{
+	AtomicCriticalSectionLocker lock;
+	return pll.GetOffset(localTime);
+}
+
+// Convert a master time to local time. The offset only changes slowly, so it doesn't matter that we estimate the local time using the current offset
+// in order to find the offset to use.
+/*static*/ uint32_t StepTimer::ConvertToLocalTime(uint32_t masterTime) noexcept
+{
+	const uint32_t approxLocalTime = masterTime + GetLocalTimeOffset(GetTimerTicks());
+	return masterTime + GetLocalTimeOffset(approxLocalTime);
+}
+
+/*static*/ uint32_t StepTimer::ConvertToMasterTime(uint32_t localTime) noexcept
+{
+	return localTime - GetLocalTimeOffset(localTime);
+}
+
 // Schedule an interrupt at the specified clock count, or return true if that time is imminent or has passed already.
 // On entry, interrupts must be disabled or the base priority must be <= step interrupt priority.
 inline bool StepTimer::ScheduleTimerInterrupt(uint32_t tim)
@@ -321,8 +370,13 @@ void StepTimer::CancelCallback()
 
 /*static*/ void StepTimer::Diagnostics(const StringRef& reply)
 {
-	reply.lcatf("Peak sync jitter %" PRIi32 "/%" PRIi32 ", peak Rx sync delay %" PRIu32 ", resyncs %u/%u, ", peakNegJitter, peakPosJitter, peakReceiveDelay, numTimeoutResyncs, numJitterResyncs);
+	const float rmsJitter = (numPhaseErrors == 0) ? 0.0 : sqrtf((float)sumSquaredPhaseErrors/(float)numPhaseErrors);
+	reply.lcatf("Clock sync %s, drift %.2fppm, RMS sync jitter %.1f, peak sync jitter %" PRIi32 "/%" PRIi32 ", peak Rx sync delay %" PRIu32 ", resyncs %u/%u, ",
+					(!IsSynced()) ? "no" : (numLockedSyncs == MinLockedSyncs) ? "locked" : "unlocked",
+					(double)pll.GetDriftPpm(), (double)rmsJitter, peakNegJitter, peakPosJitter, peakReceiveDelay, numTimeoutResyncs, numJitterResyncs);
 	peakNegJitter = peakPosJitter = 0;
+	sumSquaredPhaseErrors = 0;
+	numPhaseErrors = 0;
 	numTimeoutResyncs = numJitterResyncs = 0;
 	peakReceiveDelay = 0;
 
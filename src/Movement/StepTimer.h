@@ -9,6 +9,7 @@
 #define SRC_MOVEMENT_STEPTIMER_H_
 
 #include "RepRapFirmware.h"
+#include "ClockSyncPll.h"
 
 class CanMessageTimeSync;
 
@@ -57,10 +58,9 @@ public:
 	// ISR called from StepTimer. May sometimes get called prematurely.
 	static void Interrupt() SPEED_CRITICAL;
 
-	static uint32_t GetLocalTimeOffset() { return localTimeOffset; }
 	static void ProcessTimeSyncMessage(const CanMessageTimeSync& msg, size_t msgLen, uint16_t timeStamp) noexcept;
-	static uint32_t ConvertToLocalTime(uint32_t masterTime) { return masterTime + localTimeOffset; }
-	static uint32_t ConvertToMasterTime(uint32_t localTime) { return localTime - localTimeOffset; }
+	static uint32_t ConvertToLocalTime(uint32_t masterTime) noexcept;
+	static uint32_t ConvertToMasterTime(uint32_t localTime) noexcept;
 	static uint32_t GetMasterTime() { return ConvertToMasterTime(GetTimerTicks()); }
 
 	static bool IsSynced();
@@ -75,6 +75,7 @@ public:
 																				// increased from 1000 because of workaround we added for bad Tx time stamps on SAME70
 private:
 	static bool ScheduleTimerInterrupt(uint32_t tim) SPEED_CRITICAL;			// schedule an interrupt at the specified clock count, or return true if it has passed already
+	static uint32_t GetLocalTimeOffset(uint32_t localTime) noexcept;			// get the offset of local time from master time at the specified local time
 
 	StepTimer *next;
 	Ticks whenDue;
@@ -83,17 +84,22 @@ private:
 	volatile bool active;
 
 	static StepTimer * volatile pendingList;									// list of pending callbacks, soonest first
-	static volatile uint32_t localTimeOffset;									// local time minus master time
+	static ClockSyncPll pll;													// tracks the offset of local time from master time
 	static volatile uint32_t whenLastSynced;									// the millis tick count when we last synced
 	static uint32_t prevMasterTime;												// the previous master time received
 	static uint32_t prevLocalTime;												// the previous local time when the master time was received, corrected for receive processing delay
-	static int32_t peakPosJitter, peakNegJitter;								// the max and min corrections we made to local time offset while synced
+	static int32_t peakPosJitter, peakNegJitter;								// the max and min phase errors we measured while synced
+	static uint64_t sumSquaredPhaseErrors;										// for calculating the RMS phase error while synced
+	static unsigned int numPhaseErrors;
+	static unsigned int numLockedSyncs;											// how many consecutive phase errors have been within MaxLockedPhaseError
 	static uint32_t peakReceiveDelay;											// the maximum receive delay we measured by using the receive time stamp
 	static volatile unsigned int syncCount;										// the number of messages we have received since starting sync
 	static unsigned int numJitterResyncs, numTimeoutResyncs;
 
 	static constexpr uint32_t MaxSyncJitter = StepClockRate/100;				// 10ms
 	static constexpr unsigned int MaxSyncCount = 10;
+	static constexpr uint32_t MaxLockedPhaseError = 8;							// about 10us
+	static constexpr unsigned int MinLockedSyncs = 10;							// how many consecutive small phase errors we need before we say we are locked
 };
 
 inline __attribute__((always_inline)) StepTimer::Ticks StepTimer::GetTimerTicks()
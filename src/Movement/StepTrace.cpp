@@ -0,0 +1,184 @@
+/*
+ * StepTrace.cpp
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ */
+
+#include "StepTrace.h"
+
+#if SUPPORT_STEP_TRACE
+
+#include "Move.h"
+#include "StepTimer.h"
+#include <RTOSIface/RTOSIface.h>
+#include <TaskPriorities.h>
+#include <CanMessageFormats.h>
+#include <CanMessageBuffer.h>
+#include <CAN/CanInterface.h>
+
+constexpr size_t StepTraceTaskStackWords = 130;
+constexpr uint32_t UploadIntervalMillis = 10;						// how often we check for trace samples to upload
+constexpr size_t TraceBufferLength = STEP_TRACE_BUFFER_LENGTH;
+
+static Task<StepTraceTaskStackWords> *stepTraceTask = nullptr;
+
+// A sample recorded by the step ISR
+struct TraceEntry
+{
+	uint32_t whenStepped;											// the local step clock time at which we generated the step
+	int32_t position;												// the position of the driver in steps after the step
+	uint8_t driveAndDirection;										// the driver number in the low bits, the direction in the top bit
+};
+
+static TraceEntry traceBuffer[TraceBufferLength];
+static volatile size_t putIndex = 0;								// only written by the ISR
+static volatile size_t getIndex = 0;								// only written by the trace task
+static volatile uint32_t samplesToRecord = 0;
+static volatile bool overflowed = false;
+static int32_t positions[NumDrivers];								// the current position of each traced driver
+static uint16_t stepsPerSample = 1;
+static uint16_t stepsTillSample[NumDrivers];
+static volatile bool running = false;
+static uint32_t samplesSent = 0;
+static uint32_t numTraces = 0, numOverflows = 0;
+
+volatile uint32_t StepTrace::tracedDrivers = 0;
+
+// Record a step. Called from the step ISR only when the driver is being traced.
+void StepTrace::RecordStep(size_t drive, bool direction, uint32_t when) noexcept
+{
+	positions[drive] += (direction) ? 1 : -1;
+	if (--stepsTillSample[drive] == 0)
+	{
+		stepsTillSample[drive] = stepsPerSample;
+		const size_t nextPut = (putIndex + 1) % TraceBufferLength;
+		if (nextPut == getIndex)
+		{
+			overflowed = true;										// the trace task hasn't kept up, so discard this sample
+		}
+		else
+		{
+			TraceEntry& entry = traceBuffer[putIndex];
+			entry.whenStepped = when;
+			entry.position = positions[drive];
+			entry.driveAndDirection = (uint8_t)drive | ((direction) ? 0x80 : 0);
+			putIndex = nextPut;
+		}
+
+		if (--samplesToRecord == 0)
+		{
+			tracedDrivers = 0;										// we have recorded all the samples requested
+		}
+	}
+}
+
+// Task that uploads the trace samples to the main board
+[[noreturn]] void StepTraceTaskCode(void*) noexcept
+{
+	for (;;)
+	{
+		TaskBase::Take();
+		if (running)
+		{
+			CanMessageBuffer buf(nullptr);
+			CanMessageStepTraceData& msg = *(buf.SetupStatusMessage<CanMessageStepTraceData>(CanInterface::GetCanAddress(), CanInterface::GetCurrentMasterAddress()));
+			unsigned int samplesInBuffer = 0;
+			bool finished;
+			do
+			{
+				finished = (tracedDrivers == 0);					// read this before we read the samples, so that we don't miss any recorded after we look
+				while (getIndex != putIndex && samplesInBuffer < CanMessageStepTraceData::MaxSamples)
+				{
+					const TraceEntry& entry = traceBuffer[getIndex];
+					msg.samples[samplesInBuffer].whenStepped = StepTimer::ConvertToMasterTime(entry.whenStepped);
+					msg.samples[samplesInBuffer].position = entry.position;
+					msg.samples[samplesInBuffer].driveAndDirection = entry.driveAndDirection;
+					++samplesInBuffer;
+					getIndex = (getIndex + 1) % TraceBufferLength;
+				}
+
+				const bool lastPacket = finished && getIndex == putIndex;
+				if (samplesInBuffer == CanMessageStepTraceData::MaxSamples || lastPacket)
+				{
+					msg.firstSampleNumber = samplesSent;
+					msg.numSamples = samplesInBuffer;
+					msg.overflowed = overflowed;
+					msg.lastPacket = lastPacket;
+					msg.zero = 0;
+					if (overflowed)
+					{
+						overflowed = false;
+						++numOverflows;
+					}
+					buf.dataLength = msg.GetActualDataLength();
+					CanInterface::Send(&buf, CanTxClass::bulk);
+					samplesSent += samplesInBuffer;
+					samplesInBuffer = 0;
+					if (lastPacket)
+					{
+						break;
+					}
+				}
+				else
+				{
+					delay(UploadIntervalMillis);
+				}
+			} while (running);
+
+			running = false;
+		}
+	}
+}
+
+// Start a trace. We record the position of each requested driver every stepsPerSample steps, until we have recorded the requested number of samples.
+// We create the upload task when the first trace is requested, so that we don't use the RAM for its stack unless tracing is used.
+GCodeResult StepTrace::ProcessStartRequest(const CanMessageStartStepTrace& msg, const StringRef& reply) noexcept
+{
+	if (running)
+	{
+		reply.printf("Board %u is busy collecting step trace data", CanInterface::GetCanAddress());
+		return GCodeResult::error;
+	}
+
+	if (msg.drivers == 0 || (msg.drivers & ~((1u << NumDrivers) - 1)) != 0 || msg.numSamples == 0 || msg.stepsPerSample == 0)
+	{
+		reply.copy("Invalid step trace request");
+		return GCodeResult::error;
+	}
+
+	if (stepTraceTask == nullptr)
+	{
+		stepTraceTask = new Task<StepTraceTaskStackWords>;
+		stepTraceTask->Create(StepTraceTaskCode, "STRACE", nullptr, TaskPriority::StepTrace);
+	}
+
+	putIndex = getIndex = 0;
+	overflowed = false;
+	samplesSent = 0;
+	stepsPerSample = msg.stepsPerSample;
+	running = true;
+	{
+		// Start tracing from the live driver positions, making sure that the step ISR doesn't generate any steps while we read them
+		AtomicCriticalSectionLocker lock;
+		for (size_t driver = 0; driver < NumDrivers; ++driver)
+		{
+			positions[driver] = moveInstance->GetLivePosition(driver);
+			stepsTillSample[driver] = stepsPerSample;
+		}
+		samplesToRecord = msg.numSamples;
+		tracedDrivers = msg.drivers;
+	}
+	++numTraces;
+	stepTraceTask->Give();
+	return GCodeResult::ok;
+}
+
+void StepTrace::Diagnostics(const StringRef& reply) noexcept
+{
+	reply.lcatf("Step traces %" PRIu32 ", overflows %" PRIu32 ", %s", numTraces, numOverflows, (running) ? "running" : "idle");
+}
+
+#endif
+
+// End
@@ -0,0 +1,42 @@
+/*
+ * StepTrace.h
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ *
+ *  Optional trace of the steps that we generate, recorded by the step ISR and uploaded to the main board over CAN
+ */
+
+#ifndef SRC_MOVEMENT_STEPTRACE_H_
+#define SRC_MOVEMENT_STEPTRACE_H_
+
+#include "RepRapFirmware.h"
+
+#if SUPPORT_STEP_TRACE
+
+#include "GCodes/GCodeResult.h"
+
+class CanMessageStartStepTrace;
+
+namespace StepTrace
+{
+	GCodeResult ProcessStartRequest(const CanMessageStartStepTrace& msg, const StringRef& reply) noexcept;
+	void Diagnostics(const StringRef& reply) noexcept;
+
+	void RecordStep(size_t drive, bool direction, uint32_t when) noexcept SPEED_CRITICAL;	// called from the step ISR
+
+	extern volatile uint32_t tracedDrivers;							// bitmap of the drivers whose steps we are recording
+
+	// Record a step if we are tracing this driver. Called from the step ISR, so it must be fast when tracing is not enabled.
+	inline void CheckRecordStep(size_t drive, bool direction, uint32_t when) noexcept
+	{
+		if (tracedDrivers & (1u << drive))
+		{
+			RecordStep(drive, direction, when);
+		}
+	}
+}
+
+#endif
+
+#endif /* SRC_MOVEMENT_STEPTRACE_H_ */
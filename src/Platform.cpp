@@ -143,6 +143,8 @@ namespace Platform
 	static float stepsPerMm[NumDrivers];
 	static float motorCurrents[NumDrivers];
 	static float pressureAdvanceClocks[NumDrivers];
+	static float pressureAdvanceSmoothingClocks[NumDrivers];		// the smoothing window for pressure advance, zero for unsmoothed
+	static float pressureAdvanceNonlinear[NumDrivers];			// how much the advance time increases per mm/sec of extruder speed
 	static float idleCurrentFactor[NumDrivers];
 #endif
 
@@ -816,6 +818,8 @@ void Platform::Init()
 		idleCurrentFactor[i] = 0.3;
 		motorCurrents[i] = 0.0;
 		pressureAdvanceClocks[i] = 0.0;
+		pressureAdvanceSmoothingClocks[i] = 0.0;
+		pressureAdvanceNonlinear[i] = 0.0;
 
 # if HAS_SMART_DRIVERS
 		SmartDrivers::SetMicrostepping(i, 16, true);
@@ -1230,6 +1234,9 @@ void Platform::Spin()
 				reply.Clear();
 				moveInstance->Diagnostics(reply.GetRef());
 				debugPrintf("%s\n", reply.c_str());
+				reply.Clear();
+				moveInstance->StepDiagnostics(reply.GetRef());
+				debugPrintf("%s\n", reply.c_str());
 				//moveInstance->DebugPrintCdda();
 #if SUPPORT_I2C_SENSORS && SUPPORT_LIS3DH
 				debugPrintf("LIS3DH detected: %s", AccelerometerHandler::Present() ? "yes" : "no");
@@ -1519,9 +1526,23 @@ float Platform::GetPressureAdvanceClocks(size_t driver)
 	return pressureAdvanceClocks[driver];
 }
 
-void Platform::SetPressureAdvance(size_t driver, float advance)
+float Platform::GetPressureAdvanceSmoothingClocks(size_t driver)
+{
+	return pressureAdvanceSmoothingClocks[driver];
+}
+
+float Platform::GetPressureAdvanceNonlinear(size_t driver)
+{
+	return pressureAdvanceNonlinear[driver];
+}
+
+// Set the pressure advance time in seconds, the smoothing window in seconds, and the increase in advance time in seconds per mm/sec of extruder speed
+void Platform::SetPressureAdvance(size_t driver, float advance, float smoothingTime, float nonlinear)
 {
 	pressureAdvanceClocks[driver] = advance * (float)StepTimer::StepClockRate;
+	pressureAdvanceSmoothingClocks[driver] = smoothingTime * (float)StepTimer::StepClockRate;
+	pressureAdvanceNonlinear[driver] = nonlinear;
+	DriveMovement::ResetPressureAdvance(driver);			// the smoothed advance is relative to the settings that applied when it was accumulated
 }
 
 #if 0	// not used yet and may never be
@@ -1856,6 +1877,69 @@ static uint32_t TimedSqrt(uint64_t arg, uint32_t& timeAcc) noexcept
 	return ret;
 }
 
+#if SUPPORT_DRIVERS && DM_USE_STEP_RECURRENCE
+
+// Execute a timed step time recurrence calculation
+static uint32_t TimedAccelRecurrence(uint32_t timeFromRest, uint32_t estimate, uint32_t kSteps, uint32_t& timeAcc) noexcept
+{
+	IrqDisable();
+	asm volatile("":::"memory");
+	uint32_t now1 = SysTick->VAL;
+	const uint32_t ret = DriveMovement::CalcAccelRecurrenceInterval(timeFromRest, estimate, kSteps);
+	uint32_t now2 = SysTick->VAL;
+	asm volatile("":::"memory");
+	IrqEnable();
+	now1 &= 0x00FFFFFF;
+	now2 &= 0x00FFFFFF;
+	timeAcc += ((now1 > now2) ? now1 : now1 + (SysTick->LOAD & 0x00FFFFFF) + 1) - now2;
+	return ret;
+}
+
+// Calculate accelerating step times from rest in the same way as DriveMovement, i.e. 2^shiftFactor steps per calculation with up to MaxRecurrenceCalcs
+// recurrence calculations between exact ones, each working from the exact time of the previous calculated step. Return the largest error.
+// If evenSteps is true then include the steps between the calculated ones, which are spaced evenly using the step interval rounded down.
+static uint32_t CheckRecurrenceError(uint32_t kSteps, uint32_t firstStep, unsigned int shiftFactor, bool evenSteps) noexcept
+{
+	const uint32_t stepsPerCalc = 1u << shiftFactor;
+	uint32_t calcStep = firstStep;
+	uint32_t lastCalcTime = isqrt64((uint64_t)kSteps * calcStep);
+	uint32_t stepInterval = (lastCalcTime - isqrt64((uint64_t)kSteps * (calcStep - stepsPerCalc))) >> shiftFactor;
+	unsigned int recurrenceCalcs = 0;
+	uint32_t maxError = 0;
+	for (unsigned int i = 0; i < 100; ++i)
+	{
+		const uint32_t nextCalcStep = calcStep + stepsPerCalc;
+		uint32_t nextCalcTime;
+		if (recurrenceCalcs < DriveMovement::MaxRecurrenceCalcs)
+		{
+			nextCalcTime = lastCalcTime + DriveMovement::CalcAccelRecurrenceInterval(lastCalcTime, stepInterval << shiftFactor, kSteps << shiftFactor);
+			++recurrenceCalcs;
+		}
+		else
+		{
+			nextCalcTime = isqrt64((uint64_t)kSteps * nextCalcStep);
+			recurrenceCalcs = 0;
+		}
+		stepInterval = (nextCalcTime - lastCalcTime) >> shiftFactor;
+
+		for (uint32_t step = (evenSteps) ? calcStep + 1 : nextCalcStep; step <= nextCalcStep; ++step)
+		{
+			const uint32_t stepTime = nextCalcTime - (nextCalcStep - step) * stepInterval;
+			const uint32_t exactTime = isqrt64((uint64_t)kSteps * step);
+			const uint32_t error = (stepTime > exactTime) ? stepTime - exactTime : exactTime - stepTime;
+			if (error > maxError)
+			{
+				maxError = error;
+			}
+		}
+		lastCalcTime = nextCalcTime;
+		calcStep = nextCalcStep;
+	}
+	return maxError;
+}
+
+#endif
+
 GCodeResult Platform::DoDiagnosticTest(const CanMessageDiagnosticTest& msg, const StringRef& reply)
 {
 	if ((uint16_t)~msg.invertedTestType != msg.testType)
@@ -1901,6 +1985,54 @@ GCodeResult Platform::DoDiagnosticTest(const CanMessageDiagnosticTest& msg, cons
 			return (ok1 && ok2) ? GCodeResult::ok : GCodeResult::error;
 		}
 
+#if SUPPORT_DRIVERS && DM_USE_STEP_RECURRENCE
+	case 103:		// Compare the time taken to calculate accelerating step times using square roots and using the recurrence, and check the recurrence errors
+		{
+			// Use typical values: 80 steps/mm and 1000mm/sec^2 acceleration from rest, so the time to do n steps is sqrt(n * kSteps) step clocks
+			constexpr uint32_t kSteps = (uint32_t)((2 * StepTimer::StepClockRateSquared)/(80 * 1000));
+			constexpr uint32_t firstStep = 300;					// start far enough from rest that the recurrence would be used
+			constexpr uint32_t iterations = 100;				// use a value that divides into one million
+			uint32_t timSqrt = 0, timRecurrence = 0;
+			uint32_t recurrenceTime = isqrt64((uint64_t)kSteps * firstStep);
+			uint32_t interval = recurrenceTime - isqrt64((uint64_t)kSteps * (firstStep - 1));
+			for (uint32_t i = 1; i <= iterations; ++i)
+			{
+				const uint32_t exactTime = TimedSqrt((uint64_t)kSteps * (firstStep + i), timSqrt);
+				interval = TimedAccelRecurrence(recurrenceTime, interval, kSteps, timRecurrence);
+				recurrenceTime = exactTime;
+			}
+			reply.printf("Step time calculation: square root %.2fus, recurrence %.2fus",
+						(double)((float)(timSqrt * (1'000'000/iterations))/SystemCoreClockFreq),
+							(double)((float)(timRecurrence * (1'000'000/iterations))/SystemCoreClockFreq));
+
+			// Check the errors for each number of steps per calculation, starting where the step interval is at the top of the range in which
+			// DriveMovement uses that number. The recurrence error must not exceed MaxRecurrenceCalcs clocks. With even steps the steps between
+			// the calculated ones may also be late by up to one clock per step because the step interval is rounded down.
+			uint32_t maxErrors[DriveMovement::MaxShiftFactor + 1], maxEvenErrors[DriveMovement::MaxShiftFactor + 1];
+			bool ok = true;
+			for (unsigned int shiftFactor = 0; shiftFactor <= DriveMovement::MaxShiftFactor; ++shiftFactor)
+			{
+				const uint32_t startInterval = (shiftFactor == 0) ? 0 : DDA::MinCalcIntervalCartesian >> (shiftFactor - 1);
+				const uint32_t startStep = (shiftFactor == 0) ? firstStep : kSteps/(4 * startInterval * startInterval);
+				maxErrors[shiftFactor] = CheckRecurrenceError(kSteps, startStep, shiftFactor, false);
+				maxEvenErrors[shiftFactor] = CheckRecurrenceError(kSteps, startStep, shiftFactor, true);
+				ok = ok && maxErrors[shiftFactor] <= DriveMovement::MaxRecurrenceCalcs
+						&& maxEvenErrors[shiftFactor] <= DriveMovement::MaxRecurrenceCalcs + (1u << shiftFactor) - 1;
+			}
+			reply.lcatf("Max recurrence error at 1/2/4/8/16 steps per calculation: %" PRIu32 "/%" PRIu32 "/%" PRIu32 "/%" PRIu32 "/%" PRIu32
+						" clocks, with even steps %" PRIu32 "/%" PRIu32 "/%" PRIu32 "/%" PRIu32 "/%" PRIu32 " clocks",
+							maxErrors[0], maxErrors[1], maxErrors[2], maxErrors[3], maxErrors[4],
+								maxEvenErrors[0], maxEvenErrors[1], maxEvenErrors[2], maxEvenErrors[3], maxEvenErrors[4]);
+			return (ok) ? GCodeResult::ok : GCodeResult::error;
+		}
+#endif
+
+#if SUPPORT_DRIVERS && !SINGLE_DRIVER
+	case 104:		// Compare the time taken to schedule steps using a sorted list and using a bitmap. Caution: disables interrupts for a few microseconds at a time.
+		DDA::TimeStepSchedulers(reply);
+		return GCodeResult::ok;
+#endif
+
 	case 108:
 		{
 			unsigned int i = 100;
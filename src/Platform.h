@@ -156,7 +156,9 @@ namespace Platform
 	const float *GetDriveStepsPerUnit();
 	void SetDriveStepsPerUnit(size_t drive, float val);
 	float GetPressureAdvanceClocks(size_t driver);
-	void SetPressureAdvance(size_t driver, float advance);
+	float GetPressureAdvanceSmoothingClocks(size_t driver);
+	float GetPressureAdvanceNonlinear(size_t driver);
+	void SetPressureAdvance(size_t driver, float advance, float smoothingTime = 0.0, float nonlinear = 0.0);
 # if 0	// not used yet and may never be
 	void BuildDriverStatusMessage(CanMessageBuffer *buf) noexcept;
 # endif
@@ -20,6 +20,9 @@ namespace TaskPriority
 	static constexpr int CanAsyncSenderPriority = 4;
 	static constexpr int CanClockPriority = 4;
 	static constexpr int Accelerometer = 3;
+	static constexpr int StepTrace = 2;
+	static constexpr int TimedOutputs = 4;
+	static constexpr int GpioIsrWrites = 4;
 }
 
 #endif /* SRC_TASKPRIORITIES_H_ */
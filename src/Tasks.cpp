@@ -15,6 +15,7 @@
 #include <FilamentMonitors/FilamentMonitor.h>
 #include <Hardware/Devices.h>
 #include <Hardware/NonVolatileMemory.h>
+#include <Hardware/CompressedImage.h>
 #include <CanMessageBuffer.h>
 #include <CanMessageFormats.h>
 #include <Duet3Common.h>
@@ -256,24 +257,55 @@ static FirmwareFlashErrorCode RequestBootloaderBlock(uint32_t fileOffset, uint32
 	return FirmwareFlashErrorCode::ok;
 }
 
+// We fetch the bootloader in sub-blocks and keep several sub-block requests outstanding, so that a lost fragment only costs us a short timeout and a re-request of one sub-block
+constexpr uint32_t SubBlockSize = 2048;
+constexpr size_t NumSubBlocks = FlashBlockSize/SubBlockSize;
+constexpr size_t SubBlockWindow = 4;								// maximum number of sub-block requests outstanding
+constexpr uint32_t SubBlockReceiveTimeout = 500;					// sub-block receive timeout milliseconds, long enough for the sub-blocks ahead of it in the window to arrive
+constexpr unsigned int MaxSubBlockRetries = 8;
+
+static_assert(FlashBlockSize % SubBlockSize == 0);
+
+// The state of one sub-block of the bootloader being received
+struct SubBlockState
+{
+	uint32_t bytesReceived;											// how many contiguous bytes we have received from the start of the sub-block
+	uint32_t bytesWanted;											// zero if the sub-block is beyond the end of the file
+	uint32_t whenRequested;
+	uint8_t retries;
+	bool requested;													// true if we have an outstanding request for this sub-block
+	bool everRequested;
+
+	bool IsComplete() const noexcept { return bytesReceived == bytesWanted; }
+};
+
 // Get a buffer of data from the host, returning true if successful
 static FirmwareFlashErrorCode GetBootloaderBlock(uint8_t *blockBuffer)
 {
 	CanMessageBuffer buf(nullptr);
-	const FirmwareFlashErrorCode err = RequestBootloaderBlock(0, FlashBlockSize, buf);	// ask for 16K or 64K as a single block
+	SubBlockState subBlocks[NumSubBlocks];
+	for (SubBlockState& sb : subBlocks)
+	{
+		sb.bytesReceived = sb.retries = 0;
+		sb.bytesWanted = SubBlockSize;
+		sb.requested = sb.everRequested = false;
+	}
+
+	// Ask for the first sub-block on its own, because we don't know how long the file is until we get the first response
+	FirmwareFlashErrorCode err = RequestBootloaderBlock(0, SubBlockSize, buf);
 	if (err != FirmwareFlashErrorCode::ok)
 	{
 		return err;
 	}
+	subBlocks[0].requested = subBlocks[0].everRequested = true;
+	subBlocks[0].whenRequested = millis();
 
-	uint32_t whenStartedWaiting = millis();
-	uint32_t bytesReceived = 0;
-	bool done = false;
-	do
+	bool fileLengthKnown = false;
+	size_t numSubBlocks = 1;
+	for (;;)
 	{
 		Platform::SpinMinimal();									// check if it's time to turn the LED off
-		const bool ok = CanInterface::GetCanMessage(&buf);
-		if (ok)
+		if (CanInterface::GetCanMessage(&buf))
 		{
 			if (buf.id.MsgType() == CanMessageType::firmwareBlockResponse)
 			{
@@ -290,38 +322,89 @@ static FirmwareFlashErrorCode GetBootloaderBlock(uint8_t *blockBuffer)
 					return FirmwareFlashErrorCode::hostOther;
 
 				case CanMessageFirmwareUpdateResponse::ErrNone:
-					if (response.fileOffset <= bytesReceived)
+					if (!fileLengthKnown)
 					{
-						const uint32_t bufferOffset = response.fileOffset;
-						const uint32_t bytesToCopy = min<uint32_t>(FlashBlockSize - bufferOffset, response.dataLength);
-						memcpy(blockBuffer + bufferOffset, response.data, bytesToCopy);
-						if (response.fileOffset + bytesToCopy > bytesReceived)
+						// Now that we know the file length, work out how many sub-blocks we need and how much of the last one
+						const uint32_t fileLength = min<uint32_t>(response.fileLength, FlashBlockSize);
+						numSubBlocks = max<size_t>((fileLength + SubBlockSize - 1)/SubBlockSize, 1);
+						for (size_t i = 0; i < NumSubBlocks; ++i)
 						{
-							bytesReceived = response.fileOffset + bytesToCopy;
+							subBlocks[i].bytesWanted = (i < numSubBlocks) ? min<uint32_t>(fileLength - i * SubBlockSize, SubBlockSize) : 0;
 						}
-						if (bytesReceived == FlashBlockSize || bytesReceived >= response.fileLength)
+						fileLengthKnown = true;
+					}
+
+					if (response.fileOffset < numSubBlocks * SubBlockSize)
+					{
+						SubBlockState& sb = subBlocks[response.fileOffset/SubBlockSize];
+						const uint32_t expectedOffset = (response.fileOffset/SubBlockSize) * SubBlockSize + sb.bytesReceived;
+						if (response.fileOffset <= expectedOffset && !sb.IsComplete())	// if we missed a fragment then we ignore the rest and re-request them when this sub-block times out
 						{
-							// Reached the end of the file
-							memset(blockBuffer + bytesReceived, 0xFF, FlashBlockSize - bytesReceived);
-							done = true;
+							// Copy any new data, but don't copy beyond the end of this sub-block
+							const uint32_t endOffset = min<uint32_t>(response.fileOffset + response.dataLength, expectedOffset + (sb.bytesWanted - sb.bytesReceived));
+							if (endOffset > expectedOffset)
+							{
+								memcpy(blockBuffer + expectedOffset, response.data + (expectedOffset - response.fileOffset), endOffset - expectedOffset);
+								sb.bytesReceived += endOffset - expectedOffset;
+								sb.whenRequested = millis();				// restart the timeout because data is still arriving
+							}
 						}
 					}
-					whenStartedWaiting = millis();
 				}
 			}
 		}
-		else if (millis() - whenStartedWaiting > BlockReceiveTimeout)
+
+		// See whether we have finished, and keep the window of outstanding requests full
+		bool done = true;
+		size_t numOutstanding = 0;
+		for (size_t i = 0; i < numSubBlocks; ++i)
 		{
-			if (bytesReceived == 0)
+			SubBlockState& sb = subBlocks[i];
+			if (sb.IsComplete())
+			{
+				continue;
+			}
+
+			done = false;
+			if (sb.requested && millis() - sb.whenRequested > ((fileLengthKnown) ? SubBlockReceiveTimeout : BlockReceiveTimeout))
+			{
+				if (!fileLengthKnown || sb.retries >= MaxSubBlockRetries)
+				{
+					return FirmwareFlashErrorCode::blockReceiveTimeout;
+				}
+				sb.requested = false;
+			}
+
+			if (!sb.requested)
 			{
-				return FirmwareFlashErrorCode::blockReceiveTimeout;
+				if (numOutstanding >= SubBlockWindow)
+				{
+					continue;
+				}
+				const uint32_t offset = i * SubBlockSize + sb.bytesReceived;
+				err = RequestBootloaderBlock(offset, sb.bytesWanted - sb.bytesReceived, buf);	// ask for the rest of this sub-block
+				if (err != FirmwareFlashErrorCode::ok)
+				{
+					return err;
+				}
+				if (sb.everRequested)
+				{
+					++sb.retries;
+				}
+				sb.requested = sb.everRequested = true;
+				sb.whenRequested = millis();
 			}
-			RequestBootloaderBlock(bytesReceived, FlashBlockSize - bytesReceived, buf);			// ask for a block from the starting offset
-			whenStartedWaiting = millis();
+			++numOutstanding;
 		}
-	} while (!done);
 
-	return FirmwareFlashErrorCode::ok;
+		if (done)
+		{
+			// Reached the end of the file
+			const uint32_t bytesReceived = (numSubBlocks - 1) * SubBlockSize + subBlocks[numSubBlocks - 1].bytesReceived;
+			memset(blockBuffer + bytesReceived, 0xFF, FlashBlockSize - bytesReceived);
+			return FirmwareFlashErrorCode::ok;
+		}
+	}
 }
 
 static void ReportFlashError(FirmwareFlashErrorCode err)
@@ -337,9 +420,9 @@ static void ReportFlashError(FirmwareFlashErrorCode err)
 	delay(1000);
 }
 
-// Compute the CRC32 of a dword-aligned block of memory
-// This assumes the caller has exclusive use of the DMAC
-uint32_t ComputeCRC32(const uint32_t *start, const uint32_t *end)
+// Start a CRC32 calculation
+// This assumes the caller has exclusive use of the DMAC until the calculation is complete
+static void StartCRC32()
 {
 #if SAME5x
 	DMAC->CRCCTRL.reg = DMAC_CRCCTRL_CRCBEATSIZE_WORD | DMAC_CRCCTRL_CRCSRC_DISABLE | DMAC_CRCCTRL_CRCPOLY_CRC32;	// disable the CRC unit
@@ -353,23 +436,41 @@ uint32_t ComputeCRC32(const uint32_t *start, const uint32_t *end)
 #if SAMC21
 	DMAC->CTRL.bit.CRCENABLE = 1;
 #endif
+}
+
+// Add a dword-aligned block of memory to the CRC32 calculation
+static void AddToCRC32(const uint32_t *start, const uint32_t *end)
+{
 	while (start < end)
 	{
 		DMAC->CRCDATAIN.reg = *start++;
 		asm volatile("nop");
 		asm volatile("nop");
 	}
+}
 
+// Finish the CRC32 calculation and return the result
+static uint32_t GetCRC32()
+{
 	DMAC->CRCSTATUS.reg = DMAC_CRCSTATUS_CRCBUSY;
 	asm volatile("nop");
 	return DMAC->CRCCHKSUM.reg;
 }
 
+// Compute the CRC32 of a dword-aligned block of memory
+// This assumes the caller has exclusive use of the DMAC
+uint32_t ComputeCRC32(const uint32_t *start, const uint32_t *end)
+{
+	StartCRC32();
+	AddToCRC32(start, end);
+	return GetCRC32();
+}
+
 // Check that the bootloader we have been passed has a valid CRC
 bool CheckCRC(uint32_t *blockBuffer) noexcept
 {
 	const uint32_t crcOffset = blockBuffer[7];						// vector M9 gives the offset of the CRC from start of file, in bytes
-	if (crcOffset < 0x2000 || crcOffset > FlashBlockSize - 4)		// if the file is shorter than 8K or longer than the buffer, error
+	if (!IsValidCrcOffset(crcOffset, FlashBlockSize))				// if the file is shorter than 8K or longer than the buffer, or the offset is misaligned, error
 	{
 		return false;
 	}
@@ -377,6 +478,68 @@ bool CheckCRC(uint32_t *blockBuffer) noexcept
 	return ComputeCRC32(blockBuffer, blockBuffer + crcOffset/4) == expectedCRC;
 }
 
+static uint32_t *decompressionWindow = nullptr;
+
+// Decompress a bootloader image, allocating the decompression window the first time we need it
+template<class Consumer> static bool DecompressBootloader(const uint32_t *blockBuffer, Consumer& consumer) noexcept
+{
+	if (decompressionWindow == nullptr)
+	{
+		decompressionWindow = new uint32_t[DecompressionWindowSize/4];
+	}
+	return DecompressImage(*reinterpret_cast<const CompressedImageHeader*>(blockBuffer), FlashBlockSize, reinterpret_cast<uint8_t*>(decompressionWindow), consumer);
+}
+
+// Check the CRC of a decompressed image as it is produced, in the same way as CheckCRC does for an uncompressed image
+struct DecompressedCrcChecker
+{
+	uint32_t crcOffset = 0;
+	uint32_t expectedCRC = 0;
+	bool crcSeen = false;
+
+	bool operator()(uint32_t offset, const uint32_t *data) noexcept
+	{
+		if (offset == 0)
+		{
+			crcOffset = data[7];									// vector M9 gives the offset of the CRC from start of file, in bytes
+			if (!IsValidCrcOffset(crcOffset, FlashBlockSize))
+			{
+				return false;
+			}
+			StartCRC32();
+		}
+
+		const uint32_t endOffset = offset + DecompressionChunkSize;
+		if (offset < crcOffset)
+		{
+			AddToCRC32(data, data + (min<uint32_t>(endOffset, crcOffset) - offset)/4);
+		}
+		if (crcOffset >= offset && crcOffset < endOffset)
+		{
+			expectedCRC = data[(crcOffset - offset)/4];
+			crcSeen = true;
+		}
+		return true;
+	}
+};
+
+// Check that the compressed bootloader we have been passed decompresses to an image with a valid CRC
+static bool CheckCompressedCRC(const uint32_t *blockBuffer) noexcept
+{
+	DecompressedCrcChecker checker;
+	return DecompressBootloader(blockBuffer, checker) && checker.crcSeen && GetCRC32() == checker.expectedCRC;
+}
+
+// Decompress the bootloader into flash, which must already have been erased
+static bool WriteCompressedImage(const uint32_t *blockBuffer) noexcept
+{
+	auto writer = [](uint32_t offset, const uint32_t *data) noexcept -> bool
+					{
+						return Flash::Write(FLASH_ADDR + offset, DecompressionChunkSize, const_cast<uint32_t*>(data));
+					};
+	return DecompressBootloader(blockBuffer, writer);
+}
+
 // The task that runs to update the bootloader
 extern "C" [[noreturn]] void UpdateBootloaderTask(void *pvParameters) noexcept
 {
@@ -391,6 +554,7 @@ extern "C" [[noreturn]] void UpdateBootloaderTask(void *pvParameters) noexcept
 		}
 
 		const FirmwareFlashErrorCode err = GetBootloaderBlock(reinterpret_cast<uint8_t*>(blockBuffer));
+		const bool compressed = (blockBuffer[0] == CompressedImageHeader::MagicValue);
 		const uint32_t start = millis();
 		do
 		{
@@ -401,7 +565,7 @@ extern "C" [[noreturn]] void UpdateBootloaderTask(void *pvParameters) noexcept
 		{
 			ReportFlashError(err);
 		}
-		else if (!CheckCRC(blockBuffer))
+		else if ((compressed) ? !CheckCompressedCRC(blockBuffer) : !CheckCRC(blockBuffer))
 		{
 			ReportFlashError(FirmwareFlashErrorCode::badCRC);
 		}
@@ -423,7 +587,7 @@ extern "C" [[noreturn]] void UpdateBootloaderTask(void *pvParameters) noexcept
 		{
 			ReportFlashError(FirmwareFlashErrorCode::eraseFailed);
 		}
-		else if (!Flash::Write(FLASH_ADDR, FlashBlockSize, blockBuffer))
+		else if ((compressed) ? !WriteCompressedImage(blockBuffer) : !Flash::Write(FLASH_ADDR, FlashBlockSize, blockBuffer))
 		{
 			ReportFlashError(FirmwareFlashErrorCode::writeFailed);
 		}